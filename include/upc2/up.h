@@ -53,6 +53,43 @@ typedef struct up_context_struct {
 
     /** First character after ^Ae combination */
     uint8_t trn_tag;
+
+    /** io_uring state if the console waits with io_uring rather than
+     *  poll(); private to up.c
+     */
+    struct up_console_uring_struct *uring;
+
+    /** Shared-memory ring everything read from the target is
+     *  published to, or NULL
+     */
+    struct up_shm_struct *shm;
+
+    /** How long to wait for a serial device that goes away to come
+     *  back, in ms; 0 to give up at once
+     */
+    int reconnect_ms;
+
+    /** epoll reactor the console waits with when not using io_uring;
+     *  private to up.c
+     */
+    struct up_console_reactor_struct *reactor;
+
+    /** When the current protocol's timeout() is due, by
+     *  utils_monotonic_ns(); 0 if it isn't waiting for one
+     */
+    uint64_t proto_due_ns;
+
+    /** Set by a protocol while it is uploading: keystrokes other than
+     *  C-a commands are dropped rather than sent to the target in the
+     *  middle of its data.  Cleared when the boot stage changes.
+     */
+    int uploading;
+
+    /** Set by a protocol's transfer() when it has more to send as soon
+     *  as the BIO can take it, so that the console calls it again then
+     *  rather than waiting for input.  Cleared before each call.
+     */
+    int proto_wants_tx;
 } up_context_t;
 
 
@@ -83,12 +120,39 @@ typedef struct up_protocol_struct {
 
     /** Close down protocol before quitting */
     int (*shutdown)(void *h, up_context_t *ctx);
+
+    /** Optional: the time the boot stage asked for with
+     *  up_protocol_timer() has passed with nothing else to do.
+     *  Returns as transfer() does.
+     */
+    int (*timeout)(void *h, up_context_t *ctx, up_load_arg_t *arg);
 } up_protocol_t;
 
 
 
 #define UP_FLOW_CONTROL_NONE   (0)
 #define UP_FLOW_CONTROL_RTSCTS  (1)
+/** XON/XOFF in the data stream.  Only for the console: binary
+ *  protocols would lose any 0x11 and 0x13 bytes, so their stages run
+ *  without flow control instead.
+ */
+#define UP_FLOW_CONTROL_XONXOFF (2)
+
+/** Steps of a line sequence run as a boot stage is prepared, eg. to
+ *  reset the target or strap its boot mode
+ */
+#define UP_LINE_SET   (0) /* Change modem control lines: set, clear */
+#define UP_LINE_BREAK (1) /* Send a BREAK lasting ms */
+#define UP_LINE_WAIT  (2) /* Wait ms */
+
+#define UP_LINE_MAX_STEPS (16)
+
+typedef struct up_line_step_struct {
+    int op;
+    int set;
+    int clear;
+    int ms;
+} up_line_step_t;
 
 typedef struct up_load_arg_struct {
     /** Name to upload */
@@ -117,6 +181,10 @@ typedef struct up_load_arg_struct {
 
     /** Offset into memory for transfer (for protocols that care) */
     unsigned int offset;
+
+    /** Line sequence to run once the baud rate is set (--reset) */
+    up_line_step_t reset[UP_LINE_MAX_STEPS];
+    int nr_reset;
 } up_load_arg_t;
 
 /** Create a UP context
@@ -152,6 +220,39 @@ int up_finish_console(up_context_t *ctx);
  */
 int up_become_console(up_context_t *ctx, up_load_arg_t *args, int arglen);
 
+/** Have the console wait with io_uring: one system call a pass to
+ *  wait on the BIO and the tty and to write out everything queued for
+ *  the tty and the log.  Returns 0, or -1 with errno set if io_uring
+ *  is not available, in which case poll() is used as before.
+ */
+int up_use_uring(up_context_t *ctx);
+
+/** Publish everything read from the target to the shared-memory ring
+ *  called name (see up_shm.h), for other processes to follow.
+ *  Returns 0 or -1.
+ */
+int up_publish_shm(up_context_t *ctx, const char *name);
+
+/** Write to the console tty, in order with serial output it has been
+ *  sent.  Returns nr or -1.
+ */
+int up_console_write(up_context_t *ctx, const uint8_t *bytes, int nr);
+
+/** Have the current protocol's timeout() called ms from now, if it
+ *  is still waiting for the target, replacing any time asked for
+ *  before.  ms < 0 cancels.  Moving to another boot stage cancels
+ *  too.
+ */
+void up_protocol_timer(up_context_t *ctx, int ms);
+
+/** A sensible time to wait for a USB adapter to re-enumerate */
+#define UP_RECONNECT_MS (30000)
+
+/** Wait up to timeout_ms for the serial device to come back if it
+ *  goes away, rather than exiting; 0 to exit
+ */
+int up_set_reconnect(up_context_t *ctx, int timeout_ms);
+
 /** Log all console input to this fd */
 int up_set_log_fd(up_context_t *ctx, const int fd);
 
@@ -5,27 +5,173 @@
 #define UP_BIO_H_INCLUDED
 
 #include <stdint.h>
+#include <sys/uio.h>
+
+/** What a BIO has done since its statistics were last reset */
+typedef struct up_bio_stats_struct {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    /** System calls made to read and write the device */
+    uint64_t reads;
+    uint64_t writes;
+
+    /** ... and how many of them had nothing to do */
+    uint64_t read_eagain;
+    uint64_t write_eagain;
+
+    /** Writes which took only part of what they were given */
+    uint64_t short_writes;
+
+    /** Most bytes a single read returned */
+    int largest_read;
+
+    /** Non-zero if the driver counts UART events, as below */
+    int uart;
+
+    /** Bytes through the UART, and errors on it: overruns in the UART
+     *  (or adapter), framing and parity errors, breaks, and bytes the
+     *  host tty layer had no room for
+     */
+    uint32_t uart_rx;
+    uint32_t uart_tx;
+    uint32_t overrun;
+    uint32_t frame;
+    uint32_t parity;
+    uint32_t brk;
+    uint32_t buf_overrun;
+
+    /** Bytes read from the device and thrown away because the host
+     *  had fallen too far behind to keep them (see up_bio_thread.h)
+     */
+    uint64_t rx_dropped;
+} up_bio_stats_t;
+
+/** Modem control lines, for set_lines() */
+#define UP_BIO_LINE_DTR (1 << 0)
+#define UP_BIO_LINE_RTS (1 << 1)
 
 typedef struct up_bio_struct {
     void *handle;
 
+    /** Kept up to date by the BIO; use utils_bio_stats() to read it */
+    up_bio_stats_t stats;
+
     /** Retrieve an fd you can poll() on */
     int (*poll_fd)(struct up_bio_struct *bio);
 
     /** read(), non-blocking */
     int (*read)(struct up_bio_struct *bio, uint8_t *bytes, int nr);
 
+    /** Number of bytes already read ahead from the device and held
+     *  by the BIO.  poll() on poll_fd() cannot see these, so callers
+     *  must not block while this is non-zero.  May be NULL if the
+     *  BIO does not read ahead.
+     */
+    int (*rx_pending)(struct up_bio_struct *bio);
+
+    /** Copy up to nr bytes of input without consuming them, reading
+     *  ahead from the device if nothing is held.  Non-blocking, like
+     *  read().  May be NULL if rx_pending is.
+     */
+    int (*peek)(struct up_bio_struct *bio, uint8_t *bytes, int nr);
+
+    /** Discard nr bytes of input previously returned by peek() */
+    int (*consume)(struct up_bio_struct *bio, int nr);
+
+    /** Borrow the next run of input in place: points *bytes into the
+     *  BIO's own storage and returns how many bytes are there, or
+     *  what read() would for no data or an error.  Non-blocking.
+     *  Nothing is consumed until release(), and the bytes stay valid
+     *  after release() until the next read, peek or borrow on this
+     *  BIO.  May be NULL if the BIO has no storage to lend.
+     */
+    int (*borrow)(struct up_bio_struct *bio, const uint8_t **bytes);
+
+    /** Consume nr bytes of input previously borrowed */
+    int (*release)(struct up_bio_struct *bio, int nr);
+
     /** write(), non-blocking */
     int (*write)(struct up_bio_struct *bio, const uint8_t *bytes, int nr);
 
+    /** writev(), non-blocking.  Writes the pieces as a single unit
+     *  where the underlying transport allows it, so that a frame
+     *  built from several buffers goes out in one transfer.
+     */
+    int (*writev)(struct up_bio_struct *bio,
+                  const struct iovec   *iov,
+                  int                   iovcnt);
+
     /** write(), blocking */
     int (*safe_write)(struct up_bio_struct *bio,
                       const uint8_t        *bytes,
                       int                   nr);
 
+    /** write() for a short frame which should go out as soon as
+     *  possible: an acknowledgement, say, or a keystroke.  It is sent
+     *  ahead of queued output, though never in the middle of a frame
+     *  which has been partly sent.  Returns the number of bytes
+     *  queued, or -1 with errno EAGAIN if there is no room.  May be
+     *  NULL if the BIO does not queue output.
+     */
+    int (*urgent_write)(struct up_bio_struct *bio,
+                        const uint8_t        *bytes,
+                        int                   nr);
+
+    /** Number of bytes accepted by write() but not yet handed to the
+     *  device.  May be NULL if the BIO does not buffer output.
+     */
+    int (*tx_pending)(struct up_bio_struct *bio);
+
+    /** Level of tx_pending() above which callers should hold off
+     *  further bulk writes.  May be NULL if tx_pending is.
+     */
+    int (*tx_high_water)(struct up_bio_struct *bio);
+
+    /** Hand as much buffered output to the device as it will take
+     *  without blocking; call when poll_fd() is writable.  Returns
+     *  the number of bytes still pending, or < 0 on error.  May be
+     *  NULL if tx_pending is.
+     */
+    int (*tx_service)(struct up_bio_struct *bio);
+
+    /** Milliseconds until the BIO next needs calling whatever its
+     *  poll_fd() says, for BIOs which hold data back on a timer: 0
+     *  for now, -1 for no limit.  While this is positive there is no
+     *  point waiting for poll_fd() to be writable.  May be NULL.
+     */
+    int (*poll_timeout)(struct up_bio_struct *bio);
+
+    /** Bring stats up to date with counters kept elsewhere, such as
+     *  the driver's, and if reset, restart those from zero.  May be
+     *  NULL.
+     */
+    void (*stats_sync)(struct up_bio_struct *bio, int reset);
+
     /** set baud rate */
     int (*set_baud)(struct up_bio_struct *bio, int baud, int flow_control);
 
+    /** Raise the modem control lines (UP_BIO_LINE_xxx) in set and
+     *  drop those in clear, all at once.  Returns 0 or -1.  May be
+     *  NULL if there are no lines to control.
+     */
+    int (*set_lines)(struct up_bio_struct *bio, int set, int clear);
+
+    /** Hold the line in BREAK for ms milliseconds, once everything
+     *  written before has gone.  Blocks.  Returns 0 or -1.  May be
+     *  NULL.
+     */
+    int (*send_break)(struct up_bio_struct *bio, int ms);
+
+    /** The device has gone away (eg. a USB adapter re-enumerating as
+     *  the target resets): wait up to timeout_ms for it to come back,
+     *  reopen it and restore the baud rate and flow control.  Output
+     *  queued for the old device is lost.  Returns 0, or -1 with
+     *  errno ETIMEDOUT if it is not back yet, or some other errno if
+     *  it never will be.  May be NULL.
+     */
+    int (*reconnect)(struct up_bio_struct *bio, int timeout_ms);
+
     /** Dispose of this BIO, closing resources and releasing the BIO
      *  if dynamically allocated
      */
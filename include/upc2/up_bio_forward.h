@@ -0,0 +1,40 @@
+/* up_bio_forward.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_FORWARD_H_INCLUDED
+#define UP_BIO_FORWARD_H_INCLUDED
+
+/** @file
+ *
+ *  Plumbing for BIOs which wrap another BIO.  The wrapper's handle
+ *  must start with a pointer to the BIO it wraps; every operation it
+ *  does not replace is passed straight through.
+ */
+
+#include "upc2/up_bio.h"
+
+typedef struct up_bio_forward_struct {
+    /** The wrapped BIO.  Wrapper handles start with this */
+    up_bio_t *inner;
+} up_bio_forward_t;
+
+/** The BIO wrapped by bio */
+#define UP_BIO_INNER(bio) (((up_bio_forward_t *)((bio)->handle))->inner)
+
+/** Fill in bio to pass every operation through to inner, leaving
+ *  optional operations NULL where inner has none, and set its handle.
+ *  handle must start with an up_bio_forward_t (or an up_bio_t *)
+ *  which this sets to inner.  The default dispose disposes of inner,
+ *  then frees handle and bio.
+ */
+void up_bio_forward_init(up_bio_t *bio, void *handle, up_bio_t *inner);
+
+/** Dispose of a wrapper as the default dispose does: inner first,
+ *  then the handle and the BIO itself.  For wrappers which replace
+ *  dispose to tidy up their own state first.
+ */
+void up_bio_forward_dispose(up_bio_t *bio);
+
+#endif
+
+/* End file */
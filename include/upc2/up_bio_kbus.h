@@ -9,12 +9,28 @@
 #include "upc2/up_bio.h"
 #include "kbus/kbus.h"
 
+/* Writes are gathered into messages of up to this many bytes */
+#define UP_BIO_KBUS_COALESCE (4096)
+
+/* ... and held for no longer than this before being sent */
+#define UP_BIO_KBUS_COALESCE_MS (2)
+
 typedef struct up_bio_kbus_s
 {
     kbus_ksock_t ksock;
     kbus_message_t *msg;
     uint8_t *data;
     uint32_t nbytes;
+
+    /* Outgoing message, reused for every send since KBus has copied
+     * the data by the time kbus_ksock_send_msg() returns
+     */
+    kbus_message_t *out_msg;
+
+    /* Written bytes not yet sent, and when the first of them was */
+    uint8_t out_buf[UP_BIO_KBUS_COALESCE];
+    int out_used;
+    uint64_t out_since_ns;
 } up_bio_kbus_t;
 
 
@@ -0,0 +1,101 @@
+/* up_bio_link.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_LINK_H_INCLUDED
+#define UP_BIO_LINK_H_INCLUDED
+
+/** @file
+ *
+ *  A BIO which wraps another and makes the connection behave like a
+ *  slow, late or noisy serial link, so that protocols can be compared
+ *  under realistic conditions without the hardware.
+ */
+
+#include <stdint.h>
+#include "upc2/up_bio.h"
+#include "upc2/up_bio_forward.h"
+#include "upc2/up_ring.h"
+
+/** Bytes held in each direction */
+#define UP_BIO_LINK_BYTES (65536)
+/** Batches of bytes in flight in each direction */
+#define UP_BIO_LINK_SEGS  (1024)
+
+typedef struct up_bio_link_params_struct {
+    /** Simulated line rate; 0 to follow set_baud() */
+    int baud;
+
+    /** One-way latency added to every byte */
+    int latency_us;
+
+    /** Deliver only on multiples of this, as a USB adapter does with
+     *  its frames; 0 for no quantisation
+     */
+    int frame_us;
+
+    /** Probability of each bit being flipped */
+    double ber;
+
+    /** Probability of each byte being lost */
+    double drop;
+
+    /** Seed for the error generator, so that runs can be repeated */
+    uint64_t seed;
+} up_bio_link_params_t;
+
+/** A batch of bytes and the time it comes out of the link */
+typedef struct up_bio_link_seg_struct {
+    uint64_t due_ns;
+    int len;
+} up_bio_link_seg_t;
+
+/** One direction of the link */
+typedef struct up_bio_link_dir_struct {
+    /** Bytes in flight; the first "ready" of them have arrived */
+    up_ring_t ring;
+    int ready;
+
+    /** Batches not yet arrived */
+    up_bio_link_seg_t segs[UP_BIO_LINK_SEGS];
+    int seg_head;
+    int seg_count;
+
+    /** When the simulated line finishes sending what it has */
+    uint64_t line_free_ns;
+
+    /** Damage done */
+    unsigned int flipped;
+    unsigned int dropped;
+} up_bio_link_dir_t;
+
+typedef struct up_bio_link_struct {
+    up_bio_forward_t fwd;
+
+    up_bio_link_params_t params;
+
+    /** Rate set by the last set_baud() */
+    int baud;
+
+    uint64_t rng;
+
+    /** Host to target */
+    up_bio_link_dir_t tx;
+    /** Target to host */
+    up_bio_link_dir_t rx;
+} up_bio_link_t;
+
+/** Parse a comma-separated list of parameters: baud=<rate>,
+ *  latency=<us>, frame=<us>, ber=<probability>, drop=<probability>,
+ *  seed=<n>.  Returns 0, or -1 having reported the problem.
+ */
+int up_bio_link_parse(const char *spec, up_bio_link_params_t *params);
+
+/* Wrap inner in an emulated link.  The new BIO owns inner and
+ * disposes of it.  Returns NULL on failure, when inner is untouched.
+ */
+up_bio_t *up_bio_link_create(up_bio_t                   *inner,
+                             const up_bio_link_params_t *params);
+
+#endif
+
+/* End file */
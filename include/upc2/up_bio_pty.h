@@ -0,0 +1,27 @@
+/* up_bio_pty.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_PTY_H_INCLUDED
+#define UP_BIO_PTY_H_INCLUDED
+
+#include "upc2/up_bio.h"
+#include "upc2/up_bio_forward.h"
+
+typedef struct up_bio_pty_struct {
+    /** The serial BIO on the slave side */
+    up_bio_forward_t fwd;
+
+    /** Name of the slave device */
+    char slave_name[64];
+} up_bio_pty_t;
+
+/* Create a pseudo-terminal and return a serial BIO on its slave side,
+ * so that everything above the BIO runs exactly as it would with a
+ * real port.  *master_fd is set to the master side, which plays the
+ * part of the target and belongs to the caller.
+ */
+up_bio_t *up_bio_pty_create(int *master_fd);
+
+#endif
+
+/* End file */
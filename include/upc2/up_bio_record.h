@@ -0,0 +1,70 @@
+/* up_bio_record.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_RECORD_H_INCLUDED
+#define UP_BIO_RECORD_H_INCLUDED
+
+/** @file
+ *
+ *  A BIO which wraps another and records the traffic through it to a
+ *  trace file, for replaying later with up_bio_replay.
+ *
+ *  A trace is a header followed by records, all integers
+ *  little-endian:
+ *
+ *    header: "UPC2TRC1", u64 CLOCK_REALTIME ns, u64 CLOCK_MONOTONIC ns
+ *    record: u64 CLOCK_MONOTONIC ns, u8 kind, u32 length, data
+ *
+ *  Received bytes are stamped when the host first sees them, sent
+ *  bytes when the BIO accepts them.  A baud record's data is the u32
+ *  baud rate then the u32 flow control passed to set_baud().
+ */
+
+#include <stdint.h>
+#include "upc2/up_bio.h"
+#include "upc2/up_bio_forward.h"
+
+#define UP_TRACE_MAGIC        "UPC2TRC1"
+#define UP_TRACE_MAGIC_LEN    (8)
+#define UP_TRACE_HEADER_LEN   (UP_TRACE_MAGIC_LEN + 16)
+#define UP_TRACE_RECORD_LEN   (13)
+
+/** Record kinds */
+#define UP_TRACE_RX           ('r')
+#define UP_TRACE_TX           ('t')
+#define UP_TRACE_BAUD         ('b')
+
+/** Trace output is written in chunks of this size */
+#define UP_BIO_RECORD_BUFFER  (65536)
+
+typedef struct up_bio_record_struct {
+    up_bio_forward_t fwd;
+
+    const char *filename;
+    int fd;
+
+    /** Bytes at the front of the inner BIO's input which the host
+     *  has peeked at or borrowed, and so are already in the trace
+     */
+    int rx_seen;
+
+    /** Trace output not yet written */
+    uint8_t *buf;
+    int buf_used;
+
+    /** Set once a write to the trace has failed */
+    int failed;
+
+    uint64_t records;
+} up_bio_record_t;
+
+/* Wrap inner in a BIO which records everything through it to
+ * filename, replacing any existing file.  The new BIO owns inner.
+ * Returns NULL on failure, having reported it, when inner is
+ * untouched.
+ */
+up_bio_t *up_bio_record_create(up_bio_t *inner, const char *filename);
+
+#endif
+
+/* End file */
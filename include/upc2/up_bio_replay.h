@@ -0,0 +1,116 @@
+/* up_bio_replay.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_REPLAY_H_INCLUDED
+#define UP_BIO_REPLAY_H_INCLUDED
+
+/** @file
+ *
+ *  A BIO which plays back a trace made by up_bio_record in place of
+ *  the device, so that a session can be rerun and profiled offline.
+ *
+ *  Bytes from the target are held back until the host has sent
+ *  everything it had sent before them in the recording, and then for
+ *  as long after that as they were originally.  A host which behaves
+ *  as it did when recorded therefore sees the same bytes at the same
+ *  moments, however long it takes over its own work.
+ */
+
+#include <stdint.h>
+#include "upc2/up_bio.h"
+#include "upc2/up_ring.h"
+
+/** Bytes from the target which may be waiting to be read */
+#define UP_BIO_REPLAY_RX_BYTES (16384)
+
+/** Where the host's output stops matching the recording, how far
+ *  ahead to look for the two to line up again, and how many bytes
+ *  must agree for them to count as lined up
+ */
+#define UP_BIO_REPLAY_RESYNC_BYTES (64)
+#define UP_BIO_REPLAY_MATCH_BYTES  (8)
+
+typedef struct up_bio_replay_rec_struct {
+    uint64_t ts_ns;
+    int kind;
+    int len;
+    const uint8_t *data;
+    /** For sent bytes, the total sent by the end of this record */
+    uint64_t tx_end;
+} up_bio_replay_rec_t;
+
+typedef struct up_bio_replay_struct {
+    /** For debugging, mostly */
+    const char *filename;
+
+    /** The trace, and the records in it */
+    uint8_t *trace;
+    up_bio_replay_rec_t *recs;
+    int nr_recs;
+    uint64_t trace_start_ns;
+
+    /** Next record to play, and how much of it has been played */
+    int cur;
+    int cur_off;
+
+    /** Something to poll() on: the write end, which is never
+     *  readable, since all the timing comes from poll_timeout(), and
+     *  always writable, since we take whatever the host sends
+     */
+    int pipe_fds[2];
+
+    /** Bytes from the target which are due */
+    up_ring_t rx;
+
+    /** Host time and trace time that later target bytes are timed
+     *  from: when the host last caught up with the recording
+     */
+    uint64_t anchor_ns;
+    uint64_t anchor_ts_ns;
+
+    /** Bytes sent by the host */
+    uint64_t tx_total;
+
+    /** Everything the host sent in the recording, end to end, and how
+     *  much of it has been matched
+     */
+    uint8_t *tx_expect;
+    uint64_t tx_expect_len;
+    uint64_t tx_expect_off;
+
+    /** Bytes the host has sent which have not been compared yet, and
+     *  the offset in its output of the first of them
+     */
+    uint8_t *tx_held;
+    int tx_held_len;
+    int tx_held_size;
+    uint64_t tx_held_off;
+
+    /** Host bytes out of place or recorded bytes missing, the number
+     *  of places that happened, and where it first did (or -1)
+     */
+    uint64_t tx_differed;
+    uint64_t tx_diverged;
+    int64_t tx_first_diff;
+    int tx_in_diff;
+
+    /** Bytes the host sent after the recording ran out */
+    uint64_t tx_extra;
+
+    uint64_t rx_total;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} up_bio_replay_t;
+
+/** Non-zero if spec names a trace to replay: "replay:<file>" */
+int up_bio_replay_is_spec(const char *spec);
+
+/* Allocate and initialise a BIO which replays the trace named by
+ * "replay:<file>".  Returns NULL, having reported why, if the trace
+ * cannot be read.
+ */
+up_bio_t *up_bio_replay_create(const char *spec);
+
+#endif
+
+/* End file */
@@ -0,0 +1,63 @@
+/* up_bio_rfc2217.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_RFC2217_H_INCLUDED
+#define UP_BIO_RFC2217_H_INCLUDED
+
+#include <stdint.h>
+#include "upc2/up_bio.h"
+#include "upc2/up_ring.h"
+#include "upc2/up_txq.h"
+
+/** Size of the ring of received data, with telnet commands removed */
+#define UP_BIO_RFC2217_RX_BYTES      (16384)
+/** Size of the ring of escaped data and commands waiting to be sent */
+#define UP_BIO_RFC2217_TX_BYTES      (16384)
+/** Default level above which the transmit ring counts as congested */
+#define UP_BIO_RFC2217_TX_HIGH_WATER (12288)
+/** As UP_BIO_SOCKET_TX_BATCH */
+#define UP_BIO_RFC2217_TX_BATCH      (1400)
+/** Longest subnegotiation we will keep */
+#define UP_BIO_RFC2217_SB_BYTES      (64)
+
+typedef struct up_bio_rfc2217_struct {
+    /** For debugging, mostly */
+    const char *spec;
+
+    int fd;
+
+    /** Where the telnet parser is; see up_bio_rfc2217.c */
+    int state;
+    /** Command byte (WILL, DO, ...) awaiting its option */
+    uint8_t command;
+    /** Subnegotiation collected so far */
+    uint8_t sb[UP_BIO_RFC2217_SB_BYTES];
+    int sb_len;
+
+    /** Server has refused COM-PORT-OPTION */
+    int com_port_refused;
+    /** Baud rate the server last confirmed, 0 if none */
+    uint32_t server_baud;
+
+    /** Data received from the server */
+    up_ring_t rx;
+
+    /** Escaped data and commands waiting to be sent */
+    up_txq_t tx;
+    int tx_high_water;
+
+} up_bio_rfc2217_t;
+
+/** Non-zero if spec is "rfc2217:host:port" */
+int up_bio_rfc2217_is_spec(const char *spec);
+
+/* Allocate and initialise a BIO talking to a terminal server which
+ * supports the telnet COM-PORT-OPTION (RFC 2217), given a spec of the
+ * form "rfc2217:host:port".  Unlike the plain socket BIO, set_baud
+ * changes the remote UART.
+ */
+up_bio_t *up_bio_rfc2217_create(const char *spec, int rcvbuf);
+
+#endif
+
+/* End file */
@@ -4,7 +4,35 @@
 #ifndef UP_BIO_SERIAL_H_INCLUDED
 #define UP_BIO_SERIAL_H_INCLUDED
 
+#include <stdint.h>
+#include <termios.h>
+#include <linux/serial.h>
 #include "upc2/up_bio.h"
+#include "upc2/up_ring.h"
+#include "upc2/up_txq.h"
+
+/** Size of the user-space transmit ring */
+#define UP_BIO_SERIAL_TX_BYTES      (16384)
+/** Default level above which the transmit ring counts as congested */
+#define UP_BIO_SERIAL_TX_HIGH_WATER (12288)
+/** Default line time's worth of output to let the kernel queue */
+#define UP_BIO_SERIAL_TX_BUDGET_MS  (20)
+/** ... though never fewer bytes than this, to keep fast lines busy */
+#define UP_BIO_SERIAL_TX_BUDGET_MIN (64)
+
+/** Flags for up_bio_serial_create() */
+/** Trade CPU for latency: ASYNC_LOW_LATENCY, a 1ms FTDI latency timer
+ *  and a wake-up on every byte
+ */
+#define UP_BIO_SERIAL_LOW_LATENCY   (1 << 0)
+
+/** Size of the receive readahead ring */
+#define UP_BIO_SERIAL_RX_BYTES      (16384)
+
+/** Longest reconnect() goes between attempts to open the device, in
+ *  case udev is still setting it up when inotify says it is there
+ */
+#define UP_BIO_SERIAL_REOPEN_MS     (250)
 
 typedef struct up_bio_serial_struct {
     /** For debugging, mostly */
@@ -12,17 +40,68 @@ typedef struct up_bio_serial_struct {
 
     int serial_fd;
 
+    /** UP_BIO_SERIAL_xxx flags we were created with */
+    int flags;
+
     struct termios serial_tc;
 
+    /** serial_struct flags before low latency mode, or -1 if we
+     *  have not changed them
+     */
+    int old_serial_flags;
+
+    /** sysfs latency_timer of a USB adapter and its original value,
+     *  or -1 if we have not changed it
+     */
+    char latency_timer_path[256];
+    int old_latency_timer;
+
     int last_flow_control;
 
+    /** Baud rate the driver reports it is running at (0 if unset) */
+    int baud;
+
+    /** Bytes read ahead from the device */
+    up_ring_t rx;
+
+    /** Bytes queued for the device */
+    up_txq_t tx;
+    int tx_high_water;
+
+    /** Line time's worth of output the kernel may hold, in ms, so that
+     *  whatever we send next is never stuck behind seconds of it; 0
+     *  for as much as the kernel will take
+     */
+    int tx_budget_ms;
+
+    /** Until when the kernel has all the output it should hold */
+    uint64_t tx_resume_ns;
+
+    /** The driver's UART counters when our statistics were reset or
+     *  the device was last opened, and what earlier opens of it had
+     *  counted since the reset
+     */
+    struct serial_icounter_struct icount_base;
+    struct serial_icounter_struct icount_carried;
+
+    /** inotify watch for the device node coming back, or -1 */
+    int inotify_fd;
+    int inotify_wd;
+
 } up_bio_serial_t;
 
 /* Allocate and initialise a context structure to access the named
  * serial device (e.g. /dev/ttyUSB0).  The device will be opened and
- * all the function pointers will be filled in.
+ * all the function pointers will be filled in.  flags is a
+ * combination of UP_BIO_SERIAL_xxx; everything it changes is put
+ * back on dispose.
+ */
+up_bio_t *up_bio_serial_create(const char *serial_port, int flags);
+
+/* Let the kernel queue at most ms of line time at the current baud
+ * rate; 0 to let it queue as much as it will.
  */
-up_bio_t *up_bio_serial_create(const char *serial_port);
+void up_bio_serial_set_tx_budget(up_bio_t *bio, int ms);
 
 #endif
 
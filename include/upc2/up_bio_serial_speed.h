@@ -0,0 +1,20 @@
+/* up_bio_serial_speed.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_SERIAL_SPEED_H_INCLUDED
+#define UP_BIO_SERIAL_SPEED_H_INCLUDED
+
+/* Set the line speed of a serial fd to an arbitrary rate using the
+ * Linux termios2 BOTHER interface.  The change is immediate, so drain
+ * any output first.  Returns the rate the driver reports it actually set, or -1 with
+ * errno set if termios2 is not available on this fd (in which case
+ * fall back to cfsetspeed()).
+ *
+ * This lives in its own file because the kernel's termios2
+ * definitions clash with <termios.h>.
+ */
+int up_bio_serial_set_speed(int fd, int baud);
+
+#endif
+
+/* End file */
@@ -0,0 +1,59 @@
+/* up_bio_socket.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_SOCKET_H_INCLUDED
+#define UP_BIO_SOCKET_H_INCLUDED
+
+#include <stdint.h>
+#include "upc2/up_bio.h"
+#include "upc2/up_ring.h"
+#include "upc2/up_txq.h"
+
+/** Size of the receive readahead ring */
+#define UP_BIO_SOCKET_RX_BYTES      (16384)
+/** Size of the transmit ring */
+#define UP_BIO_SOCKET_TX_BYTES      (16384)
+/** Default level above which the transmit ring counts as congested */
+#define UP_BIO_SOCKET_TX_HIGH_WATER (12288)
+/** Queued output is sent as soon as there is this much of it; less
+ *  waits until the caller next polls or reads, so that the pieces of
+ *  a frame leave in one segment.  Roughly one Ethernet MSS.
+ */
+#define UP_BIO_SOCKET_TX_BATCH      (1400)
+
+typedef struct up_bio_socket_struct {
+    /** For debugging, mostly */
+    const char *spec;
+
+    int fd;
+
+    /** Bytes read ahead from the socket */
+    up_ring_t rx;
+
+    /** Bytes waiting to be sent */
+    up_txq_t tx;
+    int tx_high_water;
+
+} up_bio_socket_t;
+
+/** Non-zero if spec names a socket rather than a device:
+ *  "tcp:host:port" or "unix:/path"
+ */
+int up_bio_socket_is_spec(const char *spec);
+
+/** Connect to "tcp:host:port" (host may be a [bracketed] IPv6
+ *  address) or "unix:/path".  TCP connections have TCP_NODELAY set;
+ *  if rcvbuf > 0 it is used for SO_RCVBUF.  Returns a non-blocking fd
+ *  or -1, having reported the error.
+ */
+int up_bio_socket_connect(const char *spec, int rcvbuf);
+
+/* Allocate and initialise a BIO talking to a serial port server
+ * (ser2net in raw mode, say) over a TCP or Unix-domain socket.  The
+ * server owns the line settings, so set_baud only flushes.
+ */
+up_bio_t *up_bio_socket_create(const char *spec, int rcvbuf);
+
+#endif
+
+/* End file */
@@ -0,0 +1,102 @@
+/* up_bio_thread.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_BIO_THREAD_H_INCLUDED
+#define UP_BIO_THREAD_H_INCLUDED
+
+/** @file
+ *
+ *  A BIO which wraps another and hands it to a thread of its own.
+ *  The I/O thread reads everything the device sends into one ring
+ *  and writes out what the main thread queues in another, so that
+ *  however long the console, a protocol or the log keeps the main
+ *  thread busy, the device's receive buffer keeps being drained at
+ *  line rate.
+ *
+ *  The rings are lock-free (see up_spsc.h); each side wakes the other
+ *  with an eventfd, and only when it has gone to sleep.  Operations
+ *  which change the device itself (set_baud() and the like) park the
+ *  thread first and restart it afterwards.
+ *
+ *  If the main thread falls so far behind that the receive ring
+ *  fills, the thread goes on reading and discards what does not fit,
+ *  counting it in stats.rx_dropped, rather than leave the device to
+ *  overrun.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "upc2/up_bio.h"
+#include "upc2/up_bio_forward.h"
+#include "upc2/up_spsc.h"
+
+/** Receive ring: four seconds at 3 Mbaud */
+#define UP_BIO_THREAD_RX_BYTES     (1 << 20)
+/** Transmit ring for bulk output, and for urgent_write() */
+#define UP_BIO_THREAD_TX_BYTES     (1 << 16)
+#define UP_BIO_THREAD_URGENT_BYTES (4096)
+
+/** How long the main thread sleeps at most while output is in the
+ *  I/O thread's hands; it is woken sooner as the output moves
+ */
+#define UP_BIO_THREAD_TX_WAIT_MS   (20)
+
+/** Longest parking the thread waits to hand over queued output */
+#define UP_BIO_THREAD_PARK_MS      (2000)
+
+typedef struct up_bio_thread_struct {
+    up_bio_forward_t fwd;
+
+    pthread_t thread;
+    int running;
+    /** CPU to pin the thread to, or -1 */
+    int cpu;
+
+    /** Device to main thread, and main to device */
+    up_spsc_t rx;
+    up_spsc_t tx;
+    up_spsc_t urgent;
+
+    /** Main thread: bytes released from rx which stay readable until
+     *  the next read, as borrow() promises
+     */
+    int rx_released;
+
+    /** eventfds: main_fd wakes the main thread (it is our poll_fd()),
+     *  kick_fd the I/O thread.  Each is only written if the matching
+     *  flag was clear, and the woken side clears the flag before it
+     *  reads the fd, so a wakeup is never lost and rarely repeated.
+     */
+    int main_fd;
+    int kick_fd;
+    int main_woken;
+    int kicked;
+
+    /** Set by the main thread while it wants to hear about output
+     *  moving on
+     */
+    int want_tx;
+
+    /** Set by the main thread to park the I/O thread */
+    int stop;
+
+    /** Set by the I/O thread: the errno it failed with, and how much
+     *  output the wrapped BIO still holds
+     */
+    int err;
+    int inner_pending;
+
+    /** Bytes discarded because rx was full */
+    uint64_t rx_dropped;
+} up_bio_thread_t;
+
+/* Wrap inner in a BIO whose I/O runs on a thread of its own, pinned
+ * to cpu unless that is negative, and start the thread.  The new BIO
+ * owns inner.  Returns NULL on failure, having reported it, when
+ * inner is untouched.
+ */
+up_bio_t *up_bio_thread_create(up_bio_t *inner, int cpu);
+
+#endif
+
+/* End file */
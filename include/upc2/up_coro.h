@@ -0,0 +1,140 @@
+/* up_coro.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_CORO_H_INCLUDED
+#define UP_CORO_H_INCLUDED
+
+/** @file
+ *
+ *  Protocols written as straight-line code.
+ *
+ *  A coroutine protocol's boot stage is a function which sends with
+ *  up_coro_send() and waits for the target with up_coro_await_bytes()
+ *  as if it had the serial port to itself.  It runs on a stack of its
+ *  own; whenever it has to wait, it is suspended and the console goes
+ *  back to its event loop, and it is resumed from transfer() once the
+ *  bytes it wants have arrived or from timeout() once it has waited
+ *  long enough.  Nothing blocks, and the terminal, the log and other
+ *  BIOs carry on meanwhile.
+ *
+ *  The protocol's handle must start with an up_coro_t.  Its prepare()
+ *  calls up_coro_start() with the body, and its up_protocol_t uses
+ *  up_coro_transfer() and up_coro_timeout() as they are.
+ *
+ *  The body may be abandoned at any wait (eg. the user picks another
+ *  boot stage) and is not unwound, so it must not hold anything that
+ *  needs freeing across a wait.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include "upc2/up.h"
+#include "upc2/up_ring.h"
+
+/** Stack for the body: room for stdio, not for large arrays */
+#define UP_CORO_STACK_BYTES  (64 * 1024)
+
+/** Input held for the body while it is busy; also the most one
+ *  up_coro_await_bytes() can ask for
+ */
+#define UP_CORO_INPUT_BYTES  (4096)
+
+/* What the body is waiting for */
+#define UP_CORO_IDLE       (0)
+#define UP_CORO_WAIT_INPUT (1)
+#define UP_CORO_WAIT_TX    (2)
+#define UP_CORO_DONE       (3)
+
+struct up_coro_struct;
+
+/** A boot stage as straight-line code.  Returns as transfer() does
+ *  when the stage is over: > 0 for success, < 0 for failure.
+ */
+typedef int (*up_coro_fn_t)(struct up_coro_struct *co,
+                            up_context_t          *ctx,
+                            up_load_arg_t         *arg);
+
+typedef struct up_coro_struct {
+    /** The body's context, and the console's while the body runs */
+    ucontext_t self;
+    ucontext_t caller;
+    uint8_t *stack;
+
+    up_coro_fn_t fn;
+    up_context_t *ctx;
+    up_load_arg_t *arg;
+
+    /** UP_CORO_xxx */
+    int state;
+
+    /** Bytes the body is waiting for, and whether it ran out of time */
+    int want;
+    int timed_out;
+
+    /** The body's return value, once state is UP_CORO_DONE */
+    int result;
+
+    /** Input the body has not taken yet */
+    up_ring_t input;
+    int overflowed;
+} up_coro_t;
+
+/* ------------------------------------------------------------------
+ * For the protocol's up_protocol_t
+ * ------------------------------------------------------------------ */
+
+/** From prepare(): (re)start the boot stage's body, abandoning any
+ *  earlier one, and run it until it first waits.  Returns 0, or -1
+ *  if out of memory.
+ */
+int up_coro_start(up_coro_t     *co,
+                  up_context_t  *ctx,
+                  up_load_arg_t *arg,
+                  up_coro_fn_t   fn);
+
+/** transfer() for coroutine protocols: hold the input for the body,
+ *  and resume it if it has what it was waiting for
+ */
+int up_coro_transfer(void          *h,
+                     up_context_t  *ctx,
+                     up_load_arg_t *arg,
+                     const uint8_t *buf,
+                     int            buf_bytes);
+
+/** timeout() for coroutine protocols: the body's wait has timed out */
+int up_coro_timeout(void *h, up_context_t *ctx, up_load_arg_t *arg);
+
+/** From shutdown(): release the stack and input buffer */
+void up_coro_free(up_coro_t *co);
+
+/* ------------------------------------------------------------------
+ * For the body
+ * ------------------------------------------------------------------ */
+
+/** Wait until nr bytes have arrived and take them into buf.  Gives
+ *  up after timeout_ms (< 0 to wait for ever) having taken nothing.
+ *  Returns nr, or -1 with errno ETIMEDOUT.
+ */
+int up_coro_await_bytes(up_coro_t *co, uint8_t *buf, int nr,
+                        int timeout_ms);
+
+/** Discard whatever input the body has not taken */
+void up_coro_discard_input(up_coro_t *co);
+
+/** Send the pieces as one frame, waiting as long as the BIO is too
+ *  busy to take them.  Returns the number of bytes sent, or -1.
+ */
+int up_coro_sendv(up_coro_t *co, const struct iovec *iov, int iovcnt);
+
+/** Send nr bytes as one frame, as up_coro_sendv() */
+int up_coro_send(up_coro_t *co, const uint8_t *bytes, int nr);
+
+/** Send a short frame ahead of queued output (see urgent_write() in
+ *  up_bio.h), waiting for room if need be.  Returns nr or -1.
+ */
+int up_coro_send_urgent(up_coro_t *co, const uint8_t *bytes, int nr);
+
+#endif
+
+/* End file */
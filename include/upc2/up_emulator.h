@@ -0,0 +1,64 @@
+/* up_emulator.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_EMULATOR_H_INCLUDED
+#define UP_EMULATOR_H_INCLUDED
+
+/** @file
+ *
+ *  An emulated target, speaking the device side of the upload
+ *  protocols on a pty so that uploads can be timed and tested without
+ *  hardware.  It runs in a thread of its own.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "upc2/up_ring.h"
+
+/** Most boot stages we will emulate */
+#define UP_EMULATOR_MAX_STAGES (32)
+
+/** Input buffered by the emulator */
+#define UP_EMULATOR_IN_BYTES   (8192)
+
+typedef struct up_emulator_struct {
+    /** Protocol names of the boot stages, in order */
+    const char *stages[UP_EMULATOR_MAX_STAGES];
+    int nr_stages;
+
+    /** Time the target takes to deal with each packet */
+    int delay_us;
+
+    /** Master side of the pty: the wire to the host */
+    int fd;
+
+    /** Written to ask the thread to stop */
+    int stop_pipe[2];
+
+    pthread_t thread;
+    int running;
+
+    /** Bytes received and not yet dealt with */
+    up_ring_t in;
+} up_emulator_t;
+
+/** Create an emulator whose target takes delay_us over each packet */
+up_emulator_t *up_emulator_create(int delay_us);
+
+/** Add a boot stage, by protocol name ("grouch", "xmodem",
+ *  "xmodem128", "kinetis" or "kinetis-s").  Returns 0 or -1.
+ */
+int up_emulator_add_stage(up_emulator_t *emu, const char *protocol);
+
+/** Start emulating on fd, which the emulator now owns.  The target
+ *  runs through the stages in order, reporting how each went on the
+ *  wire, then echoes whatever it is sent.  Returns 0 or -1.
+ */
+int up_emulator_start(up_emulator_t *emu, int fd);
+
+/** Stop the emulator if it is running and free it */
+void up_emulator_dispose(up_emulator_t *emu);
+
+#endif
+
+/* End file */
@@ -0,0 +1,100 @@
+/* up_reactor.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_REACTOR_H_INCLUDED
+#define UP_REACTOR_H_INCLUDED
+
+/** @file
+ *
+ *  An epoll event loop.  Callers register callbacks for file
+ *  descriptors becoming ready and for deadlines; all the deadlines
+ *  share one timerfd, set for the earliest, so an idle loop sleeps
+ *  until something actually happens rather than ticking.  Not
+ *  thread-safe.
+ */
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/** Most file descriptors one reactor watches */
+#define UP_REACTOR_MAX_FDS (8)
+
+struct up_reactor_struct;
+
+/** Called with the EPOLLxxx events fd is ready for */
+typedef void (*up_reactor_fd_fn)(struct up_reactor_struct *r,
+                                 int                       fd,
+                                 int                       revents,
+                                 void                     *arg);
+
+/** A deadline.  Embed one wherever it is needed and fill in expired
+ *  and arg; the rest belongs to the reactor.
+ */
+typedef struct up_reactor_timer_struct {
+    void (*expired)(struct up_reactor_timer_struct *t, void *arg);
+    void *arg;
+
+    uint64_t due_ns;
+    int armed;
+    struct up_reactor_timer_struct *next;
+} up_reactor_timer_t;
+
+typedef struct up_reactor_watch_struct {
+    int fd;
+    int events;
+    up_reactor_fd_fn fn;
+    void *arg;
+} up_reactor_watch_t;
+
+typedef struct up_reactor_struct {
+    int epoll_fd;
+    int timer_fd;
+
+    /** What timer_fd is set for, 0 if nothing */
+    uint64_t timer_set_ns;
+
+    up_reactor_watch_t watch[UP_REACTOR_MAX_FDS];
+
+    /** Armed timers, soonest first */
+    up_reactor_timer_t *timers;
+} up_reactor_t;
+
+/** Returns NULL with errno set on failure */
+up_reactor_t *up_reactor_create(void);
+
+/** Forget every fd and timer and free the reactor */
+void up_reactor_dispose(up_reactor_t *r);
+
+/** Call fn when fd is ready for events (EPOLLIN, EPOLLOUT; EPOLLERR
+ *  and EPOLLHUP are always reported).  Watching an fd again changes
+ *  its events and callback, costing a system call only if the events
+ *  change.  Returns 0 or -1.
+ */
+int up_reactor_watch(up_reactor_t     *r,
+                     int               fd,
+                     int               events,
+                     up_reactor_fd_fn  fn,
+                     void             *arg);
+
+/** Stop watching fd.  Safe from a callback, and on an fd which has
+ *  already been closed.
+ */
+void up_reactor_unwatch(up_reactor_t *r, int fd);
+
+/** Call t->expired() once, ms milliseconds from now, replacing any
+ *  deadline it already had.
+ */
+void up_reactor_timer_start(up_reactor_t *r, up_reactor_timer_t *t, int ms);
+
+/** Cancel t, if it is armed */
+void up_reactor_timer_stop(up_reactor_t *r, up_reactor_timer_t *t);
+
+/** Wait up to timeout_ms (-1 for as long as it takes) for fds or
+ *  timers, and run the callbacks for those that are ready.  Returns
+ *  the number of callbacks run, or -1 with errno set.
+ */
+int up_reactor_run(up_reactor_t *r, int timeout_ms);
+
+#endif
+
+/* End file */
@@ -0,0 +1,71 @@
+/* up_ring.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_RING_H_INCLUDED
+#define UP_RING_H_INCLUDED
+
+/** @file
+ *
+ *  A simple byte ring, used by BIOs to buffer input and output.
+ *  Not thread-safe.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct up_ring_struct {
+    uint8_t *data;
+
+    /** Capacity in bytes */
+    int size;
+
+    /** Offset of the first byte held */
+    int head;
+
+    /** Number of bytes held */
+    int count;
+} up_ring_t;
+
+/** Allocate storage for a ring of size bytes.  Returns 0 or -1 */
+int up_ring_init(up_ring_t *ring, int size);
+
+/** Release a ring's storage */
+void up_ring_free(up_ring_t *ring);
+
+/** Copy as much of bytes as will fit onto the end of the ring.
+ *  Returns the number of bytes queued.
+ */
+int up_ring_put(up_ring_t *ring, const uint8_t *bytes, int nr);
+
+/** Copy up to nr bytes from the front of the ring without consuming
+ *  them.  Returns the number copied.
+ */
+int up_ring_copy(const up_ring_t *ring, uint8_t *tgt, int nr);
+
+/** Drop up to nr bytes from the front of the ring.  Returns the
+ *  number dropped.
+ */
+int up_ring_consume(up_ring_t *ring, int nr);
+
+/** Point *bytes at the contiguous run at the front of the ring and
+ *  return its length.
+ */
+int up_ring_run(const up_ring_t *ring, const uint8_t **bytes);
+
+/** Describe the bytes held as at most two iovecs, for writev().
+ *  Returns the iovec count (0 if empty).
+ */
+int up_ring_data_iov(const up_ring_t *ring, struct iovec iov[2]);
+
+/** Describe the free space as at most two iovecs, for readv().
+ *  Follow with up_ring_commit() for the bytes actually filled.
+ *  Returns the iovec count (0 if full).
+ */
+int up_ring_space_iov(const up_ring_t *ring, struct iovec iov[2]);
+
+/** Account for nr bytes written into the space from up_ring_space_iov() */
+void up_ring_commit(up_ring_t *ring, int nr);
+
+#endif
+
+/* End file */
@@ -0,0 +1,149 @@
+/* up_shm.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_SHM_H_INCLUDED
+#define UP_SHM_H_INCLUDED
+
+/** @file
+ *
+ *  A ring in POSIX shared memory through which upc2 publishes
+ *  everything it reads from the target, so that other processes can
+ *  follow the serial stream as it happens without copying it or
+ *  touching the tty.  There is one writer and any number of readers.
+ *
+ *  The writer never waits for readers.  A reader which falls more
+ *  than a ring's worth behind finds out, is told how much it missed,
+ *  and carries on from the newest data.
+ *
+ *  Layout: an up_shm_header_t, then data_size bytes of data.  The
+ *  data is a sequence of records, each an up_shm_record_t followed by
+ *  len bytes, padded to a multiple of 8.  Positions are byte counts
+ *  since the ring was created; a record is at (position % data_size)
+ *  and never wraps.  Where too little room is left before the end of
+ *  the data, there is a pad record (or, if even that won't fit,
+ *  nothing) and the next record starts back at the beginning.
+ */
+
+#include <stdint.h>
+
+#define UP_SHM_MAGIC "UPC2SHM1"
+#define UP_SHM_MAGIC_LEN (8)
+
+/** Room for the header, keeping the data page-aligned */
+#define UP_SHM_HEADER_BYTES (4096)
+
+/** Size of the data area: a power of two */
+#define UP_SHM_DATA_BYTES (1 << 20)
+
+/** Longest record; longer chunks are published as several */
+#define UP_SHM_MAX_RECORD (16384)
+
+/** Record flags */
+#define UP_SHM_PAD (1 << 0) /* Skip this record: the ring wraps */
+
+typedef struct up_shm_header_struct {
+    char magic[UP_SHM_MAGIC_LEN];
+    uint32_t header_size;
+    uint32_t writer_pid;
+    uint64_t data_size;
+
+    /** Where the writer may be writing: anything a reader has from
+     *  before (reserve - data_size) may have been overwritten
+     */
+    uint64_t reserve;
+
+    /** Where the next record will go; everything before is complete */
+    uint64_t head;
+
+    /** Where the oldest record not yet overwritten is */
+    uint64_t tail;
+
+    /** Records completed, and so the sequence number of the next */
+    uint64_t records;
+
+    /** Bumped after each record, for readers to futex-wait on */
+    uint32_t wake;
+
+    /** Readers waiting on wake; the writer only wakes them if so */
+    uint32_t waiters;
+
+    /** Set when the writer goes away */
+    uint32_t closed;
+    uint32_t pad;
+} up_shm_header_t;
+
+typedef struct up_shm_record_struct {
+    uint64_t seq;
+
+    /** CLOCK_REALTIME when the bytes were read, in ns */
+    uint64_t ts_ns;
+
+    uint32_t len;
+    uint32_t flags;
+} up_shm_record_t;
+
+typedef struct up_shm_struct {
+    /** shm_open() name; the writer removes it when done */
+    char name[64];
+    int writer;
+
+    up_shm_header_t *hdr;
+    uint8_t *data;
+    uint64_t map_len;
+
+    /** Reader: where the next record is, and the sequence number
+     *  expected there
+     */
+    uint64_t pos;
+    uint64_t seq;
+
+    /** Reader: the record handed out by up_shm_read() */
+    uint64_t cur_pos;
+    uint64_t cur_next;
+} up_shm_t;
+
+/** Create the ring called name (as for shm_open(), eg. "/upc2"),
+ *  replacing any left over.  Returns NULL, having said why, if it
+ *  cannot be created.
+ */
+up_shm_t *up_shm_create(const char *name);
+
+/** Publish nr bytes just read from the target */
+void up_shm_publish(up_shm_t *shm, const uint8_t *bytes, int nr);
+
+/** Writer: mark the ring closed and remove it.  Reader: detach. */
+void up_shm_dispose(up_shm_t *shm);
+
+/** Attach to the ring called name as a reader, starting at the
+ *  oldest record still there if from_start, otherwise at the next
+ *  one written.  Returns NULL with errno set on failure.
+ */
+up_shm_t *up_shm_open(const char *name, int from_start);
+
+/** Find the next record.  On success, points *rec at its header and
+ *  *bytes at its data, in the ring itself, and returns 1; call
+ *  up_shm_done() when finished with them.  Returns 0 if there is
+ *  nothing new, or -1 if the reader has been overrun, in which case
+ *  *lost is set to the number of records missed and reading goes on
+ *  from the newest.
+ */
+int up_shm_read(up_shm_t               *shm,
+                const up_shm_record_t **rec,
+                const uint8_t         **bytes,
+                uint64_t               *lost);
+
+/** Finish with the record from up_shm_read().  Returns 0, or -1 if
+ *  the writer overwrote it meanwhile, so that what was read may be
+ *  garbage.
+ */
+int up_shm_done(up_shm_t *shm);
+
+/** Wait up to timeout_ms for something new.  Returns 1 if there may
+ *  be, 0 on timeout, or -1 if the writer has closed the ring and
+ *  everything in it has been read.
+ */
+int up_shm_wait(up_shm_t *shm, int timeout_ms);
+
+#endif
+
+/* End file */
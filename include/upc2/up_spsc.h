@@ -0,0 +1,79 @@
+/* up_spsc.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_SPSC_H_INCLUDED
+#define UP_SPSC_H_INCLUDED
+
+/** @file
+ *
+ *  A lock-free byte ring between exactly two threads: one producer,
+ *  which only ever adds bytes, and one consumer, which only ever
+ *  takes them.  Neither waits for the other; each just sees as much
+ *  room or data as the other has published so far.
+ *
+ *  head and tail count bytes since the ring was created, so full and
+ *  empty are never confused; each is written by one side only and
+ *  kept on its own cache line.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define UP_SPSC_CACHE_LINE (64)
+
+typedef struct up_spsc_struct {
+    uint8_t *data;
+
+    /** Capacity in bytes: a power of two */
+    uint32_t size;
+
+    /** Where the producer adds bytes; written only by the producer */
+    uint64_t tail __attribute__((aligned(UP_SPSC_CACHE_LINE)));
+
+    /** Where the consumer takes them; written only by the consumer */
+    uint64_t head __attribute__((aligned(UP_SPSC_CACHE_LINE)));
+} up_spsc_t;
+
+/** Allocate storage for a ring of at least size bytes, rounded up to
+ *  a power of two.  Returns 0 or -1.
+ */
+int up_spsc_init(up_spsc_t *q, int size);
+
+/** Release a ring's storage.  Neither side may be using it. */
+void up_spsc_free(up_spsc_t *q);
+
+/** Producer: free space, as at most two iovecs to fill.  Follow with
+ *  up_spsc_commit() for the bytes actually filled.  Returns the
+ *  iovec count (0 if full).
+ */
+int up_spsc_space_iov(up_spsc_t *q, struct iovec iov[2]);
+
+/** Producer: publish nr bytes written into the space */
+void up_spsc_commit(up_spsc_t *q, int nr);
+
+/** Producer: copy as much of bytes as will fit into the ring and
+ *  publish it.  Returns the number of bytes queued.
+ */
+int up_spsc_put(up_spsc_t *q, const uint8_t *bytes, int nr);
+
+/** Consumer: the bytes held, as at most two iovecs.  Returns the
+ *  iovec count (0 if empty).
+ */
+int up_spsc_data_iov(up_spsc_t *q, struct iovec iov[2]);
+
+/** Consumer: copy up to nr bytes from the front without taking them.
+ *  Returns the number copied.
+ */
+int up_spsc_copy(up_spsc_t *q, uint8_t *tgt, int nr);
+
+/** Consumer: hand nr bytes from the front back to the producer */
+void up_spsc_consume(up_spsc_t *q, int nr);
+
+/** Bytes held.  Exact for the consumer; a lower bound on the room
+ *  for the producer.  Either side may ask.
+ */
+int up_spsc_count(up_spsc_t *q);
+
+#endif
+
+/* End file */
@@ -0,0 +1,89 @@
+/* up_txq.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_TXQ_H_INCLUDED
+#define UP_TXQ_H_INCLUDED
+
+/** @file
+ *
+ *  A transmit queue with two lanes, used by BIOs which buffer output.
+ *  Bulk output is queued as frames, one for each write.  Urgent
+ *  output - acknowledgements, keystrokes - goes out ahead of any
+ *  queued bulk frames, though never in the middle of one which has
+ *  been partly sent.  Not thread-safe.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "upc2/up_ring.h"
+
+/** Room for urgent output */
+#define UP_TXQ_URGENT_BYTES (256)
+
+/** Bulk frames whose boundaries are kept; past this, new bytes are
+ *  added to the last frame, which just makes urgent output wait a
+ *  little longer.
+ */
+#define UP_TXQ_FRAMES (64)
+
+/** Most iovecs up_txq_data_iov() will produce */
+#define UP_TXQ_IOV (6)
+
+/** For up_txq_put(): how the bytes relate to those already queued */
+#define UP_TXQ_MORE    (0) /* The rest of the last frame */
+#define UP_TXQ_NEW     (1) /* A frame of their own */
+#define UP_TXQ_STARTED (2) /* The rest of a frame partly sent directly */
+
+typedef struct up_txq_struct {
+    up_ring_t bulk;
+    up_ring_t urgent;
+
+    /** Bytes of each bulk frame still queued, oldest first */
+    int frame_len[UP_TXQ_FRAMES];
+    int frame_head;
+    int frames;
+
+    /** Non-zero if the oldest bulk frame has been partly sent */
+    int started;
+
+    /** Bytes queued in both lanes */
+    int count;
+} up_txq_t;
+
+/** Allocate storage for size bytes of bulk output.  Returns 0 or -1 */
+int up_txq_init(up_txq_t *q, int size);
+
+/** Release a queue's storage */
+void up_txq_free(up_txq_t *q);
+
+/** Bytes of bulk output that can be queued now */
+int up_txq_room(const up_txq_t *q);
+
+/** Queue as much of bytes as will fit as bulk output; how is one of
+ *  UP_TXQ_MORE, UP_TXQ_NEW or UP_TXQ_STARTED.  Returns the number of
+ *  bytes queued.
+ */
+int up_txq_put(up_txq_t *q, const uint8_t *bytes, int nr, int how);
+
+/** Queue as much of bytes as will fit as urgent output.  Returns the
+ *  number of bytes queued.
+ */
+int up_txq_put_urgent(up_txq_t *q, const uint8_t *bytes, int nr);
+
+/** Describe the bytes to send, in the order they should go.  Returns
+ *  the iovec count (0 if empty).
+ */
+int up_txq_data_iov(const up_txq_t *q, struct iovec iov[UP_TXQ_IOV]);
+
+/** Drop nr bytes sent from the front of what up_txq_data_iov()
+ *  described.
+ */
+void up_txq_consume(up_txq_t *q, int nr);
+
+/** Drop everything queued */
+void up_txq_discard(up_txq_t *q);
+
+#endif
+
+/* End file */
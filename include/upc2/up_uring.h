@@ -0,0 +1,104 @@
+/* up_uring.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef UP_URING_H_INCLUDED
+#define UP_URING_H_INCLUDED
+
+/** @file
+ *
+ *  A minimal io_uring, driven with the raw system calls so that we
+ *  need neither liburing nor a recent C library.  Requests are queued
+ *  without a system call and go to the kernel together on the next
+ *  up_uring_wait() or up_uring_submit().  Each request is tracked by
+ *  an up_uring_op_t, whose complete() is called when it finishes.
+ *  Not thread-safe.
+ */
+
+#include <stdint.h>
+
+/** Number of submission queue entries we ask for */
+#define UP_URING_ENTRIES (32)
+
+typedef struct up_uring_op_struct {
+    /** Called from up_uring_reap() with the result of the request:
+     *  what the system call would have returned, or -errno
+     */
+    void (*complete)(struct up_uring_op_struct *op, int res);
+
+    /** Non-zero from queueing until complete() is called */
+    int busy;
+} up_uring_op_t;
+
+typedef struct up_uring_struct {
+    int fd;
+
+    /* Submission queue */
+    void *sq_map;
+    unsigned int sq_map_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sqes_len;
+    unsigned int sq_entries;
+
+    /** Entries queued since the last system call */
+    unsigned int to_submit;
+
+    /* Completion queue */
+    void *cq_map;
+    unsigned int cq_map_len;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /** io_uring_enter() calls made, for the curious */
+    uint64_t enters;
+} up_uring_t;
+
+/** Set up a ring.  Returns NULL with errno set if this kernel (or a
+ *  seccomp filter) will not give us one we can use.
+ */
+up_uring_t *up_uring_create(void);
+
+/** Tear the ring down.  Requests in flight are abandoned, so their
+ *  buffers must not be freed before this.
+ */
+void up_uring_dispose(up_uring_t *ring);
+
+/** Queue a read(), write() at the current file position, or a
+ *  one-shot poll() for events.  Returns 0, or -1 if the request could
+ *  not be queued even after submitting what was there.
+ */
+int up_uring_read(up_uring_t *ring, up_uring_op_t *op,
+                  int fd, void *buf, unsigned int nr);
+int up_uring_write(up_uring_t *ring, up_uring_op_t *op,
+                   int fd, const void *buf, unsigned int nr);
+int up_uring_poll(up_uring_t *ring, up_uring_op_t *op, int fd, int events);
+
+/** Queue removal of a poll queued by up_uring_poll().  The poll
+ *  completes with -ECANCELED if it had not fired.
+ */
+int up_uring_poll_remove(up_uring_t *ring, up_uring_op_t *op);
+
+/** Hand queued requests to the kernel without waiting.  Returns 0 or
+ *  -1.
+ */
+int up_uring_submit(up_uring_t *ring);
+
+/** Hand queued requests to the kernel and wait up to timeout_ms (-1
+ *  for ever) for at least one to finish, in a single system call,
+ *  then reap.  Returns the number reaped or -1.
+ */
+int up_uring_wait(up_uring_t *ring, int timeout_ms);
+
+/** Call complete() for every finished request.  No system call.
+ *  Returns the number reaped.
+ */
+int up_uring_reap(up_uring_t *ring);
+
+#endif
+
+/* End file */
@@ -5,8 +5,15 @@
 #define UTILS_H_INCLUDED
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "upc2/up.h"
 
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t utils_monotonic_ns(void);
+
+/* Sleep until utils_monotonic_ns() reaches deadline_ns */
+void utils_sleep_until(uint64_t deadline_ns);
+
 /* Ensure all 'len' bytes are written to the fd, or error */
 int utils_safe_write(int fd, const uint8_t *data, int len);
 
@@ -22,15 +29,129 @@ int utils_safe_read(int fd, uint8_t *data, int len);
  */
 int utils_check_critical_control(up_context_t *up);
 
-/* safe_write() for bios */
+/* safe_write() for bios.  Waits for the bio to accept all the
+ * data; returns -1 on a hard error.
+ */
 int utils_bio_safe_write(up_bio_t *bio, const uint8_t *data, int nr);
 
+/* Write a short frame ahead of whatever the bio has queued, waiting
+ * for room as safe_write() does.  Returns nr or -1.
+ */
+int utils_bio_urgent_write(up_bio_t *bio, const uint8_t *data, int nr);
+
+/* Largest iovcnt utils_bio_safe_writev() will accept */
+#define UTILS_BIO_MAX_IOV 16
+
+/* safe_write() for bios, gathering several buffers into one write
+ * where the bio supports it
+ */
+int utils_bio_safe_writev(up_bio_t           *bio,
+                          const struct iovec *iov,
+                          int                 iovcnt);
+
+/* Bytes queued in the bio awaiting the device (0 if unbuffered) */
+int utils_bio_tx_pending(up_bio_t *bio);
+
+/* Non-zero if the bio's queued output is above its high-water mark,
+ * so bulk writers should wait before writing more
+ */
+int utils_bio_tx_congested(up_bio_t *bio);
+
+/* Pass queued output on to the device without blocking.  Returns the
+ * bytes still pending or < 0 on error.
+ */
+int utils_bio_tx_service(up_bio_t *bio);
+
+/* poll() the bio for up to timeout_ms, servicing queued output when
+ * it becomes writable.  Returns the revents seen, or < 0 on error.
+ */
+int utils_bio_wait(up_bio_t *bio, int events, int timeout_ms);
+
+/* Bytes the bio has read ahead from the device (0 if unbuffered) */
+int utils_bio_rx_pending(up_bio_t *bio);
+
+/* Milliseconds until the bio needs calling regardless of its fd, or
+ * -1 if it doesn't
+ */
+int utils_bio_poll_timeout(up_bio_t *bio);
+
+/* Look at up to nr bytes of input without consuming them; non-blocking.
+ * Fails with ENOSYS if the bio does not read ahead.
+ */
+int utils_bio_peek(up_bio_t *bio, uint8_t *data, int nr);
+
+/* Consume nr bytes of input previously seen with utils_bio_peek() */
+int utils_bio_consume(up_bio_t *bio, int nr);
+
+/* Get at the next run of input without copying it where the bio can
+ * lend out its own storage; otherwise read up to nr bytes into
+ * scratch.  Returns the number of bytes at *data (which may exceed nr
+ * when borrowed) or what read() would.  Follow with
+ * utils_bio_release() for the bytes actually used.
+ */
+int utils_bio_borrow(up_bio_t       *bio,
+                     const uint8_t **data,
+                     uint8_t        *scratch,
+                     int             nr);
+
+/* Consume nr bytes obtained with utils_bio_borrow() */
+int utils_bio_release(up_bio_t *bio, int nr);
+
+/* Read a single byte, waiting up to timeout_ms for it.  Returns the
+ * byte, or -1 with errno set: ETIMEDOUT if nothing arrived, EPIPE if
+ * the device hung up.
+ */
+int utils_bio_read_byte(up_bio_t *bio, int timeout_ms);
+
+/* Wait up to timeout_ms for queued output to reach the device.
+ * Returns the number of bytes left unsent, or < 0 on error.
+ */
+int utils_bio_flush(up_bio_t *bio, int timeout_ms);
+
+/* Account in stats for a read() or write() of nr bytes which returned
+ * rv, with errno as it left it.
+ */
+void utils_bio_count_read(up_bio_stats_t *stats, int nr, int rv);
+void utils_bio_count_write(up_bio_stats_t *stats, int nr, int rv);
+
+/* The BIO's statistics, brought up to date */
+const up_bio_stats_t *utils_bio_stats(up_bio_t *bio);
+
+/* Start the BIO's statistics again from zero */
+void utils_bio_stats_reset(up_bio_t *bio);
+
+/* Print the BIO's statistics to the console */
+void utils_bio_print_stats(up_context_t *ctx, up_bio_t *bio);
+
 /* safe_write for console with printf semantics */
 int utils_safe_printf(up_context_t *ctx, const char *str, ...);
 
-/* set_baud as a protocol "prepare" entry point */
+/* Longest a line sequence waits for earlier output to go */
+#define UP_LINE_FLUSH_MS (2000)
+
+/* Parse a line sequence such as "dtr=0,rts=1,wait=100,dtr=1,break=250"
+ * into at most max steps.  Returns the number of steps, or -1 having
+ * said what is wrong.
+ */
+int utils_parse_line_sequence(const char     *spec,
+                              up_line_step_t *steps,
+                              int             max);
+
+/* Run a line sequence on the context's BIO, blocking until it is done.
+ * Returns 0, or -1 if it failed or the BIO cannot do it.
+ */
+int utils_run_line_sequence(up_context_t         *ctx,
+                            const up_line_step_t *steps,
+                            int                   nr);
+
+/* set_baud, then the stage's line sequence, as a protocol "prepare"
+ * entry point
+ */
 int utils_protocol_set_baud(void *h, up_context_t *ctx, up_load_arg_t *arg);
 
+/* ... for the console, the only stage allowed XON/XOFF flow control */
+int utils_console_set_baud(void *h, up_context_t *ctx, up_load_arg_t *arg);
+
 /* Decode handshake to a constant string */
 const char *utils_decode_flow_control(int fc);
 
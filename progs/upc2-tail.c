@@ -0,0 +1,126 @@
+/* upc2-tail.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  Follow the serial stream a upc2 run with --shm publishes, copying
+ *  it to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "upc2/up_shm.h"
+
+/* How long to wait for data before checking on the writer again */
+#define TAIL_WAIT_MS 1000
+
+struct option options[] = {
+    { "from-start", no_argument, NULL, 's' },
+    { "help",       no_argument, NULL, '?' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(void);
+
+static int write_all(int fd, const uint8_t *bytes, int nr) {
+    while (nr > 0) {
+        int rv = write(fd, bytes, nr);
+
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        bytes += rv;
+        nr -= rv;
+    }
+    return 0;
+}
+
+int main(int argn, char *args[]) {
+    static uint8_t buf[UP_SHM_MAX_RECORD];
+    int from_start = 0;
+    up_shm_t *shm;
+    int option;
+    int rv = 0;
+
+    while ((option = getopt_long(argn, args, "s", options, NULL)) != -1) {
+        switch (option) {
+            case 's':
+                from_start = 1;
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind != argn - 1) {
+        usage();
+        return 1;
+    }
+
+    shm = up_shm_open(args[optind], from_start);
+    if (shm == NULL) {
+        fprintf(stderr, "upc2-tail: Cannot open %s: %s [%d]\n",
+                args[optind], strerror(errno), errno);
+        return 2;
+    }
+
+    for (;;) {
+        const up_shm_record_t *rec;
+        const uint8_t *bytes;
+        uint64_t lost;
+        int len;
+
+        rv = up_shm_read(shm, &rec, &bytes, &lost);
+        if (rv < 0) {
+            fprintf(stderr, "upc2-tail: Overrun; %" PRIu64 " chunks lost\n",
+                    lost);
+            continue;
+        }
+        if (rv == 0) {
+            rv = up_shm_wait(shm, TAIL_WAIT_MS);
+            if (rv < 0) {
+                /* upc2 has gone */
+                rv = 0;
+                break;
+            }
+            continue;
+        }
+
+        /* Take a copy, so we only pass on what the writer left alone */
+        len = rec->len;
+        if (len > UP_SHM_MAX_RECORD)
+            len = UP_SHM_MAX_RECORD;
+        memcpy(buf, bytes, len);
+        if (up_shm_done(shm) < 0) {
+            fprintf(stderr, "upc2-tail: Overrun while reading a chunk\n");
+            continue;
+        }
+        if (write_all(STDOUT_FILENO, buf, len) < 0) {
+            rv = 3;
+            break;
+        }
+    }
+
+    up_shm_dispose(shm);
+    return rv;
+}
+
+static void usage(void) {
+    printf("Syntax: upc2-tail [--from-start] <name>\n"
+           "\n"
+           "Copies what upc2 --shm <name> reads from the target to stdout.\n"
+           "\t--from-start \tBegin with the oldest data still held,\n"
+           "\t\t\trather than the next to arrive.\n");
+}
+
+/* End file */
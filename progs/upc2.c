@@ -27,7 +27,15 @@
 #include "upc2/up_bio_kbus.h"
 #else
 #include "upc2/up_bio_serial.h"
+#include "upc2/up_bio_pty.h"
+#include "upc2/up_emulator.h"
 #endif
+#include "upc2/up_bio_socket.h"
+#include "upc2/up_bio_rfc2217.h"
+#include "upc2/up_bio_link.h"
+#include "upc2/up_bio_record.h"
+#include "upc2/up_bio_replay.h"
+#include "upc2/up_bio_thread.h"
 #include "upc2/up_lineend.h"
 #include "upc2/grouch.h"
 #include "upc2/xmodem.h"
@@ -91,6 +99,17 @@ struct option options[] = {
     { "script",   required_argument, NULL, 'x' },
     { "lineend",  required_argument, NULL, 'n' },
     { "hex",      no_argument,       NULL, 'h' },
+    { "low-latency", no_argument,    NULL, 'L' },
+    { "rcvbuf",   required_argument, NULL, 'r' },
+    { "emu-delay", required_argument, NULL, 'e' },
+    { "link",     required_argument, NULL, 'k' },
+    { "record",   required_argument, NULL, 'R' },
+    { "uring",    no_argument,       NULL, 'U' },
+    { "tx-budget", required_argument, NULL, 'T' },
+    { "shm",      required_argument, NULL, 'S' },
+    { "reset",    required_argument, NULL, 'Z' },
+    { "reconnect", optional_argument, NULL, 'c' },
+    { "io-thread", optional_argument, NULL, 'I' },
     { "help",     no_argument,       NULL, '?' },
     { NULL, 0, NULL, 0 }
 };
@@ -98,6 +117,12 @@ struct option options[] = {
 static void usage(void);
 static char *read_script(const char *filename, int *pargn, char ***pargs);
 static up_parse_protocol_t *parse_protocol(const char *name);
+#ifndef KBUS_DEBUG
+static up_bio_t *create_emulated_target(up_emulator_t **pemu,
+                                        int            delay_us,
+                                        up_load_arg_t *args,
+                                        int            nr_args);
+#endif
 
 int main(int argn, char *args[]) {
     up_context_t *upc;
@@ -113,6 +138,23 @@ int main(int argn, char *args[]) {
     int fc = UP_FLOW_CONTROL_NONE;
     int option;
     int hex_mode = 0;
+#ifndef KBUS_DEBUG
+    int serial_flags = 0;
+    up_emulator_t *emu = NULL;
+    int emu_delay = 0;
+    int tx_budget_ms = UP_BIO_SERIAL_TX_BUDGET_MS;
+#endif
+    int rcvbuf = 0;
+    const char *link_spec = NULL;
+    const char *record_file = NULL;
+    int use_uring = 0;
+    const char *shm_name = NULL;
+    up_line_step_t console_reset[UP_LINE_MAX_STEPS];
+    int nr_console_reset = 0;
+    int reconnect_ms = 0;
+    int io_thread = 0;
+    int io_cpu = -1;
+    up_bio_t *bio;
     up_parse_protocol_t *selected_protocol;
     up_translation_table_t *translations = parse_line_end("none");
 
@@ -259,6 +301,68 @@ int main(int argn, char *args[]) {
                     hex_mode = 1;
                     break;
 
+#ifndef KBUS_DEBUG
+                case 'L':
+                    serial_flags |= UP_BIO_SERIAL_LOW_LATENCY;
+                    break;
+
+                case 'e':
+                    emu_delay = strtol(optarg, NULL, 0);
+                    break;
+
+                case 'T':
+                    tx_budget_ms = strtol(optarg, NULL, 0);
+                    break;
+#endif
+
+                case 'r':
+                    rcvbuf = strtol(optarg, NULL, 0);
+                    break;
+
+                case 'k':
+                    link_spec = optarg;
+                    break;
+
+                case 'R':
+                    record_file = optarg;
+                    break;
+
+                case 'U':
+                    use_uring = 1;
+                    break;
+
+                case 'S':
+                    shm_name = optarg;
+                    break;
+
+                case 'c':
+                    reconnect_ms = (optarg == NULL) ? UP_RECONNECT_MS :
+                        strtol(optarg, NULL, 0);
+                    break;
+
+                case 'I':
+                    io_thread = 1;
+                    if (optarg != NULL)
+                        io_cpu = strtol(optarg, NULL, 0);
+                    break;
+
+                case 'Z':
+                {
+                    /* Before any boot stage, it is for the console */
+                    up_line_step_t *steps =
+                        (cur_arg < 0) ? console_reset : up_args[cur_arg].reset;
+                    int nr = utils_parse_line_sequence(optarg, steps,
+                                                       UP_LINE_MAX_STEPS);
+
+                    if (nr < 0)
+                        return 6;
+                    if (cur_arg < 0)
+                        nr_console_reset = nr;
+                    else
+                        up_args[cur_arg].nr_reset = nr;
+                    break;
+                }
+
                 case 'n':
                     /* Line endings */
                     if ((translations = parse_line_end(optarg)) == NULL)
@@ -272,6 +376,9 @@ int main(int argn, char *args[]) {
                 case 'f':
                     if (strstr(optarg, "rts") || strstr(optarg, "cts")) {
                         fc = UP_FLOW_CONTROL_RTSCTS;
+                    } else if (strstr(optarg, "xon") ||
+                               strstr(optarg, "xoff")) {
+                        fc = UP_FLOW_CONTROL_XONXOFF;
                     } else if (!strcmp(optarg, "none")) {
                         fc = UP_FLOW_CONTROL_NONE;
                     } else {
@@ -316,6 +423,8 @@ int main(int argn, char *args[]) {
     up_args[cur_arg].baud = baud;
     up_args[cur_arg].protocol = &dummy_protocol;
     up_args[cur_arg].fc = fc;
+    memcpy(up_args[cur_arg].reset, console_reset, sizeof(console_reset));
+    up_args[cur_arg].nr_reset = nr_console_reset;
 
 
     /* Now open all the files and do the protocol preparation */
@@ -377,19 +486,87 @@ int main(int argn, char *args[]) {
     if (hex_mode) {
         upc->hex_mode = 1;
     }
+
+    if (use_uring && up_use_uring(upc) < 0)
+    {
+        printf("[[ io_uring not available (%s); using epoll ]]\n",
+               strerror(errno));
+    }
+
+    if (shm_name != NULL && up_publish_shm(upc, shm_name) < 0)
+    {
+        rv = -1;
+        goto end;
+    }
     
 
-    /* Open a serial port */
+    /* Open a serial port, or a connection to a serial server */
+    if (up_bio_replay_is_spec(serial_port))
+        bio = up_bio_replay_create(serial_port);
+    else if (up_bio_rfc2217_is_spec(serial_port))
+        bio = up_bio_rfc2217_create(serial_port, rcvbuf);
+    else if (up_bio_socket_is_spec(serial_port))
+        bio = up_bio_socket_create(serial_port, rcvbuf);
 #ifdef KBUS_DEBUG
-    up_bio_t *bio = up_bio_kbus_create(serial_port);
+    else
+        bio = up_bio_kbus_create(serial_port);
 #else
-    up_bio_t *bio = up_bio_serial_create(serial_port);
+    else if (!strcmp(serial_port, "emu"))
+        bio = create_emulated_target(&emu, emu_delay, up_args, cur_arg);
+    else
+    {
+        bio = up_bio_serial_create(serial_port, serial_flags);
+        if (bio != NULL)
+            up_bio_serial_set_tx_budget(bio, tx_budget_ms);
+    }
 #endif
     if (!bio) {
         fprintf(stderr, "Cannot create serial BIO for %s.\n", serial_port);
         goto end;
     }
 
+    /* Make it a worse connection than it really is */
+    if (link_spec != NULL)
+    {
+        up_bio_link_params_t link_params;
+        up_bio_t *link_bio = NULL;
+
+        if (up_bio_link_parse(link_spec, &link_params) == 0)
+            link_bio = up_bio_link_create(bio, &link_params);
+        if (link_bio == NULL)
+        {
+            bio->dispose(bio);
+            goto end;
+        }
+        bio = link_bio;
+    }
+
+    /* Keep a copy of the traffic as the host sees it */
+    if (record_file != NULL)
+    {
+        up_bio_t *record_bio = up_bio_record_create(bio, record_file);
+
+        if (record_bio == NULL)
+        {
+            bio->dispose(bio);
+            goto end;
+        }
+        bio = record_bio;
+    }
+
+    /* Outermost, so everything above runs off the main thread too */
+    if (io_thread)
+    {
+        up_bio_t *thread_bio = up_bio_thread_create(bio, io_cpu);
+
+        if (thread_bio == NULL)
+        {
+            bio->dispose(bio);
+            goto end;
+        }
+        bio = thread_bio;
+    }
+
     rv = up_attach_bio(upc, bio);
     if (rv < 0) {
         fprintf(stderr, "Cannot attach serial BIO for %s \n", serial_port);
@@ -401,6 +578,7 @@ int main(int argn, char *args[]) {
     fflush(stdout);
 
     up_set_log_fd(upc, log_fd);
+    up_set_reconnect(upc, reconnect_ms);
 
     /* Mine stdin is made the fool o'the FTDI .. */
     up_become_console(upc, up_args, cur_arg+1);
@@ -424,6 +602,10 @@ int main(int argn, char *args[]) {
 
 end:
     up_dispose(&upc);
+#ifndef KBUS_DEBUG
+    /* After the BIO, which may still be flushing to it */
+    up_emulator_dispose(emu);
+#endif
     return rv;
 }
 
@@ -432,12 +614,47 @@ static void usage(void)
 {
     printf("Syntax: upc2 [--serial /dev/ttyUSBX] [--log file]\n"
            "\t\t[--lineend line-ending]\n"
-           "\t\t[--grouch filename [--protocol proto] [--baud baud]]*\n"
-           "\t\t[--hex]\n"
+           "\t\t[--grouch filename [--protocol proto] [--baud baud]\n"
+           "\t\t  [--reset seq]]*\n"
+           "\t\t[--hex] [--low-latency] [--rcvbuf bytes]\n"
+           "\t\t[--emu-delay us] [--link spec] [--record file] [--uring]\n"
+           "\t\t[--tx-budget ms] [--shm name] [--reconnect[=ms]]\n"
+           "\t\t[--io-thread[=cpu]]\n"
            "\t\t[--script filename]*\n"
            "\t\t[<baud>]\n"
            "\n"
            "\t--serial <device> \tUse the given serial device.\n"
+           "\t\t<device> may also be tcp:<host>:<port> or unix:<path>\n"
+           "\t\tto talk to a serial port server (eg. ser2net, raw mode),\n"
+           "\t\tor rfc2217:<host>:<port> for a telnet server that can\n"
+           "\t\tchange the baud rate (RFC 2217).\n"
+           "\t\treplay:<file> plays back a trace made with --record.\n"
+           "\t\t'emu' runs the boot stages against a target emulated in\n"
+           "\t\tsoftware, to test and time uploads without hardware.\n"
+           "\t--emu-delay <us> \tTime the emulated target takes over\n"
+           "\t\teach packet.\n"
+           "\t--link <spec> \t\tEmulate a slow or noisy link.  <spec> is\n"
+           "\t\ta comma-separated list of baud=<rate> (default: follow\n"
+           "\t\tthe boot stages), latency=<us>, frame=<us> (USB frame\n"
+           "\t\tquantisation), ber=<bit error rate>, drop=<byte loss\n"
+           "\t\trate> and seed=<n>.\n"
+           "\t--record <file> \tRecord all serial traffic, timestamped,\n"
+           "\t\tto a trace file for --serial replay:<file>.\n"
+           "\t--uring \t\tWait and write console output with io_uring,\n"
+           "\t\tfalling back to epoll if the kernel can't.\n"
+           "\t--tx-budget <ms> \tLet the serial driver queue no more than\n"
+           "\t\tthis much line time of output (default 20, 0 for no limit).\n"
+           "\t--reconnect[=<ms>] \tIf the serial device goes away (eg. a\n"
+           "\t\tUSB adapter on the target, as it resets), wait this long\n"
+           "\t\t(default 30000) for it to come back and carry on.\n"
+           "\t--io-thread[=<cpu>] \tRead and write the serial device on a\n"
+           "\t\tthread of its own (pinned to <cpu> if given), so that\n"
+           "\t\ta busy terminal or log never stalls it.\n"
+           "\t--shm <name> \t\tPublish everything read from the target\n"
+           "\t\tto a shared-memory ring (eg. /upc2) for other programs;\n"
+           "\t\tupc2-tail <name> follows it.\n"
+           "\t--rcvbuf <bytes> \tSocket receive buffer size for network\n"
+           "\t\tconnections.\n"
            "\t--log <file> \t\tAppend all console input to this file.\n"
            "\t--lineend <line-end> \tTranslate line endings in console.\n"
            "\t\t<line-end> can be 'none' or a string made up of the line\n"
@@ -447,8 +664,17 @@ static void usage(void)
            "\t\ton the target, and vice versa.\n"
            "\t--grouch <filename> \tUpload the given file.\n"
            "\t--baud <rate> \t\tChange baud rate.\n"
-           "\t--fc   <none|rtscts>\tSet flow control.\n"
+           "\t--reset <seq> \t\tOnce the baud rate is set, drive the\n"
+           "\t\tmodem control lines, eg. to reset the target into its\n"
+           "\t\tbootloader.  <seq> is a comma-separated list of\n"
+           "\t\tdtr=<0|1>, rts=<0|1>, break=<ms> and wait=<ms>.  Before\n"
+           "\t\tany --grouch, it is for the console.\n"
+           "\t--fc   <none|rtscts|xonxoff>\tSet flow control for the"
+           " console.\n"
+           "\t\txonxoff is not used while uploading.\n"
            "\t--hex   \t\t Display output in hex.\n"
+           "\t--low-latency \t\t Minimise serial latency (FTDI latency\n"
+           "\t\t\t\t timer, ASYNC_LOW_LATENCY); speeds up xmodem and kinetis.\n"
            "\t--defer \t\t Defer this boot stage until invoked by eg. C-a n \n"
            "\t--offset <n> \t\t Offset into memory to transfer file\n"
            "\t--protocol <proto> \tChange protocol for upload.  \n"
@@ -612,8 +838,59 @@ static up_parse_protocol_t *parse_protocol(const char *name)
 }
 
 
+#ifndef KBUS_DEBUG
+/* Start a target emulator for the boot stages in args, and return a
+ * BIO connected to it.
+ */
+static up_bio_t *create_emulated_target(up_emulator_t **pemu,
+                                        int            delay_us,
+                                        up_load_arg_t *args,
+                                        int            nr_args)
+{
+    up_emulator_t *emu;
+    up_bio_t *bio;
+    int master_fd;
+    int i;
+
+    emu = up_emulator_create(delay_us);
+    if (emu == NULL)
+    {
+        fprintf(stderr, "Cannot create target emulator\n");
+        return NULL;
+    }
+    for (i = 0; i < nr_args; ++i)
+    {
+        if (args[i].fd >= 0 &&
+            up_emulator_add_stage(emu, args[i].protocol->name) < 0)
+        {
+            fprintf(stderr, "Too many boot stages to emulate\n");
+            up_emulator_dispose(emu);
+            return NULL;
+        }
+    }
+
+    bio = up_bio_pty_create(&master_fd);
+    if (bio == NULL)
+    {
+        up_emulator_dispose(emu);
+        return NULL;
+    }
+    if (up_emulator_start(emu, master_fd) < 0)
+    {
+        bio->dispose(bio);
+        /* The emulator owns master_fd now */
+        up_emulator_dispose(emu);
+        return NULL;
+    }
+    *pemu = emu;
+    return bio;
+}
+#endif
+
+
 static int prepare_console(void *h, up_context_t *ctx, up_load_arg_t *arg)
 {
     arg->echo = 1;
-    return utils_protocol_set_baud(h, ctx, arg);
+    /* The one stage where XON/XOFF flow control is safe */
+    return utils_console_set_baud(h, ctx, arg);
 }
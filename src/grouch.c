@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <stddef.h>
 
 #include "upc2/grouch.h"
 #include "upc2/up.h"
@@ -15,13 +16,32 @@
 
 #define NAME_MAYBE_NULL(n) (((n) == NULL) ? "(no file name)" : (n))
 
+/* How much of the file we hold at once */
+#define GROUCH_BUFFER_BYTES 4096
+
+/* Where a boot stage has got to */
+#define GROUCH_HUNT   0 /* Looking for the "*LOAD*" cue */
+#define GROUCH_UPLOAD 1 /* Sending the length, file and checksum */
+
+typedef struct grouch_struct
+{
+    int state;
+    int fsm;         /* How much of the cue we have seen */
+    int in_buf;      /* Bytes in buf still to send */
+    int eof;
+    int wrote_sum;
+    uint32_t sum;
+    uint8_t buf[GROUCH_BUFFER_BYTES];
+} grouch_t;
+
 static void *init_grouch(void);
 static int prepare_grouch(void          *h,
                           up_context_t  *ctx,
                           up_load_arg_t *arg);
-/* Attempts to start grouchloading given a buffer of serial input.
- * Returns 0 if the "*LOAD*" cue has not yet been seen, -1 on error or
- * 1 if the grouchload has been completed successfully.
+/* Looks for the "*LOAD*" cue in a buffer of serial input, then sends
+ * the file a piece at a time, as the BIO can take it.  Returns 0
+ * while there is more to do, -1 on error or 1 once the grouchload
+ * has been sent.
  */
 static int maybe_grouch(void          *h,
                         up_context_t  *ctx,
@@ -43,7 +63,7 @@ const up_protocol_t grouch_protocol = {
 
 static void *init_grouch(void)
 {
-    return malloc(sizeof(int));
+    return malloc(sizeof(grouch_t));
 }
 
 
@@ -58,18 +78,18 @@ int prepare_grouch(void          *h,
                    up_context_t  *ctx,
                    up_load_arg_t *arg)
 {
-    int *p_fsm = (int *)h;
+    grouch_t *g = (grouch_t *)h;
 
-    *p_fsm = 0;
+    memset(g, '\0', offsetof(grouch_t, buf));
+    g->state = GROUCH_HUNT;
     return utils_protocol_set_baud(h, ctx, arg);
 }
 
 
-static int grouch(up_context_t *upc, up_load_arg_t *arg) {
+/* Got our cue: queue up the length, ready to send */
+static int grouch_start(grouch_t *g, up_context_t *upc, up_load_arg_t *arg)
+{
     off_t len;
-    uint8_t buf[4096];
-    int in_buf = 0;
-    int done = 0;
 
     len = lseek(arg->fd, 0, SEEK_END);
     if (len == (off_t)-1)
@@ -81,29 +101,35 @@ static int grouch(up_context_t *upc, up_load_arg_t *arg) {
     }
     lseek(arg->fd, 0, SEEK_SET);
 
-    uint32_t sum = 0, wrote_sum = 0;
     // Preload the buffer with the length, BE.
-    buf[0] = '*'; // Synchronisation.
-    buf[1] = (len >> 24) & 0xff;
-    buf[2] = (len >> 16) & 0xff;
-    buf[3] = (len >> 8) & 0xff;
-    buf[4] = (len & 0xff);
-    in_buf = 5;
-
-    while (!done || in_buf)
-    {
-        int rv;
-        if (utils_check_critical_control(upc) < 0)
-            return -2;
+    g->buf[0] = '*'; // Synchronisation.
+    g->buf[1] = (len >> 24) & 0xff;
+    g->buf[2] = (len >> 16) & 0xff;
+    g->buf[3] = (len >> 8) & 0xff;
+    g->buf[4] = (len & 0xff);
+    g->in_buf = 5;
+    g->sum = 0;
+    g->eof = g->wrote_sum = 0;
+    g->state = GROUCH_UPLOAD;
+    upc->uploading = 1;
+    return 0;
+}
 
-        /* Echo serial input to console */
-        rv = upc->bio->read(upc->bio, &buf[in_buf], 4096-in_buf);
-        if (rv > 0)
-        {
-            utils_safe_write(upc->ttyfd, &buf[in_buf], rv);
-        }
 
-        rv = utils_safe_read(arg->fd, &buf[in_buf], 4096-in_buf);
+/* Top up from the file and make one write to the BIO, which queues
+ * what the device cannot take yet.  Returns 1 when everything has
+ * been handed over, 0 if there is more, or -1.
+ */
+static int grouch_send(grouch_t *g, up_context_t *upc, up_load_arg_t *arg)
+{
+    int rv;
+
+    /* Only top up from the file while the BIO is keeping up */
+    if (!g->eof && g->in_buf < GROUCH_BUFFER_BYTES &&
+        !utils_bio_tx_congested(upc->bio))
+    {
+        rv = utils_safe_read(arg->fd, &g->buf[g->in_buf],
+                             GROUCH_BUFFER_BYTES - g->in_buf);
         if (rv < 0)
         {
             fprintf(stderr,
@@ -117,26 +143,7 @@ static int grouch(up_context_t *upc, up_load_arg_t *arg) {
         }
         else if (!rv)
         {
-            if (wrote_sum)
-            {
-                done = 1;
-            }
-            else
-            {
-                if (in_buf < (4096 - 4))
-                {
-                    buf[in_buf] = (sum >> 24) & 0xff;
-                    buf[in_buf+1] = (sum >> 16) & 0xff;
-                    buf[in_buf+2] = (sum >> 8) & 0xff;
-                    buf[in_buf+3] = (sum >> 0) & 0xff;
-                    in_buf += 4;
-                    utils_safe_printf(
-                        upc,
-                        "! grouch complete: host sum = 0x%08x \n",
-                        sum);
-                    wrote_sum = 1;
-                }
-            }
+            g->eof = 1;
         }
         else
         {
@@ -144,21 +151,46 @@ static int grouch(up_context_t *upc, up_load_arg_t *arg) {
             // Update sum.
             for (x = 0; x < rv; ++x)
             {
-                sum += buf[in_buf + x];
+                g->sum += g->buf[g->in_buf + x];
             }
-            in_buf += rv;
+            g->in_buf += rv;
         }
-        // Now write to the output ...
-        rv = upc->bio->safe_write(upc->bio, buf, in_buf);
-        // printf("<host> wrote %d / %d\n", rv, in_buf);
-        if (rv >= 0)
+    }
+    if (g->eof && !g->wrote_sum && g->in_buf <= (GROUCH_BUFFER_BYTES - 4))
+    {
+        g->buf[g->in_buf] = (g->sum >> 24) & 0xff;
+        g->buf[g->in_buf+1] = (g->sum >> 16) & 0xff;
+        g->buf[g->in_buf+2] = (g->sum >> 8) & 0xff;
+        g->buf[g->in_buf+3] = (g->sum >> 0) & 0xff;
+        g->in_buf += 4;
+        utils_safe_printf(
+            upc,
+            "! grouch complete: host sum = 0x%08x \n",
+            g->sum);
+        g->wrote_sum = 1;
+    }
+
+    if (g->in_buf > 0)
+    {
+        rv = upc->bio->write(upc->bio, g->buf, g->in_buf);
+        if (rv < 0)
         {
-            //printf("rv = %d, in_buf = %d \n", rv, in_buf);
-            memmove(&buf[0], &buf[in_buf], in_buf-rv);
-            in_buf -= rv;
+            if (errno != EINTR && errno != EAGAIN)
+            {
+                fprintf(stderr, "Error writing grouch data: %s [%d]\n",
+                        strerror(errno), errno);
+                return -1;
+            }
+            rv = 0;
         }
+        memmove(&g->buf[0], &g->buf[rv], g->in_buf - rv);
+        g->in_buf -= rv;
     }
+    if (g->wrote_sum && g->in_buf == 0)
+        return 1;
 
+    /* Back to the console until the BIO can take more */
+    upc->proto_wants_tx = 1;
     return 0;
 }
 
@@ -171,8 +203,11 @@ static int maybe_grouch(void          *h,
 {
     static const char *cue = "*LOAD*";
     static const int cuelen = 6;
+    grouch_t *g = (grouch_t *)h;
     int x;
-    int *p_fsm = (int *)h;
+
+    if (g->state == GROUCH_UPLOAD)
+        return grouch_send(g, ctx, arg);
 
     for (x = 0; x < rv; ++x)
     {
@@ -182,22 +217,20 @@ static int maybe_grouch(void          *h,
         if (!c) continue;
 
         //  printf("f = %d c = '%c' (%d)\n", ctx->grouchfsm, c, c);
-        if (cue[*p_fsm] == c)
+        if (cue[g->fsm] == c)
         {
-            ++(*p_fsm);
-            if (*p_fsm == cuelen)
+            ++g->fsm;
+            if (g->fsm == cuelen)
             {
                 // Got our cue! Go do it
-                int rv;
-
-                rv = grouch(ctx, arg);
-                // We're either errored or done.
-                return (rv < 0 ? -1 : 1);
+                if (grouch_start(g, ctx, arg) < 0)
+                    return -1;
+                return grouch_send(g, ctx, arg);
             }
         }
         else
         {
-            *p_fsm = (cue[0] == c ? 1 : 0);
+            g->fsm = (cue[0] == c ? 1 : 0);
         }
     }
     // Still hunting.
@@ -1,7 +1,12 @@
 /* kinetis-bin.c */
 /* Copyright (c) Kynesim Ltd, 2019 */
 
-/* As for kinetis-srec.c, but expecting a .bin file instead of .s19 */
+/* As for kinetis-srec.c, but expecting a .bin file instead of .s19.
+ *
+ * Written as a coroutine (see up_coro.h): the boot sequence below
+ * reads from top to bottom, and the coroutine runtime suspends it
+ * whenever it waits for the target.
+ */
 
 #include <stdio.h>
 #include <stdint.h>
@@ -12,6 +17,7 @@
 #include <sys/types.h>
 
 #include "upc2/up.h"
+#include "upc2/up_coro.h"
 #include "upc2/kinetis-bin.h"
 #include "upc2/utils.h"
 
@@ -20,14 +26,11 @@
 
 typedef struct kcontext_struct
 {
-    int state;
-    int pkt_state;
-    int count;
-    int content_len;
-    off_t file_bytes; /* Number of bytes in the file */
-    int file_nbytes;  /* Number of bytes in file_buffer */
-    uint8_t file_buffer[32];
-    uint8_t buffer[256];
+    up_coro_t co;     /* Must come first */
+    off_t file_bytes; /* Number of bytes of the file left to send */
+    int frame_len;
+    uint8_t frame[6 + 32]; /* Last command or data sent, for NAKs */
+    uint8_t buffer[256];   /* Last packet received */
 } kcontext_t;
 
 
@@ -52,24 +55,8 @@ typedef struct kcontext_struct
      (p[10 + 4*n + 2] << 16) | \
      (p[10 + 4*n + 3] << 24))
 
-/* Overall state machine */
-#define STATE_WAIT_FOR_PING_RESPONSE 0
-#define STATE_WAIT_FOR_ERASE_ACK     1
-#define STATE_WAIT_FOR_ERASE_RESP    2
-#define STATE_WAIT_FOR_WRITE_ACK     3
-#define STATE_WAIT_FOR_WRITE_RESP    4
-#define STATE_WAIT_FOR_DATA_ACK      5
-#define STATE_WAIT_FOR_DATA_RESP     6
-#define STATE_WAIT_FOR_RESET_ACK     7
-#define STATE_WAIT_FOR_RESET_RESP    8
-
-
-/* Packet reader state machine */
-#define PKT_WAIT_FOR_START     0
-#define PKT_WAIT_FOR_TYPE      1
-#define PKT_READ_PING_RESPONSE 2
-#define PKT_READ_HEADER        3
-#define PKT_READ_BODY          4
+/* How long to wait for an answer before pinging again */
+#define KINETIS_PING_RETRY_MS 1000
 
 
 static uint32_t crc_byte(uint32_t crc, uint8_t byte)
@@ -103,59 +90,57 @@ static uint16_t crc_packet(const uint8_t *buffer)
     return crc & 0xffff;
 }
 
-static uint16_t crc_split_packet(const uint8_t *header, const uint8_t *buffer)
+
+/* Send the frame built in kctx->frame.  Returns 0 or -1. */
+static int send_frame(kcontext_t *kctx)
 {
-    uint32_t crc = 0;
-    int len = (header[2] | (header[3] << 8));
-    int i;
+    if (up_coro_send(&kctx->co, kctx->frame, kctx->frame_len) < 0)
+    {
+        fprintf(stderr, "\n**Error %d sending to target: %s\n",
+                errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-    for (i = 0; i < 4; i++)
-        crc = crc_byte(crc, header[i]);
-    for (i = 0; i < len; i++)
-        crc = crc_byte(crc, buffer[i]);
 
-    return crc & 0xffff;
+static int send_ping(kcontext_t *kctx)
+{
+    kctx->frame[0] = PKT_START;
+    kctx->frame[1] = PKT_TYPE_PING;
+    kctx->frame_len = 2;
+    return send_frame(kctx);
 }
 
 
-static int send_packet(up_bio_t *bio,
-                       const uint8_t *buffer,
-                       int nbytes)
+static int send_ack(kcontext_t *kctx)
 {
-    int rv;
+    const uint8_t buffer[2] = { PKT_START, PKT_TYPE_ACK };
 
-    while (nbytes > 0)
+    /* The target waits for this before it will say anything else */
+    if (up_coro_send_urgent(&kctx->co, buffer, 2) < 0)
     {
-        rv = bio->safe_write(bio, buffer, nbytes);
-        if (rv < 0)
-            return rv;
-        nbytes -= rv;
-        buffer += rv;
+        fprintf(stderr, "**Error %d sending ACK: %s\n",
+                errno, strerror(errno));
+        return -1;
     }
     return 0;
 }
 
 
-static int send_ping(up_bio_t *bio)
+static void finish_frame(kcontext_t *kctx)
 {
-    const uint8_t buffer[2] = { PKT_START, PKT_TYPE_PING };
+    uint16_t crc = crc_packet(kctx->frame);
 
-    return send_packet(bio, buffer, 2);
+    kctx->frame[4] = crc & 0xff;
+    kctx->frame[5] = (crc >> 8) & 0xff;
+    kctx->frame_len = (kctx->frame[2] | (kctx->frame[3] << 8)) + 6;
 }
 
 
-static int send_ack(up_bio_t *bio)
+static void build_command0(kcontext_t *kctx, uint8_t command)
 {
-    const uint8_t buffer[2] = { PKT_START, PKT_TYPE_ACK };
-
-    return send_packet(bio, buffer, 2);
-}
-
-
-static int send_command0(up_bio_t *bio, uint8_t command)
-{
-    uint8_t buffer[10];
-    uint16_t crc;
+    uint8_t *buffer = kctx->frame;
 
     buffer[0] = PKT_START;
     buffer[1] = PKT_TYPE_COMMAND;
@@ -166,21 +151,16 @@ static int send_command0(up_bio_t *bio, uint8_t command)
     buffer[7] = 0x00; /* Flags */
     buffer[8] = 0x00; /* Reserved */
     buffer[9] = 0x00; /* Parameter Count */
-
-    crc = crc_packet(buffer);
-    buffer[4] = crc & 0xff;
-    buffer[5] = (crc >> 8) & 0xff;
-    return send_packet(bio, buffer, 10);
+    finish_frame(kctx);
 }
 
 
-static int send_command2(up_bio_t *bio,
-                         uint8_t command,
-                         uint32_t param1,
-                         uint32_t param2)
+static void build_command2(kcontext_t *kctx,
+                           uint8_t command,
+                           uint32_t param1,
+                           uint32_t param2)
 {
-    uint8_t buffer[18];
-    uint16_t crc;
+    uint8_t *buffer = kctx->frame;
 
     buffer[0] = PKT_START;
     buffer[1] = PKT_TYPE_COMMAND;
@@ -199,584 +179,329 @@ static int send_command2(up_bio_t *bio,
     buffer[15] = (param2 >> 8) & 0xff;
     buffer[16] = (param2 >> 16) & 0xff;
     buffer[17] = (param2 >> 24) & 0xff;
-
-    crc = crc_packet(buffer);
-    buffer[4] = crc & 0xff;
-    buffer[5] = (crc >> 8) & 0xff;
-    return send_packet(bio, buffer, 18);
+    finish_frame(kctx);
 }
 
 
-static int send_raw_data(up_bio_t *bio,
-                         const uint8_t *buffer,
-                         uint16_t nbytes)
+/* Read the next (up to) 32 bytes of the file into a data packet.
+ * Returns the number of bytes read, or -1.
+ */
+static int build_data(kcontext_t *kctx, up_load_arg_t *arg)
 {
-    uint8_t header[6];
-    uint16_t crc;
+    int nbytes = (kctx->file_bytes > 32) ? 32 : kctx->file_bytes;
     int rv;
 
-    if (nbytes > 32)
-        nbytes = 32;
-    header[0] = PKT_START;
-    header[1] = PKT_TYPE_DATA;
-    header[2] = nbytes;
-    header[3] = 0x00;
-    crc = crc_split_packet(header, buffer);
-    header[4] = crc & 0xff;
-    header[5] = (crc >> 8) & 0xff;
-    rv = send_packet(bio, header, 6);
-    if (rv == 0)
-        rv = send_packet(bio, buffer, nbytes);
-    if (rv < 0)
-        return rv;
-    return nbytes;
-}
-
-
-static int start_write(kcontext_t *kctx,
-                       up_context_t *upc,
-                       up_load_arg_t *arg)
-{
-    kctx->file_bytes = lseek(arg->fd, 0, SEEK_END);
-    if (kctx->file_bytes == (off_t)-1)
-    {
-        fprintf(stderr, "Cannot lseek() %s: %s [%d]\n",
-                NAME_MAYBE_NULL(arg->file_name),
-                strerror(errno),
-                errno);
-        return -1;
-    }
-    lseek(arg->fd, 0, SEEK_SET);
-
-    /* Now send the write command */
-    if (send_command2(upc->bio,
-                      CMD_WRITE_MEMORY,
-                      arg->offset,
-                      kctx->file_bytes) < 0)
+    rv = utils_safe_read(arg->fd, &kctx->frame[6], nbytes);
+    if (rv <= 0)
     {
         fprintf(stderr,
-                "\n**Error %d sending WRITE command: %s\n",
-                errno, strerror(errno));
+                "Error reading bin file %s: %s [%d]\n",
+                NAME_MAYBE_NULL(arg->file_name),
+                (rv < 0) ? strerror(errno) : "file shrank",
+                (rv < 0) ? errno : 0);
         return -1;
     }
-    return 0;
+    kctx->frame[0] = PKT_START;
+    kctx->frame[1] = PKT_TYPE_DATA;
+    kctx->frame[2] = rv;
+    kctx->frame[3] = 0x00;
+    finish_frame(kctx);
+    return rv;
 }
 
 
-static int handle_generic_response(kcontext_t *kctx,
-                                   up_context_t *upc,
-                                   up_load_arg_t *arg)
+/* Wait for the next packet from the target, into kctx->buffer.
+ * Pings, data and commands other than responses are reported and
+ * skipped.  Returns the packet type, or -1 with errno ETIMEDOUT if
+ * nothing arrives in time, or EPROTO if the target aborts or its
+ * response is corrupt.
+ */
+static int await_packet(kcontext_t *kctx, int timeout_ms)
 {
-    uint32_t status = GET_PARAMETER(kctx->buffer, 0);
-    uint32_t tag = GET_PARAMETER(kctx->buffer, 1);
-    int rv;
+    up_coro_t *co = &kctx->co;
+    uint8_t *buffer = kctx->buffer;
+    int len;
 
-    switch (kctx->state)
+    while (1)
     {
-        case STATE_WAIT_FOR_ERASE_RESP:
-            if (tag != CMD_FLASH_ERASE_ALL_UNSECURE)
-            {
-                fprintf(stderr,
-                        "\n**Error: unexpected tag 0x%02x in response\n",
-                        tag);
-                return -1;
-            }
-            if (status != 0)
-            {
-                fprintf(stderr, "\n**Error %d erasing flash\n", status);
-                return -1;
-            }
-            fprintf(stderr, "...done\n");
-            if (send_ack(upc->bio) < 0)
-            {
-                fprintf(stderr,
-                        "**Error %d sending ACK: %s\n",
-                        errno, strerror(errno));
-                return -1;
-            }
-            fprintf(stderr, "Writing...\n");
-            if ((rv = start_write(kctx, upc, arg)) < 0)
-                return -1;
-            kctx->state = STATE_WAIT_FOR_WRITE_ACK;
-            break;
-
-        case STATE_WAIT_FOR_WRITE_RESP:
-            if (tag != CMD_WRITE_MEMORY)
-            {
-                fprintf(stderr,
-                        "\n**Error: unexpected tag 0x%02x in response\n",
-                        tag);
-                return -1;
-            }
-            if (status != 0)
-            {
-                fprintf(stderr, "\n**Error %d writing flash\n", status);
-                return -1;
-            }
-            if (send_ack(upc->bio) < 0)
-            {
-                fprintf(stderr,
-                        "**Error %d sending ACK: %s\n",
-                        errno, strerror(errno));
-                return -1;
-            }
-            kctx->file_nbytes = (kctx->file_bytes > 32) ?
-                32 : kctx->file_bytes;
-            rv = utils_safe_read(arg->fd,
-                                 kctx->file_buffer,
-                                 kctx->file_nbytes);
-            if (rv < 0)
-            {
-                fprintf(stderr,
-                        "Error reading bin file %s: %s [%d]\n",
-                        NAME_MAYBE_NULL(arg->file_name),
-                        strerror(errno),
-                        errno);
-                return -1;
-            }
-            if (send_raw_data(upc->bio, kctx->file_buffer, rv) < 0)
-            {
-                fprintf(stderr,
-                        "**Error %d sending data: %s\n",
-                        errno, strerror(errno));
-                return -1;
-            }
-            /* Stash in case we need to re-send */
-            kctx->file_nbytes = rv;
-            kctx->file_bytes -= rv;
-            kctx->state = STATE_WAIT_FOR_DATA_ACK;
-            break;
-
-        case STATE_WAIT_FOR_DATA_RESP:
-            if (tag != CMD_WRITE_MEMORY)
-            {
-                fprintf(stderr,
-                        "\n**Error: unexpected tag 0x%02x in response\n",
-                        tag);
-                return -1;
-            }
-            if (status != 0)
-            {
-                fprintf(stderr, "\n**Error %d writing flash\n", status);
-                return -1;
-            }
-            if (send_ack(upc->bio) < 0)
-            {
-                fprintf(stderr,
-                        "**Error %d sending ACK: %s\n",
-                        errno, strerror(errno));
-                return -1;
-            }
-            fprintf(stderr, "Download complete\nResetting chip...");
-            if (send_command0(upc->bio, CMD_RESET) < 0)
-            {
-                fprintf(stderr,
-                        "\n**Error %d sending RESET command: %s\n",
-                        errno,
-                        strerror(errno));
-                return -1;
-            }
-            kctx->state = STATE_WAIT_FOR_RESET_ACK;
-            break;
+        if (up_coro_await_bytes(co, &buffer[0], 1, timeout_ms) < 0)
+            return -1;
+        if (buffer[0] != PKT_START)
+            continue;
+        if (up_coro_await_bytes(co, &buffer[1], 1, timeout_ms) < 0)
+            return -1;
+
+        switch (buffer[1])
+        {
+            case PKT_TYPE_ACK:
+            case PKT_TYPE_NAK:
+                return buffer[1];
 
-        case STATE_WAIT_FOR_RESET_RESP:
-            if (tag != CMD_RESET)
-            {
-                fprintf(stderr,
-                        "\n**Error: unexpected tag 0x%02x in response\n",
-                        tag);
-                return -1;
-            }
-            if (status != 0)
-            {
-                fprintf(stderr, "\n**Error %d in reset\n", status);
-                return -1;
-            }
-            if (send_ack(upc->bio) < 0)
-            {
-                fprintf(stderr,
-                        "**Error %d sending ACK: %s\n",
-                        errno, strerror(errno));
+            case PKT_TYPE_ACK_ABORT:
+                fprintf(stderr, "\n**Boot Aborted\n");
+                errno = EPROTO;
                 return -1;
-            }
-            return 1;
 
-        default:
-            /* We have no idea what this is about */
-            break;
-    }
-
-    return 0;
-}
+            case PKT_TYPE_PING:
+                /* We never expect to get one of these */
+                fprintf(stderr, "Ping\n");
+                break;
 
+            case PKT_TYPE_PING_RESP:
+                if (up_coro_await_bytes(co, &buffer[2], 8, timeout_ms) < 0)
+                    return -1;
+                return buffer[1];
 
-/* Reads the buffer, looking for a Kinetis packet.  Returns -1 if no
- * (complete) packet is found in the buffer, otherwise the index of
- * the last byte of the packet.
- */
-static int read_packet(kcontext_t *kctx,
-                       const uint8_t *buf,
-                       int rv)
-{
-    int i;
+            case PKT_TYPE_COMMAND:
+            case PKT_TYPE_DATA:
+            {
+                uint16_t crc;
 
-    for (i = 0; i < rv; i++)
-    {
-        switch (kctx->pkt_state)
-        {
-            case PKT_WAIT_FOR_START:
-                if (buf[i] == PKT_START)
+                if (up_coro_await_bytes(co, &buffer[2], 4, timeout_ms) < 0)
+                    return -1;
+                len = buffer[2] | (buffer[3] << 8);
+                if (len > 250)
                 {
-                    kctx->count = 1;
-                    kctx->buffer[0] = PKT_START;
-                    kctx->pkt_state = PKT_WAIT_FOR_TYPE;
+                    /* Too much, assume a bad START */
+                    break;
                 }
-                break;
-
-            case PKT_WAIT_FOR_TYPE:
-                kctx->count = 2;
-                kctx->buffer[1] = buf[i];
-                switch (buf[i])
+                if (up_coro_await_bytes(co, &buffer[6], len, timeout_ms) < 0)
+                    return -1;
+                if (buffer[1] == PKT_TYPE_DATA)
                 {
-                    case PKT_TYPE_ACK:
-                    case PKT_TYPE_NAK:
-                    case PKT_TYPE_ACK_ABORT:
-                    case PKT_TYPE_PING:
-                        kctx->pkt_state = PKT_WAIT_FOR_START;
-                        kctx->count = 0;
-                        return i;
-
-                    case PKT_TYPE_PING_RESP:
-                        kctx->pkt_state = PKT_READ_PING_RESPONSE;
-                        break;
-
-                    case PKT_TYPE_COMMAND:
-                    case PKT_TYPE_DATA:
-                        kctx->pkt_state = PKT_READ_HEADER;
-                        break;
-
-                    default:
-                        /* Invalid, assume we mis-identified a START */
-                        kctx->pkt_state = PKT_WAIT_FOR_START;
-                        kctx->count = 0;
-                        break;
+                    fprintf(stderr, "\n**Ignoring unexpected data\n");
+                    break;
                 }
-                break;
 
-            case PKT_READ_PING_RESPONSE:
-                kctx->buffer[kctx->count++] = buf[i];
-                if (kctx->count == 10)
+                /* First validate the response */
+                crc = crc_packet(buffer);
+                if ((crc & 0xff) != buffer[4] ||
+                    ((crc >> 8) & 0xff) != buffer[5])
                 {
-                    kctx->pkt_state = PKT_WAIT_FOR_START;
-                    kctx->count = 0;
-                    return i;
+                    fprintf(stderr, "\n**Invalid CRC received, aborting\n");
+                    errno = EPROTO;
+                    return -1;
                 }
-                break;
-
-            case PKT_READ_HEADER:
-                kctx->buffer[kctx->count++] = buf[i];
-                if (kctx->count == 6)
+                /* What's the command? */
+                if (buffer[6] != RESP_GENERIC_RESPONSE)
                 {
-                    kctx->content_len =
-                        kctx->buffer[2] | (kctx->buffer[3] << 8);
-                    if (kctx->content_len > 250)
-                    {
-                        /* Too much, assume a bad START again */
-                        kctx->pkt_state = PKT_WAIT_FOR_START;
-                        kctx->count = 0;
-                        break;
-                    }
-                    kctx->pkt_state = PKT_READ_BODY;
+                    fprintf(stderr,
+                            "\n**Unexpected command/response 0x%02x\n",
+                            buffer[6]);
+                    /* Otherwise ignore it */
+                    break;
                 }
-                break;
+                return buffer[1];
+            }
 
-            case PKT_READ_BODY:
-                kctx->buffer[kctx->count++] = buf[i];
-                if (kctx->count == kctx->content_len + 6)
-                {
-                    kctx->pkt_state = PKT_WAIT_FOR_START;
-                    kctx->count = 0;
-                    return i;
-                }
+            default:
+                /* Invalid, assume we mis-identified a START */
                 break;
         }
     }
-
-    return -1;
 }
 
 
-
-static void *init_kinetis(void)
+/* Wait for the target to acknowledge the frame we sent, sending it
+ * again each time it NAKs.  Returns 0 or -1.
+ */
+static int await_ack(kcontext_t *kctx)
 {
-    return malloc(sizeof(kcontext_t));
+    while (1)
+    {
+        int type = await_packet(kctx, -1);
+
+        if (type < 0)
+            return -1;
+        if (type == PKT_TYPE_ACK)
+            return 0;
+        if (type == PKT_TYPE_NAK)
+        {
+            /* Somehow what we sent got mangled.  Try again */
+            if (kctx->frame[1] == PKT_TYPE_COMMAND)
+            {
+                fprintf(stderr, " (retry)");
+                fflush(stderr);
+            }
+            if (send_frame(kctx) < 0)
+                return -1;
+        }
+        /* Else no idea what this is about */
+    }
 }
 
 
-static int shutdown_kinetis(void *h, up_context_t *ctx)
+/* Wait for the response to command tag, check it and acknowledge it.
+ * Returns 0 or -1.
+ */
+static int await_response(kcontext_t *kctx, uint32_t tag, const char *what)
 {
-    free(h);
-    return 0;
-}
+    uint32_t status;
+    uint32_t got_tag;
 
+    while (1)
+    {
+        int type = await_packet(kctx, -1);
 
-static int prepare_kinetis(void *h, up_context_t *upc, up_load_arg_t *arg)
-{
-    int rv;
-    kcontext_t *kctx = (kcontext_t *)h;
+        if (type < 0)
+            return -1;
+        if (type == PKT_TYPE_COMMAND)
+            break;
+        /* Else no idea what this is about */
+    }
 
-    kctx->state = STATE_WAIT_FOR_PING_RESPONSE;
-    kctx->pkt_state = PKT_WAIT_FOR_START;
-    kctx->count = 0;
-    kctx->file_bytes = 0;
-    arg->echo = 0;
+    status = GET_PARAMETER(kctx->buffer, 0);
+    got_tag = GET_PARAMETER(kctx->buffer, 1);
+    if (got_tag != tag)
+    {
+        fprintf(stderr, "\n**Error: unexpected tag 0x%02x in response\n",
+                got_tag);
+        return -1;
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "\n**Error %d %s\n", status, what);
+        return -1;
+    }
+    return send_ack(kctx);
+}
 
-    /* Initialise h */
-    rv = utils_protocol_set_baud(h, upc, arg);
-    if (rv < 0)
-        return rv;
-    return send_ping(upc->bio);
+
+/* Send the command built in kctx->frame and see it through */
+static int run_command(kcontext_t *kctx, uint32_t tag, const char *what)
+{
+    if (send_frame(kctx) < 0 || await_ack(kctx) < 0)
+        return -1;
+    return await_response(kctx, tag, what);
 }
 
 
-static int maybe_kinetis_bootload(void          *h,
-                                  up_context_t  *upc,
-                                  up_load_arg_t *arg,
-                                  const uint8_t *buf,
-                                  int           rv)
+/* The boot stage, as the target sees it */
+static int kinetis_boot(up_coro_t *co, up_context_t *upc, up_load_arg_t *arg)
 {
-    kcontext_t *kctx = (kcontext_t *)h;
-    int last;
+    kcontext_t *kctx = (kcontext_t *)co;
+    int type;
 
-    while (rv > 0)
+    /* Ping until the bootloader answers.  It may not have been
+     * listening yet, eg. with the target still coming out of reset.
+     */
+    while (1)
     {
-        last = read_packet(kctx, buf, rv);
-        if (last == -1)
-        {
-            /* Didn't find anything */
-            /* Resend the ping */
-            fprintf(stderr, "Resend ping\n");
-            send_ping(upc->bio);
-            return 0;
-        }
+        if (send_ping(kctx) < 0)
+            return -1;
+        do
+            type = await_packet(kctx, KINETIS_PING_RETRY_MS);
+        while (type >= 0 && type != PKT_TYPE_PING_RESP);
+        if (type >= 0)
+            break;
+        if (errno != ETIMEDOUT)
+            return -1;
+        /* Whatever we have of a packet is a second old: start afresh */
+        up_coro_discard_input(co);
+    }
+    fprintf(stderr,
+            "Ping Response, protocol %c %d.%d.%d, options 0x%04x\n",
+            kctx->buffer[5],
+            kctx->buffer[4],
+            kctx->buffer[3],
+            kctx->buffer[2],
+            kctx->buffer[6] | (kctx->buffer[7] << 8));
+    if (kctx->buffer[5] != 'P')
+    {
+        fprintf(stderr, "**Error: not in bootloader\n");
+        return -1;
+    }
 
-        buf += ++last;
-        rv -= last;
+    /* We have the attention of the bootloader and it has correctly
+     * autobauded.  The next step is to erase the flash.
+     */
+    fprintf(stderr, "Erasing...");
+    fflush(stderr);
+    build_command0(kctx, CMD_FLASH_ERASE_ALL_UNSECURE);
+    if (run_command(kctx, CMD_FLASH_ERASE_ALL_UNSECURE, "erasing flash") < 0)
+        return -1;
+    fprintf(stderr, "...done\n");
 
-        switch (kctx->buffer[1])
-        {
-            case PKT_TYPE_PING:
-                /* We never expect to get one of these */
-                fprintf(stderr, "Ping\n");
-                break;
+    fprintf(stderr, "Writing...\n");
+    kctx->file_bytes = lseek(arg->fd, 0, SEEK_END);
+    if (kctx->file_bytes == (off_t)-1)
+    {
+        fprintf(stderr, "Cannot lseek() %s: %s [%d]\n",
+                NAME_MAYBE_NULL(arg->file_name),
+                strerror(errno),
+                errno);
+        return -1;
+    }
+    lseek(arg->fd, 0, SEEK_SET);
+    build_command2(kctx, CMD_WRITE_MEMORY, arg->offset, kctx->file_bytes);
+    if (run_command(kctx, CMD_WRITE_MEMORY, "writing flash") < 0)
+        return -1;
 
-            case PKT_TYPE_PING_RESP:
-                fprintf(stderr,
-                        "Ping Response, protocol %c %d.%d.%d, options 0x%04x\n",
-                        kctx->buffer[5],
-                        kctx->buffer[4],
-                        kctx->buffer[3],
-                        kctx->buffer[2],
-                        kctx->buffer[6] | (kctx->buffer[7] << 8));
-                if (kctx->state == STATE_WAIT_FOR_PING_RESPONSE)
-                {
-                    if (kctx->buffer[5] != 'P')
-                    {
-                        fprintf(stderr, "**Error: not in bootloader\n");
-                        return -1;
-                    }
-
-                    /* We have the attention of the bootloader and it
-                     * has correctly autobauded.  The next step is to
-                     * erase the flash.
-                     */
-                    fprintf(stderr, "Erasing...");
-                    fflush(stderr);
-                    if (send_command0(upc->bio,
-                                      CMD_FLASH_ERASE_ALL_UNSECURE) < 0)
-                    {
-                        fprintf(stderr,
-                                "**Error %d sending ERASE command: %s\n",
-                                errno, strerror(errno));
-                        return -1;
-                    }
-                    kctx->state = STATE_WAIT_FOR_ERASE_ACK;
-                }
-                /* Else we weren't expecting this and don't care */
-                break;
+    /* The data goes 32 bytes at a time, each packet ACKed, and the
+     * write command is answered once it has all gone
+     */
+    while (kctx->file_bytes > 0)
+    {
+        int rv = build_data(kctx, arg);
 
-            case PKT_TYPE_ACK:
-                switch (kctx->state)
-                {
-                    case STATE_WAIT_FOR_ERASE_ACK:
-                    case STATE_WAIT_FOR_RESET_ACK:
-                        fputc('\n', stderr);
-                        /* FALL THROUGH */
-                    case STATE_WAIT_FOR_WRITE_ACK:
-                        kctx->state++;
-                        break;
-
-                    case STATE_WAIT_FOR_DATA_ACK:
-                        /* Are we done, or is there more data? */
-                        if (kctx->file_bytes == 0)
-                        {
-                            /* All done, a response will be coming */
-                            kctx->state = STATE_WAIT_FOR_DATA_RESP;
-                            break;
-                        }
-                        /* Otherwise send some more data */
-                        {
-                            int rv;
-
-                            kctx->file_nbytes = (kctx->file_bytes > 32) ?
-                                32 : kctx->file_bytes;
-                            rv = utils_safe_read(arg->fd,
-                                                 kctx->file_buffer,
-                                                 kctx->file_nbytes);
-                            if (rv < 0)
-                            {
-                                fprintf(stderr,
-                                        "Error reading bin file %s: %s [%d]\n",
-                                        NAME_MAYBE_NULL(arg->file_name),
-                                        strerror(errno),
-                                        errno);
-                                return -1;
-                            }
-                            if (send_raw_data(upc->bio,
-                                              kctx->file_buffer,
-                                              rv) < 0)
-                            {
-                                fprintf(stderr,
-                                        "**Error %d sending data: %s\n",
-                                        errno, strerror(errno));
-                                return -1;
-                            }
-                            /* Stash in case we need to re-send */
-                            kctx->file_nbytes = rv;
-                            kctx->file_bytes -= rv;
-                        }
-                        break;
-
-                    default:
-                        /* No idea what this is an ACK for */
-                        break;
-                }
-                break;
+        if (rv < 0 || send_frame(kctx) < 0 || await_ack(kctx) < 0)
+            return -1;
+        kctx->file_bytes -= rv;
+    }
+    if (await_response(kctx, CMD_WRITE_MEMORY, "writing flash") < 0)
+        return -1;
 
-            case PKT_TYPE_NAK:
-                /* Somehow what we sent got mangled.  Try again */
-                switch (kctx->state)
-                {
-                    case STATE_WAIT_FOR_ERASE_ACK:
-                        fprintf(stderr, " (retry)");
-                        fflush(stderr);
-                        if (send_command0(upc->bio,
-                                          CMD_FLASH_ERASE_ALL_UNSECURE) < 0)
-                        {
-                            fprintf(stderr,
-                                    "**Error %d sending ERASE command: %s\n",
-                                    errno, strerror(errno));
-                            return -1;
-                        }
-                        break;
-
-                    case STATE_WAIT_FOR_WRITE_ACK:
-                        fprintf(stderr, " (retry)");
-                        fflush(stderr);
-                        if (send_command2(upc->bio,
-                                          CMD_WRITE_MEMORY,
-                                          0,
-                                          kctx->file_nbytes) < 0)
-                        {
-                            fprintf(stderr,
-                                    "**Error %d sending WRITE command: %s\n",
-                                    errno, strerror(errno));
-                            return -1;
-                        }
-                        break;
-
-                    case STATE_WAIT_FOR_RESET_ACK:
-                        fprintf(stderr, " (retry)");
-                        fflush(stderr);
-                        if (send_command0(upc->bio, CMD_RESET) < 0)
-                        {
-                            fprintf(stderr,
-                                    "**Error %d sending RESET command: %s\n",
-                                    errno, strerror(errno));
-                            return -1;
-                        }
-                        break;
-
-                    case STATE_WAIT_FOR_DATA_ACK:
-                        if (send_raw_data(upc->bio,
-                                          kctx->file_buffer,
-                                          kctx->file_nbytes) < 0)
-                        {
-                            fprintf(stderr,
-                                    "**Error %d sending data: %s\n",
-                                    errno, strerror(errno));
-                            return -1;
-                        }
-                        break;
-
-                    default:
-                        /* No idea what this refers to */
-                        break;
-                }
-                break;
+    fprintf(stderr, "Download complete\nResetting chip...");
+    build_command0(kctx, CMD_RESET);
+    if (run_command(kctx, CMD_RESET, "in reset") < 0)
+        return -1;
+    fputc('\n', stderr);
+    return 1;
+}
 
-            case PKT_TYPE_ACK_ABORT:
-                fprintf(stderr, "\n**Boot Aborted\n");
-                return -1;
 
-            case PKT_TYPE_COMMAND:
-            {
-                /* First validate the response */
-                uint16_t crc = crc_packet(kctx->buffer);
-                int result;
+static void *init_kinetis(void)
+{
+    kcontext_t *kctx = (kcontext_t *)malloc(sizeof(kcontext_t));
 
-                if ((crc & 0xff) != kctx->buffer[4] ||
-                    ((crc >> 8) & 0xff) != kctx->buffer[5])
-                {
-                    fprintf(stderr, "\n**Invalid CRC received, aborting\n");
-                    return -1;
-                }
+    if (kctx != NULL)
+        memset(kctx, '\0', sizeof(kcontext_t));
+    return kctx;
+}
 
-                /* What's the command? */
-                if (kctx->buffer[6] != RESP_GENERIC_RESPONSE)
-                {
-                    fprintf(stderr,
-                            "\n**Unexpected command/response 0x%02x\n",
-                            kctx->buffer[6]);
-                    /* Otherwise ignore it */
-                    break;
-                }
-                result = handle_generic_response(kctx, upc, arg);
-                if (result < 0)
-                    return -1;
-                if (result > 0)
-                    return 1;
-                break;
-            }
 
-            case PKT_TYPE_DATA:
-                fprintf(stderr, "\n**Ignoring unexpected data\n");
-                break;
-        }
-    }
+static int shutdown_kinetis(void *h, up_context_t *ctx)
+{
+    kcontext_t *kctx = (kcontext_t *)h;
 
-    /* Still working on it */
+    up_coro_free(&kctx->co);
+    free(kctx);
     return 0;
 }
 
 
+static int prepare_kinetis(void *h, up_context_t *upc, up_load_arg_t *arg)
+{
+    kcontext_t *kctx = (kcontext_t *)h;
+    int rv;
+
+    arg->echo = 0;
+
+    /* Initialise h */
+    rv = utils_protocol_set_baud(h, upc, arg);
+    if (rv < 0)
+        return rv;
+    return up_coro_start(&kctx->co, upc, arg, kinetis_boot);
+}
+
+
 const up_protocol_t kinetis_bin_protocol =
 {
     "kinetis",
     init_kinetis,
     prepare_kinetis,
-    maybe_kinetis_bootload,
+    up_coro_transfer,
     NULL,
-    shutdown_kinetis
+    shutdown_kinetis,
+    up_coro_timeout
 };
-
@@ -45,6 +45,9 @@ typedef struct kcontext_struct
      (p[10 + 4*n + 2] << 16) | \
      (p[10 + 4*n + 3] << 24))
 
+/* How long to wait for an answer before pinging again */
+#define KINETIS_PING_RETRY_MS 1000
+
 /* Overall state machine */
 #define STATE_WAIT_FOR_PING_RESPONSE 0
 #define STATE_WAIT_FOR_ERASE_ACK     1
@@ -128,7 +131,8 @@ static int send_ack(up_bio_t *bio)
 {
     const uint8_t buffer[2] = { PKT_START, PKT_TYPE_ACK };
 
-    return send_packet(bio, buffer, 2);
+    /* The target waits for this before it will say anything else */
+    return (utils_bio_urgent_write(bio, buffer, 2) < 0) ? -1 : 0;
 }
 
 
@@ -457,10 +461,28 @@ static int prepare_kinetis(void *h, up_context_t *upc, up_load_arg_t *arg)
     rv = utils_protocol_set_baud(h, upc, arg);
     if (rv < 0)
         return rv;
+    up_protocol_timer(upc, KINETIS_PING_RETRY_MS);
     return send_ping(upc->bio);
 }
 
 
+/* The bootloader has not answered our ping.  It may not have been
+ * listening yet, eg. with the target still coming out of reset, so
+ * ask again.  Spare answers are ignored.
+ */
+static int kinetis_timeout(void *h, up_context_t *upc, up_load_arg_t *arg)
+{
+    kcontext_t *kctx = (kcontext_t *)h;
+
+    if (kctx->state != STATE_WAIT_FOR_PING_RESPONSE)
+        return 0;
+    /* Whatever we have of a packet is a second old: start afresh */
+    kctx->pkt_state = PKT_WAIT_FOR_START;
+    up_protocol_timer(upc, KINETIS_PING_RETRY_MS);
+    return (send_ping(upc->bio) < 0) ? -1 : 0;
+}
+
+
 /* Reads the buffer, looking for a Kinetis packet.  Returns -1 if no
  * (complete) packet is found in the buffer, otherwise the index of
  * the last byte of the packet.
@@ -774,5 +796,6 @@ const up_protocol_t kinetis_srec_protocol =
     prepare_kinetis,
     maybe_kinetis_bootload,
     NULL,
-    shutdown_kinetis
+    shutdown_kinetis,
+    kinetis_timeout
 };
@@ -21,9 +21,74 @@
 #include "upc2/up.h"
 #include "upc2/utils.h"
 #include "upc2/up_lineend.h"
+#include "upc2/up_ring.h"
+#include "upc2/up_uring.h"
+#include "upc2/up_shm.h"
+#include "upc2/up_reactor.h"
 
 #define NAME_MAYBE_NULL(n) (((n) == NULL) ? "(no file name)" : (n))
 
+/* Most serial input the console handles per pass */
+#define UP_CONSOLE_CHUNK 256
+/* Most keystrokes it handles per pass */
+#define UP_CONSOLE_KEYS 32
+
+/* Longest we wait for a vanished device before checking for C-a x */
+#define UP_CONSOLE_RECONNECT_POLL_MS (250)
+
+/* Console output queued for io_uring, per fd */
+#define UP_CONSOLE_OUT_BYTES (65536)
+/* Longest we wait for queued console output to go at the end */
+#define UP_CONSOLE_FLUSH_MS (2000)
+
+/* A poll() the console keeps armed on the ring */
+typedef struct up_console_poll_struct {
+    up_uring_op_t op;
+    int events;
+    /* What it reported, until the console picks it up */
+    int revents;
+} up_console_poll_t;
+
+/* Output queued for one fd; one write at a time is in flight */
+typedef struct up_console_out_struct {
+    up_uring_op_t op;
+    int fd;
+    up_ring_t queue;
+} up_console_out_t;
+
+typedef struct up_console_uring_struct {
+    up_uring_t *ring;
+
+    /* Two, so that one can be re-armed with new events while the
+     * other's removal is in flight
+     */
+    up_console_poll_t bio_poll[2];
+    up_console_poll_t tty_poll;
+
+    up_console_out_t tty_out;
+    up_console_out_t log_out;
+} up_console_uring_t;
+
+/* The console's epoll loop.  Each pass arms what it wants to hear
+ * about and runs the reactor once; the callbacks leave the pass's
+ * result in ret.
+ */
+typedef struct up_console_reactor_struct {
+    up_reactor_t *r;
+    up_context_t *ctx;
+    up_load_arg_t *args;
+    int nr_args;
+    int ret;
+
+    /* The BIO fd being watched, -1 if none */
+    int bio_fd;
+    /* Set once the BIO has been dealt with this pass */
+    int bio_done;
+
+    up_reactor_timer_t bio_timer;
+    up_reactor_timer_t proto_timer;
+} up_console_reactor_t;
+
 static void groan_with(up_context_t *ctx, int which);
 static void console_help(up_context_t *upc);
 static void list_boot_stages(up_context_t  *ctx,
@@ -39,6 +104,8 @@ static void select_boot(up_context_t  *upc,
 
 static int hex_of(uint8_t *out_buf, const uint8_t *in_buf,
                   int nr_translate);
+static up_console_reactor_t *console_reactor_create(up_context_t *ctx);
+static void console_reactor_dispose(up_console_reactor_t *cr);
 
 static void console_help(up_context_t *upc) {
     utils_safe_printf(upc,
@@ -55,6 +122,8 @@ static void console_help(up_context_t *upc) {
                       "C-a p                Select previous boot stage\n"
                       "C-a e <c1> <c2>      Change line endings\n"
                       "C-a t                Toggle local echo\n"
+                      "C-a i                Show and reset serial I/O"
+                      " statistics\n"
                       "C-a x                Quit.\n"
                       "C-a C-a              Literal C-a \n"
                       "C-a <anything else>  Spiders?\n"
@@ -150,6 +219,8 @@ static void select_boot(up_context_t  *upc,
                       args[selection].offset);
 
     /* Prepare stage selection */
+    up_protocol_timer(upc, -1);
+    upc->uploading = upc->proto_wants_tx = 0;
     if (args[selection].protocol->prepare != NULL)
         args[selection].protocol->prepare(args[selection].protocol_handle,
                                           upc, &args[selection]);
@@ -189,6 +260,288 @@ static void toggle_local_echo(int tty_fd)
 }
 
 
+
+static void console_poll_done(up_uring_op_t *op, int res) {
+    up_console_poll_t *p = (up_console_poll_t *)op;
+
+    /* Removed polls are expected; anything else is the fd's fault */
+    if (res >= 0)
+        p->revents |= res;
+    else if (res != -ECANCELED && res != -ENOENT)
+        p->revents |= POLLERR;
+}
+
+/* Queue a write of the next run of output, if none is in flight */
+static void console_out_post(up_console_uring_t *cu, up_console_out_t *out) {
+    const uint8_t *bytes;
+    int run;
+
+    if (out->op.busy || out->queue.count == 0)
+        return;
+    run = up_ring_run(&out->queue, &bytes);
+    /* If the ring is full, the next pass will try again */
+    up_uring_write(cu->ring, &out->op, out->fd, bytes, run);
+}
+
+static void console_out_done(up_uring_op_t *op, int res) {
+    up_console_out_t *out = (up_console_out_t *)op;
+
+    if (res > 0) {
+        up_ring_consume(&out->queue, res);
+    } else if (res != -EAGAIN && res != -EINTR) {
+        /* As utils_safe_write() would, complain and give up on it */
+        fprintf(stderr, "! Cannot write(fd=%d): %s [%d]\n",
+                out->fd, strerror(-res), -res);
+        up_ring_consume(&out->queue, out->queue.count);
+    }
+}
+
+/* Queue output for fd, waiting for room if we must.  Returns nr or -1 */
+static int console_out_queue(up_console_uring_t *cu,
+                             up_console_out_t   *out,
+                             int                 fd,
+                             const uint8_t      *bytes,
+                             int                 nr) {
+    uint64_t start = utils_monotonic_ns();
+    int done = 0;
+
+    /* The log fd may change under us; drain what went to the old one */
+    while (out->fd != fd && (out->queue.count > 0 || out->op.busy)) {
+        console_out_post(cu, out);
+        if (up_uring_wait(cu->ring, 100) < 0)
+            return -1;
+    }
+    out->fd = fd;
+    while (1) {
+        done += up_ring_put(&out->queue, &bytes[done], nr - done);
+        if (done == nr)
+            return nr;
+        /* Full: let some go, but don't hang on a stuck terminal */
+        if (utils_monotonic_ns() - start >
+            UP_CONSOLE_FLUSH_MS * 1000000ULL) {
+            errno = EAGAIN;
+            return -1;
+        }
+        console_out_post(cu, out);
+        if (up_uring_wait(cu->ring, 100) < 0)
+            return -1;
+    }
+}
+
+/* Wait until queued output has gone, or UP_CONSOLE_FLUSH_MS */
+static void console_out_flush(up_console_uring_t *cu) {
+    uint64_t start = utils_monotonic_ns();
+
+    while (cu->tty_out.queue.count > 0 || cu->tty_out.op.busy ||
+           cu->log_out.queue.count > 0 || cu->log_out.op.busy) {
+        if (utils_monotonic_ns() - start > UP_CONSOLE_FLUSH_MS * 1000000ULL)
+            break;
+        console_out_post(cu, &cu->tty_out);
+        console_out_post(cu, &cu->log_out);
+        if (up_uring_wait(cu->ring, 100) < 0)
+            break;
+    }
+}
+
+/* Write to fd, via the ring if we have one.  The console's own output
+ * only goes to the kernel with its next wait; kick sends it now.
+ */
+static int console_output(up_context_t  *ctx,
+                          int            fd,
+                          const uint8_t *bytes,
+                          int            nr,
+                          int            kick) {
+    up_console_uring_t *cu = ctx->uring;
+    up_console_out_t *out;
+
+    if (cu == NULL || fd < 0)
+        return utils_safe_write(fd, bytes, nr);
+    out = (fd == ctx->ttyfd) ? &cu->tty_out : &cu->log_out;
+    if (console_out_queue(cu, out, fd, bytes, nr) < 0)
+        return -1;
+    if (kick) {
+        up_uring_reap(cu->ring);
+        console_out_post(cu, out);
+        if (up_uring_submit(cu->ring) < 0)
+            return -1;
+    }
+    return nr;
+}
+
+/* poll() the BIO and the tty, and send queued output, in one system
+ * call.  The polls stay armed until they fire, so a pass on which
+ * nothing changed costs just the wait.
+ */
+static int console_uring_wait(up_context_t  *ctx,
+                              struct pollfd *fds,
+                              int            timeout) {
+    up_console_uring_t *cu = ctx->uring;
+    up_console_poll_t *armed = NULL;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        up_console_poll_t *p = &cu->bio_poll[i];
+
+        if (!p->op.busy)
+            continue;
+        if (p->events == fds[0].events && armed == NULL)
+            armed = p;
+        else
+            up_uring_poll_remove(cu->ring, &p->op);
+    }
+    for (i = 0; i < 2 && armed == NULL; i++) {
+        up_console_poll_t *p = &cu->bio_poll[i];
+
+        if (!p->op.busy) {
+            p->events = fds[0].events;
+            if (up_uring_poll(cu->ring, &p->op, fds[0].fd, p->events) < 0)
+                return -1;
+            armed = p;
+        }
+    }
+    if (!cu->tty_poll.op.busy &&
+        up_uring_poll(cu->ring, &cu->tty_poll.op, fds[1].fd, fds[1].events) < 0)
+        return -1;
+    console_out_post(cu, &cu->tty_out);
+    console_out_post(cu, &cu->log_out);
+
+    /* Something may have fired since we last looked */
+    if (cu->bio_poll[0].revents || cu->bio_poll[1].revents ||
+        cu->tty_poll.revents)
+        timeout = 0;
+    if (up_uring_wait(cu->ring, timeout) < 0)
+        return -1;
+
+    fds[0].revents = (cu->bio_poll[0].revents | cu->bio_poll[1].revents) &
+        (fds[0].events | POLLERR | POLLHUP | POLLNVAL);
+    fds[1].revents = cu->tty_poll.revents;
+    cu->bio_poll[0].revents = cu->bio_poll[1].revents = 0;
+    cu->tty_poll.revents = 0;
+    return 0;
+}
+
+int up_use_uring(up_context_t *ctx) {
+    up_console_uring_t *cu;
+    int i;
+
+    cu = (up_console_uring_t *)malloc(sizeof(up_console_uring_t));
+    if (cu == NULL)
+        return -1;
+    memset(cu, '\0', sizeof(up_console_uring_t));
+    cu->ring = up_uring_create();
+    if (cu->ring == NULL ||
+        up_ring_init(&cu->tty_out.queue, UP_CONSOLE_OUT_BYTES) < 0 ||
+        up_ring_init(&cu->log_out.queue, UP_CONSOLE_OUT_BYTES) < 0) {
+        int err = errno;
+
+        up_uring_dispose(cu->ring);
+        up_ring_free(&cu->tty_out.queue);
+        up_ring_free(&cu->log_out.queue);
+        free(cu);
+        errno = err;
+        return -1;
+    }
+    for (i = 0; i < 2; i++)
+        cu->bio_poll[i].op.complete = console_poll_done;
+    cu->tty_poll.op.complete = console_poll_done;
+    cu->tty_out.op.complete = console_out_done;
+    cu->log_out.op.complete = console_out_done;
+    cu->tty_out.fd = cu->log_out.fd = -1;
+    ctx->uring = cu;
+    return 0;
+}
+
+static void console_uring_dispose(up_console_uring_t *cu) {
+    console_out_flush(cu);
+    /* Closing the ring abandons the polls, so they can go after */
+    up_uring_dispose(cu->ring);
+    up_ring_free(&cu->tty_out.queue);
+    up_ring_free(&cu->log_out.queue);
+    free(cu);
+}
+
+int up_publish_shm(up_context_t *ctx, const char *name) {
+    up_shm_t *shm = up_shm_create(name);
+
+    if (shm == NULL)
+        return -1;
+    up_shm_dispose(ctx->shm);
+    ctx->shm = shm;
+    return 0;
+}
+
+/* The BIO's fd has been replaced; forget the polls on the old one */
+static void console_uring_forget_bio(up_console_uring_t *cu) {
+    int tries;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (cu->bio_poll[i].op.busy)
+            up_uring_poll_remove(cu->ring, &cu->bio_poll[i].op);
+    }
+    for (tries = 0; tries < 10; tries++) {
+        if (!cu->bio_poll[0].op.busy && !cu->bio_poll[1].op.busy)
+            break;
+        up_uring_wait(cu->ring, 100);
+    }
+    cu->bio_poll[0].revents = cu->bio_poll[1].revents = 0;
+}
+
+/* The serial device has failed, perhaps because the target reset and
+ * took its USB UART with it.  Wait for it to come back, if we may,
+ * and carry on with the boot stage we were on.  Returns 0 if it is
+ * back, -1 if not.
+ */
+static int console_reconnect(up_context_t *ctx) {
+    uint64_t start = utils_monotonic_ns();
+    int elapsed_ms = 0;
+
+    if (ctx->reconnect_ms <= 0 || ctx->bio->reconnect == NULL)
+        return -1;
+    utils_safe_printf(ctx, "[[ Serial device gone; waiting up to %d ms"
+                      " for it. C-a x to give up ]]\n", ctx->reconnect_ms);
+    while (elapsed_ms < ctx->reconnect_ms) {
+        int wait_ms = ctx->reconnect_ms - elapsed_ms;
+
+        if (wait_ms > UP_CONSOLE_RECONNECT_POLL_MS)
+            wait_ms = UP_CONSOLE_RECONNECT_POLL_MS;
+        if (ctx->bio->reconnect(ctx->bio, wait_ms) == 0) {
+            if (ctx->uring != NULL)
+                console_uring_forget_bio(ctx->uring);
+            /* The new fd may have the old number, so epoll must be
+             * told about it afresh
+             */
+            if (ctx->reactor != NULL && ctx->reactor->bio_fd >= 0) {
+                up_reactor_unwatch(ctx->reactor->r, ctx->reactor->bio_fd);
+                ctx->reactor->bio_fd = -1;
+            }
+            utils_safe_printf(ctx, "[[ Serial device back after %d ms ]]\n",
+                              (int)((utils_monotonic_ns() - start) / 1000000));
+            return 0;
+        }
+        if (errno != ETIMEDOUT) {
+            utils_safe_printf(ctx, "! upc2: Cannot reopen serial: %s [%d]\n",
+                              strerror(errno), errno);
+            return -1;
+        }
+        if (utils_check_critical_control(ctx) < 0)
+            return -1;
+        elapsed_ms = (utils_monotonic_ns() - start) / 1000000;
+    }
+    utils_safe_printf(ctx, "! upc2: Serial device did not come back\n");
+    return -1;
+}
+
+int up_set_reconnect(up_context_t *ctx, int timeout_ms) {
+    ctx->reconnect_ms = (timeout_ms > 0) ? timeout_ms : 0;
+    return 0;
+}
+
+int up_console_write(up_context_t *ctx, const uint8_t *bytes, int nr) {
+    return console_output(ctx, ctx->ttyfd, bytes, nr, 1);
+}
+
+
 int up_create(up_context_t **ctxp, up_translation_table_t * translation) {
     up_context_t *ctx = NULL;
     int rv = 0;
@@ -209,6 +562,9 @@ int up_dispose(up_context_t **ctxp) {
     {
         up_context_t *ctx = *ctxp;
         if (ctx->bio) { ctx->bio->dispose(ctx->bio); ctx->bio = NULL; }
+        if (ctx->uring) { console_uring_dispose(ctx->uring); ctx->uring = NULL; }
+        if (ctx->reactor) { console_reactor_dispose(ctx->reactor); ctx->reactor = NULL; }
+        if (ctx->shm) { up_shm_dispose(ctx->shm); ctx->shm = NULL; }
         if (ctx->logfd >= 0) { close(ctx->logfd); ctx->logfd = -1; }
         free(ctx); (*ctxp) = NULL;
     }
@@ -237,118 +593,192 @@ int up_start_console(up_context_t *ctx, int tty_fd) {
     ctx->ttyfd = tty_fd;
     ctx->ttyflags = fcntl(ctx->ttyfd, F_GETFL, 0);
     fcntl(ctx->ttyfd, F_SETFL, O_NONBLOCK);
+    /* io_uring does its own waiting; otherwise epoll, or failing
+     * that poll()
+     */
+    if (ctx->uring == NULL && ctx->reactor == NULL) {
+        ctx->reactor = console_reactor_create(ctx);
+        if (ctx->reactor == NULL)
+            utils_safe_printf(ctx, "! upc2: No epoll (%s [%d]);"
+                              " polling instead\n", strerror(errno), errno);
+    }
     return utils_safe_printf(ctx,
                              "upc2: Starting terminal. C-a h for help\n");
 }
 
 
-int up_operate_console(up_context_t  *ctx,
-                       up_load_arg_t *args,
-                       int            nr_args) {
-    uint8_t buf[512];
-    int rv;
-    int ret = 0;
-    struct pollfd fds[2];
+/* Act on what the current protocol's transfer() or timeout() said:
+ * < 0 to give up, > 0 to move on to the next boot stage.  Returns 0
+ * or -1.
+ */
+static int console_stage_result(up_context_t  *ctx,
+                                up_load_arg_t *args,
+                                int            nr_args,
+                                int            ret) {
     up_load_arg_t *cur_arg = &args[ctx->cur_arg];
 
-    fds[0].revents = fds[1].revents = 0;
-    fds[0].fd = ctx->bio->poll_fd(ctx->bio);
-    fds[0].events = POLLIN |POLLERR;
-    fds[1].fd = ctx->ttyfd;
-    fds[1].events = POLLIN | POLLERR;
+    // If ret < 0, something went wrong
+    if (ret <= 0)
+        return ret;
+    // If ret > 0, we've terminated. Move to the next argument and
+    // prep the protocol.
+    up_protocol_timer(ctx, -1);
+    ctx->uploading = ctx->proto_wants_tx = 0;
+    if (cur_arg->protocol->complete != NULL)
+        cur_arg->protocol->complete(cur_arg->protocol_handle,
+                                    ctx, cur_arg);
+    cur_arg = &args[++ctx->cur_arg];
+    utils_safe_printf(ctx, "[[ Boot stage %d: %s %s @ %d fc %s ]]\n",
+                      ctx->cur_arg,
+                      cur_arg->protocol->name,
+                      NAME_MAYBE_NULL(cur_arg->file_name),
+                      cur_arg->baud,
+                      utils_decode_flow_control(cur_arg->fc));
+    ctx->console_mode = (ctx->cur_arg >= nr_args ||
+                         cur_arg->fd < 0 ||
+                         cur_arg->deferred);
+    if (ctx->console_mode)
+        utils_safe_printf(ctx, "[[ Entering Console Mode ]]\n");
+    if (ctx->cur_arg < nr_args) {
+        if (cur_arg->protocol->prepare != NULL)
+            cur_arg->protocol->prepare(cur_arg->protocol_handle,
+                                       ctx, cur_arg);
+    }
+    return 0;
+}
 
-    // Tick around every 1s or so. Our writes are all synchronous,
-    // so we don't care about POLLOUT.
-    poll(fds, 2, 1000);
-    if ((fds[0].revents & (POLLHUP | POLLERR)) ||
-        (fds[1].revents & (POLLHUP | POLLERR))) {
-        utils_safe_printf(ctx,
-                          "! upc2 I/O falied: fd %d / 0x%04x , %d 0x%04x\n",
-                          fds[0].fd, fds[0].revents,
-                          fds[1].fd, fds[1].revents);
-        ret = -1;
-        goto end;
+/* Serial output, if the BIO can take some (POLLOUT in revents) or its
+ * timer may be due (tx_due), then serial input, which goes to the
+ * terminal, the log and the protocol.  Returns 0 or -1.
+ */
+static int console_bio_ready(up_context_t  *ctx,
+                             up_load_arg_t *args,
+                             int            nr_args,
+                             int            revents,
+                             int            tx_due) {
+    uint8_t buf[UP_CONSOLE_CHUNK];
+    const uint8_t *in_buf = buf;
+    uint8_t hex_buf[UP_CONSOLE_CHUNK * 4];
+    uint8_t trn_buf[UP_CONSOLE_CHUNK * 8];
+    up_load_arg_t *cur_arg = &args[ctx->cur_arg];
+    int rv;
+
+    if (((revents & POLLOUT) || tx_due) &&
+        utils_bio_tx_service(ctx->bio) < 0) {
+        int err = errno;
+
+        if (console_reconnect(ctx) == 0)
+            return 0;
+        errno = err;
+        utils_safe_printf(ctx, "! upc2: Failed to write to serial: %s [%d]\n",
+                          strerror(errno), errno);
+        return -1;
     }
 
     /* Read from serial, copy to output and (potentially) log */
-    rv = ctx->bio->read( ctx->bio, buf, 32 );
+    /* Work on the BIO's own storage where it lends it out */
+    rv = utils_bio_borrow(ctx->bio, &in_buf, buf, UP_CONSOLE_CHUNK);
+    if (rv < 0 && errno != EINTR && errno != EAGAIN) {
+        int err = errno;
+
+        if (console_reconnect(ctx) == 0)
+            return 0;
+        errno = err;
+        /* eg. the serial server went away */
+        utils_safe_printf(ctx, "! upc2: Failed to read from serial: %s [%d]\n",
+                          strerror(errno), errno);
+        return -1;
+    }
     if (rv > 0) {
-        uint8_t *out_buf = buf;
-        uint8_t *x_buf = buf;
+        const uint8_t *out_buf = in_buf;
+        const uint8_t *x_buf = in_buf;
+        int out_bytes = rv;
 
         if (ctx->console_mode) {
+            /* Translation needs room, so take a chunk at a time */
+            if (rv > UP_CONSOLE_CHUNK)
+                rv = UP_CONSOLE_CHUNK;
+            out_bytes = rv;
             if (ctx->hex_mode) {
-                /* We only ever read up to 32 bytes at a time,
-                 * so reuse some of our nice big buffer.
-                 */
+                /* Each byte becomes at most four */
                 x_buf = out_buf;
-                out_buf = buf+64;
-                rv = hex_of( out_buf, x_buf, rv );
+                out_buf = hex_buf;
+                out_bytes = hex_of( hex_buf, x_buf, out_bytes );
             }
             if (ctx->trn != NULL) {
-                /* We only ever read up to 32 bytes at a time,
-                 * so reuse some of our nice big buffer.
-                 */
+                /* ... and at most two after that */
                 x_buf = out_buf;
-                out_buf = buf+256;
-                rv = translate_buffer(out_buf, x_buf,
-                                      rv, &ctx->trn->from_serial);
-            } 
+                out_buf = trn_buf;
+                out_bytes = translate_buffer(trn_buf, x_buf,
+                                             out_bytes,
+                                             &ctx->trn->from_serial);
+            }
         }
-        if (rv) {
+        /* Untranslated, exactly as the protocol will see them */
+        if (ctx->shm != NULL)
+            up_shm_publish(ctx->shm, in_buf, rv);
+        if (out_bytes) {
             if (cur_arg->echo)
-                utils_safe_write(ctx->ttyfd, out_buf, rv);
+                console_output(ctx, ctx->ttyfd, out_buf, out_bytes, 0);
             if (ctx->logfd >= 0) {
-                utils_safe_write(ctx->logfd, out_buf, rv);
+                console_output(ctx, ctx->logfd, out_buf, out_bytes, 0);
             }
         }
+        /* The bytes stay valid for the protocol until it next reads */
+        utils_bio_release(ctx->bio, rv);
     }
 
     /* Run protocol state machines */
     if (!ctx->console_mode) {
         // Run the state machine.
+        int ret;
+
+        ctx->proto_wants_tx = 0;
         ret = cur_arg->protocol->transfer(cur_arg->protocol_handle,
                                           ctx, cur_arg,
-                                          buf, rv);
-
-        // If ret < 0, something went wrong
-        if (ret < 0)
-            goto end;
-        // If ret > 0, we've terminated. Move to the next argument and
-        // prep the protocol.
-        if (ret > 0) {
-            if (cur_arg->protocol->complete != NULL)
-                cur_arg->protocol->complete(cur_arg->protocol_handle,
-                                            ctx, cur_arg);
-            cur_arg = &args[++ctx->cur_arg];
-            utils_safe_printf(ctx, "[[ Boot stage %d: %s %s @ %d fc %s ]]\n",
-                              ctx->cur_arg,
-                              cur_arg->protocol->name,
-                              NAME_MAYBE_NULL(cur_arg->file_name),
-                              cur_arg->baud,
-                              utils_decode_flow_control(cur_arg->fc));
-            ctx->console_mode = (ctx->cur_arg >= nr_args ||
-                                 cur_arg->fd < 0 ||
-                                 cur_arg->deferred);
-            if (ctx->console_mode)
-                utils_safe_printf(ctx, "[[ Entering Console Mode ]]\n");
-            if (ctx->cur_arg < nr_args) {
-                if (cur_arg->protocol->prepare != NULL)
-                    cur_arg->protocol->prepare(cur_arg->protocol_handle,
-                                               ctx, cur_arg);
-            }
-        }
+                                          in_buf, rv);
+
+        return console_stage_result(ctx, args, nr_args, ret);
     }
+    return 0;
+}
+
+/* Call the protocol's timeout() if the time it asked for has come.
+ * Returns 0 or -1.
+ */
+static int console_proto_due(up_context_t  *ctx,
+                             up_load_arg_t *args,
+                             int            nr_args) {
+    up_load_arg_t *cur_arg = &args[ctx->cur_arg];
 
+    if (ctx->proto_due_ns == 0 || utils_monotonic_ns() < ctx->proto_due_ns)
+        return 0;
+    ctx->proto_due_ns = 0;
+    /* Nothing to retry while the user has the console */
+    if (ctx->console_mode || ctx->cur_arg >= nr_args ||
+        cur_arg->protocol->timeout == NULL)
+        return 0;
+    return console_stage_result(ctx, args, nr_args,
+                                cur_arg->protocol->timeout(
+                                    cur_arg->protocol_handle,
+                                    ctx, cur_arg));
+}
 
-    // Anything from the terminal?
-    /* NB: unlike utils_check_critical_control(), this passes data
-     * from the terminal to the serial output.
-     */
-    rv = read(ctx->ttyfd, buf, 32);
+/* Keystrokes: console commands, or input for the target.
+ * NB: unlike utils_check_critical_control(), this passes data from
+ * the terminal to the serial output.  Returns 0 or -1.
+ */
+static int console_tty_ready(up_context_t  *ctx,
+                             up_load_arg_t *args,
+                             int            nr_args) {
+    uint8_t buf[UP_CONSOLE_KEYS];
+    uint8_t out_buf[UP_CONSOLE_KEYS * 8];
+    int ret = 0;
+    int rv;
+
+    rv = read(ctx->ttyfd, buf, UP_CONSOLE_KEYS);
     if (rv > 0) {
         int i, optr = 0;
-        uint8_t *out_buf = buf + 128; /* Again, use upper buffer space */
 
         for (i = 0; i < rv; ++i) {
             if (ctx->control_mode == 3) {
@@ -399,6 +829,10 @@ int up_operate_console(up_context_t  *ctx,
                     case 't':
                         toggle_local_echo(ctx->ttyfd);
                         break;
+                    case 'i':
+                        utils_bio_print_stats(ctx, ctx->bio);
+                        utils_bio_stats_reset(ctx->bio);
+                        break;
                     case '0':
                     case '1':
                     case '2':
@@ -464,9 +898,20 @@ int up_operate_console(up_context_t  *ctx,
                 out_buf[optr++] = buf[i];
             }
         }
-        /** @todo Don't echo while downloads are ongoing? */
-        if (optr > 0)
-            ctx->bio->write(ctx->bio, out_buf, optr);
+        /* Keystrokes go ahead of any upload data queued, as far as
+         * there is room; a long paste takes its turn with the rest.
+         * None at all go in the middle of an upload.
+         */
+        if (optr > 0 && !ctx->uploading) {
+            int sent = 0;
+
+            if (ctx->bio->urgent_write != NULL)
+                sent = ctx->bio->urgent_write(ctx->bio, out_buf, optr);
+            if (sent < 0)
+                sent = 0;
+            if (sent < optr)
+                ctx->bio->write(ctx->bio, &out_buf[sent], optr - sent);
+        }
     } else if (rv == 0) {
         utils_safe_printf(ctx, "! upc2: Input closed.\n");
         ret = -1;
@@ -478,12 +923,264 @@ int up_operate_console(up_context_t  *ctx,
             ret = -1;
         }
     }
-end:
     return ret;
 }
 
+/* Reactor callbacks.  EPOLLIN, EPOLLOUT, EPOLLERR and EPOLLHUP have
+ * the values of their POLLxxx namesakes, so revents passes straight
+ * on to the helpers above.
+ */
+static void reactor_bio_fd(up_reactor_t *r, int fd, int revents, void *arg) {
+    up_console_reactor_t *cr = (up_console_reactor_t *)arg;
+    up_context_t *ctx = cr->ctx;
+
+    if (cr->ret < 0 || cr->bio_done)
+        return;
+    cr->bio_done = 1;
+    if (revents & (EPOLLHUP | EPOLLERR)) {
+        if (console_reconnect(ctx) == 0)
+            return;
+        utils_safe_printf(ctx, "! upc2 I/O falied: fd %d / 0x%04x\n",
+                          fd, revents);
+        cr->ret = -1;
+        return;
+    }
+    cr->ret = console_bio_ready(ctx, cr->args, cr->nr_args, revents, 0);
+}
+
+static void reactor_bio_timer(up_reactor_timer_t *t, void *arg) {
+    up_console_reactor_t *cr = (up_console_reactor_t *)arg;
+
+    if (cr->ret < 0 || cr->bio_done)
+        return;
+    cr->bio_done = 1;
+    cr->ret = console_bio_ready(cr->ctx, cr->args, cr->nr_args, 0, 1);
+}
+
+static void reactor_tty_fd(up_reactor_t *r, int fd, int revents, void *arg) {
+    up_console_reactor_t *cr = (up_console_reactor_t *)arg;
+
+    if (cr->ret < 0)
+        return;
+    if (revents & (EPOLLHUP | EPOLLERR)) {
+        utils_safe_printf(cr->ctx, "! upc2 I/O falied: fd %d / 0x%04x\n",
+                          fd, revents);
+        cr->ret = -1;
+        return;
+    }
+    cr->ret = console_tty_ready(cr->ctx, cr->args, cr->nr_args);
+}
+
+static void reactor_proto_timer(up_reactor_timer_t *t, void *arg) {
+    up_console_reactor_t *cr = (up_console_reactor_t *)arg;
+
+    if (cr->ret < 0)
+        return;
+    cr->ret = console_proto_due(cr->ctx, cr->args, cr->nr_args);
+}
+
+static up_console_reactor_t *console_reactor_create(up_context_t *ctx) {
+    up_console_reactor_t *cr;
+
+    cr = (up_console_reactor_t *)malloc(sizeof(up_console_reactor_t));
+    if (cr == NULL)
+        return NULL;
+    memset(cr, '\0', sizeof(up_console_reactor_t));
+    cr->ctx = ctx;
+    cr->bio_fd = -1;
+    cr->bio_timer.expired = reactor_bio_timer;
+    cr->bio_timer.arg = cr;
+    cr->proto_timer.expired = reactor_proto_timer;
+    cr->proto_timer.arg = cr;
+    cr->r = up_reactor_create();
+    if (cr->r == NULL ||
+        up_reactor_watch(cr->r, ctx->ttyfd, EPOLLIN, reactor_tty_fd, cr) < 0) {
+        int err = errno;
+
+        up_reactor_dispose(cr->r);
+        free(cr);
+        errno = err;
+        return NULL;
+    }
+    return cr;
+}
+
+static void console_reactor_dispose(up_console_reactor_t *cr) {
+    up_reactor_dispose(cr->r);
+    free(cr);
+}
+
+/* Watch the BIO for what we want from it next */
+static int console_reactor_arm(up_console_reactor_t *cr) {
+    up_bio_t *bio = cr->ctx->bio;
+    int fd = bio->poll_fd(bio);
+    int events = EPOLLIN;
+    int bio_timeout = utils_bio_poll_timeout(bio);
+
+    /* The BIO may be holding output for the device, or the protocol
+     * have more for it; if so, wake up when it can take some more,
+     * unless it is pacing itself.
+     */
+    if ((utils_bio_tx_pending(bio) > 0 || cr->ctx->proto_wants_tx) &&
+        bio_timeout <= 0)
+        events |= EPOLLOUT;
+
+    /* A reconnect gives the BIO a new fd */
+    if (fd != cr->bio_fd) {
+        if (cr->bio_fd >= 0)
+            up_reactor_unwatch(cr->r, cr->bio_fd);
+        cr->bio_fd = -1;
+    }
+    if (fd >= 0) {
+        if (up_reactor_watch(cr->r, fd, events, reactor_bio_fd, cr) < 0)
+            return -1;
+        cr->bio_fd = fd;
+    }
+
+    if (bio_timeout >= 0)
+        up_reactor_timer_start(cr->r, &cr->bio_timer, bio_timeout);
+    else
+        up_reactor_timer_stop(cr->r, &cr->bio_timer);
+    return 0;
+}
+
+/* One pass of the console on the reactor: sleeps until the BIO, the
+ * tty or a deadline needs us, with no tick.
+ */
+static int console_reactor_pass(up_context_t  *ctx,
+                                up_load_arg_t *args,
+                                int            nr_args) {
+    up_console_reactor_t *cr = ctx->reactor;
+    int timeout = -1;
+
+    cr->args = args;
+    cr->nr_args = nr_args;
+    cr->ret = 0;
+    cr->bio_done = 0;
+    if (console_reactor_arm(cr) < 0) {
+        utils_safe_printf(ctx, "! upc2: Cannot watch serial: %s [%d]\n",
+                          strerror(errno), errno);
+        return -1;
+    }
+
+    /* Don't sleep on input the BIO has already read ahead */
+    if (utils_bio_rx_pending(ctx->bio) > 0)
+        timeout = 0;
+
+    if (up_reactor_run(cr->r, timeout) < 0) {
+        utils_safe_printf(ctx, "! upc2: epoll wait failed: %s [%d]\n",
+                          strerror(errno), errno);
+        return -1;
+    }
+    /* ... and which epoll cannot see */
+    if (timeout == 0 && !cr->bio_done && cr->ret >= 0)
+        cr->ret = console_bio_ready(ctx, args, nr_args, 0, 0);
+    return cr->ret;
+}
+
+void up_protocol_timer(up_context_t *ctx, int ms) {
+    if (ms < 0) {
+        ctx->proto_due_ns = 0;
+        if (ctx->reactor != NULL)
+            up_reactor_timer_stop(ctx->reactor->r, &ctx->reactor->proto_timer);
+        return;
+    }
+    ctx->proto_due_ns = utils_monotonic_ns() + (uint64_t)ms * 1000000ULL;
+    if (ctx->reactor != NULL)
+        up_reactor_timer_start(ctx->reactor->r, &ctx->reactor->proto_timer,
+                               ms);
+}
+
+
+int up_operate_console(up_context_t  *ctx,
+                       up_load_arg_t *args,
+                       int            nr_args) {
+    int ret = 0;
+    int timeout = -1;
+    int bio_timeout;
+    struct pollfd fds[2];
+
+    if (ctx->reactor != NULL)
+        return console_reactor_pass(ctx, args, nr_args);
+
+    fds[0].revents = fds[1].revents = 0;
+    fds[0].fd = ctx->bio->poll_fd(ctx->bio);
+    fds[0].events = POLLIN |POLLERR;
+    fds[1].fd = ctx->ttyfd;
+    fds[1].events = POLLIN | POLLERR;
+
+    /* The BIO may be holding output for the device, or the protocol
+     * have more for it; if so, wake up when it can take some more.
+     */
+    if (utils_bio_tx_pending(ctx->bio) > 0 || ctx->proto_wants_tx)
+        fds[0].events |= POLLOUT;
+
+    /* Don't sleep on input the BIO has already read ahead */
+    if (utils_bio_rx_pending(ctx->bio) > 0)
+        timeout = 0;
+
+    /* ... or past the BIO's own timer */
+    bio_timeout = utils_bio_poll_timeout(ctx->bio);
+    if (bio_timeout >= 0 && (timeout < 0 || bio_timeout < timeout))
+        timeout = bio_timeout;
+    if (bio_timeout > 0)
+        fds[0].events &= ~POLLOUT;
+
+    /* ... or the protocol's */
+    if (ctx->proto_due_ns != 0) {
+        uint64_t now = utils_monotonic_ns();
+        int proto_ms = (ctx->proto_due_ns > now) ?
+            (int)((ctx->proto_due_ns - now + 999999) / 1000000) : 0;
+
+        if (timeout < 0 || proto_ms < timeout)
+            timeout = proto_ms;
+    }
+
+    /* Nothing to do until something happens: no tick */
+    if (ctx->uring != NULL) {
+        if (console_uring_wait(ctx, fds, timeout) < 0) {
+            utils_safe_printf(ctx, "! upc2: io_uring wait failed: %s [%d]\n",
+                              strerror(errno), errno);
+            return -1;
+        }
+    } else {
+        poll(fds, 2, timeout);
+    }
+    if ((fds[0].revents & (POLLHUP | POLLERR)) &&
+        !(fds[1].revents & (POLLHUP | POLLERR))) {
+        if (console_reconnect(ctx) == 0)
+            return 0;
+    }
+    if ((fds[0].revents & (POLLHUP | POLLERR)) ||
+        (fds[1].revents & (POLLHUP | POLLERR))) {
+        utils_safe_printf(ctx,
+                          "! upc2 I/O falied: fd %d / 0x%04x , %d 0x%04x\n",
+                          fds[0].fd, fds[0].revents,
+                          fds[1].fd, fds[1].revents);
+        return -1;
+    }
+
+    ret = console_bio_ready(ctx, args, nr_args, fds[0].revents,
+                            bio_timeout >= 0);
+    if (ret < 0)
+        return ret;
+    ret = console_proto_due(ctx, args, nr_args);
+    if (ret < 0)
+        return ret;
+
+    // Anything from the terminal?
+    if (ctx->uring != NULL && !(fds[1].revents & POLLIN)) {
+        /* The ring has told us there is nothing; don't ask again */
+        return 0;
+    }
+    return console_tty_ready(ctx, args, nr_args);
+}
+
 int up_finish_console(up_context_t *ctx) {
     utils_safe_printf(ctx, "! upc2: Terminating console.\n");
+    /* Queued output must go while the terminal is still set up for it */
+    if (ctx->uring != NULL)
+        console_out_flush(ctx->uring);
     tcsetattr(ctx->ttyfd, TCSANOW, &ctx->tc);
     fcntl(ctx->ttyfd, F_SETFL, ctx->ttyflags);
     return 0;
@@ -0,0 +1,172 @@
+/* up_bio_forward.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  Pass-through operations for BIOs which wrap another BIO.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "upc2/up_bio_forward.h"
+#include "upc2/utils.h"
+
+
+static int fwd_poll_fd(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->poll_fd(inner);
+}
+
+static int fwd_read(up_bio_t *bio, uint8_t *bytes, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->read(inner, bytes, nr);
+}
+
+static int fwd_rx_pending(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->rx_pending(inner);
+}
+
+static int fwd_peek(up_bio_t *bio, uint8_t *bytes, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->peek(inner, bytes, nr);
+}
+
+static int fwd_consume(up_bio_t *bio, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->consume(inner, nr);
+}
+
+static int fwd_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->borrow(inner, bytes);
+}
+
+static int fwd_release(up_bio_t *bio, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->release(inner, nr);
+}
+
+static int fwd_write(up_bio_t *bio, const uint8_t *bytes, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->write(inner, bytes, nr);
+}
+
+static int fwd_writev(up_bio_t *bio, const struct iovec *iov, int iovcnt) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->writev(inner, iov, iovcnt);
+}
+
+static int fwd_safe_write(up_bio_t *bio, const uint8_t *bytes, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->safe_write(inner, bytes, nr);
+}
+
+static int fwd_urgent_write(up_bio_t *bio, const uint8_t *bytes, int nr) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->urgent_write(inner, bytes, nr);
+}
+
+static int fwd_tx_pending(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->tx_pending(inner);
+}
+
+static int fwd_tx_high_water(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->tx_high_water(inner);
+}
+
+static int fwd_tx_service(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->tx_service(inner);
+}
+
+static int fwd_poll_timeout(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->poll_timeout(inner);
+}
+
+/* A wrapper reports on the device, not on itself */
+static void fwd_stats_sync(up_bio_t *bio, int reset) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+
+    if (reset)
+        utils_bio_stats_reset(inner);
+    bio->stats = *utils_bio_stats(inner);
+}
+
+static int fwd_set_baud(up_bio_t *bio, int baud, int flow_control) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->set_baud(inner, baud, flow_control);
+}
+
+static int fwd_set_lines(up_bio_t *bio, int set, int clear) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->set_lines(inner, set, clear);
+}
+
+static int fwd_send_break(up_bio_t *bio, int ms) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->send_break(inner, ms);
+}
+
+static int fwd_reconnect(up_bio_t *bio, int timeout_ms) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+    return inner->reconnect(inner, timeout_ms);
+}
+
+void up_bio_forward_dispose(up_bio_t *bio) {
+    up_bio_t *inner = UP_BIO_INNER(bio);
+
+    inner->dispose(inner);
+    free(bio->handle);
+    memset(bio, '\0', sizeof(up_bio_t));
+    free(bio);
+}
+
+
+void up_bio_forward_init(up_bio_t *bio, void *handle, up_bio_t *inner) {
+    memset(bio, '\0', sizeof(up_bio_t));
+    ((up_bio_forward_t *)handle)->inner = inner;
+    bio->handle = handle;
+    bio->dispose = up_bio_forward_dispose;
+    bio->poll_fd = fwd_poll_fd;
+    bio->read = fwd_read;
+    bio->write = fwd_write;
+    bio->safe_write = fwd_safe_write;
+    bio->stats_sync = fwd_stats_sync;
+    bio->set_baud = fwd_set_baud;
+    /* Optional operations stay optional */
+    if (inner->rx_pending != NULL)
+        bio->rx_pending = fwd_rx_pending;
+    if (inner->peek != NULL)
+        bio->peek = fwd_peek;
+    if (inner->consume != NULL)
+        bio->consume = fwd_consume;
+    if (inner->borrow != NULL)
+        bio->borrow = fwd_borrow;
+    if (inner->release != NULL)
+        bio->release = fwd_release;
+    if (inner->writev != NULL)
+        bio->writev = fwd_writev;
+    if (inner->urgent_write != NULL)
+        bio->urgent_write = fwd_urgent_write;
+    if (inner->tx_pending != NULL)
+        bio->tx_pending = fwd_tx_pending;
+    if (inner->tx_high_water != NULL)
+        bio->tx_high_water = fwd_tx_high_water;
+    if (inner->tx_service != NULL)
+        bio->tx_service = fwd_tx_service;
+    if (inner->poll_timeout != NULL)
+        bio->poll_timeout = fwd_poll_timeout;
+    if (inner->set_lines != NULL)
+        bio->set_lines = fwd_set_lines;
+    if (inner->send_break != NULL)
+        bio->send_break = fwd_send_break;
+    if (inner->reconnect != NULL)
+        bio->reconnect = fwd_reconnect;
+}
+
+/* End file */
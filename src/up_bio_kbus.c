@@ -6,18 +6,63 @@
  * A BIO for Kbus.  This is mostly intended for debugging protocol
  * modules.
  *
+ * Each KBus message costs a couple of system calls, so writes are
+ * gathered up and sent together when the buffer fills, when the
+ * caller next waits on the BIO or reads from it, or after
+ * UP_BIO_KBUS_COALESCE_MS at the latest.
+ *
  * @author Rhodri James <rhodri@kynesim.co.uk>
  * @date   2019-03-04
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include "kbus/kbus.h"
 
 #include "upc2/up.h"
 #include "upc2/up_bio_kbus.h"
+#include "upc2/utils.h"
+
 
+/* Send nbytes as one message.  Returns 0 or a negative errno */
+static int kbus_send(up_bio_t *bio, const uint8_t *buffer, int nbytes)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+    kbus_msg_id_t id;
+    int rv;
+
+    /* The message points at the data rather than holding a copy */
+    handle->out_msg->data = (void *)buffer;
+    handle->out_msg->data_len = nbytes;
+    rv = kbus_ksock_send_msg(handle->ksock, handle->out_msg, &id);
+    handle->out_msg->data = NULL;
+    handle->out_msg->data_len = 0;
+    bio->stats.writes++;
+    if (rv < 0)
+        return rv;
+    bio->stats.bytes_out += nbytes;
+    return 0;
+}
+
+
+/* Send whatever writes have gathered */
+static int kbus_flush(up_bio_t *bio)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+    int rv;
+
+    if (handle->out_used == 0)
+        return 0;
+    rv = kbus_send(bio, handle->out_buf, handle->out_used);
+    if (rv < 0)
+        return rv;
+    handle->out_used = 0;
+    return 0;
+}
 
 
 static void up_bio_kbus_dispose(up_bio_t *bio)
@@ -25,9 +70,14 @@ static void up_bio_kbus_dispose(up_bio_t *bio)
     up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
 
     if (handle->ksock >= 0)
+    {
+        kbus_flush(bio);
         kbus_ksock_close(handle->ksock);
+    }
     if (handle->msg != NULL)
         kbus_msg_delete(&handle->msg);
+    if (handle->out_msg != NULL)
+        kbus_msg_delete(&handle->out_msg);
     free(handle);
     memset(bio, 0, sizeof(up_bio_t)); /* Make life easier for Valgrind */
     free(bio);
@@ -42,64 +92,199 @@ static int up_bio_kbus_poll_fd(up_bio_t *bio)
 }
 
 
-static int up_bio_kbus_read(up_bio_t *bio, uint8_t *buffer, int nbytes)
+static int up_bio_kbus_borrow(up_bio_t *bio, const uint8_t **buffer)
 {
     up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
     int rv;
 
+    /* A fully released message is kept until now so that what was
+     * borrowed from it stays valid
+     */
+    if (handle->msg != NULL && handle->nbytes == 0)
+    {
+        kbus_msg_delete(&handle->msg);
+        handle->msg = NULL;
+        handle->data = NULL;
+    }
     if (handle->msg == NULL)
     {
+        /* Anyone reading is probably waiting for an answer to what
+         * they have written
+         */
+        if ((rv = kbus_flush(bio)) < 0)
+            return rv;
         rv = kbus_ksock_read_next_msg(handle->ksock, &handle->msg);
+        bio->stats.reads++;
         if (rv < 0)
             return rv;
         if (handle->msg == NULL)
+        {
+            bio->stats.read_eagain++;
             return 0; /* Nothing to read */
+        }
         handle->data = kbus_msg_data_ptr(handle->msg);
         handle->nbytes = handle->msg->data_len;
+        bio->stats.bytes_in += handle->nbytes;
+        if ((int)handle->nbytes > bio->stats.largest_read)
+            bio->stats.largest_read = handle->nbytes;
     }
-    if (handle->nbytes <= nbytes)
-    {
-        /* This is a single message */
-        memcpy(buffer, handle->data, handle->nbytes);
-        rv = handle->nbytes;
-        kbus_msg_delete(&handle->msg);
-        handle->msg = NULL;
-        handle->data = NULL;
-        handle->nbytes = 0;
-        return rv;
-    }
+    /* Lend out the rest of the message data in place */
+    *buffer = handle->data;
+    return handle->nbytes;
+}
+
 
-    /* Otherwise we have asked for only part of the current message */
-    memcpy(buffer, handle->data, nbytes);
+static int up_bio_kbus_release(up_bio_t *bio, int nbytes)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+
+    if ((uint32_t)nbytes > handle->nbytes)
+        nbytes = handle->nbytes;
     handle->data += nbytes;
     handle->nbytes -= nbytes;
     return nbytes;
 }
 
 
+static int up_bio_kbus_rx_pending(up_bio_t *bio)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+
+    /* The rest of a partly read message is invisible to poll() */
+    return handle->nbytes;
+}
+
+
+static int up_bio_kbus_read(up_bio_t *bio, uint8_t *buffer, int nbytes)
+{
+    const uint8_t *data;
+    int rv;
+
+    rv = up_bio_kbus_borrow(bio, &data);
+    if (rv <= 0)
+        return rv;
+    /* We may be asked for only part of the current message */
+    if (rv > nbytes)
+        rv = nbytes;
+    memcpy(buffer, data, rv);
+    return up_bio_kbus_release(bio, rv);
+}
+
+
 static int up_bio_kbus_write(up_bio_t *bio, const uint8_t *buffer, int nbytes)
 {
     up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
-    kbus_message_t *msg;
-    kbus_msg_id_t id;
     int rv;
 
-    rv = kbus_msg_create(&msg, "$.upc.fromUpc", 13,
-                         buffer, nbytes, 0);
-    if (rv < 0)
+    if (nbytes <= 0)
+        return 0;
+    if (handle->out_used + nbytes > UP_BIO_KBUS_COALESCE)
+    {
+        if ((rv = kbus_flush(bio)) < 0)
+            return rv;
+    }
+    /* Something too big to gather can go straight from the caller */
+    if (nbytes > UP_BIO_KBUS_COALESCE)
+    {
+        if ((rv = kbus_send(bio, buffer, nbytes)) < 0)
+            return rv;
+        return nbytes;
+    }
+    if (handle->out_used == 0)
+        handle->out_since_ns = utils_monotonic_ns();
+    memcpy(&handle->out_buf[handle->out_used], buffer, nbytes);
+    handle->out_used += nbytes;
+    if (handle->out_used == UP_BIO_KBUS_COALESCE &&
+        (rv = kbus_flush(bio)) < 0)
         return rv;
-    rv = kbus_ksock_send_msg(handle->ksock, msg, &id);
+    /* Otherwise the whole lot will go in a later KBus message */
+    return nbytes;
+}
+
+
+static int up_bio_kbus_writev(up_bio_t           *bio,
+                              const struct iovec *iov,
+                              int                 iovcnt)
+{
+    int done = 0;
+    int i;
+    int rv;
+
+    /* The pieces are gathered like any other writes */
+    for (i = 0; i < iovcnt; i++)
+    {
+        rv = up_bio_kbus_write(bio, iov[i].iov_base, iov[i].iov_len);
+        if (rv < 0)
+            return (done > 0) ? done : rv;
+        done += rv;
+    }
+    return done;
+}
+
+
+static int up_bio_kbus_safe_write(up_bio_t      *bio,
+                                  const uint8_t *buffer,
+                                  int            nbytes)
+{
+    int rv;
+    int flushed;
+
+    rv = up_bio_kbus_write(bio, buffer, nbytes);
     if (rv < 0)
         return rv;
-    /* Otherwise we sent the *whole* message in one KBus packet */
-    return nbytes;
+    /* Callers of safe_write() expect the bytes to have gone */
+    if ((flushed = kbus_flush(bio)) < 0)
+        return flushed;
+    return rv;
+}
+
+
+static int up_bio_kbus_tx_pending(up_bio_t *bio)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+
+    return handle->out_used;
+}
+
+
+static int up_bio_kbus_tx_high_water(up_bio_t *bio)
+{
+    return UP_BIO_KBUS_COALESCE;
+}
+
+
+static int up_bio_kbus_tx_service(up_bio_t *bio)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+    int rv;
+
+    /* A KBus socket is always writable, so this is our cue to send */
+    if ((rv = kbus_flush(bio)) < 0)
+        return rv;
+    return handle->out_used;
+}
+
+
+static int up_bio_kbus_poll_timeout(up_bio_t *bio)
+{
+    up_bio_kbus_t *handle = (up_bio_kbus_t *)(bio->handle);
+    uint64_t held_ms;
+
+    if (handle->out_used == 0)
+        return -1;
+    held_ms = (utils_monotonic_ns() - handle->out_since_ns) / 1000000;
+    if (held_ms >= UP_BIO_KBUS_COALESCE_MS)
+        return 0;
+    return UP_BIO_KBUS_COALESCE_MS - held_ms;
 }
 
 
 static int up_bio_kbus_set_baud(up_bio_t *bio, int baud, int flow_control)
 {
-    /* We could send a special message with this info, but let's not for now */
-    return 0;
+    /* We could send a special message with this info, but let's not
+     * for now.  Do get the last stage's bytes out first, though.
+     */
+    return kbus_flush(bio);
 }
 
 
@@ -122,9 +307,17 @@ up_bio_t *up_bio_kbus_create(const char *bus)
     bio->handle = handle;
     bio->dispose = up_bio_kbus_dispose;
     bio->poll_fd = up_bio_kbus_poll_fd;
+    bio->rx_pending = up_bio_kbus_rx_pending;
     bio->read = up_bio_kbus_read;
+    bio->borrow = up_bio_kbus_borrow;
+    bio->release = up_bio_kbus_release;
     bio->write = up_bio_kbus_write;
-    bio->safe_write = up_bio_kbus_write;
+    bio->writev = up_bio_kbus_writev;
+    bio->safe_write = up_bio_kbus_safe_write;
+    bio->tx_pending = up_bio_kbus_tx_pending;
+    bio->tx_high_water = up_bio_kbus_tx_high_water;
+    bio->tx_service = up_bio_kbus_tx_service;
+    bio->poll_timeout = up_bio_kbus_poll_timeout;
     bio->set_baud = up_bio_kbus_set_baud;
 
     handle->ksock = kbus_ksock_open_by_name(bus, O_RDWR);
@@ -147,5 +340,18 @@ up_bio_t *up_bio_kbus_create(const char *bus)
         return NULL;
     }
 
+    /* One message for all our sends, pointing at the data to go */
+    if ((rv = kbus_msg_create_pointy(&handle->out_msg,
+                                     "$.upc.fromUpc", 13,
+                                     NULL, 0, 0)) < 0)
+    {
+        fprintf(stderr, "Unable to create upc message: %s [%d]\n",
+                strerror(-rv), -rv);
+        kbus_ksock_close(handle->ksock);
+        free(handle);
+        free(bio);
+        return NULL;
+    }
+
     return bio;
 }
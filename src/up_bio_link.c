@@ -0,0 +1,491 @@
+/* up_bio_link.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO which makes the BIO it wraps behave like a slow, late or
+ *  noisy link.  Bytes in each direction are held in a ring, in
+ *  batches stamped with the time they come out of the far end: the
+ *  time the simulated line takes to send them at the current rate,
+ *  plus the latency, rounded up to the next USB frame.  Bits are
+ *  flipped and bytes dropped on the way in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "upc2/up.h"
+#include "upc2/up_bio_link.h"
+#include "upc2/utils.h"
+
+
+/* Longest we will wait for held output to go */
+#define UP_BIO_LINK_FLUSH_MS (5000)
+
+#define LINK_HANDLE(c, bio)                            \
+    up_bio_link_t *(c) = (up_bio_link_t *)((bio)->handle)
+
+
+/* xorshift64*: quick, and repeatable from the seed */
+static uint64_t rng_next(up_bio_link_t *handle) {
+    handle->rng ^= handle->rng >> 12;
+    handle->rng ^= handle->rng << 25;
+    handle->rng ^= handle->rng >> 27;
+    return handle->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double rng_uniform(up_bio_link_t *handle) {
+    return (rng_next(handle) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int line_baud(up_bio_link_t *handle) {
+    return handle->params.baud ? handle->params.baud : handle->baud;
+}
+
+/* Copy bytes onto the ring, damaging them as we go.  Returns the
+ * number of bytes that survived.
+ */
+static int put_damaged(up_bio_link_t     *handle,
+                       up_bio_link_dir_t *dir,
+                       const uint8_t     *bytes,
+                       int                nr) {
+    uint8_t buf[256];
+    int kept = 0;
+    int n = 0;
+    int i, b;
+
+    if (handle->params.ber <= 0.0 && handle->params.drop <= 0.0)
+        return up_ring_put(&dir->ring, bytes, nr);
+
+    for (i = 0; i < nr; i++) {
+        uint8_t c = bytes[i];
+
+        if (handle->params.drop > 0.0 &&
+            rng_uniform(handle) < handle->params.drop) {
+            dir->dropped++;
+            continue;
+        }
+        if (handle->params.ber > 0.0) {
+            for (b = 0; b < 8; b++) {
+                if (rng_uniform(handle) < handle->params.ber) {
+                    c ^= 1 << b;
+                    dir->flipped++;
+                }
+            }
+        }
+        buf[n++] = c;
+        if (n == sizeof(buf)) {
+            kept += up_ring_put(&dir->ring, buf, n);
+            n = 0;
+        }
+    }
+    return kept + up_ring_put(&dir->ring, buf, n);
+}
+
+/* Send nr bytes into one end of the link at time now.  Returns how
+ * many were taken, which is fewer than nr only if the ring is full.
+ */
+static int dir_put(up_bio_link_t     *handle,
+                   up_bio_link_dir_t *dir,
+                   const uint8_t     *bytes,
+                   int                nr,
+                   uint64_t           now) {
+    int baud = line_baud(handle);
+    uint64_t latency_ns = handle->params.latency_us * 1000ULL;
+    uint64_t frame_ns = handle->params.frame_us * 1000ULL;
+    /* Stamp batches of about a millisecond's worth, so that a large
+     * write trickles out rather than arriving all at once.
+     */
+    int piece = baud ? baud / 10 / 1000 : nr;
+    int room = dir->ring.size - dir->ring.count;
+    int taken = 0;
+
+    if (piece < 1)
+        piece = 1;
+    if (nr > room)
+        nr = room;
+
+    while (taken < nr) {
+        int n = (nr - taken < piece) ? nr - taken : piece;
+        uint64_t start = (dir->line_free_ns > now) ? dir->line_free_ns : now;
+        uint64_t due;
+        int kept;
+
+        /* Ten bits a character */
+        dir->line_free_ns =
+            start + (baud ? (uint64_t)n * 10 * 1000000000ULL / baud : 0);
+        due = dir->line_free_ns + latency_ns;
+        if (frame_ns)
+            due = ((due + frame_ns - 1) / frame_ns) * frame_ns;
+
+        kept = put_damaged(handle, dir, &bytes[taken], n);
+        taken += n;
+        if (kept == 0)
+            continue;
+
+        if (dir->seg_count > 0) {
+            up_bio_link_seg_t *last = &dir->segs[(dir->seg_head +
+                                                  dir->seg_count - 1) %
+                                                 UP_BIO_LINK_SEGS];
+            /* Same arrival, or no room to keep them apart */
+            if (last->due_ns >= due || dir->seg_count == UP_BIO_LINK_SEGS) {
+                if (due > last->due_ns)
+                    last->due_ns = due;
+                last->len += kept;
+                continue;
+            }
+        }
+        dir->segs[(dir->seg_head + dir->seg_count) % UP_BIO_LINK_SEGS].due_ns =
+            due;
+        dir->segs[(dir->seg_head + dir->seg_count) % UP_BIO_LINK_SEGS].len =
+            kept;
+        dir->seg_count++;
+    }
+    return taken;
+}
+
+/* Move batches which have arrived by now to the ready bytes */
+static void dir_promote(up_bio_link_dir_t *dir, uint64_t now) {
+    while (dir->seg_count > 0 && dir->segs[dir->seg_head].due_ns <= now) {
+        dir->ready += dir->segs[dir->seg_head].len;
+        dir->seg_head = (dir->seg_head + 1) % UP_BIO_LINK_SEGS;
+        dir->seg_count--;
+    }
+}
+
+static void dir_consume(up_bio_link_dir_t *dir, int nr) {
+    if (nr > dir->ready)
+        nr = dir->ready;
+    up_ring_consume(&dir->ring, nr);
+    dir->ready -= nr;
+}
+
+
+/* Take whatever the inner BIO has and send it down the link towards
+ * us.  Returns what the inner BIO's read() last did.
+ */
+static int rx_pull(up_bio_link_t *handle) {
+    up_bio_t *inner = handle->fwd.inner;
+    uint64_t now = utils_monotonic_ns();
+    uint8_t buf[4096];
+    int rv = 0;
+
+    while (1) {
+        int room = handle->rx.ring.size - handle->rx.ring.count;
+
+        if (room == 0)
+            break;
+        if (room > (int)sizeof(buf))
+            room = sizeof(buf);
+        rv = inner->read(inner, buf, room);
+        if (rv <= 0)
+            break;
+        dir_put(handle, &handle->rx, buf, rv, now);
+        if (rv < room)
+            break;
+    }
+    return rv;
+}
+
+/* Make sure anything due has arrived.  Returns the number of bytes
+ * ready, or -1 with errno set as read() would.
+ */
+static int rx_ready(up_bio_link_t *handle) {
+    int rv = rx_pull(handle);
+
+    if (rv < 0 && errno != EAGAIN && errno != EINTR)
+        return -1;
+    dir_promote(&handle->rx, utils_monotonic_ns());
+    if (handle->rx.ready == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return handle->rx.ready;
+}
+
+static int up_bio_link_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    LINK_HANDLE(handle, bio);
+    int ready = rx_ready(handle);
+    int run;
+
+    if (ready < 0)
+        return ready;
+    run = up_ring_run(&handle->rx.ring, bytes);
+    return (run < ready) ? run : ready;
+}
+
+static int up_bio_link_peek(up_bio_t *bio, uint8_t *tgt, int nr) {
+    LINK_HANDLE(handle, bio);
+    int ready = rx_ready(handle);
+
+    if (ready < 0)
+        return ready;
+    return up_ring_copy(&handle->rx.ring, tgt, (nr < ready) ? nr : ready);
+}
+
+static int up_bio_link_consume(up_bio_t *bio, int nr) {
+    LINK_HANDLE(handle, bio);
+    if (nr > handle->rx.ready)
+        nr = handle->rx.ready;
+    dir_consume(&handle->rx, nr);
+    return nr;
+}
+
+static int up_bio_link_read(up_bio_t *bio, uint8_t *tgt, int nr) {
+    int rv = up_bio_link_peek(bio, tgt, nr);
+
+    if (rv > 0)
+        up_bio_link_consume(bio, rv);
+    return rv;
+}
+
+static int up_bio_link_rx_pending(up_bio_t *bio) {
+    LINK_HANDLE(handle, bio);
+
+    dir_promote(&handle->rx, utils_monotonic_ns());
+    if (handle->rx.ready > 0)
+        return handle->rx.ready;
+    /* Bytes the inner BIO holds still need pulling into the link */
+    if (handle->rx.ring.count < handle->rx.ring.size)
+        return utils_bio_rx_pending(handle->fwd.inner);
+    return 0;
+}
+
+static int up_bio_link_tx_service(up_bio_t *bio) {
+    LINK_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+
+    dir_promote(&handle->tx, utils_monotonic_ns());
+    while (handle->tx.ready > 0) {
+        const uint8_t *bytes;
+        int run = up_ring_run(&handle->tx.ring, &bytes);
+        int rv;
+
+        if (run > handle->tx.ready)
+            run = handle->tx.ready;
+        rv = inner->write(inner, bytes, run);
+        if (rv < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -1;
+            break;
+        }
+        dir_consume(&handle->tx, rv);
+        if (rv < run)
+            break;
+    }
+    if (utils_bio_tx_service(inner) < 0)
+        return -1;
+    return handle->tx.ring.count + utils_bio_tx_pending(inner);
+}
+
+static int up_bio_link_tx_pending(up_bio_t *bio) {
+    LINK_HANDLE(handle, bio);
+    return handle->tx.ring.count + utils_bio_tx_pending(handle->fwd.inner);
+}
+
+static int up_bio_link_tx_high_water(up_bio_t *bio) {
+    LINK_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+
+    if (inner->tx_high_water != NULL)
+        return inner->tx_high_water(inner);
+    return handle->tx.ring.size / 2;
+}
+
+static int up_bio_link_writev(up_bio_t           *bio,
+                              const struct iovec *iov,
+                              int                 iovcnt) {
+    LINK_HANDLE(handle, bio);
+    uint64_t now = utils_monotonic_ns();
+    int done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        int put = dir_put(handle, &handle->tx, iov[i].iov_base,
+                          iov[i].iov_len, now);
+
+        done += put;
+        if (put < (int)iov[i].iov_len)
+            break;
+    }
+    if (up_bio_link_tx_service(bio) < 0 && done == 0)
+        return -1;
+    if (done == 0 && iovcnt > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+static int up_bio_link_write(up_bio_t      *bio,
+                             const uint8_t *bytes,
+                             int            nr) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)bytes;
+    iov.iov_len = nr;
+    return up_bio_link_writev(bio, &iov, 1);
+}
+
+static int up_bio_link_safe_write(up_bio_t      *bio,
+                                  const uint8_t *bytes,
+                                  int            nr) {
+    return utils_bio_safe_write(bio, bytes, nr);
+}
+
+static int up_bio_link_poll_timeout(up_bio_t *bio) {
+    LINK_HANDLE(handle, bio);
+    uint64_t now = utils_monotonic_ns();
+    uint64_t due = 0;
+    int inner_ms = utils_bio_poll_timeout(handle->fwd.inner);
+    int ms;
+
+    dir_promote(&handle->rx, now);
+    dir_promote(&handle->tx, now);
+    if (handle->rx.ready > 0 || handle->tx.ready > 0)
+        return 0;
+    if (handle->rx.seg_count > 0)
+        due = handle->rx.segs[handle->rx.seg_head].due_ns;
+    if (handle->tx.seg_count > 0 &&
+        (due == 0 || handle->tx.segs[handle->tx.seg_head].due_ns < due))
+        due = handle->tx.segs[handle->tx.seg_head].due_ns;
+    if (due == 0)
+        return inner_ms;
+
+    /* Round up, or we wake just before it's time */
+    ms = (int)((due - now + 999999) / 1000000);
+    if (inner_ms >= 0 && inner_ms < ms)
+        ms = inner_ms;
+    return ms;
+}
+
+static int up_bio_link_set_baud(up_bio_t *bio, int baud, int flow_control) {
+    LINK_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+
+    /* What is on the line goes at the old rate */
+    utils_bio_flush(bio, UP_BIO_LINK_FLUSH_MS);
+    if (baud > 0)
+        handle->baud = baud;
+    return inner->set_baud(inner, baud, flow_control);
+}
+
+static void up_bio_link_dispose(up_bio_t *bio) {
+    LINK_HANDLE(handle, bio);
+
+    utils_bio_flush(bio, UP_BIO_LINK_FLUSH_MS);
+    if (handle->params.ber > 0.0 || handle->params.drop > 0.0)
+        printf("[[ link: to target %u bits flipped, %u bytes dropped;"
+               " from target %u bits flipped, %u bytes dropped ]]\n",
+               handle->tx.flipped, handle->tx.dropped,
+               handle->rx.flipped, handle->rx.dropped);
+    up_ring_free(&handle->rx.ring);
+    up_ring_free(&handle->tx.ring);
+    up_bio_forward_dispose(bio);
+}
+
+
+int up_bio_link_parse(const char *spec, up_bio_link_params_t *params) {
+    char *copy = strdup(spec);
+    char *save = NULL;
+    char *item;
+    int rv = 0;
+
+    if (copy == NULL)
+        return -1;
+    memset(params, '\0', sizeof(up_bio_link_params_t));
+    params->seed = 1;
+
+    for (item = strtok_r(copy, ",", &save);
+         item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        char *end = NULL;
+
+        if (value == NULL) {
+            rv = -1;
+            break;
+        }
+        *value++ = '\0';
+        if (!strcmp(item, "baud")) {
+            params->baud = up_read_baud(value);
+            end = (params->baud < 0) ? value : "";
+        } else if (!strcmp(item, "latency")) {
+            params->latency_us = strtol(value, &end, 0);
+        } else if (!strcmp(item, "frame")) {
+            params->frame_us = strtol(value, &end, 0);
+        } else if (!strcmp(item, "ber")) {
+            params->ber = strtod(value, &end);
+        } else if (!strcmp(item, "drop")) {
+            params->drop = strtod(value, &end);
+        } else if (!strcmp(item, "seed")) {
+            params->seed = strtoull(value, &end, 0);
+        }
+        if (end == NULL || *end != '\0' || end == value) {
+            rv = -1;
+            break;
+        }
+    }
+    if (rv < 0 || params->latency_us < 0 || params->frame_us < 0 ||
+        params->ber < 0.0 || params->ber > 1.0 ||
+        params->drop < 0.0 || params->drop > 1.0) {
+        fprintf(stderr, "Bad link spec '%s': expected eg."
+                " baud=115200,latency=2000,frame=1000,ber=1e-6,drop=0\n",
+                spec);
+        rv = -1;
+    }
+    free(copy);
+    return rv;
+}
+
+
+up_bio_t *up_bio_link_create(up_bio_t                   *inner,
+                             const up_bio_link_params_t *params) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_link_t *handle = (up_bio_link_t *)malloc(sizeof(up_bio_link_t));
+
+    if (a_bio == NULL || handle == NULL)
+        goto fail;
+    memset(handle, '\0', sizeof(up_bio_link_t));
+    if (up_ring_init(&handle->rx.ring, UP_BIO_LINK_BYTES) < 0 ||
+        up_ring_init(&handle->tx.ring, UP_BIO_LINK_BYTES) < 0)
+        goto fail;
+    handle->params = *params;
+    handle->rng = params->seed ? params->seed : 1;
+
+    up_bio_forward_init(a_bio, handle, inner);
+    a_bio->dispose = up_bio_link_dispose;
+    a_bio->read = up_bio_link_read;
+    a_bio->rx_pending = up_bio_link_rx_pending;
+    a_bio->peek = up_bio_link_peek;
+    a_bio->consume = up_bio_link_consume;
+    a_bio->borrow = up_bio_link_borrow;
+    a_bio->release = up_bio_link_consume;
+    a_bio->write = up_bio_link_write;
+    a_bio->writev = up_bio_link_writev;
+    a_bio->safe_write = up_bio_link_safe_write;
+    /* Everything takes its turn on the simulated line */
+    a_bio->urgent_write = NULL;
+    a_bio->tx_pending = up_bio_link_tx_pending;
+    a_bio->tx_high_water = up_bio_link_tx_high_water;
+    a_bio->tx_service = up_bio_link_tx_service;
+    a_bio->poll_timeout = up_bio_link_poll_timeout;
+    a_bio->set_baud = up_bio_link_set_baud;
+    return a_bio;
+
+fail:
+    fprintf(stderr, "! Out of memory for link emulation\n");
+    if (handle != NULL) {
+        up_ring_free(&handle->rx.ring);
+        up_ring_free(&handle->tx.ring);
+    }
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
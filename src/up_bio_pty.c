@@ -0,0 +1,67 @@
+/* up_bio_pty.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO on a pseudo-terminal, for talking to targets emulated in
+ *  software.  It is the serial BIO on the slave side; all this adds is
+ *  the creation of the pty and somewhere to keep its name.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "upc2/up_bio_pty.h"
+#include "upc2/up_bio_serial.h"
+
+
+up_bio_t *up_bio_pty_create(int *master_fd) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_pty_t *handle = (up_bio_pty_t *)malloc(sizeof(up_bio_pty_t));
+    up_bio_t *serial;
+    int fd;
+
+    if (a_bio == NULL || handle == NULL)
+        goto fail;
+    memset(handle, '\0', sizeof(up_bio_pty_t));
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 ||
+        ptsname_r(fd, handle->slave_name, sizeof(handle->slave_name))) {
+        fprintf(stderr, "! Cannot create a pty: %s [%d]\n",
+                strerror(errno), errno);
+        if (fd >= 0)
+            close(fd);
+        goto fail;
+    }
+
+    /* The serial BIO makes the line raw; that is shared with the
+     * master side.
+     */
+    serial = up_bio_serial_create(handle->slave_name, 0);
+    if (serial == NULL) {
+        close(fd);
+        goto fail;
+    }
+    /* A pty drains as fast as the far end reads, not at a line rate */
+    up_bio_serial_set_tx_budget(serial, 0);
+    up_bio_forward_init(a_bio, handle, serial);
+    /* A pty has no modem control lines, and does not come back */
+    a_bio->set_lines = NULL;
+    a_bio->send_break = NULL;
+    a_bio->reconnect = NULL;
+    *master_fd = fd;
+    return a_bio;
+
+fail:
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
@@ -0,0 +1,298 @@
+/* up_bio_record.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO which records the traffic through the BIO it wraps.  Records
+ *  are built in a buffer and written out a chunk at a time, so that
+ *  recording costs a memcpy on the I/O path rather than a system
+ *  call.  The buffer is also written out at each baud rate change,
+ *  so a trace cut short by a crash still covers the earlier stages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upc2/up_bio_record.h"
+#include "upc2/utils.h"
+
+
+#define RECORD_HANDLE(c, bio)                              \
+    up_bio_record_t *(c) = (up_bio_record_t *)((bio)->handle)
+
+
+static void trace_flush(up_bio_record_t *handle) {
+    if (handle->buf_used > 0 && !handle->failed &&
+        utils_safe_write(handle->fd, handle->buf, handle->buf_used) < 0) {
+        fprintf(stderr, "! Cannot write trace %s - recording stopped\n",
+                handle->filename);
+        handle->failed = 1;
+    }
+    handle->buf_used = 0;
+}
+
+static void trace_put(up_bio_record_t *handle,
+                      const uint8_t   *bytes,
+                      int              nr) {
+    while (nr > 0) {
+        int n = UP_BIO_RECORD_BUFFER - handle->buf_used;
+
+        if (n > nr)
+            n = nr;
+        memcpy(&handle->buf[handle->buf_used], bytes, n);
+        handle->buf_used += n;
+        bytes += n;
+        nr -= n;
+        if (handle->buf_used == UP_BIO_RECORD_BUFFER)
+            trace_flush(handle);
+    }
+}
+
+static void put_le(uint8_t *out, uint64_t val, int nr) {
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        out[i] = val & 0xff;
+        val >>= 8;
+    }
+}
+
+/* Start a record of nr bytes; its data follows with trace_put() */
+static void trace_record(up_bio_record_t *handle, int kind, int nr) {
+    uint8_t hdr[UP_TRACE_RECORD_LEN];
+
+    put_le(&hdr[0], utils_monotonic_ns(), 8);
+    hdr[8] = kind;
+    put_le(&hdr[9], nr, 4);
+    trace_put(handle, hdr, sizeof(hdr));
+    handle->records++;
+}
+
+/* The host has seen nr bytes at the front of the input; record those
+ * it has not seen before.
+ */
+static void record_seen(up_bio_record_t *handle,
+                        const uint8_t   *bytes,
+                        int              nr) {
+    if (nr <= handle->rx_seen)
+        return;
+    trace_record(handle, UP_TRACE_RX, nr - handle->rx_seen);
+    trace_put(handle, &bytes[handle->rx_seen], nr - handle->rx_seen);
+    handle->rx_seen = nr;
+}
+
+static void record_consumed(up_bio_record_t *handle, int nr) {
+    handle->rx_seen = (nr < handle->rx_seen) ? handle->rx_seen - nr : 0;
+}
+
+static int up_bio_record_read(up_bio_t *bio, uint8_t *bytes, int nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->read(inner, bytes, nr);
+
+    if (rv > 0) {
+        record_seen(handle, bytes, rv);
+        record_consumed(handle, rv);
+    }
+    return rv;
+}
+
+static int up_bio_record_peek(up_bio_t *bio, uint8_t *bytes, int nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->peek(inner, bytes, nr);
+
+    if (rv > 0)
+        record_seen(handle, bytes, rv);
+    return rv;
+}
+
+static int up_bio_record_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->borrow(inner, bytes);
+
+    if (rv > 0)
+        record_seen(handle, *bytes, rv);
+    return rv;
+}
+
+static int up_bio_record_consume(up_bio_t *bio, int nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->consume(inner, nr);
+
+    if (rv > 0)
+        record_consumed(handle, rv);
+    return rv;
+}
+
+static int up_bio_record_release(up_bio_t *bio, int nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->release(inner, nr);
+
+    if (rv > 0)
+        record_consumed(handle, rv);
+    return rv;
+}
+
+static int up_bio_record_write(up_bio_t *bio, const uint8_t *bytes, int nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->write(inner, bytes, nr);
+
+    if (rv > 0) {
+        trace_record(handle, UP_TRACE_TX, rv);
+        trace_put(handle, bytes, rv);
+    }
+    return rv;
+}
+
+static int up_bio_record_writev(up_bio_t           *bio,
+                                const struct iovec *iov,
+                                int                 iovcnt) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->writev(inner, iov, iovcnt);
+    int left = rv;
+    int i;
+
+    if (rv <= 0)
+        return rv;
+    /* One record for however much of the pieces went */
+    trace_record(handle, UP_TRACE_TX, rv);
+    for (i = 0; i < iovcnt && left > 0; i++) {
+        int n = ((int)iov[i].iov_len < left) ? (int)iov[i].iov_len : left;
+
+        trace_put(handle, iov[i].iov_base, n);
+        left -= n;
+    }
+    return rv;
+}
+
+static int up_bio_record_safe_write(up_bio_t      *bio,
+                                    const uint8_t *bytes,
+                                    int            nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->safe_write(inner, bytes, nr);
+
+    if (rv > 0) {
+        trace_record(handle, UP_TRACE_TX, rv);
+        trace_put(handle, bytes, rv);
+    }
+    return rv;
+}
+
+static int up_bio_record_urgent_write(up_bio_t      *bio,
+                                      const uint8_t *bytes,
+                                      int            nr) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv = inner->urgent_write(inner, bytes, nr);
+
+    /* Recorded when queued, like everything else sent */
+    if (rv > 0) {
+        trace_record(handle, UP_TRACE_TX, rv);
+        trace_put(handle, bytes, rv);
+    }
+    return rv;
+}
+
+static int up_bio_record_set_baud(up_bio_t *bio, int baud, int flow_control) {
+    RECORD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    uint8_t data[8];
+
+    put_le(&data[0], (uint32_t)baud, 4);
+    put_le(&data[4], (uint32_t)flow_control, 4);
+    trace_record(handle, UP_TRACE_BAUD, sizeof(data));
+    trace_put(handle, data, sizeof(data));
+    /* Stage boundaries are a good time to get the trace onto disc */
+    trace_flush(handle);
+    return inner->set_baud(inner, baud, flow_control);
+}
+
+static void up_bio_record_dispose(up_bio_t *bio) {
+    RECORD_HANDLE(handle, bio);
+
+    trace_flush(handle);
+    close(handle->fd);
+    printf("[[ Recorded %llu records to %s ]]\n",
+           (unsigned long long)handle->records, handle->filename);
+    free(handle->buf);
+    up_bio_forward_dispose(bio);
+}
+
+
+up_bio_t *up_bio_record_create(up_bio_t *inner, const char *filename) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_record_t *handle = (up_bio_record_t *)malloc(sizeof(up_bio_record_t));
+    uint8_t header[UP_TRACE_HEADER_LEN];
+    struct timespec now;
+
+    if (a_bio == NULL || handle == NULL) {
+        fprintf(stderr, "! Out of memory for recording\n");
+        goto fail;
+    }
+    memset(handle, '\0', sizeof(up_bio_record_t));
+    handle->filename = filename;
+    handle->fd = -1;
+    handle->buf = (uint8_t *)malloc(UP_BIO_RECORD_BUFFER);
+    if (handle->buf == NULL) {
+        fprintf(stderr, "! Out of memory for recording\n");
+        goto fail;
+    }
+    handle->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (handle->fd < 0) {
+        fprintf(stderr, "! Cannot open %s: %s [%d]\n",
+                filename, strerror(errno), errno);
+        goto fail;
+    }
+
+    memcpy(header, UP_TRACE_MAGIC, UP_TRACE_MAGIC_LEN);
+    clock_gettime(CLOCK_REALTIME, &now);
+    put_le(&header[UP_TRACE_MAGIC_LEN],
+           (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, 8);
+    put_le(&header[UP_TRACE_MAGIC_LEN + 8], utils_monotonic_ns(), 8);
+    trace_put(handle, header, sizeof(header));
+
+    up_bio_forward_init(a_bio, handle, inner);
+    a_bio->dispose = up_bio_record_dispose;
+    a_bio->read = up_bio_record_read;
+    a_bio->write = up_bio_record_write;
+    a_bio->safe_write = up_bio_record_safe_write;
+    a_bio->set_baud = up_bio_record_set_baud;
+    if (inner->peek != NULL)
+        a_bio->peek = up_bio_record_peek;
+    if (inner->consume != NULL)
+        a_bio->consume = up_bio_record_consume;
+    if (inner->borrow != NULL)
+        a_bio->borrow = up_bio_record_borrow;
+    if (inner->release != NULL)
+        a_bio->release = up_bio_record_release;
+    if (inner->writev != NULL)
+        a_bio->writev = up_bio_record_writev;
+    if (inner->urgent_write != NULL)
+        a_bio->urgent_write = up_bio_record_urgent_write;
+    return a_bio;
+
+fail:
+    if (handle != NULL) {
+        if (handle->fd >= 0)
+            close(handle->fd);
+        free(handle->buf);
+    }
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
@@ -0,0 +1,510 @@
+/* up_bio_replay.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO which replays a recorded trace.  The whole trace is read in
+ *  up front and indexed, so playing it back costs no I/O.  What the
+ *  host sends is compared with what was recorded, and the differences
+ *  are counted rather than acted on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "upc2/up_bio_record.h"
+#include "upc2/up_bio_replay.h"
+#include "upc2/utils.h"
+
+
+#define REPLAY_HANDLE(c, bio)                              \
+    up_bio_replay_t *(c) = (up_bio_replay_t *)((bio)->handle)
+
+#define REPLAY_PREFIX "replay:"
+
+
+static uint64_t get_le(const uint8_t *in, int nr) {
+    uint64_t val = 0;
+
+    while (nr-- > 0)
+        val = (val << 8) | in[nr];
+    return val;
+}
+
+/* Hand over whatever is due by now */
+static void replay_advance(up_bio_replay_t *handle, uint64_t now) {
+    while (handle->cur < handle->nr_recs) {
+        const up_bio_replay_rec_t *rec = &handle->recs[handle->cur];
+
+        if (rec->kind == UP_TRACE_TX) {
+            /* Wait for the host to catch up */
+            if (handle->tx_total < rec->tx_end)
+                break;
+            handle->anchor_ns = now;
+            handle->anchor_ts_ns = rec->ts_ns;
+        } else if (rec->kind == UP_TRACE_RX) {
+            uint64_t due = handle->anchor_ns;
+            int put;
+
+            if (rec->ts_ns > handle->anchor_ts_ns)
+                due += rec->ts_ns - handle->anchor_ts_ns;
+            if (due > now)
+                break;
+            put = up_ring_put(&handle->rx, &rec->data[handle->cur_off],
+                              rec->len - handle->cur_off);
+            handle->rx_total += put;
+            handle->cur_off += put;
+            if (handle->cur_off < rec->len)
+                break;
+        }
+        handle->cur++;
+        handle->cur_off = 0;
+    }
+    if (handle->cur == handle->nr_recs && handle->end_ns == 0)
+        handle->end_ns = now;
+}
+
+/* Non-zero if the host's bytes from tx_held[h] agree with the
+ * recording from tx_expect[e], for as far as both go up to
+ * UP_BIO_REPLAY_MATCH_BYTES
+ */
+static int tx_agrees(const up_bio_replay_t *handle, int h, uint64_t e) {
+    uint64_t n = UP_BIO_REPLAY_MATCH_BYTES;
+
+    if (h >= handle->tx_held_len || e >= handle->tx_expect_len)
+        return 0;
+    if (n > (uint64_t)(handle->tx_held_len - h))
+        n = handle->tx_held_len - h;
+    if (n > handle->tx_expect_len - e)
+        n = handle->tx_expect_len - e;
+    return !memcmp(&handle->tx_held[h], &handle->tx_expect[e], n);
+}
+
+/* Compare what the host has sent so far with the recording.  Where
+ * they differ, look ahead for the nearest point at which they agree
+ * again, whether the host changed, added or left out bytes, so that
+ * one slip is counted once rather than throwing out the rest of the
+ * comparison.  Unless final, stop short of the end of the host's
+ * bytes if there is not enough after a difference to look ahead over.
+ */
+static void replay_diff(up_bio_replay_t *handle, int final) {
+    int i = 0;
+
+    while (i < handle->tx_held_len) {
+        uint64_t off = handle->tx_expect_off;
+        int skip_host = 1, skip_rec = 1;
+        int d;
+
+        if (off == handle->tx_expect_len) {
+            handle->tx_extra += handle->tx_held_len - i;
+            i = handle->tx_held_len;
+            break;
+        }
+        if (handle->tx_held[i] == handle->tx_expect[off]) {
+            handle->tx_in_diff = 0;
+            handle->tx_expect_off++;
+            i++;
+            continue;
+        }
+        if (!final && handle->tx_held_len - i <
+            UP_BIO_REPLAY_RESYNC_BYTES + UP_BIO_REPLAY_MATCH_BYTES)
+            break;
+
+        if (handle->tx_first_diff < 0)
+            handle->tx_first_diff = handle->tx_held_off + i;
+        if (!handle->tx_in_diff)
+            handle->tx_diverged++;
+        handle->tx_in_diff = 1;
+        for (d = 1; d <= UP_BIO_REPLAY_RESYNC_BYTES; d++) {
+            if (tx_agrees(handle, i + d, off + d)) {
+                /* Changed */
+                skip_host = skip_rec = d;
+                break;
+            }
+            if (tx_agrees(handle, i + d, off)) {
+                /* Added */
+                skip_host = d;
+                skip_rec = 0;
+                break;
+            }
+            if (tx_agrees(handle, i, off + d)) {
+                /* Left out */
+                skip_host = 0;
+                skip_rec = d;
+                break;
+            }
+        }
+        /* If nothing lines up, step on a byte and look again */
+        handle->tx_differed += (skip_host > skip_rec) ? skip_host : skip_rec;
+        handle->tx_expect_off += skip_rec;
+        i += skip_host;
+    }
+
+    memmove(handle->tx_held, &handle->tx_held[i], handle->tx_held_len - i);
+    handle->tx_held_len -= i;
+    handle->tx_held_off += i;
+}
+
+/* Check what the host sent against the recording */
+static void replay_compare(up_bio_replay_t *handle,
+                           const uint8_t   *bytes,
+                           int              nr) {
+    handle->tx_total += nr;
+    if (handle->tx_held == NULL)
+        return;
+    if (handle->tx_held_len + nr > handle->tx_held_size) {
+        int size = 2 * (handle->tx_held_len + nr);
+        uint8_t *held = (uint8_t *)realloc(handle->tx_held, size);
+
+        if (held == NULL) {
+            fprintf(stderr, "! Out of memory; no longer comparing"
+                    " with the recording\n");
+            free(handle->tx_held);
+            handle->tx_held = NULL;
+            return;
+        }
+        handle->tx_held = held;
+        handle->tx_held_size = size;
+    }
+    memcpy(&handle->tx_held[handle->tx_held_len], bytes, nr);
+    handle->tx_held_len += nr;
+    replay_diff(handle, 0);
+}
+
+/* The write end of an empty pipe: never readable, but always writable,
+ * as we always are, so a protocol waiting to send more is woken at once
+ */
+static int up_bio_replay_poll_fd(up_bio_t *bio) {
+    REPLAY_HANDLE(handle, bio);
+    return handle->pipe_fds[1];
+}
+
+/* Returns the number of bytes ready, or -1 with errno set as read()
+ * would: EAGAIN while there is more to come, ECONNRESET at the end.
+ */
+static int rx_ready(up_bio_replay_t *handle) {
+    replay_advance(handle, utils_monotonic_ns());
+    if (handle->rx.count > 0)
+        return handle->rx.count;
+    errno = (handle->cur == handle->nr_recs) ? ECONNRESET : EAGAIN;
+    return -1;
+}
+
+static int up_bio_replay_peek(up_bio_t *bio, uint8_t *bytes, int nr) {
+    REPLAY_HANDLE(handle, bio);
+    int rv = rx_ready(handle);
+
+    if (rv < 0)
+        return rv;
+    return up_ring_copy(&handle->rx, bytes, nr);
+}
+
+static int up_bio_replay_consume(up_bio_t *bio, int nr) {
+    REPLAY_HANDLE(handle, bio);
+    int rv = up_ring_consume(&handle->rx, nr);
+
+    bio->stats.bytes_in += rv;
+    return rv;
+}
+
+static int up_bio_replay_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    REPLAY_HANDLE(handle, bio);
+    int rv = rx_ready(handle);
+
+    if (rv < 0)
+        return rv;
+    return up_ring_run(&handle->rx, bytes);
+}
+
+static int up_bio_replay_read(up_bio_t *bio, uint8_t *bytes, int nr) {
+    int rv = up_bio_replay_peek(bio, bytes, nr);
+
+    if (rv > 0)
+        up_bio_replay_consume(bio, rv);
+    return rv;
+}
+
+static int up_bio_replay_rx_pending(up_bio_t *bio) {
+    REPLAY_HANDLE(handle, bio);
+
+    replay_advance(handle, utils_monotonic_ns());
+    return handle->rx.count;
+}
+
+static int up_bio_replay_write(up_bio_t *bio, const uint8_t *bytes, int nr) {
+    REPLAY_HANDLE(handle, bio);
+
+    replay_compare(handle, bytes, nr);
+    replay_advance(handle, utils_monotonic_ns());
+    bio->stats.bytes_out += nr;
+    return nr;
+}
+
+static int up_bio_replay_writev(up_bio_t           *bio,
+                                const struct iovec *iov,
+                                int                 iovcnt) {
+    REPLAY_HANDLE(handle, bio);
+    int done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        replay_compare(handle, iov[i].iov_base, iov[i].iov_len);
+        done += iov[i].iov_len;
+    }
+    replay_advance(handle, utils_monotonic_ns());
+    bio->stats.bytes_out += done;
+    return done;
+}
+
+static int up_bio_replay_poll_timeout(up_bio_t *bio) {
+    REPLAY_HANDLE(handle, bio);
+    uint64_t now = utils_monotonic_ns();
+    const up_bio_replay_rec_t *rec;
+    uint64_t due;
+
+    replay_advance(handle, now);
+    /* The end of the trace reads as an error, so deliver it now */
+    if (handle->rx.count > 0 || handle->cur == handle->nr_recs)
+        return 0;
+    rec = &handle->recs[handle->cur];
+    if (rec->kind != UP_TRACE_RX || handle->rx.count == handle->rx.size)
+        return -1;
+    due = handle->anchor_ns;
+    if (rec->ts_ns > handle->anchor_ts_ns)
+        due += rec->ts_ns - handle->anchor_ts_ns;
+    /* Round up, or we wake just before it's time */
+    return (due > now) ? (int)((due - now + 999999) / 1000000) : 0;
+}
+
+static int up_bio_replay_set_baud(up_bio_t *bio, int baud, int flow_control) {
+    /* The recording has whatever the line did at each rate */
+    return 0;
+}
+
+static void up_bio_replay_dispose(up_bio_t *bio) {
+    REPLAY_HANDLE(handle, bio);
+    uint64_t took = (handle->end_ns ? handle->end_ns : utils_monotonic_ns()) -
+        handle->start_ns;
+    uint64_t recorded = handle->nr_recs ?
+        handle->recs[handle->nr_recs - 1].ts_ns - handle->trace_start_ns : 0;
+    char diffs[80];
+
+    if (handle->tx_held != NULL)
+        replay_diff(handle, 1);
+    if (handle->tx_first_diff < 0)
+        strcpy(diffs, "as recorded");
+    else
+        snprintf(diffs, sizeof(diffs),
+                 "%llu differed in %llu places, first at byte %lld",
+                 (unsigned long long)handle->tx_differed,
+                 (unsigned long long)handle->tx_diverged,
+                 (long long)handle->tx_first_diff);
+
+    printf("[[ replay: %llu bytes from target, %llu to target"
+           " (%s, %llu extra), record %d of %d;"
+           " %d.%03d s, recorded %d.%03d s ]]\n",
+           (unsigned long long)handle->rx_total,
+           (unsigned long long)handle->tx_total,
+           diffs,
+           (unsigned long long)handle->tx_extra,
+           handle->cur, handle->nr_recs,
+           (int)(took / 1000000000), (int)(took / 1000000 % 1000),
+           (int)(recorded / 1000000000), (int)(recorded / 1000000 % 1000));
+    close(handle->pipe_fds[0]);
+    close(handle->pipe_fds[1]);
+    up_ring_free(&handle->rx);
+    free(handle->tx_held);
+    free(handle->tx_expect);
+    free(handle->recs);
+    free(handle->trace);
+    free(handle);
+    memset(bio, '\0', sizeof(up_bio_t));
+    free(bio);
+}
+
+
+/* Read the whole trace into handle->trace.  Returns its length or -1 */
+static long load_trace(up_bio_replay_t *handle) {
+    struct stat st;
+    long done = 0;
+    int fd = open(handle->filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "! Cannot open %s: %s [%d]\n",
+                handle->filename, strerror(errno), errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    handle->trace = (uint8_t *)malloc(st.st_size ? st.st_size : 1);
+    if (handle->trace == NULL) {
+        fprintf(stderr, "! Out of memory for %s\n", handle->filename);
+        close(fd);
+        return -1;
+    }
+    while (done < st.st_size) {
+        int rv = read(fd, &handle->trace[done], st.st_size - done);
+
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0) {
+            fprintf(stderr, "! Cannot read %s: %s [%d]\n", handle->filename,
+                    rv ? strerror(errno) : "short read", rv ? errno : 0);
+            close(fd);
+            return -1;
+        }
+        done += rv;
+    }
+    close(fd);
+    return done;
+}
+
+/* Index the records of a trace of size bytes.  Returns 0 or -1 */
+static int index_trace(up_bio_replay_t *handle, long size) {
+    uint64_t tx_total = 0;
+    long off;
+    int pass;
+    int i;
+
+    if (size < UP_TRACE_HEADER_LEN ||
+        memcmp(handle->trace, UP_TRACE_MAGIC, UP_TRACE_MAGIC_LEN)) {
+        fprintf(stderr, "! %s is not an upc2 trace\n", handle->filename);
+        return -1;
+    }
+    handle->trace_start_ns = get_le(&handle->trace[UP_TRACE_MAGIC_LEN + 8], 8);
+
+    /* Count, then fill in */
+    for (pass = 0; pass < 2; pass++) {
+        handle->nr_recs = 0;
+        for (off = UP_TRACE_HEADER_LEN; off < size; ) {
+            const uint8_t *hdr = &handle->trace[off];
+            long len;
+
+            if (size - off < UP_TRACE_RECORD_LEN ||
+                (len = (long)get_le(&hdr[9], 4)) >
+                size - off - UP_TRACE_RECORD_LEN) {
+                /* A recording cut short by a crash; play what there is */
+                fprintf(stderr, "! %s is truncated after %d records\n",
+                        handle->filename, handle->nr_recs);
+                break;
+            }
+            if (pass == 1) {
+                up_bio_replay_rec_t *rec = &handle->recs[handle->nr_recs];
+
+                rec->ts_ns = get_le(&hdr[0], 8);
+                rec->kind = hdr[8];
+                rec->len = len;
+                rec->data = &hdr[UP_TRACE_RECORD_LEN];
+                if (rec->kind == UP_TRACE_TX)
+                    tx_total += len;
+                rec->tx_end = tx_total;
+            }
+            handle->nr_recs++;
+            off += UP_TRACE_RECORD_LEN + len;
+        }
+        if (pass == 0) {
+            handle->recs = (up_bio_replay_rec_t *)
+                malloc((handle->nr_recs + 1) * sizeof(up_bio_replay_rec_t));
+            if (handle->recs == NULL) {
+                fprintf(stderr, "! Out of memory for %s\n", handle->filename);
+                return -1;
+            }
+        }
+    }
+
+    /* What the host sent, end to end, to compare against */
+    handle->tx_expect_len = tx_total;
+    handle->tx_expect = (uint8_t *)malloc(tx_total ? tx_total : 1);
+    handle->tx_held = (uint8_t *)malloc(UP_BIO_REPLAY_RX_BYTES);
+    if (handle->tx_expect == NULL || handle->tx_held == NULL) {
+        fprintf(stderr, "! Out of memory for %s\n", handle->filename);
+        return -1;
+    }
+    handle->tx_held_size = UP_BIO_REPLAY_RX_BYTES;
+    handle->tx_first_diff = -1;
+    for (i = 0; i < handle->nr_recs; i++) {
+        const up_bio_replay_rec_t *rec = &handle->recs[i];
+
+        if (rec->kind == UP_TRACE_TX)
+            memcpy(&handle->tx_expect[rec->tx_end - rec->len],
+                   rec->data, rec->len);
+    }
+    return 0;
+}
+
+
+int up_bio_replay_is_spec(const char *spec) {
+    return !strncmp(spec, REPLAY_PREFIX, strlen(REPLAY_PREFIX));
+}
+
+up_bio_t *up_bio_replay_create(const char *spec) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_replay_t *handle = (up_bio_replay_t *)malloc(sizeof(up_bio_replay_t));
+    long size;
+
+    if (a_bio == NULL || handle == NULL) {
+        fprintf(stderr, "! Out of memory for replay\n");
+        free(handle);
+        free(a_bio);
+        return NULL;
+    }
+    memset(a_bio, '\0', sizeof(up_bio_t));
+    memset(handle, '\0', sizeof(up_bio_replay_t));
+    handle->pipe_fds[0] = handle->pipe_fds[1] = -1;
+    handle->filename = &spec[strlen(REPLAY_PREFIX)];
+
+    size = load_trace(handle);
+    if (size < 0 || index_trace(handle, size) < 0)
+        goto fail;
+    if (up_ring_init(&handle->rx, UP_BIO_REPLAY_RX_BYTES) < 0) {
+        fprintf(stderr, "! Out of memory for replay\n");
+        goto fail;
+    }
+    if (pipe(handle->pipe_fds) < 0) {
+        fprintf(stderr, "! Cannot create pipe: %s [%d]\n",
+                strerror(errno), errno);
+        goto fail;
+    }
+    handle->start_ns = handle->anchor_ns = utils_monotonic_ns();
+    handle->anchor_ts_ns = handle->trace_start_ns;
+    printf("[[ Replaying %d records from %s ]]\n",
+           handle->nr_recs, handle->filename);
+
+    a_bio->handle = handle;
+    a_bio->dispose = up_bio_replay_dispose;
+    a_bio->poll_fd = up_bio_replay_poll_fd;
+    a_bio->read = up_bio_replay_read;
+    a_bio->rx_pending = up_bio_replay_rx_pending;
+    a_bio->peek = up_bio_replay_peek;
+    a_bio->consume = up_bio_replay_consume;
+    a_bio->borrow = up_bio_replay_borrow;
+    a_bio->release = up_bio_replay_consume;
+    a_bio->write = up_bio_replay_write;
+    a_bio->writev = up_bio_replay_writev;
+    a_bio->safe_write = up_bio_replay_write;
+    a_bio->poll_timeout = up_bio_replay_poll_timeout;
+    a_bio->set_baud = up_bio_replay_set_baud;
+    return a_bio;
+
+fail:
+    if (handle->pipe_fds[0] >= 0) {
+        close(handle->pipe_fds[0]);
+        close(handle->pipe_fds[1]);
+    }
+    up_ring_free(&handle->rx);
+    free(handle->tx_held);
+    free(handle->tx_expect);
+    free(handle->recs);
+    free(handle->trace);
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
@@ -0,0 +1,716 @@
+/* up_bio_rfc2217.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO for a terminal server speaking telnet with the COM-PORT-OPTION
+ *  of RFC 2217, so that baud rate and flow control changes reach the
+ *  remote UART.
+ *
+ *  Data bytes of 0xff (IAC) are doubled on the way out and undoubled
+ *  on the way in.  Both directions find IACs with memchr() and move
+ *  the runs in between with memcpy(), so bulk data costs much the
+ *  same as it does over a plain socket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "upc2/up.h"
+#include "upc2/up_bio_rfc2217.h"
+#include "upc2/up_bio_socket.h"
+#include "upc2/utils.h"
+
+
+/* Longest we will wait for queued output to go */
+#define UP_BIO_RFC2217_FLUSH_MS (5000)
+/* Longest we will wait for the server to confirm a new baud rate */
+#define UP_BIO_RFC2217_ACK_MS   (1000)
+
+/* Telnet (RFC 854) */
+#define TN_SE    (240)
+#define TN_SB    (250)
+#define TN_WILL  (251)
+#define TN_WONT  (252)
+#define TN_DO    (253)
+#define TN_DONT  (254)
+#define TN_IAC   (255)
+
+#define TN_OPT_BINARY   (0)
+#define TN_OPT_SGA      (3)
+#define TN_OPT_COM_PORT (44)
+
+/* COM-PORT-OPTION commands; the server answers with command + 100 */
+#define CPO_SET_BAUDRATE  (1)
+#define CPO_SET_DATASIZE  (2)
+#define CPO_SET_PARITY    (3)
+#define CPO_SET_STOPSIZE  (4)
+#define CPO_SET_CONTROL   (5)
+#define CPO_SERVER_OFFSET (100)
+
+#define CPO_PARITY_NONE        (1)
+#define CPO_STOPSIZE_1         (1)
+#define CPO_CONTROL_NONE       (1)
+#define CPO_CONTROL_XONXOFF    (2)
+#define CPO_CONTROL_HARDWARE   (3)
+#define CPO_CONTROL_BREAK_ON   (5)
+#define CPO_CONTROL_BREAK_OFF  (6)
+#define CPO_CONTROL_DTR_ON     (8)
+#define CPO_CONTROL_DTR_OFF    (9)
+#define CPO_CONTROL_RTS_ON     (11)
+#define CPO_CONTROL_RTS_OFF    (12)
+
+/* Parser states */
+#define STATE_DATA    (0)
+#define STATE_IAC     (1)
+#define STATE_OPTION  (2)
+#define STATE_SB      (3)
+#define STATE_SB_IAC  (4)
+
+#define RFC2217_HANDLE(c, bio)                         \
+    up_bio_rfc2217_t *(c) = (up_bio_rfc2217_t *)((bio)->handle)
+
+
+static int up_bio_rfc2217_tx_service(up_bio_t *bio);
+
+int up_bio_rfc2217_is_spec(const char *spec) {
+    return !strncmp(spec, "rfc2217:", 8);
+}
+
+/* For tx_put(): the urgent lane, as opposed to a UP_TXQ_xxx */
+#define TX_URGENT (-1)
+
+static int tx_put(up_bio_rfc2217_t *handle,
+                  const uint8_t    *bytes,
+                  int               nr,
+                  int               how) {
+    if (how == TX_URGENT)
+        return up_txq_put_urgent(&handle->tx, bytes, nr);
+    return up_txq_put(&handle->tx, bytes, nr, how);
+}
+
+static int tx_room(up_bio_rfc2217_t *handle, int how) {
+    if (how == TX_URGENT)
+        return handle->tx.urgent.size - handle->tx.urgent.count;
+    return up_txq_room(&handle->tx);
+}
+
+/* Queue nr bytes of data, doubling IACs, starting a frame if how is
+ * UP_TXQ_NEW.  Only whole escapes are queued, so we never leave half
+ * of one for the server to misread.  Returns the number of input
+ * bytes taken.
+ */
+static int tx_escape(up_bio_rfc2217_t *handle,
+                     const uint8_t    *bytes,
+                     int               nr,
+                     int               how) {
+    static const uint8_t iac_iac[2] = { TN_IAC, TN_IAC };
+    int done = 0;
+
+    while (done < nr) {
+        const uint8_t *iac = memchr(&bytes[done], TN_IAC, nr - done);
+        int run = (iac == NULL) ? nr - done : iac - &bytes[done];
+
+        if (run > 0) {
+            int queued = tx_put(handle, &bytes[done], run, how);
+
+            done += queued;
+            if (queued > 0 && how == UP_TXQ_NEW)
+                how = UP_TXQ_MORE;
+            if (queued < run)
+                break;
+            continue;
+        }
+        if (tx_room(handle, how) < 2)
+            break;
+        tx_put(handle, iac_iac, 2, how);
+        if (how == UP_TXQ_NEW)
+            how = UP_TXQ_MORE;
+        done++;
+    }
+    return done;
+}
+
+/* Queue a telnet command verbatim, in the lane given by how (as for
+ * tx_put()).  A command is queued whole or not at all: half of one
+ * would throw the server's parser for the rest of the session.
+ * Returns 0, or -1 with errno EAGAIN if there is no room.
+ */
+static int tx_command(up_bio_rfc2217_t *handle, uint8_t command,
+                      uint8_t option, int how) {
+    uint8_t cmd[3];
+
+    cmd[0] = TN_IAC;
+    cmd[1] = command;
+    cmd[2] = option;
+    if (tx_room(handle, how) < 3) {
+        errno = EAGAIN;
+        return -1;
+    }
+    tx_put(handle, cmd, 3, how);
+    return 0;
+}
+
+/* Queue a COM-PORT-OPTION subnegotiation carrying a big-endian value
+ * of size bytes.  The value is data as far as telnet is concerned, so
+ * any IACs in it are doubled.  All or nothing, as tx_command().
+ */
+static int tx_com_port(up_bio_rfc2217_t *handle, uint8_t command,
+                       uint32_t value, int size) {
+    uint8_t sb[4 + 2 * 4 + 2];
+    int nr = 0;
+    int i;
+
+    sb[nr++] = TN_IAC;
+    sb[nr++] = TN_SB;
+    sb[nr++] = TN_OPT_COM_PORT;
+    sb[nr++] = command;
+    for (i = 0; i < size; i++) {
+        sb[nr] = value >> (8 * (size - 1 - i));
+        if (sb[nr++] == TN_IAC)
+            sb[nr++] = TN_IAC;
+    }
+    sb[nr++] = TN_IAC;
+    sb[nr++] = TN_SE;
+    if (up_txq_room(&handle->tx) < nr) {
+        errno = EAGAIN;
+        return -1;
+    }
+    up_txq_put(&handle->tx, sb, nr, UP_TXQ_NEW);
+    return 0;
+}
+
+/* Answer a WILL/WONT/DO/DONT from the server.  We offered everything
+ * we want at connect time, so only refusals of things we didn't offer
+ * need saying; agreeing again would start a negotiation loop.
+ * Refusals go in the urgent lane, which never splits a bulk frame, so
+ * they need not wait behind an upload.
+ */
+static void handle_option(up_bio_rfc2217_t *handle, uint8_t command,
+                          uint8_t option) {
+    switch (command) {
+    case TN_DO:
+        if (option != TN_OPT_BINARY && option != TN_OPT_SGA &&
+            option != TN_OPT_COM_PORT)
+            tx_command(handle, TN_WONT, option, TX_URGENT);
+        break;
+    case TN_WILL:
+        if (option != TN_OPT_BINARY && option != TN_OPT_SGA)
+            tx_command(handle, TN_DONT, option, TX_URGENT);
+        break;
+    case TN_DONT:
+        if (option == TN_OPT_COM_PORT && !handle->com_port_refused) {
+            fprintf(stderr, "! %s: server refuses COM-PORT-OPTION;"
+                    " baud rates cannot be changed\n", handle->spec);
+            handle->com_port_refused = 1;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void handle_subnegotiation(up_bio_rfc2217_t *handle) {
+    const uint8_t *sb = handle->sb;
+
+    if (handle->sb_len < 2 || sb[0] != TN_OPT_COM_PORT)
+        return;
+    if (sb[1] == CPO_SET_BAUDRATE + CPO_SERVER_OFFSET &&
+        handle->sb_len >= 6) {
+        handle->server_baud = ((uint32_t)sb[2] << 24 | sb[3] << 16 |
+                               sb[4] << 8 | sb[5]);
+    }
+    /* Line and modem state notifications are of no interest */
+}
+
+/* Run nr bytes from the server through the telnet parser, putting
+ * data on the receive ring.  The caller guarantees the ring has room
+ * for nr bytes, which is the most the data can be.
+ */
+static void rx_decode(up_bio_rfc2217_t *handle,
+                      const uint8_t    *raw,
+                      int               nr) {
+    int i = 0;
+
+    while (i < nr) {
+        uint8_t c;
+
+        if (handle->state == STATE_DATA) {
+            const uint8_t *iac = memchr(&raw[i], TN_IAC, nr - i);
+            int run = (iac == NULL) ? nr - i : iac - &raw[i];
+
+            up_ring_put(&handle->rx, &raw[i], run);
+            i += run;
+            if (iac != NULL) {
+                handle->state = STATE_IAC;
+                i++;
+            }
+            continue;
+        }
+
+        c = raw[i++];
+        switch (handle->state) {
+        case STATE_IAC:
+            if (c == TN_IAC) {
+                up_ring_put(&handle->rx, &c, 1);
+                handle->state = STATE_DATA;
+            } else if (c >= TN_WILL) {
+                handle->command = c;
+                handle->state = STATE_OPTION;
+            } else if (c == TN_SB) {
+                handle->sb_len = 0;
+                handle->state = STATE_SB;
+            } else {
+                /* NOP, GA, AYT and friends */
+                handle->state = STATE_DATA;
+            }
+            break;
+        case STATE_OPTION:
+            handle_option(handle, handle->command, c);
+            handle->state = STATE_DATA;
+            break;
+        case STATE_SB:
+            if (c == TN_IAC) {
+                handle->state = STATE_SB_IAC;
+            } else if (handle->sb_len < UP_BIO_RFC2217_SB_BYTES) {
+                handle->sb[handle->sb_len++] = c;
+            }
+            break;
+        case STATE_SB_IAC:
+            if (c == TN_IAC) {
+                if (handle->sb_len < UP_BIO_RFC2217_SB_BYTES)
+                    handle->sb[handle->sb_len++] = c;
+                handle->state = STATE_SB;
+            } else {
+                /* IAC SE, or something broken; either way it's over */
+                if (c == TN_SE)
+                    handle_subnegotiation(handle);
+                handle->state = STATE_DATA;
+            }
+            break;
+        }
+    }
+}
+
+/* Read what the server has, as far as the receive ring has room.
+ * Returns the number of bytes read from the socket, which may all
+ * have been telnet commands, or what read() did.
+ */
+static int rx_fill(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    uint8_t raw[4096];
+    int room = handle->rx.size - handle->rx.count;
+    int rv;
+
+    if (room > (int)sizeof(raw))
+        room = sizeof(raw);
+    if (room == 0)
+        return 0;
+    rv = read(handle->fd, raw, room);
+    utils_bio_count_read(&bio->stats, room, rv);
+    if (rv == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (rv > 0)
+        rx_decode(handle, raw, rv);
+    return rv;
+}
+
+/* Top up the receive ring if it is empty, as up_bio_socket.c */
+static int rx_ready(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+
+    if (up_bio_rfc2217_tx_service(bio) < 0)
+        return -1;
+    while (handle->rx.count == 0) {
+        int rv = rx_fill(bio);
+
+        if (rv <= 0)
+            return rv;
+    }
+    /* Negotiation may have left answers to send */
+    if (up_bio_rfc2217_tx_service(bio) < 0)
+        return -1;
+    return handle->rx.count;
+}
+
+static int up_bio_rfc2217_poll_fd(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    return handle->fd;
+}
+
+static int up_bio_rfc2217_consume(up_bio_t *bio, int nr) {
+    RFC2217_HANDLE(handle, bio);
+    return up_ring_consume(&handle->rx, nr);
+}
+
+static int up_bio_rfc2217_peek(up_bio_t *bio, uint8_t *tgt, int nr) {
+    RFC2217_HANDLE(handle, bio);
+    int rv = rx_ready(bio);
+
+    if (rv <= 0)
+        return rv;
+    return up_ring_copy(&handle->rx, tgt, nr);
+}
+
+static int up_bio_rfc2217_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    RFC2217_HANDLE(handle, bio);
+    int rv = rx_ready(bio);
+
+    if (rv <= 0)
+        return rv;
+    return up_ring_run(&handle->rx, bytes);
+}
+
+static int up_bio_rfc2217_read(up_bio_t *bio, uint8_t *tgt, int nr) {
+    int rv = up_bio_rfc2217_peek(bio, tgt, nr);
+
+    if (rv > 0)
+        up_bio_rfc2217_consume(bio, rv);
+    return rv;
+}
+
+static int up_bio_rfc2217_rx_pending(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    return handle->rx.count;
+}
+
+static int up_bio_rfc2217_tx_service(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    struct iovec iov[UP_TXQ_IOV];
+    struct msghdr msg;
+    int rv;
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = up_txq_data_iov(&handle->tx, iov);
+    if (msg.msg_iovlen == 0)
+        return 0;
+    rv = sendmsg(handle->fd, &msg, MSG_NOSIGNAL);
+    utils_bio_count_write(&bio->stats, handle->tx.count, rv);
+    if (rv < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return handle->tx.count;
+        return -1;
+    }
+    up_txq_consume(&handle->tx, rv);
+    return handle->tx.count;
+}
+
+static int up_bio_rfc2217_tx_pending(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    return handle->tx.count;
+}
+
+static int up_bio_rfc2217_tx_high_water(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    return handle->tx_high_water;
+}
+
+/* As up_bio_socket_writev(), escaping on the way into the ring */
+static int up_bio_rfc2217_writev(up_bio_t           *bio,
+                                 const struct iovec *iov,
+                                 int                 iovcnt) {
+    RFC2217_HANDLE(handle, bio);
+    int done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        const uint8_t *bytes = iov[i].iov_base;
+        int left = iov[i].iov_len;
+
+        while (left > 0) {
+            int queued = tx_escape(handle, bytes, left,
+                                   (done > 0) ? UP_TXQ_MORE : UP_TXQ_NEW);
+
+            done += queued;
+            bytes += queued;
+            left -= queued;
+            if (left == 0)
+                break;
+            if (up_bio_rfc2217_tx_service(bio) < 0)
+                return done ? done : -1;
+            /* An escape needs two bytes of room */
+            if (up_txq_room(&handle->tx) < 2)
+                goto out;
+        }
+    }
+out:
+    if (handle->tx.count >= UP_BIO_RFC2217_TX_BATCH &&
+        up_bio_rfc2217_tx_service(bio) < 0 && done == 0)
+        return -1;
+
+    if (done == 0 && iovcnt > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+static int up_bio_rfc2217_write(up_bio_t      *bio,
+                                const uint8_t *bytes,
+                                int            nr) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)bytes;
+    iov.iov_len = nr;
+    return up_bio_rfc2217_writev(bio, &iov, 1);
+}
+
+/* As up_bio_socket_urgent_write(), escaping on the way in */
+static int up_bio_rfc2217_urgent_write(up_bio_t      *bio,
+                                       const uint8_t *bytes,
+                                       int            nr) {
+    RFC2217_HANDLE(handle, bio);
+    int queued = tx_escape(handle, bytes, nr, TX_URGENT);
+
+    if (up_bio_rfc2217_tx_service(bio) < 0 && queued == 0)
+        return -1;
+    if (queued == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return queued;
+}
+
+static int up_bio_rfc2217_safe_write(up_bio_t      *bio,
+                                     const uint8_t *bytes,
+                                     int            nr) {
+    int rv = utils_bio_safe_write(bio, bytes, nr);
+
+    if (rv >= 0 && utils_bio_flush(bio, UP_BIO_RFC2217_FLUSH_MS) < 0)
+        return -1;
+    return rv;
+}
+
+/* Wait for the server to confirm a baud rate, reading ahead any data
+ * that arrives meanwhile.
+ */
+static void wait_for_baud(up_bio_t *bio, int timeout_ms) {
+    RFC2217_HANDLE(handle, bio);
+    uint64_t deadline = utils_monotonic_ns() + timeout_ms * 1000000ULL;
+
+    while (handle->server_baud == 0 && !handle->com_port_refused) {
+        int left_ms =
+            (int)((int64_t)(deadline - utils_monotonic_ns()) / 1000000);
+
+        if (left_ms <= 0 || handle->rx.count == handle->rx.size)
+            break;
+        if (utils_bio_wait(bio, POLLIN, left_ms) < 0)
+            break;
+        if (rx_fill(bio) < 0 && errno != EAGAIN && errno != EINTR)
+            break;
+    }
+}
+
+static int up_bio_rfc2217_set_baud(up_bio_t *bio, int baud,
+                                   int flow_control) {
+    RFC2217_HANDLE(handle, bio);
+    int control;
+
+    if (handle->com_port_refused)
+        return 0;
+
+    /* Anything queued must go at the old rate; we can only hope the
+     * server sends it before acting on the change.
+     */
+    if (utils_bio_flush(bio, UP_BIO_RFC2217_FLUSH_MS) != 0) {
+        fprintf(stderr, "! %s: output did not drain in %d ms\n",
+                handle->spec, UP_BIO_RFC2217_FLUSH_MS);
+        return -1;
+    }
+    printf("[[ Changing baud rate to %d / %s on %s ]]\n",
+           baud, utils_decode_flow_control(flow_control), handle->spec);
+
+    switch (flow_control) {
+    case UP_FLOW_CONTROL_RTSCTS:
+        control = CPO_CONTROL_HARDWARE;
+        break;
+    case UP_FLOW_CONTROL_XONXOFF:
+        /* The server obeys and strips them, as a local port would */
+        control = CPO_CONTROL_XONXOFF;
+        break;
+    default:
+        control = CPO_CONTROL_NONE;
+        break;
+    }
+    /* The queue is empty, so these fit */
+    if (tx_com_port(handle, CPO_SET_CONTROL, control, 1) < 0)
+        return -1;
+    if (baud > 0) {
+        handle->server_baud = 0;
+        if (tx_com_port(handle, CPO_SET_BAUDRATE, baud, 4) < 0)
+            return -1;
+    }
+    if (utils_bio_flush(bio, UP_BIO_RFC2217_FLUSH_MS) != 0)
+        return -1;
+
+    if (baud > 0) {
+        wait_for_baud(bio, UP_BIO_RFC2217_ACK_MS);
+        if (handle->server_baud == 0) {
+            if (!handle->com_port_refused)
+                printf("[[ %s: no confirmation of %d baud ]]\n",
+                       handle->spec, baud);
+        } else if (handle->server_baud != (uint32_t)baud) {
+            printf("[[ %s: asked for %d baud, server set %u ]]\n",
+                   handle->spec, baud, handle->server_baud);
+        }
+    }
+    return 0;
+}
+
+/* Send queued SET-CONTROL requests now, so that their timing is ours */
+static int control_now(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+
+    if (utils_bio_flush(bio, UP_BIO_RFC2217_FLUSH_MS) != 0) {
+        fprintf(stderr, "! %s: output did not drain in %d ms\n",
+                handle->spec, UP_BIO_RFC2217_FLUSH_MS);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+static int up_bio_rfc2217_set_lines(up_bio_t *bio, int set, int clear) {
+    RFC2217_HANDLE(handle, bio);
+
+    if (handle->com_port_refused) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    /* Output queued before goes first, and leaves room for these */
+    if (control_now(bio) < 0)
+        return -1;
+    if (((set & UP_BIO_LINE_DTR) &&
+         tx_com_port(handle, CPO_SET_CONTROL, CPO_CONTROL_DTR_ON, 1) < 0) ||
+        ((clear & UP_BIO_LINE_DTR) &&
+         tx_com_port(handle, CPO_SET_CONTROL, CPO_CONTROL_DTR_OFF, 1) < 0) ||
+        ((set & UP_BIO_LINE_RTS) &&
+         tx_com_port(handle, CPO_SET_CONTROL, CPO_CONTROL_RTS_ON, 1) < 0) ||
+        ((clear & UP_BIO_LINE_RTS) &&
+         tx_com_port(handle, CPO_SET_CONTROL, CPO_CONTROL_RTS_OFF, 1) < 0))
+        return -1;
+    return control_now(bio);
+}
+
+static int up_bio_rfc2217_send_break(up_bio_t *bio, int ms) {
+    RFC2217_HANDLE(handle, bio);
+
+    if (handle->com_port_refused) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    /* The server sends what it has been given before acting on this,
+     * we hope, as for a baud rate change
+     */
+    if (control_now(bio) < 0 ||
+        tx_com_port(handle, CPO_SET_CONTROL, CPO_CONTROL_BREAK_ON, 1) < 0 ||
+        control_now(bio) < 0)
+        return -1;
+    utils_sleep_until(utils_monotonic_ns() + ms * 1000000ULL);
+    if (tx_com_port(handle, CPO_SET_CONTROL, CPO_CONTROL_BREAK_OFF, 1) < 0)
+        return -1;
+    return control_now(bio);
+}
+
+static void up_bio_rfc2217_dispose(up_bio_t *bio) {
+    RFC2217_HANDLE(handle, bio);
+    if (handle->fd >= 0) {
+        utils_bio_flush(bio, UP_BIO_RFC2217_FLUSH_MS);
+        close(handle->fd);
+    }
+    up_ring_free(&handle->rx);
+    up_txq_free(&handle->tx);
+    free(handle);
+    memset(bio, '\0', sizeof(up_bio_t));
+    free(bio);
+}
+
+
+up_bio_t *up_bio_rfc2217_create(const char *spec, int rcvbuf) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_rfc2217_t *handle =
+        (up_bio_rfc2217_t *)malloc(sizeof(up_bio_rfc2217_t));
+    char tcp_spec[300];
+
+    if (a_bio == NULL || handle == NULL)
+        goto fail;
+    memset(a_bio, '\0', sizeof(up_bio_t));
+    memset(handle, '\0', sizeof(up_bio_rfc2217_t));
+    a_bio->handle = handle;
+    a_bio->dispose = up_bio_rfc2217_dispose;
+    a_bio->poll_fd = up_bio_rfc2217_poll_fd;
+    a_bio->read = up_bio_rfc2217_read;
+    a_bio->rx_pending = up_bio_rfc2217_rx_pending;
+    a_bio->peek = up_bio_rfc2217_peek;
+    a_bio->consume = up_bio_rfc2217_consume;
+    a_bio->borrow = up_bio_rfc2217_borrow;
+    a_bio->release = up_bio_rfc2217_consume;
+    a_bio->write = up_bio_rfc2217_write;
+    a_bio->writev = up_bio_rfc2217_writev;
+    a_bio->safe_write = up_bio_rfc2217_safe_write;
+    a_bio->urgent_write = up_bio_rfc2217_urgent_write;
+    a_bio->tx_pending = up_bio_rfc2217_tx_pending;
+    a_bio->tx_high_water = up_bio_rfc2217_tx_high_water;
+    a_bio->tx_service = up_bio_rfc2217_tx_service;
+    a_bio->set_baud = up_bio_rfc2217_set_baud;
+    a_bio->set_lines = up_bio_rfc2217_set_lines;
+    a_bio->send_break = up_bio_rfc2217_send_break;
+    handle->spec = spec;
+    handle->state = STATE_DATA;
+    handle->tx_high_water = UP_BIO_RFC2217_TX_HIGH_WATER;
+    handle->fd = -1;
+    if (up_ring_init(&handle->rx, UP_BIO_RFC2217_RX_BYTES) < 0 ||
+        up_txq_init(&handle->tx, UP_BIO_RFC2217_TX_BYTES) < 0) {
+        fprintf(stderr, "! Out of memory for %s buffers\n", spec);
+        goto fail;
+    }
+
+    if (!up_bio_rfc2217_is_spec(spec) ||
+        snprintf(tcp_spec, sizeof(tcp_spec), "tcp:%s",
+                 spec + 8) >= (int)sizeof(tcp_spec)) {
+        fprintf(stderr, "! Bad RFC 2217 address '%s'\n", spec);
+        goto fail;
+    }
+    handle->fd = up_bio_socket_connect(tcp_spec, rcvbuf);
+    if (handle->fd < 0)
+        goto fail;
+
+    /* Ask for an 8-bit clean line we can drive, then 8N1 on the UART.
+     * Baud rate and flow control come with the first boot stage.
+     */
+    /* The queue is empty, so these all fit */
+    tx_command(handle, TN_WILL, TN_OPT_BINARY, UP_TXQ_NEW);
+    tx_command(handle, TN_DO, TN_OPT_BINARY, UP_TXQ_NEW);
+    tx_command(handle, TN_WILL, TN_OPT_SGA, UP_TXQ_NEW);
+    tx_command(handle, TN_DO, TN_OPT_SGA, UP_TXQ_NEW);
+    tx_command(handle, TN_WILL, TN_OPT_COM_PORT, UP_TXQ_NEW);
+    tx_com_port(handle, CPO_SET_DATASIZE, 8, 1);
+    tx_com_port(handle, CPO_SET_PARITY, CPO_PARITY_NONE, 1);
+    tx_com_port(handle, CPO_SET_STOPSIZE, CPO_STOPSIZE_1, 1);
+    up_bio_rfc2217_tx_service(a_bio);
+    return a_bio;
+
+fail:
+    if (handle != NULL) {
+        if (handle->fd >= 0)
+            close(handle->fd);
+        up_ring_free(&handle->rx);
+        up_txq_free(&handle->tx);
+    }
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
@@ -18,13 +18,25 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <linux/serial.h>
 
 #include "upc2/up.h"
 #include "upc2/up_bio_serial.h"
+#include "upc2/up_bio_serial_speed.h"
 #include "upc2/utils.h"
 
 
+/* Longest we will wait for queued output to drain before giving up */
+#define UP_BIO_SERIAL_FLUSH_MS (5000)
+/* Bytes a UART or USB adapter may hold beyond the kernel's queue */
+#define UP_BIO_SERIAL_FIFO_BYTES (64)
+
 #define SERIAL_HANDLE(c, bio)                          \
     up_bio_serial_t *(c) = (up_bio_serial_t *)((bio)->handle)
 
@@ -38,16 +50,337 @@ static int up_bio_serial_poll_fd(up_bio_t *bio) {
     return handle->serial_fd;
 }
 
+/* Read as much as the device has into the free space of the receive
+ * ring, in one system call.  Returns what read() did.
+ */
+static int rx_fill(up_bio_t *bio) {
+    SERIAL_HANDLE(handle, bio);
+    struct iovec iov[2];
+    int iovcnt = up_ring_space_iov(&handle->rx, iov);
+    int rv;
+
+    if (iovcnt == 0)
+        return 0;
+    rv = readv(handle->serial_fd, iov, iovcnt);
+    utils_bio_count_read(&bio->stats, handle->rx.size - handle->rx.count, rv);
+    if (rv > 0)
+        up_ring_commit(&handle->rx, rv);
+    return rv;
+}
+
+static int up_bio_serial_consume(up_bio_t *bio, int nr) {
+    SERIAL_HANDLE(handle, bio);
+    return up_ring_consume(&handle->rx, nr);
+}
+
+static int up_bio_serial_peek(up_bio_t *bio, uint8_t *tgt, int nr) {
+    SERIAL_HANDLE(handle, bio);
+
+    /* Only go to the device when we have nothing, so that a run of
+     * small reads costs one system call rather than one each.
+     */
+    if (handle->rx.count == 0) {
+        int rv = rx_fill(bio);
+        if (rv <= 0)
+            return rv;
+    }
+    return up_ring_copy(&handle->rx, tgt, nr);
+}
+
+static int up_bio_serial_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    SERIAL_HANDLE(handle, bio);
+
+    if (handle->rx.count == 0) {
+        int rv = rx_fill(bio);
+        if (rv <= 0)
+            return rv;
+    }
+    /* Lend out the contiguous run at the front of the ring */
+    return up_ring_run(&handle->rx, bytes);
+}
+
 static int up_bio_serial_read(up_bio_t *bio, uint8_t *tgt, int nr) {
+    int rv = up_bio_serial_peek(bio, tgt, nr);
+
+    if (rv > 0)
+        up_bio_serial_consume(bio, rv);
+    return rv;
+}
+
+static int up_bio_serial_rx_pending(up_bio_t *bio) {
+    SERIAL_HANDLE(handle, bio);
+    return handle->rx.count;
+}
+
+/* The tx budget in bytes at the current rate, or -1 for no limit */
+static int pace_budget(up_bio_serial_t *handle) {
+    int bytes;
+
+    if (handle->tx_budget_ms <= 0 || handle->baud <= 0)
+        return -1;
+    /* Ten bits a character on the wire */
+    bytes = (int)((int64_t)handle->baud * handle->tx_budget_ms / 10000);
+    return (bytes < UP_BIO_SERIAL_TX_BUDGET_MIN) ?
+        UP_BIO_SERIAL_TX_BUDGET_MIN : bytes;
+}
+
+/* Bytes the kernel may be given now, or -1 for no limit */
+static int pace_room(up_bio_serial_t *handle) {
+    int budget = pace_budget(handle);
+    uint64_t now;
+    int outq;
+
+    if (budget < 0)
+        return -1;
+    now = utils_monotonic_ns();
+    if (now < handle->tx_resume_ns)
+        return 0;
+    if (ioctl(handle->serial_fd, TIOCOUTQ, &outq) < 0)
+        return -1;
+    /* Top the queue up when half of it has gone, rather than feeding
+     * it a few bytes at a time; note when that will be.
+     */
+    if (outq > budget / 2) {
+        handle->tx_resume_ns = now +
+            (uint64_t)(outq - budget / 2) * 10 * 1000000000ULL /
+            handle->baud;
+        return 0;
+    }
+    return budget - outq;
+}
+
+/* Cut iov down to its first nr bytes, returning the new count */
+static int iov_trim(struct iovec *iov, int iovcnt, int nr) {
+    int i;
+
+    for (i = 0; i < iovcnt && nr > 0; i++) {
+        if ((int)iov[i].iov_len > nr)
+            iov[i].iov_len = nr;
+        nr -= iov[i].iov_len;
+    }
+    return i;
+}
+
+static int up_bio_serial_tx_service(up_bio_t *bio) {
+    SERIAL_HANDLE(handle, bio);
+    struct iovec iov[UP_TXQ_IOV];
+    int iovcnt = up_txq_data_iov(&handle->tx, iov);
+    int room;
+    int rv;
+
+    if (iovcnt == 0)
+        return 0;
+    room = pace_room(handle);
+    if (room == 0)
+        return handle->tx.count;
+    if (room > 0)
+        iovcnt = iov_trim(iov, iovcnt, room);
+    rv = writev(handle->serial_fd, iov, iovcnt);
+    utils_bio_count_write(&bio->stats, handle->tx.count, rv);
+    if (rv < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return handle->tx.count;
+        return -1;
+    }
+    up_txq_consume(&handle->tx, rv);
+    return handle->tx.count;
+}
+
+static int up_bio_serial_poll_timeout(up_bio_t *bio) {
+    SERIAL_HANDLE(handle, bio);
+    uint64_t now;
+
+    if (handle->tx.count == 0)
+        return -1;
+    now = utils_monotonic_ns();
+    if (now >= handle->tx_resume_ns)
+        return -1;
+    /* Round up, so as not to wake just too soon */
+    return (int)((handle->tx_resume_ns - now + 999999) / 1000000);
+}
+
+static int up_bio_serial_tx_pending(up_bio_t *bio) {
+    SERIAL_HANDLE(handle, bio);
+    return handle->tx.count;
+}
+
+static int up_bio_serial_tx_high_water(up_bio_t *bio) {
     SERIAL_HANDLE(handle, bio);
-    return read(handle->serial_fd, tgt, nr);
+    return handle->tx_high_water;
+}
+
+static int iov_bytes(const struct iovec *iov, int iovcnt) {
+    int nr = 0;
+
+    while (iovcnt-- > 0)
+        nr += iov[iovcnt].iov_len;
+    return nr;
+}
+
+static int up_bio_serial_writev(up_bio_t           *bio,
+                                const struct iovec *iov,
+                                int                 iovcnt) {
+    SERIAL_HANDLE(handle, bio);
+    int done = 0;
+    int direct;
+    int room;
+    int i;
+
+    /* Keep ordering: nothing goes straight to the device while
+     * earlier bytes are still queued.
+     */
+    if (handle->tx.count > 0 && up_bio_serial_tx_service(bio) < 0)
+        return -1;
+
+    /* ... nor more than the kernel should hold */
+    direct = (handle->tx.count == 0);
+    if (direct) {
+        room = pace_room(handle);
+        direct = (room < 0 || iov_bytes(iov, iovcnt) <= room);
+    }
+
+    i = 0;
+    if (direct) {
+        int rv = writev(handle->serial_fd, iov, iovcnt);
+
+        utils_bio_count_write(&bio->stats, iov_bytes(iov, iovcnt), rv);
+        if (rv < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                return -1;
+            rv = 0;
+        }
+        done = rv;
+        /* Skip the pieces the device took whole */
+        while (i < iovcnt && rv >= (int)iov[i].iov_len) {
+            rv -= iov[i].iov_len;
+            i++;
+        }
+        if (i < iovcnt) {
+            /* Nothing may cut into the rest of a write the device has
+             * started on
+             */
+            int queued = up_txq_put(&handle->tx,
+                                    (const uint8_t *)iov[i].iov_base + rv,
+                                    iov[i].iov_len - rv,
+                                    (done > 0) ? UP_TXQ_STARTED :
+                                    UP_TXQ_NEW);
+            done += queued;
+            if (queued < (int)iov[i].iov_len - rv)
+                return done;
+            i++;
+        }
+    }
+
+    for (; i < iovcnt; i++) {
+        int queued = up_txq_put(&handle->tx,
+                                iov[i].iov_base, iov[i].iov_len,
+                                (done > 0) ? UP_TXQ_MORE : UP_TXQ_NEW);
+
+        done += queued;
+        if (queued < (int)iov[i].iov_len)
+            break;
+    }
+    if (!direct && up_bio_serial_tx_service(bio) < 0 && done == 0)
+        return -1;
+
+    if (done == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
 }
 
 static int up_bio_serial_write(up_bio_t      *bio,
                                const uint8_t *bytes,
                                int            nr) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)bytes;
+    iov.iov_len = nr;
+    return up_bio_serial_writev(bio, &iov, 1);
+}
+
+static int up_bio_serial_urgent_write(up_bio_t      *bio,
+                                      const uint8_t *bytes,
+                                      int            nr) {
     SERIAL_HANDLE(handle, bio);
-    return write(handle->serial_fd, bytes, nr);
+    int queued;
+
+    /* With nothing queued there is nothing to jump */
+    if (handle->tx.count == 0)
+        return up_bio_serial_write(bio, bytes, nr);
+    queued = up_txq_put_urgent(&handle->tx, bytes, nr);
+    if (up_bio_serial_tx_service(bio) < 0 && queued == 0)
+        return -1;
+    if (queued == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return queued;
+}
+
+/* Sleep for roughly the time it takes to send nr bytes at the
+ * current rate, within [1ms, limit_ms]
+ */
+static void sleep_for_bytes(up_bio_serial_t *handle, int nr, int limit_ms) {
+    int baud = handle->baud ? handle->baud : 9600;
+    /* Ten bits a character on the wire */
+    long us = (long)nr * 10 * 1000000L / baud;
+
+    if (us < 1000)
+        us = 1000;
+    if (us > limit_ms * 1000L)
+        us = limit_ms * 1000L;
+    usleep(us);
+}
+
+/* Wait until everything written has left the transmitter, or until
+ * timeout_ms has passed.  Returns 0 when drained, -1 on timeout.
+ */
+static int drain(up_bio_t *bio, int timeout_ms) {
+    SERIAL_HANDLE(handle, bio);
+    uint64_t deadline = utils_monotonic_ns() + timeout_ms * 1000000ULL;
+    int left_ms;
+    int outq;
+    int lsr;
+    /* Whether there was anything to drain */
+    int sent = (handle->tx.count > 0);
+
+    /* Our own ring first ... */
+    if (utils_bio_flush(bio, timeout_ms) != 0)
+        return -1;
+
+    /* ... then the kernel's output queue, sleeping about as long as
+     * what is left should take to send ...
+     */
+    while (ioctl(handle->serial_fd, TIOCOUTQ, &outq) == 0 && outq > 0) {
+        left_ms = (int)((int64_t)(deadline - utils_monotonic_ns()) / 1000000);
+        if (left_ms <= 0)
+            return -1;
+        sleep_for_bytes(handle, outq, left_ms);
+        sent = 1;
+    }
+
+    /* ... and finally the shift register, where the UART will tell
+     * us.  USB adapters and ptys generally won't; for those, allow
+     * for a FIFO's worth still on its way, which is as near as we can
+     * get without a tcdrain() that might never return.
+     */
+    if (ioctl(handle->serial_fd, TIOCSERGETLSR, &lsr) < 0) {
+        left_ms = (int)((int64_t)(deadline - utils_monotonic_ns()) / 1000000);
+        if (sent && left_ms > 0)
+            sleep_for_bytes(handle, UP_BIO_SERIAL_FIFO_BYTES, left_ms);
+        return 0;
+    }
+    while (!(lsr & TIOCSER_TEMT)) {
+        left_ms = (int)((int64_t)(deadline - utils_monotonic_ns()) / 1000000);
+        if (left_ms <= 0)
+            return -1;
+        sleep_for_bytes(handle, 1, left_ms);
+        if (ioctl(handle->serial_fd, TIOCSERGETLSR, &lsr) < 0)
+            break;
+    }
+    return 0;
 }
 
 static int up_bio_serial_set_baud(up_bio_t *bio, int baud, int flow_control) {
@@ -56,20 +389,41 @@ static int up_bio_serial_set_baud(up_bio_t *bio, int baud, int flow_control) {
     if (baud || handle->last_flow_control != flow_control)
     {
         struct termios tios;
+        uint64_t start = utils_monotonic_ns();
+        int drain_us;
 
-        printf("[[ Changing baud rate to %d / %s ]]\n", baud,
-               utils_decode_flow_control(flow_control) );
-        sleep(1); /* Allow drainage */
+        /* Anything still queued must go at the old rate */
+        if (drain(bio, UP_BIO_SERIAL_FLUSH_MS) < 0) {
+            fprintf(stderr, "! %s: output did not drain in %d ms;"
+                    " discarding it\n",
+                    handle->serial_port, UP_BIO_SERIAL_FLUSH_MS);
+            up_txq_discard(&handle->tx);
+            tcflush(handle->serial_fd, TCOFLUSH);
+        }
+        drain_us = (utils_monotonic_ns() - start) / 1000;
+        printf("[[ Changing baud rate to %d / %s (drained in %d.%03d ms) ]]\n",
+               baud, utils_decode_flow_control(flow_control),
+               drain_us / 1000, drain_us % 1000);
 
         tcgetattr(handle->serial_fd, &tios);
         switch (flow_control) { 
         case UP_FLOW_CONTROL_NONE:
             tios.c_cflag &= ~(CRTSCTS);
-            tios.c_iflag &= ~(IXON);
+            tios.c_iflag &= ~(IXON | IXOFF | IXANY);
             break;
         case UP_FLOW_CONTROL_RTSCTS:
             tios.c_cflag |= (CRTSCTS);
-            tios.c_iflag &= ~(IXON);
+            tios.c_iflag &= ~(IXON | IXOFF | IXANY);
+            break;
+        case UP_FLOW_CONTROL_XONXOFF:
+            /* The line discipline obeys and strips XON/XOFF from the
+             * target, and sends them when its own buffer fills
+             */
+            tios.c_cflag &= ~(CRTSCTS);
+            tios.c_iflag &= ~(IXANY);
+            tios.c_iflag |= (IXON | IXOFF);
+            tios.c_cc[VSTART] = 0x11;
+            tios.c_cc[VSTOP] = 0x13;
             break;
         default:
             /* Do nothing */
@@ -77,12 +431,116 @@ static int up_bio_serial_set_baud(up_bio_t *bio, int baud, int flow_control) {
         }
 
         handle->last_flow_control = flow_control;
-        cfsetspeed(&tios, baud);
-        tcsetattr(handle->serial_fd, TCSADRAIN, &tios);
+        tcsetattr(handle->serial_fd, TCSANOW, &tios);
+
+        if (baud > 0) {
+            int actual = up_bio_serial_set_speed(handle->serial_fd, baud);
+
+            if (actual < 0) {
+                /* No termios2; the C library may still know the rate */
+                if (cfsetspeed(&tios, baud) < 0 ||
+                    tcsetattr(handle->serial_fd, TCSANOW, &tios) < 0) {
+                    fprintf(stderr, "! Cannot set %d baud on %s: %s [%d]\n",
+                            baud, handle->serial_port,
+                            strerror(errno), errno);
+                    return -1;
+                }
+                actual = baud;
+            } else if (actual != baud) {
+                printf("[[ %s: asked for %d baud, driver set %d ]]\n",
+                       handle->serial_port, baud, actual);
+            }
+            handle->baud = actual;
+        }
     }
     return 0;
 }
 
+static int up_bio_serial_set_lines(up_bio_t *bio, int set, int clear) {
+    SERIAL_HANDLE(handle, bio);
+    int bits;
+
+    if (ioctl(handle->serial_fd, TIOCMGET, &bits) < 0)
+        return -1;
+    if (set & UP_BIO_LINE_DTR)
+        bits |= TIOCM_DTR;
+    if (clear & UP_BIO_LINE_DTR)
+        bits &= ~TIOCM_DTR;
+    if (set & UP_BIO_LINE_RTS)
+        bits |= TIOCM_RTS;
+    if (clear & UP_BIO_LINE_RTS)
+        bits &= ~TIOCM_RTS;
+    /* Both lines in one call, so they change together */
+    return ioctl(handle->serial_fd, TIOCMSET, &bits);
+}
+
+static int up_bio_serial_send_break(up_bio_t *bio, int ms) {
+    SERIAL_HANDLE(handle, bio);
+    uint64_t until;
+
+    /* tcsendbreak() only promises "between 0.25 and 0.5 seconds", so
+     * time it ourselves
+     */
+    if (drain(bio, UP_BIO_SERIAL_FLUSH_MS) < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (ioctl(handle->serial_fd, TIOCSBRK) < 0)
+        return -1;
+    until = utils_monotonic_ns() + ms * 1000000ULL;
+    utils_sleep_until(until);
+    return ioctl(handle->serial_fd, TIOCCBRK);
+}
+
+/* The driver's counters since we last reset, where it keeps them */
+static void up_bio_serial_stats_sync(up_bio_t *bio, int reset) {
+    SERIAL_HANDLE(handle, bio);
+    struct serial_icounter_struct now;
+    struct serial_icounter_struct *base = &handle->icount_base;
+    struct serial_icounter_struct *carried = &handle->icount_carried;
+
+    if (ioctl(handle->serial_fd, TIOCGICOUNT, &now) < 0)
+        return;
+    if (reset) {
+        *base = now;
+        memset(carried, '\0', sizeof(*carried));
+    }
+    bio->stats.uart = 1;
+    bio->stats.uart_rx = carried->rx + now.rx - base->rx;
+    bio->stats.uart_tx = carried->tx + now.tx - base->tx;
+    bio->stats.overrun = carried->overrun + now.overrun - base->overrun;
+    bio->stats.frame = carried->frame + now.frame - base->frame;
+    bio->stats.parity = carried->parity + now.parity - base->parity;
+    bio->stats.brk = carried->brk + now.brk - base->brk;
+    bio->stats.buf_overrun =
+        carried->buf_overrun + now.buf_overrun - base->buf_overrun;
+}
+
+/* The device is going: keep what it counted, as far as we last saw */
+static void icount_carry(up_bio_t *bio) {
+    SERIAL_HANDLE(handle, bio);
+    struct serial_icounter_struct *carried = &handle->icount_carried;
+
+    up_bio_serial_stats_sync(bio, 0);
+    if (!bio->stats.uart)
+        return;
+    carried->rx = bio->stats.uart_rx;
+    carried->tx = bio->stats.uart_tx;
+    carried->overrun = bio->stats.overrun;
+    carried->frame = bio->stats.frame;
+    carried->parity = bio->stats.parity;
+    carried->brk = bio->stats.brk;
+    carried->buf_overrun = bio->stats.buf_overrun;
+}
+
+/* The device is back, perhaps as a new adapter counting from zero:
+ * count from wherever it is now
+ */
+static void icount_rebase(up_bio_serial_t *handle) {
+    if (ioctl(handle->serial_fd, TIOCGICOUNT, &handle->icount_base) < 0)
+        memset(&handle->icount_base, '\0', sizeof(handle->icount_base));
+}
+
 static int up_bio_serial_safe_write(up_bio_t      *bio,
                                     const uint8_t *bytes,
                                     int            nr) {
@@ -90,12 +548,234 @@ static int up_bio_serial_safe_write(up_bio_t      *bio,
     return utils_bio_safe_write(bio, bytes, nr);
 }
 
+/* Read an integer from a sysfs file, -1 on failure */
+static int read_sysfs_int(const char *path) {
+    char buf[16];
+    int fd = open(path, O_RDONLY);
+    int rv;
+
+    if (fd < 0)
+        return -1;
+    rv = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (rv <= 0)
+        return -1;
+    buf[rv] = '\0';
+    return atoi(buf);
+}
+
+static int write_sysfs_int(const char *path, int value) {
+    char buf[16];
+    int fd = open(path, O_WRONLY);
+    int len = snprintf(buf, sizeof(buf), "%d\n", value);
+    int rv;
+
+    if (fd < 0)
+        return -1;
+    rv = write(fd, buf, len);
+    close(fd);
+    return (rv == len) ? 0 : -1;
+}
+
+/* Ask the driver and (for FTDI-style USB adapters) the adapter itself
+ * to hand us each byte as soon as it arrives.  Stop-and-wait protocols
+ * spend most of their time waiting for one-byte ACKs, so this is
+ * worth far more to them than the extra wake-ups cost.
+ */
+static void setup_low_latency(up_bio_serial_t *handle) {
+    struct serial_struct ss;
+    char real[PATH_MAX];
+    const char *name;
+
+    if (ioctl(handle->serial_fd, TIOCGSERIAL, &ss) == 0) {
+        handle->old_serial_flags = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(handle->serial_fd, TIOCSSERIAL, &ss) < 0)
+            handle->old_serial_flags = -1;
+    }
+
+    /* Follow /dev/serial/by-id links and the like to the real node */
+    if (realpath(handle->serial_port, real) == NULL)
+        return;
+    name = strrchr(real, '/');
+    name = (name == NULL) ? real : name + 1;
+    if (strncmp(name, "ttyUSB", 6))
+        return;
+    if (snprintf(handle->latency_timer_path,
+                 sizeof(handle->latency_timer_path),
+                 "/sys/bus/usb-serial/devices/%s/latency_timer",
+                 name) >= (int)sizeof(handle->latency_timer_path))
+        return;
+    handle->old_latency_timer = read_sysfs_int(handle->latency_timer_path);
+    if (handle->old_latency_timer < 0)
+        return;
+    if (write_sysfs_int(handle->latency_timer_path, 1) < 0) {
+        fprintf(stderr, "! Cannot set %s: %s [%d]\n",
+                handle->latency_timer_path, strerror(errno), errno);
+        handle->old_latency_timer = -1;
+    }
+}
+
+static void restore_low_latency(up_bio_serial_t *handle) {
+    struct serial_struct ss;
+
+    if (handle->old_serial_flags >= 0 &&
+        ioctl(handle->serial_fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags = handle->old_serial_flags;
+        ioctl(handle->serial_fd, TIOCSSERIAL, &ss);
+        handle->old_serial_flags = -1;
+    }
+    if (handle->old_latency_timer >= 0) {
+        write_sysfs_int(handle->latency_timer_path,
+                        handle->old_latency_timer);
+        handle->old_latency_timer = -1;
+    }
+}
+
+/* Open the device and make the line raw; the boot stage's baud rate
+ * and flow control come later.  Returns 0, or -1 with errno set.
+ */
+static int open_port(up_bio_serial_t *handle) {
+    struct termios s;
+
+    handle->serial_fd = open(handle->serial_port, O_RDWR | O_NONBLOCK);
+    if (handle->serial_fd < 0)
+        return -1;
+    tcgetattr(handle->serial_fd, &handle->serial_tc);
+    s = handle->serial_tc;
+    cfmakeraw(&s);
+    s.c_cflag |= CLOCAL | CREAD;
+    s.c_cflag &= ~(CRTSCTS);
+    s.c_iflag &= ~(IXON);
+    /* poll() wakes as soon as a single byte arrives */
+    s.c_cc[VMIN] = 1;
+    s.c_cc[VTIME] = 0;
+    handle->last_flow_control = UP_FLOW_CONTROL_NONE;
+    tcsetattr(handle->serial_fd, TCSANOW, &s);
+    if (handle->flags & UP_BIO_SERIAL_LOW_LATENCY)
+        setup_low_latency(handle);
+    return 0;
+}
+
+/* Non-zero if open() failing with err may just mean the device is
+ * still on its way back
+ */
+static int still_coming(int err) {
+    return (err == ENOENT || err == ENODEV || err == ENXIO ||
+            err == EIO || err == EACCES || err == EPERM || err == EBUSY);
+}
+
+/* Wait up to timeout_ms for a change in the directory the device node
+ * lives in - or the nearest one above it that exists, since
+ * /dev/serial/by-id goes when the last adapter does.
+ */
+static int wait_for_node(up_bio_serial_t *handle, int timeout_ms) {
+    char dir[PATH_MAX];
+    char events[4096];
+    struct pollfd pfd;
+    char *slash;
+    int wd;
+
+    if (handle->inotify_fd < 0) {
+        handle->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (handle->inotify_fd < 0)
+            return -1;
+        handle->inotify_wd = -1;
+    }
+
+    if (snprintf(dir, sizeof(dir), "%s",
+                 handle->serial_port) >= (int)sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    do {
+        slash = strrchr(dir, '/');
+        if (slash == NULL)
+            strcpy(dir, ".");
+        else if (slash == dir)
+            dir[1] = '\0';
+        else
+            *slash = '\0';
+        wd = inotify_add_watch(handle->inotify_fd, dir,
+                               IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+    } while (wd < 0 && errno == ENOENT && strcmp(dir, "/") &&
+             strcmp(dir, "."));
+    if (wd < 0)
+        return -1;
+    if (handle->inotify_wd >= 0 && handle->inotify_wd != wd)
+        inotify_rm_watch(handle->inotify_fd, handle->inotify_wd);
+    handle->inotify_wd = wd;
+
+    if (timeout_ms > UP_BIO_SERIAL_REOPEN_MS)
+        timeout_ms = UP_BIO_SERIAL_REOPEN_MS;
+    pfd.fd = handle->inotify_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout_ms);
+    /* Which events don't matter; we just try again */
+    while (read(handle->inotify_fd, events, sizeof(events)) > 0)
+        ;
+    return 0;
+}
+
+static void stop_watching(up_bio_serial_t *handle) {
+    if (handle->inotify_fd >= 0)
+        close(handle->inotify_fd);
+    handle->inotify_fd = -1;
+    handle->inotify_wd = -1;
+}
+
+static int up_bio_serial_reconnect(up_bio_t *bio, int timeout_ms) {
+    SERIAL_HANDLE(handle, bio);
+    uint64_t deadline = utils_monotonic_ns() + timeout_ms * 1000000ULL;
+    int baud = handle->baud;
+    int fc = handle->last_flow_control;
+
+    if (handle->serial_fd >= 0) {
+        /* Nothing queued for the old device will reach it now, and
+         * what we changed went with it
+         */
+        icount_carry(bio);
+        close(handle->serial_fd);
+        handle->serial_fd = -1;
+        handle->old_serial_flags = -1;
+        handle->old_latency_timer = -1;
+        up_txq_discard(&handle->tx);
+        handle->tx_resume_ns = 0;
+    }
+
+    while (open_port(handle) < 0) {
+        int left_ms =
+            (int)((int64_t)(deadline - utils_monotonic_ns()) / 1000000);
+
+        if (!still_coming(errno))
+            return -1;
+        if (left_ms <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (wait_for_node(handle, left_ms) < 0)
+            return -1;
+    }
+    stop_watching(handle);
+    icount_rebase(handle);
+
+    /* Back to what the boot stage asked for */
+    handle->last_flow_control = -1;
+    return up_bio_serial_set_baud(bio, baud, fc);
+}
+
 static void up_bio_serial_dispose(up_bio_t *bio) {
     SERIAL_HANDLE(handle, bio);
     if (handle->serial_fd >= 0) {
+        utils_bio_flush(bio, UP_BIO_SERIAL_FLUSH_MS);
+        restore_low_latency(handle);
         tcsetattr(handle->serial_fd, TCSAFLUSH, &handle->serial_tc);
         close(handle->serial_fd);
     }
+    stop_watching(handle);
+    up_ring_free(&handle->rx);
+    up_txq_free(&handle->tx);
     free(handle);
     // Make sure further calls are easy for valgrind
     // to catch.
@@ -104,7 +784,7 @@ static void up_bio_serial_dispose(up_bio_t *bio) {
 }
 
 
-up_bio_t *up_bio_serial_create(const char *port) {
+up_bio_t *up_bio_serial_create(const char *port, int flags) {
     up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
     up_bio_serial_t *handle =
         (up_bio_serial_t *)malloc(sizeof(up_bio_serial_t));
@@ -115,27 +795,56 @@ up_bio_t *up_bio_serial_create(const char *port) {
     a_bio->dispose = up_bio_serial_dispose;
     a_bio->poll_fd = up_bio_serial_poll_fd;
     a_bio->read = up_bio_serial_read;
+    a_bio->rx_pending = up_bio_serial_rx_pending;
+    a_bio->peek = up_bio_serial_peek;
+    a_bio->consume = up_bio_serial_consume;
+    a_bio->borrow = up_bio_serial_borrow;
+    a_bio->release = up_bio_serial_consume;
     a_bio->write = up_bio_serial_write;
+    a_bio->writev = up_bio_serial_writev;
     a_bio->safe_write = up_bio_serial_safe_write;
+    a_bio->urgent_write = up_bio_serial_urgent_write;
+    a_bio->tx_pending = up_bio_serial_tx_pending;
+    a_bio->tx_high_water = up_bio_serial_tx_high_water;
+    a_bio->tx_service = up_bio_serial_tx_service;
+    a_bio->poll_timeout = up_bio_serial_poll_timeout;
+    a_bio->stats_sync = up_bio_serial_stats_sync;
     a_bio->set_baud = up_bio_serial_set_baud;
-    handle->serial_fd = open(port, O_RDWR | O_NONBLOCK);
-    if (handle->serial_fd < 0) {
+    a_bio->set_lines = up_bio_serial_set_lines;
+    a_bio->send_break = up_bio_serial_send_break;
+    a_bio->reconnect = up_bio_serial_reconnect;
+    handle->tx_high_water = UP_BIO_SERIAL_TX_HIGH_WATER;
+    handle->tx_budget_ms = UP_BIO_SERIAL_TX_BUDGET_MS;
+    handle->serial_port = port;
+    handle->flags = flags;
+    handle->old_serial_flags = -1;
+    handle->old_latency_timer = -1;
+    handle->serial_fd = -1;
+    handle->inotify_fd = handle->inotify_wd = -1;
+    if (up_ring_init(&handle->rx, UP_BIO_SERIAL_RX_BYTES) < 0 ||
+        up_txq_init(&handle->tx, UP_BIO_SERIAL_TX_BYTES) < 0) {
+        fprintf(stderr, "! Out of memory for %s buffers\n", port);
+        goto fail;
+    }
+    if (open_port(handle) < 0) {
         fprintf(stderr, "! Cannot open %s: %s [%d] \n",
                 port, strerror(errno), errno);
         goto fail;
     }
-    struct termios s;
-    tcgetattr(handle->serial_fd, &handle->serial_tc);
-    s = handle->serial_tc;
-    cfmakeraw(&s);
-    s.c_cflag |= CLOCAL | CREAD;
-    s.c_cflag &= ~(CRTSCTS);
-    s.c_iflag &= ~(IXON);
-    handle->last_flow_control = UP_FLOW_CONTROL_NONE;
-    tcsetattr(handle->serial_fd, TCSANOW, &s);
+    /* The driver's counters run from boot; ours run from now */
+    up_bio_serial_stats_sync(a_bio, 1);
     return a_bio;
 fail:
+    up_ring_free(&handle->rx);
+    up_txq_free(&handle->tx);
     free(handle);
     free(a_bio);
     return NULL;
 }
+
+void up_bio_serial_set_tx_budget(up_bio_t *bio, int ms) {
+    SERIAL_HANDLE(handle, bio);
+
+    handle->tx_budget_ms = (ms > 0) ? ms : 0;
+    handle->tx_resume_ns = 0;
+}
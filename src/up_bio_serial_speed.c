@@ -0,0 +1,43 @@
+/* up_bio_serial_speed.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  Arbitrary baud rates for the serial BIO.
+ *
+ *  cfsetspeed() only understands the fixed Bxxx rates, so anything
+ *  else (or a rate the C library's table doesn't know) goes through
+ *  termios2 with BOTHER, and we read back what the driver really
+ *  chose so the caller can report it.
+ */
+
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "upc2/up_bio_serial_speed.h"
+
+int up_bio_serial_set_speed(int fd, int baud) {
+#if defined(TCGETS2) && defined(BOTHER)
+    struct termios2 t2;
+
+    if (ioctl(fd, TCGETS2, &t2) < 0)
+        return -1;
+    t2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    t2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    t2.c_ispeed = baud;
+    t2.c_ospeed = baud;
+    if (ioctl(fd, TCSETS2, &t2) < 0)
+        return -1;
+
+    /* Drivers round to what their divisors can do, and say so */
+    if (ioctl(fd, TCGETS2, &t2) < 0)
+        return -1;
+    return t2.c_ospeed;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* End file */
@@ -0,0 +1,435 @@
+/* up_bio_socket.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO for a serial port server reached over a TCP or Unix-domain
+ *  socket, so that upc2 can talk to ser2net and friends directly
+ *  rather than through socat and a pty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "upc2/up.h"
+#include "upc2/up_bio_socket.h"
+#include "upc2/utils.h"
+
+
+/* Longest we will wait for queued output to go on dispose */
+#define UP_BIO_SOCKET_FLUSH_MS (5000)
+
+#define SOCKET_HANDLE(c, bio)                          \
+    up_bio_socket_t *(c) = (up_bio_socket_t *)((bio)->handle)
+
+
+static int up_bio_socket_tx_service(up_bio_t *bio);
+
+int up_bio_socket_is_spec(const char *spec) {
+    return (!strncmp(spec, "tcp:", 4) || !strncmp(spec, "unix:", 5));
+}
+
+static int set_rcvbuf(int fd, int rcvbuf) {
+    if (rcvbuf > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                   &rcvbuf, sizeof(rcvbuf)) < 0) {
+        fprintf(stderr, "! Cannot set a %d byte receive buffer: %s [%d]\n",
+                rcvbuf, strerror(errno), errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int connect_tcp(const char *spec, int rcvbuf) {
+    const char *where = spec + 4;
+    char host[256];
+    const char *port;
+    const char *host_end;
+    struct addrinfo hints;
+    struct addrinfo *res, *ai;
+    int fd = -1;
+    int one = 1;
+    int rv;
+
+    /* [v6::addr]:port or host:port */
+    if (where[0] == '[') {
+        host_end = strchr(where, ']');
+        if (host_end == NULL || host_end[1] != ':')
+            goto bad_spec;
+        where++;
+        port = host_end + 2;
+    } else {
+        host_end = strrchr(where, ':');
+        if (host_end == NULL)
+            goto bad_spec;
+        port = host_end + 1;
+    }
+    if (host_end - where >= (int)sizeof(host) || *port == '\0')
+        goto bad_spec;
+    memcpy(host, where, host_end - where);
+    host[host_end - where] = '\0';
+
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rv = getaddrinfo(host, port, &hints, &res);
+    if (rv != 0) {
+        fprintf(stderr, "! Cannot resolve %s: %s\n", spec, gai_strerror(rv));
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        /* The window is negotiated at connect() time */
+        if (set_rcvbuf(fd, rcvbuf) == 0 &&
+            connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "! Cannot connect to %s: %s [%d]\n",
+                spec, strerror(errno), errno);
+        return -1;
+    }
+
+    /* We do our own batching; see UP_BIO_SOCKET_TX_BATCH */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+
+bad_spec:
+    fprintf(stderr, "! Bad socket address '%s': expected tcp:host:port\n",
+            spec);
+    return -1;
+}
+
+static int connect_unix(const char *spec, int rcvbuf) {
+    const char *path = spec + 5;
+    struct sockaddr_un sun;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "! Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&sun, '\0', sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "! Cannot create socket: %s [%d]\n",
+                strerror(errno), errno);
+        return -1;
+    }
+    if (set_rcvbuf(fd, rcvbuf) < 0)
+        goto fail;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        fprintf(stderr, "! Cannot connect to %s: %s [%d]\n",
+                path, strerror(errno), errno);
+        goto fail;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+int up_bio_socket_connect(const char *spec, int rcvbuf) {
+    int fd;
+
+    if (!strncmp(spec, "tcp:", 4)) {
+        fd = connect_tcp(spec, rcvbuf);
+    } else if (!strncmp(spec, "unix:", 5)) {
+        fd = connect_unix(spec, rcvbuf);
+    } else {
+        fprintf(stderr, "! '%s' is not a socket address\n", spec);
+        return -1;
+    }
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+
+static int up_bio_socket_poll_fd(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    return handle->fd;
+}
+
+/* Read as much as the socket has into the free space of the receive
+ * ring.  The server closing the connection is an error to us: there
+ * is no more serial port.
+ */
+static int rx_fill(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    struct iovec iov[2];
+    int iovcnt = up_ring_space_iov(&handle->rx, iov);
+    int rv;
+
+    if (iovcnt == 0)
+        return 0;
+    rv = readv(handle->fd, iov, iovcnt);
+    utils_bio_count_read(&bio->stats, handle->rx.size - handle->rx.count, rv);
+    if (rv == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (rv > 0)
+        up_ring_commit(&handle->rx, rv);
+    return rv;
+}
+
+static int up_bio_socket_consume(up_bio_t *bio, int nr) {
+    SOCKET_HANDLE(handle, bio);
+    return up_ring_consume(&handle->rx, nr);
+}
+
+/* Top up the receive ring if it is empty.  Whoever is reading is
+ * probably waiting for an answer, so send what we have first.
+ */
+static int rx_ready(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+
+    if (handle->rx.count > 0)
+        return handle->rx.count;
+    if (up_bio_socket_tx_service(bio) < 0)
+        return -1;
+    return rx_fill(bio);
+}
+
+static int up_bio_socket_peek(up_bio_t *bio, uint8_t *tgt, int nr) {
+    SOCKET_HANDLE(handle, bio);
+    int rv = rx_ready(bio);
+
+    if (rv <= 0)
+        return rv;
+    return up_ring_copy(&handle->rx, tgt, nr);
+}
+
+static int up_bio_socket_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    SOCKET_HANDLE(handle, bio);
+    int rv = rx_ready(bio);
+
+    if (rv <= 0)
+        return rv;
+    return up_ring_run(&handle->rx, bytes);
+}
+
+static int up_bio_socket_read(up_bio_t *bio, uint8_t *tgt, int nr) {
+    int rv = up_bio_socket_peek(bio, tgt, nr);
+
+    if (rv > 0)
+        up_bio_socket_consume(bio, rv);
+    return rv;
+}
+
+static int up_bio_socket_rx_pending(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    return handle->rx.count;
+}
+
+static int up_bio_socket_tx_service(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    struct iovec iov[UP_TXQ_IOV];
+    struct msghdr msg;
+    int rv;
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = up_txq_data_iov(&handle->tx, iov);
+    if (msg.msg_iovlen == 0)
+        return 0;
+    /* A dead server should be an error, not a SIGPIPE */
+    rv = sendmsg(handle->fd, &msg, MSG_NOSIGNAL);
+    utils_bio_count_write(&bio->stats, handle->tx.count, rv);
+    if (rv < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return handle->tx.count;
+        return -1;
+    }
+    up_txq_consume(&handle->tx, rv);
+    return handle->tx.count;
+}
+
+static int up_bio_socket_tx_pending(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    return handle->tx.count;
+}
+
+static int up_bio_socket_tx_high_water(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    return handle->tx_high_water;
+}
+
+/* Everything goes through the transmit ring.  With TCP_NODELAY each
+ * send() is a segment, so small writes wait there for company until
+ * there is a segment's worth or the caller polls or reads; callers
+ * always service output before they sleep, so nothing waits long.
+ */
+static int up_bio_socket_writev(up_bio_t           *bio,
+                                const struct iovec *iov,
+                                int                 iovcnt) {
+    SOCKET_HANDLE(handle, bio);
+    int done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        const uint8_t *bytes = iov[i].iov_base;
+        int left = iov[i].iov_len;
+
+        while (left > 0) {
+            int queued = up_txq_put(&handle->tx, bytes, left,
+                                    (done > 0) ? UP_TXQ_MORE : UP_TXQ_NEW);
+
+            done += queued;
+            bytes += queued;
+            left -= queued;
+            if (left == 0)
+                break;
+            /* Full: make room, or stop if the socket won't take any */
+            if (up_bio_socket_tx_service(bio) < 0)
+                return done ? done : -1;
+            if (up_txq_room(&handle->tx) == 0)
+                goto out;
+        }
+    }
+out:
+    if (handle->tx.count >= UP_BIO_SOCKET_TX_BATCH &&
+        up_bio_socket_tx_service(bio) < 0 && done == 0)
+        return -1;
+
+    if (done == 0 && iovcnt > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+static int up_bio_socket_write(up_bio_t      *bio,
+                               const uint8_t *bytes,
+                               int            nr) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)bytes;
+    iov.iov_len = nr;
+    return up_bio_socket_writev(bio, &iov, 1);
+}
+
+/* Urgent bytes don't wait for company */
+static int up_bio_socket_urgent_write(up_bio_t      *bio,
+                                      const uint8_t *bytes,
+                                      int            nr) {
+    SOCKET_HANDLE(handle, bio);
+    int queued = up_txq_put_urgent(&handle->tx, bytes, nr);
+
+    if (up_bio_socket_tx_service(bio) < 0 && queued == 0)
+        return -1;
+    if (queued == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return queued;
+}
+
+static int up_bio_socket_safe_write(up_bio_t      *bio,
+                                    const uint8_t *bytes,
+                                    int            nr) {
+    int rv = utils_bio_safe_write(bio, bytes, nr);
+
+    /* Blocking writers expect the bytes to have gone */
+    if (rv >= 0 && utils_bio_flush(bio, UP_BIO_SOCKET_FLUSH_MS) < 0)
+        return -1;
+    return rv;
+}
+
+static int up_bio_socket_set_baud(up_bio_t *bio, int baud, int flow_control) {
+    SOCKET_HANDLE(handle, bio);
+
+    /* Let anything meant for the old rate get to the server first */
+    utils_bio_flush(bio, UP_BIO_SOCKET_FLUSH_MS);
+    if (baud)
+        printf("[[ %s: baud rate %d / %s is up to the server ]]\n",
+               handle->spec, baud, utils_decode_flow_control(flow_control));
+    return 0;
+}
+
+static void up_bio_socket_dispose(up_bio_t *bio) {
+    SOCKET_HANDLE(handle, bio);
+    if (handle->fd >= 0) {
+        utils_bio_flush(bio, UP_BIO_SOCKET_FLUSH_MS);
+        close(handle->fd);
+    }
+    up_ring_free(&handle->rx);
+    up_txq_free(&handle->tx);
+    free(handle);
+    memset(bio, '\0', sizeof(up_bio_t));
+    free(bio);
+}
+
+
+up_bio_t *up_bio_socket_create(const char *spec, int rcvbuf) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_socket_t *handle =
+        (up_bio_socket_t *)malloc(sizeof(up_bio_socket_t));
+
+    if (a_bio == NULL || handle == NULL)
+        goto fail;
+    memset(a_bio, '\0', sizeof(up_bio_t));
+    memset(handle, '\0', sizeof(up_bio_socket_t));
+    a_bio->handle = handle;
+    a_bio->dispose = up_bio_socket_dispose;
+    a_bio->poll_fd = up_bio_socket_poll_fd;
+    a_bio->read = up_bio_socket_read;
+    a_bio->rx_pending = up_bio_socket_rx_pending;
+    a_bio->peek = up_bio_socket_peek;
+    a_bio->consume = up_bio_socket_consume;
+    a_bio->borrow = up_bio_socket_borrow;
+    a_bio->release = up_bio_socket_consume;
+    a_bio->write = up_bio_socket_write;
+    a_bio->writev = up_bio_socket_writev;
+    a_bio->safe_write = up_bio_socket_safe_write;
+    a_bio->urgent_write = up_bio_socket_urgent_write;
+    a_bio->tx_pending = up_bio_socket_tx_pending;
+    a_bio->tx_high_water = up_bio_socket_tx_high_water;
+    a_bio->tx_service = up_bio_socket_tx_service;
+    a_bio->set_baud = up_bio_socket_set_baud;
+    handle->spec = spec;
+    handle->tx_high_water = UP_BIO_SOCKET_TX_HIGH_WATER;
+    handle->fd = -1;
+    if (up_ring_init(&handle->rx, UP_BIO_SOCKET_RX_BYTES) < 0 ||
+        up_txq_init(&handle->tx, UP_BIO_SOCKET_TX_BYTES) < 0) {
+        fprintf(stderr, "! Out of memory for %s buffers\n", spec);
+        goto fail;
+    }
+    handle->fd = up_bio_socket_connect(spec, rcvbuf);
+    if (handle->fd < 0)
+        goto fail;
+    return a_bio;
+
+fail:
+    if (handle != NULL) {
+        up_ring_free(&handle->rx);
+        up_txq_free(&handle->tx);
+    }
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
@@ -0,0 +1,691 @@
+/* up_bio_thread.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A BIO which runs the BIO it wraps on an I/O thread.
+ *
+ *  Only the I/O thread touches the wrapped BIO while it runs.  The
+ *  main thread reads from the receive ring and queues output on the
+ *  transmit rings, and anything which must act on the device itself
+ *  parks the thread, does its work on the main thread and restarts
+ *  the thread.
+ *
+ *  Wakeups are Dekker-style: the sleeper clears its flag, fences and
+ *  then looks at the rings; the waker publishes into a ring, fences
+ *  and writes the eventfd only if it is the one to set the flag.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "upc2/up_bio_thread.h"
+#include "upc2/utils.h"
+
+/* Most reads the thread makes before it next looks at the output */
+#define THREAD_READS_PER_PASS 8
+/* Where input goes when there is no room for it */
+#define THREAD_SCRATCH_BYTES  4096
+
+#define THREAD_HANDLE(c, bio)                              \
+    up_bio_thread_t *(c) = (up_bio_thread_t *)((bio)->handle)
+
+
+static void efd_write(int fd) {
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void efd_drain(int fd) {
+    uint64_t val;
+
+    while (read(fd, &val, sizeof(val)) < 0 && errno == EINTR)
+        ;
+}
+
+/* Wake whoever sleeps on fd, unless they have been woken already */
+static void wake(int *woken, int fd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(woken, 1, __ATOMIC_SEQ_CST))
+        efd_write(fd);
+}
+
+/* Take a wakeup; anything published from now on brings another */
+static void woken(int *woken, int fd) {
+    __atomic_store_n(woken, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    efd_drain(fd);
+}
+
+
+/* ------------------------------------------------------------------
+ * The I/O thread
+ * ------------------------------------------------------------------ */
+
+static void thread_fail(up_bio_thread_t *handle, int err) {
+    __atomic_store_n(&handle->err, err ? err : EIO, __ATOMIC_RELEASE);
+    wake(&handle->main_woken, handle->main_fd);
+}
+
+/* Hand queued output to the wrapped BIO: urgent frames first, unless
+ * the last bulk hand-over was cut short and an urgent frame could
+ * land in the middle of it.  Returns the bytes handed over, or -1.
+ */
+static int thread_tx(up_bio_thread_t *handle, int *split) {
+    up_bio_t *inner = handle->fwd.inner;
+    struct iovec iov[2];
+    int was_pending = handle->inner_pending;
+    int moved = 0;
+    int iovcnt;
+    int rv;
+
+    if (inner->tx_service != NULL && inner->tx_service(inner) < 0)
+        return -1;
+
+    if (!*split && up_spsc_data_iov(&handle->urgent, iov) > 0) {
+        if (inner->urgent_write != NULL)
+            rv = inner->urgent_write(inner, iov[0].iov_base, iov[0].iov_len);
+        else
+            rv = inner->write(inner, iov[0].iov_base, iov[0].iov_len);
+        if (rv < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        if (rv > 0) {
+            up_spsc_consume(&handle->urgent, rv);
+            moved += rv;
+        }
+    }
+
+    iovcnt = up_spsc_data_iov(&handle->tx, iov);
+    if (iovcnt > 0) {
+        int total = iov[0].iov_len + ((iovcnt > 1) ? iov[1].iov_len : 0);
+
+        if (inner->writev != NULL)
+            rv = inner->writev(inner, iov, iovcnt);
+        else
+            rv = inner->write(inner, iov[0].iov_base, iov[0].iov_len);
+        if (rv < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        if (rv < 0)
+            rv = 0;
+        *split = (rv < total);
+        /* Say the wrapped BIO has the bytes before they leave the
+         * ring, so tx_pending() never reads low
+         */
+        __atomic_store_n(&handle->inner_pending, utils_bio_tx_pending(inner),
+                         __ATOMIC_RELEASE);
+        if (rv > 0) {
+            up_spsc_consume(&handle->tx, rv);
+            moved += rv;
+        }
+    }
+    __atomic_store_n(&handle->inner_pending, utils_bio_tx_pending(inner),
+                     __ATOMIC_RELEASE);
+    /* ... and what the wrapped BIO has passed on counts too */
+    if (handle->inner_pending < was_pending)
+        moved += was_pending - handle->inner_pending;
+    return moved;
+}
+
+/* Read what the device has for us.  Returns the bytes read (including
+ * any dropped), or -1.
+ */
+static int thread_rx(up_bio_thread_t *handle) {
+    up_bio_t *inner = handle->fwd.inner;
+    uint8_t scratch[THREAD_SCRATCH_BYTES];
+    int got = 0;
+    int i;
+
+    for (i = 0; i < THREAD_READS_PER_PASS; i++) {
+        struct iovec iov[2];
+        int want;
+        int rv;
+
+        if (up_spsc_space_iov(&handle->rx, iov) > 0) {
+            want = iov[0].iov_len;
+            rv = inner->read(inner, iov[0].iov_base, want);
+            if (rv > 0)
+                up_spsc_commit(&handle->rx, rv);
+        } else {
+            /* The main thread is a megabyte behind: keep the device
+             * from overrunning, and say what was lost
+             */
+            want = sizeof(scratch);
+            rv = inner->read(inner, scratch, want);
+            if (rv > 0)
+                handle->rx_dropped += rv;
+        }
+        if (rv < 0)
+            return (errno == EAGAIN || errno == EINTR) ? got : -1;
+        got += rv;
+        if (rv < want)
+            break;
+    }
+    return got;
+}
+
+/* Parking: give the wrapped BIO what is queued, if it will take it */
+static void thread_park(up_bio_thread_t *handle, int *split) {
+    up_bio_t *inner = handle->fwd.inner;
+    uint64_t start = utils_monotonic_ns();
+
+    while (up_spsc_count(&handle->tx) > 0 ||
+           up_spsc_count(&handle->urgent) > 0) {
+        uint64_t elapsed = (utils_monotonic_ns() - start) / 1000000;
+
+        if (elapsed >= UP_BIO_THREAD_PARK_MS)
+            break;
+        if (thread_tx(handle, split) < 0) {
+            thread_fail(handle, errno);
+            break;
+        }
+        utils_bio_wait(inner, POLLOUT, UP_BIO_THREAD_PARK_MS - elapsed);
+    }
+}
+
+static void *io_thread(void *arg) {
+    up_bio_thread_t *handle = (up_bio_thread_t *)arg;
+    up_bio_t *inner = handle->fwd.inner;
+    int split = 0;
+    int hup = 0;
+
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd fds[2];
+        int timeout = -1;
+        int bio_timeout;
+        int moved, got;
+
+        woken(&handle->kicked, handle->kick_fd);
+
+        moved = thread_tx(handle, &split);
+        if (moved < 0) {
+            thread_fail(handle, errno);
+            return NULL;
+        }
+        got = thread_rx(handle);
+        if (got < 0) {
+            thread_fail(handle, errno);
+            return NULL;
+        }
+        /* Hung up, and nothing left to read */
+        if (hup && got == 0) {
+            thread_fail(handle, EIO);
+            return NULL;
+        }
+        if (got > 0 ||
+            (moved > 0 && __atomic_load_n(&handle->want_tx, __ATOMIC_ACQUIRE)))
+            wake(&handle->main_woken, handle->main_fd);
+
+        fds[0].fd = inner->poll_fd(inner);
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = handle->kick_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if ((!split && up_spsc_count(&handle->urgent) > 0) ||
+            up_spsc_count(&handle->tx) > 0 ||
+            utils_bio_tx_pending(inner) > 0)
+            fds[0].events |= POLLOUT;
+        bio_timeout = utils_bio_poll_timeout(inner);
+        if (bio_timeout >= 0)
+            timeout = bio_timeout;
+        if (bio_timeout > 0)
+            fds[0].events &= ~POLLOUT;
+        if (got > 0 || utils_bio_rx_pending(inner) > 0)
+            timeout = 0;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            thread_fail(handle, errno);
+            return NULL;
+        }
+        hup = (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+    }
+    thread_park(handle, &split);
+    return NULL;
+}
+
+static int thread_start(up_bio_thread_t *handle) {
+    int rv;
+
+    __atomic_store_n(&handle->stop, 0, __ATOMIC_RELEASE);
+    rv = pthread_create(&handle->thread, NULL, io_thread, handle);
+    if (rv != 0) {
+        errno = rv;
+        return -1;
+    }
+    handle->running = 1;
+    if (handle->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(handle->cpu, &cpus);
+        rv = pthread_setaffinity_np(handle->thread, sizeof(cpus), &cpus);
+        if (rv != 0) {
+            fprintf(stderr, "! Cannot pin I/O thread to CPU %d: %s [%d]\n",
+                    handle->cpu, strerror(rv), rv);
+            /* Once is enough */
+            handle->cpu = -1;
+        }
+    }
+    return 0;
+}
+
+static void thread_stop(up_bio_thread_t *handle) {
+    if (!handle->running)
+        return;
+    __atomic_store_n(&handle->stop, 1, __ATOMIC_RELEASE);
+    efd_write(handle->kick_fd);
+    pthread_join(handle->thread, NULL);
+    handle->running = 0;
+}
+
+/* Restart the I/O thread after work done on the main thread with it
+ * stopped, unless it had given up.  Preserves errno.
+ */
+static void thread_resume(up_bio_thread_t *handle) {
+    int err = errno;
+
+    if (!__atomic_load_n(&handle->err, __ATOMIC_ACQUIRE) &&
+        thread_start(handle) < 0)
+        __atomic_store_n(&handle->err, errno, __ATOMIC_RELEASE);
+    errno = err;
+}
+
+
+/* ------------------------------------------------------------------
+ * The main thread
+ * ------------------------------------------------------------------ */
+
+static void kick(up_bio_thread_t *handle) {
+    wake(&handle->kicked, handle->kick_fd);
+}
+
+/* Bytes released are handed back to the I/O thread only now, so that
+ * borrowed bytes outlive release() as borrow() promises.
+ */
+static void rx_settle(up_bio_thread_t *handle) {
+    woken(&handle->main_woken, handle->main_fd);
+    if (handle->rx_released > 0) {
+        up_spsc_consume(&handle->rx, handle->rx_released);
+        handle->rx_released = 0;
+    }
+}
+
+/* No input: EAGAIN, or why the I/O thread gave up */
+static int rx_none(up_bio_thread_t *handle) {
+    int err = __atomic_load_n(&handle->err, __ATOMIC_ACQUIRE);
+
+    errno = err ? err : EAGAIN;
+    return -1;
+}
+
+static int up_bio_thread_poll_fd(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+    return handle->main_fd;
+}
+
+static int up_bio_thread_peek(up_bio_t *bio, uint8_t *bytes, int nr) {
+    THREAD_HANDLE(handle, bio);
+    int rv;
+
+    rx_settle(handle);
+    rv = up_spsc_copy(&handle->rx, bytes, nr);
+    return (rv > 0 || nr == 0) ? rv : rx_none(handle);
+}
+
+static int up_bio_thread_consume(up_bio_t *bio, int nr) {
+    THREAD_HANDLE(handle, bio);
+    int held = up_spsc_count(&handle->rx) - handle->rx_released;
+
+    if (nr > held)
+        nr = held;
+    up_spsc_consume(&handle->rx, handle->rx_released + nr);
+    handle->rx_released = 0;
+    if (nr > 0)
+        kick(handle);
+    return nr;
+}
+
+static int up_bio_thread_read(up_bio_t *bio, uint8_t *bytes, int nr) {
+    int rv = up_bio_thread_peek(bio, bytes, nr);
+
+    if (rv > 0)
+        up_bio_thread_consume(bio, rv);
+    return rv;
+}
+
+static int up_bio_thread_rx_pending(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+    return up_spsc_count(&handle->rx) - handle->rx_released;
+}
+
+static int up_bio_thread_borrow(up_bio_t *bio, const uint8_t **bytes) {
+    THREAD_HANDLE(handle, bio);
+    struct iovec iov[2];
+
+    rx_settle(handle);
+    if (up_spsc_data_iov(&handle->rx, iov) == 0)
+        return rx_none(handle);
+    *bytes = iov[0].iov_base;
+    return iov[0].iov_len;
+}
+
+static int up_bio_thread_release(up_bio_t *bio, int nr) {
+    THREAD_HANDLE(handle, bio);
+    int held = up_spsc_count(&handle->rx) - handle->rx_released;
+
+    if (nr > held)
+        nr = held;
+    handle->rx_released += nr;
+    return nr;
+}
+
+/* Output can be queued until the I/O thread fails and everything it
+ * read before that has been read
+ */
+static int tx_failed(up_bio_thread_t *handle) {
+    int err = __atomic_load_n(&handle->err, __ATOMIC_ACQUIRE);
+
+    if (err == 0 || up_spsc_count(&handle->rx) > handle->rx_released)
+        return 0;
+    errno = err;
+    return 1;
+}
+
+static int up_bio_thread_write(up_bio_t *bio, const uint8_t *bytes, int nr) {
+    THREAD_HANDLE(handle, bio);
+    int rv;
+
+    if (tx_failed(handle))
+        return -1;
+    rv = up_spsc_put(&handle->tx, bytes, nr);
+    if (rv > 0)
+        kick(handle);
+    if (rv == 0 && nr > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return rv;
+}
+
+static int up_bio_thread_writev(up_bio_t           *bio,
+                                const struct iovec *iov,
+                                int                 iovcnt) {
+    THREAD_HANDLE(handle, bio);
+    int total = 0;
+    int queued = 0;
+    int i;
+
+    if (tx_failed(handle))
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    /* A frame which will fit goes in whole, so the I/O thread can
+     * hand it over in one piece
+     */
+    if (total <= (int)handle->tx.size &&
+        total > (int)handle->tx.size - up_spsc_count(&handle->tx)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        int rv = up_spsc_put(&handle->tx, iov[i].iov_base, iov[i].iov_len);
+
+        queued += rv;
+        if (rv < (int)iov[i].iov_len)
+            break;
+    }
+    if (queued > 0)
+        kick(handle);
+    if (queued == 0 && total > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return queued;
+}
+
+static int up_bio_thread_urgent_write(up_bio_t      *bio,
+                                      const uint8_t *bytes,
+                                      int            nr) {
+    THREAD_HANDLE(handle, bio);
+
+    if (tx_failed(handle))
+        return -1;
+    /* Urgent frames are short: all or nothing */
+    if (nr > (int)handle->urgent.size - up_spsc_count(&handle->urgent)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    up_spsc_put(&handle->urgent, bytes, nr);
+    kick(handle);
+    return nr;
+}
+
+static int up_bio_thread_tx_pending(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+
+    return up_spsc_count(&handle->tx) + up_spsc_count(&handle->urgent) +
+        __atomic_load_n(&handle->inner_pending, __ATOMIC_ACQUIRE);
+}
+
+static int up_bio_thread_tx_high_water(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+    return handle->tx.size / 2;
+}
+
+/* The I/O thread does the work; all we do is listen to it */
+static int up_bio_thread_tx_service(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+
+    woken(&handle->main_woken, handle->main_fd);
+    if (tx_failed(handle))
+        return -1;
+    return up_bio_thread_tx_pending(bio);
+}
+
+/* Our eventfd is always writable, so while there is output we ask to
+ * be called on a timer, and the I/O thread wakes us sooner as the
+ * output moves on.
+ */
+static int up_bio_thread_poll_timeout(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+    int pending = up_bio_thread_tx_pending(bio) > 0;
+
+    __atomic_store_n(&handle->want_tx, pending, __ATOMIC_RELEASE);
+    return pending ? UP_BIO_THREAD_TX_WAIT_MS : -1;
+}
+
+static int up_bio_thread_safe_write(up_bio_t      *bio,
+                                    const uint8_t *bytes,
+                                    int            nr) {
+    THREAD_HANDLE(handle, bio);
+    int done = 0;
+
+    __atomic_store_n(&handle->want_tx, 1, __ATOMIC_RELEASE);
+    while (done < nr) {
+        struct pollfd pfd;
+        int rv = up_bio_thread_write(bio, &bytes[done], nr - done);
+
+        if (rv < 0 && errno != EAGAIN)
+            return -1;
+        if (rv > 0) {
+            done += rv;
+            continue;
+        }
+        pfd.fd = handle->main_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+            return -1;
+        woken(&handle->main_woken, handle->main_fd);
+    }
+    return done;
+}
+
+/* Our own counts go with the wrapped BIO's */
+static void up_bio_thread_stats_sync(up_bio_t *bio, int reset) {
+    THREAD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+
+    thread_stop(handle);
+    if (reset) {
+        utils_bio_stats_reset(inner);
+        handle->rx_dropped = 0;
+    }
+    bio->stats = *utils_bio_stats(inner);
+    bio->stats.rx_dropped = handle->rx_dropped;
+    thread_resume(handle);
+}
+
+static int up_bio_thread_set_baud(up_bio_t *bio, int baud, int flow_control) {
+    THREAD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv;
+
+    thread_stop(handle);
+    rv = inner->set_baud(inner, baud, flow_control);
+    thread_resume(handle);
+    return rv;
+}
+
+static int up_bio_thread_set_lines(up_bio_t *bio, int set, int clear) {
+    THREAD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv;
+
+    thread_stop(handle);
+    rv = inner->set_lines(inner, set, clear);
+    thread_resume(handle);
+    return rv;
+}
+
+static int up_bio_thread_send_break(up_bio_t *bio, int ms) {
+    THREAD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv;
+
+    thread_stop(handle);
+    rv = inner->send_break(inner, ms);
+    thread_resume(handle);
+    return rv;
+}
+
+/* The thread has stopped by the time anyone asks for this; what it
+ * had queued for the old device goes, but what it read is kept.
+ */
+static int up_bio_thread_reconnect(up_bio_t *bio, int timeout_ms) {
+    THREAD_HANDLE(handle, bio);
+    up_bio_t *inner = handle->fwd.inner;
+    int rv;
+
+    thread_stop(handle);
+    rv = inner->reconnect(inner, timeout_ms);
+    if (rv < 0)
+        return rv;
+    /* The I/O thread owns these heads, but it is not running */
+    handle->tx.head = handle->tx.tail;
+    handle->urgent.head = handle->urgent.tail;
+    handle->inner_pending = 0;
+    __atomic_store_n(&handle->err, 0, __ATOMIC_RELEASE);
+    return thread_start(handle);
+}
+
+static void up_bio_thread_dispose(up_bio_t *bio) {
+    THREAD_HANDLE(handle, bio);
+
+    thread_stop(handle);
+    if (handle->rx_dropped > 0)
+        printf("[[ I/O thread dropped %llu bytes ]]\n",
+               (unsigned long long)handle->rx_dropped);
+    up_spsc_free(&handle->rx);
+    up_spsc_free(&handle->tx);
+    up_spsc_free(&handle->urgent);
+    close(handle->main_fd);
+    close(handle->kick_fd);
+    up_bio_forward_dispose(bio);
+}
+
+
+up_bio_t *up_bio_thread_create(up_bio_t *inner, int cpu) {
+    up_bio_t *a_bio = (up_bio_t *)malloc(sizeof(up_bio_t));
+    up_bio_thread_t *handle = (up_bio_thread_t *)malloc(sizeof(up_bio_thread_t));
+
+    if (a_bio == NULL || handle == NULL) {
+        fprintf(stderr, "! Out of memory for the I/O thread\n");
+        free(handle);
+        free(a_bio);
+        return NULL;
+    }
+    memset(handle, '\0', sizeof(up_bio_thread_t));
+    handle->cpu = cpu;
+    handle->main_fd = handle->kick_fd = -1;
+    if (up_spsc_init(&handle->rx, UP_BIO_THREAD_RX_BYTES) < 0 ||
+        up_spsc_init(&handle->tx, UP_BIO_THREAD_TX_BYTES) < 0 ||
+        up_spsc_init(&handle->urgent, UP_BIO_THREAD_URGENT_BYTES) < 0) {
+        fprintf(stderr, "! Out of memory for the I/O thread\n");
+        goto fail;
+    }
+    handle->main_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    handle->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handle->main_fd < 0 || handle->kick_fd < 0) {
+        fprintf(stderr, "! Cannot create eventfd: %s [%d]\n",
+                strerror(errno), errno);
+        goto fail;
+    }
+
+    up_bio_forward_init(a_bio, handle, inner);
+    a_bio->dispose = up_bio_thread_dispose;
+    a_bio->poll_fd = up_bio_thread_poll_fd;
+    a_bio->read = up_bio_thread_read;
+    a_bio->rx_pending = up_bio_thread_rx_pending;
+    a_bio->peek = up_bio_thread_peek;
+    a_bio->consume = up_bio_thread_consume;
+    a_bio->borrow = up_bio_thread_borrow;
+    a_bio->release = up_bio_thread_release;
+    a_bio->write = up_bio_thread_write;
+    a_bio->writev = up_bio_thread_writev;
+    a_bio->safe_write = up_bio_thread_safe_write;
+    a_bio->urgent_write = up_bio_thread_urgent_write;
+    a_bio->tx_pending = up_bio_thread_tx_pending;
+    a_bio->tx_high_water = up_bio_thread_tx_high_water;
+    a_bio->tx_service = up_bio_thread_tx_service;
+    a_bio->poll_timeout = up_bio_thread_poll_timeout;
+    a_bio->stats_sync = up_bio_thread_stats_sync;
+    a_bio->set_baud = up_bio_thread_set_baud;
+    if (inner->set_lines != NULL)
+        a_bio->set_lines = up_bio_thread_set_lines;
+    if (inner->send_break != NULL)
+        a_bio->send_break = up_bio_thread_send_break;
+    if (inner->reconnect != NULL)
+        a_bio->reconnect = up_bio_thread_reconnect;
+
+    if (thread_start(handle) < 0) {
+        fprintf(stderr, "! Cannot start I/O thread: %s [%d]\n",
+                strerror(errno), errno);
+        /* Give inner back untouched */
+        memset(a_bio, '\0', sizeof(up_bio_t));
+        goto fail;
+    }
+    return a_bio;
+
+fail:
+    up_spsc_free(&handle->rx);
+    up_spsc_free(&handle->tx);
+    up_spsc_free(&handle->urgent);
+    if (handle->main_fd >= 0)
+        close(handle->main_fd);
+    if (handle->kick_fd >= 0)
+        close(handle->kick_fd);
+    free(handle);
+    free(a_bio);
+    return NULL;
+}
+
+/* End file */
@@ -0,0 +1,279 @@
+/* up_coro.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  Coroutines for protocols, on ucontext.
+ *
+ *  The console resumes a body with swapcontext() from transfer(),
+ *  timeout() or prepare(), and the body swaps back when it has to
+ *  wait.  All of this happens on the console's thread, one body at a
+ *  time, so there is nothing to lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "upc2/up_coro.h"
+#include "upc2/utils.h"
+
+/* makecontext() can only pass ints, so the body to start goes here */
+static up_coro_t *coro_starting;
+
+
+static void coro_main(void)
+{
+    up_coro_t *co = coro_starting;
+    int result = co->fn(co, co->ctx, co->arg);
+
+    /* 0 would mean "still working", which is no longer true */
+    co->result = (result == 0) ? 1 : result;
+    co->state = UP_CORO_DONE;
+    /* ... and back to whoever resumed us, through uc_link */
+}
+
+/* Run the body until it next waits or finishes.  Returns as
+ * transfer() does.
+ */
+static int coro_resume(up_coro_t *co)
+{
+    swapcontext(&co->caller, &co->self);
+    if (co->state == UP_CORO_DONE)
+        return co->result;
+    return 0;
+}
+
+/* From the body: wait for the console to resume us */
+static void coro_yield(up_coro_t *co, int state)
+{
+    co->state = state;
+    swapcontext(&co->self, &co->caller);
+}
+
+/* From the body: wait until the BIO can take more */
+static void coro_wait_tx(up_coro_t *co)
+{
+    co->ctx->proto_wants_tx = 1;
+    coro_yield(co, UP_CORO_WAIT_TX);
+}
+
+
+int up_coro_start(up_coro_t     *co,
+                  up_context_t  *ctx,
+                  up_load_arg_t *arg,
+                  up_coro_fn_t   fn)
+{
+    if (co->stack == NULL)
+    {
+        co->stack = (uint8_t *)malloc(UP_CORO_STACK_BYTES);
+        if (co->stack == NULL ||
+            up_ring_init(&co->input, UP_CORO_INPUT_BYTES) < 0)
+        {
+            free(co->stack);
+            co->stack = NULL;
+            fprintf(stderr, "! Out of memory for protocol coroutine\n");
+            return -1;
+        }
+    }
+    /* Whatever an abandoned body was doing, it is over */
+    up_coro_discard_input(co);
+    co->overflowed = 0;
+    co->fn = fn;
+    co->ctx = ctx;
+    co->arg = arg;
+    co->timed_out = 0;
+    co->want = 0;
+
+    getcontext(&co->self);
+    co->self.uc_stack.ss_sp = co->stack;
+    co->self.uc_stack.ss_size = UP_CORO_STACK_BYTES;
+    co->self.uc_link = &co->caller;
+    makecontext(&co->self, coro_main, 0);
+    co->state = UP_CORO_IDLE;
+    coro_starting = co;
+
+    /* prepare()'s result goes nowhere, so if the body is over already
+     * have the console ask transfer() for it straight away
+     */
+    if (coro_resume(co) != 0)
+        ctx->proto_wants_tx = 1;
+    return 0;
+}
+
+
+int up_coro_transfer(void          *h,
+                     up_context_t  *ctx,
+                     up_load_arg_t *arg,
+                     const uint8_t *buf,
+                     int            buf_bytes)
+{
+    up_coro_t *co = (up_coro_t *)h;
+
+    if (co->state == UP_CORO_DONE)
+        return co->result;
+    if (buf_bytes > 0 &&
+        up_ring_put(&co->input, buf, buf_bytes) < buf_bytes &&
+        !co->overflowed)
+    {
+        utils_safe_printf(ctx, "! upc2: Protocol input overflowed;"
+                          " bytes lost\n");
+        co->overflowed = 1;
+    }
+    if ((co->state == UP_CORO_WAIT_INPUT &&
+         co->input.count >= co->want) ||
+        co->state == UP_CORO_WAIT_TX)
+        return coro_resume(co);
+    return 0;
+}
+
+
+int up_coro_timeout(void *h, up_context_t *ctx, up_load_arg_t *arg)
+{
+    up_coro_t *co = (up_coro_t *)h;
+
+    if (co->state == UP_CORO_DONE)
+        return co->result;
+    if (co->state != UP_CORO_WAIT_INPUT)
+        return 0;
+    co->timed_out = 1;
+    return coro_resume(co);
+}
+
+
+void up_coro_free(up_coro_t *co)
+{
+    free(co->stack);
+    co->stack = NULL;
+    up_ring_free(&co->input);
+    co->state = UP_CORO_IDLE;
+}
+
+
+int up_coro_await_bytes(up_coro_t *co, uint8_t *buf, int nr,
+                        int timeout_ms)
+{
+    if (nr > co->input.size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (co->input.count < nr)
+    {
+        co->want = nr;
+        co->timed_out = 0;
+        if (timeout_ms >= 0)
+            up_protocol_timer(co->ctx, timeout_ms);
+        while (co->input.count < nr && !co->timed_out)
+            coro_yield(co, UP_CORO_WAIT_INPUT);
+        if (timeout_ms >= 0)
+            up_protocol_timer(co->ctx, -1);
+        if (co->input.count < nr)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    up_ring_copy(&co->input, buf, nr);
+    up_ring_consume(&co->input, nr);
+    return nr;
+}
+
+
+void up_coro_discard_input(up_coro_t *co)
+{
+    up_ring_consume(&co->input, co->input.count);
+}
+
+
+int up_coro_sendv(up_coro_t *co, const struct iovec *iov, int iovcnt)
+{
+    up_bio_t *bio = co->ctx->bio;
+    struct iovec local[UTILS_BIO_MAX_IOV];
+    int cur = 0;
+    int done = 0;
+
+    if (iovcnt > UTILS_BIO_MAX_IOV)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(local, iov, iovcnt * sizeof(struct iovec));
+
+    /* Don't add to a queue which is already long */
+    while (utils_bio_tx_congested(bio))
+        coro_wait_tx(co);
+    while (cur < iovcnt)
+    {
+        int rv;
+
+        if (local[cur].iov_len == 0)
+        {
+            cur++;
+            continue;
+        }
+        if (bio->writev != NULL)
+            rv = bio->writev(bio, &local[cur], iovcnt - cur);
+        else
+            rv = bio->write(bio, local[cur].iov_base, local[cur].iov_len);
+        if (rv < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN)
+                return -1;
+            rv = 0;
+        }
+        done += rv;
+        /* Step over whatever was written */
+        while (cur < iovcnt && rv >= (int)local[cur].iov_len)
+        {
+            rv -= local[cur].iov_len;
+            cur++;
+        }
+        if (cur < iovcnt && rv > 0)
+        {
+            local[cur].iov_base = (uint8_t *)local[cur].iov_base + rv;
+            local[cur].iov_len -= rv;
+        }
+        if (cur < iovcnt)
+            coro_wait_tx(co);
+    }
+    return done;
+}
+
+
+int up_coro_send(up_coro_t *co, const uint8_t *bytes, int nr)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)bytes;
+    iov.iov_len = nr;
+    return up_coro_sendv(co, &iov, 1);
+}
+
+
+int up_coro_send_urgent(up_coro_t *co, const uint8_t *bytes, int nr)
+{
+    up_bio_t *bio = co->ctx->bio;
+    int done = 0;
+
+    if (bio->urgent_write == NULL)
+        return up_coro_send(co, bytes, nr);
+    while (done < nr)
+    {
+        int rv = bio->urgent_write(bio, &bytes[done], nr - done);
+
+        if (rv < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN)
+                return -1;
+            rv = 0;
+        }
+        done += rv;
+        if (done < nr)
+            coro_wait_tx(co);
+    }
+    return done;
+}
+
+/* End file */
@@ -0,0 +1,710 @@
+/* up_emulator.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  An emulated target for the upload protocols.  The emulator thread
+ *  sits on the master side of a pty and plays the part of the device
+ *  through each boot stage in turn:
+ *
+ *   - grouch: print "*LOAD*", take the image and check its sum
+ *   - xmodem, xmodem128: send 'C' and ACK each CRC-16 block
+ *   - kinetis, kinetis-s: answer KBOOT ping, erase, write and reset,
+ *     checking and generating the packet CRCs
+ *
+ *  At the end of each stage it reports on the wire, as a real target
+ *  would print a banner, how much arrived, how long it took and how
+ *  many packets were bad.  After the last stage it echoes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "upc2/up_emulator.h"
+#include "upc2/utils.h"
+
+
+/* Longest the target waits for the host in the middle of a stage */
+#define EMU_STALL_MS     (10000)
+/* How often the target repeats its cue until the host responds */
+#define EMU_LOAD_CUE_MS  (1000)
+#define EMU_XMODEM_C_MS  (250)
+/* How long a block may take to arrive, and how long the line must be
+ * quiet after a bad one before we NAK it */
+#define EMU_XMODEM_BLOCK_MS (1000)
+#define EMU_XMODEM_PURGE_MS (100)
+
+#define XMODEM_SOH (0x01)
+#define XMODEM_STX (0x02)
+#define XMODEM_EOT (0x04)
+#define XMODEM_ACK (0x06)
+#define XMODEM_NAK (0x15)
+#define XMODEM_CAN (0x18)
+
+#define KBOOT_START      (0x5a)
+#define KBOOT_ACK        (0xa1)
+#define KBOOT_NAK        (0xa2)
+#define KBOOT_ACK_ABORT  (0xa3)
+#define KBOOT_COMMAND    (0xa4)
+#define KBOOT_DATA       (0xa5)
+#define KBOOT_PING       (0xa6)
+#define KBOOT_PING_RESP  (0xa7)
+
+#define KBOOT_CMD_WRITE_MEMORY   (0x04)
+#define KBOOT_CMD_RESET          (0x0b)
+#define KBOOT_GENERIC_RESPONSE   (0xa0)
+#define KBOOT_STATUS_UNKNOWN_CMD (10000)
+
+/* Returned by the packet reader for a packet with a bad CRC, or a
+ * length longer than any real KBOOT packet's.  The input ring could
+ * never hold a corrupt length of up to 64K, so waiting for it would
+ * only stall the stage.
+ */
+#define KBOOT_BAD_CRC    (-2)
+#define KBOOT_MAX_LEN    (512)
+
+/* Stage results */
+#define STAGE_DONE    (0)
+#define STAGE_FAILED  (1)
+#define STAGE_STOPPED (-1)
+
+
+/* Wait for events on the wire, or for a request to stop.  Returns
+ * the wire's revents (0 on timeout), or -1 to stop.
+ */
+static int emu_wait(up_emulator_t *emu, int events, int timeout_ms)
+{
+    struct pollfd fds[2];
+
+    fds[0].fd = emu->fd;
+    fds[0].events = events;
+    fds[0].revents = 0;
+    fds[1].fd = emu->stop_pipe[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, 2, timeout_ms) < 0 && errno != EINTR)
+        return -1;
+    if (fds[1].revents)
+        return -1;
+    if ((fds[0].revents & POLLHUP) && !(fds[0].revents & POLLIN))
+    {
+        /* Nobody has the slave side open; wait for someone to */
+        if (poll(&fds[1], 1, (timeout_ms < 0 || timeout_ms > 100) ?
+                 100 : timeout_ms) > 0)
+            return -1;
+        return 0;
+    }
+    return fds[0].revents;
+}
+
+/* Read whatever the host has sent.  Returns the number of bytes
+ * read, 0 on timeout or -1 to stop.
+ */
+static int emu_fill(up_emulator_t *emu, int timeout_ms)
+{
+    struct iovec iov[2];
+    int iovcnt;
+    int rv;
+
+    rv = emu_wait(emu, POLLIN, timeout_ms);
+    if (rv <= 0)
+        return rv;
+    iovcnt = up_ring_space_iov(&emu->in, iov);
+    if (iovcnt == 0)
+        return 0;
+    rv = readv(emu->fd, iov, iovcnt);
+    if (rv < 0)
+        return (errno == EAGAIN || errno == EINTR || errno == EIO) ? 0 : -1;
+    up_ring_commit(&emu->in, rv);
+    return rv;
+}
+
+/* Read exactly nr bytes.  Returns nr, 0 on timeout or -1 to stop */
+static int emu_get(up_emulator_t *emu, uint8_t *buf, int nr, int timeout_ms)
+{
+    uint64_t deadline = utils_monotonic_ns() + timeout_ms * 1000000ULL;
+
+    while (emu->in.count < nr)
+    {
+        int left_ms =
+            (int)((int64_t)(deadline - utils_monotonic_ns()) / 1000000);
+
+        if (left_ms <= 0)
+            return 0;
+        if (emu_fill(emu, left_ms) < 0)
+            return -1;
+    }
+    up_ring_copy(&emu->in, buf, nr);
+    up_ring_consume(&emu->in, nr);
+    return nr;
+}
+
+/* Discard input until the line has been quiet for quiet_ms.
+ * Returns 0 or -1 to stop.
+ */
+static int emu_purge(up_emulator_t *emu, int quiet_ms)
+{
+    int rv;
+
+    do
+    {
+        up_ring_consume(&emu->in, emu->in.count);
+        rv = emu_fill(emu, quiet_ms);
+    } while (rv > 0);
+    return rv;
+}
+
+/* Send nr bytes to the host.  Returns 0 or -1 to stop */
+static int emu_put(up_emulator_t *emu, const uint8_t *bytes, int nr)
+{
+    while (nr > 0)
+    {
+        int rv = write(emu->fd, bytes, nr);
+
+        if (rv < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR && errno != EIO)
+                return -1;
+            if (emu_wait(emu, POLLOUT, 100) < 0)
+                return -1;
+            continue;
+        }
+        bytes += rv;
+        nr -= rv;
+    }
+    return 0;
+}
+
+static int emu_put_byte(up_emulator_t *emu, uint8_t c)
+{
+    return emu_put(emu, &c, 1);
+}
+
+static int emu_printf(up_emulator_t *emu, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+    return emu_put(emu, (const uint8_t *)buf, len);
+}
+
+/* The target thinking about a packet */
+static void emu_delay(up_emulator_t *emu)
+{
+    if (emu->delay_us > 0)
+        usleep(emu->delay_us);
+}
+
+/* Report on a stage */
+static int emu_report(up_emulator_t *emu, const char *what,
+                      uint64_t start, uint32_t bytes,
+                      int errors, const char *result)
+{
+    uint64_t us = (utils_monotonic_ns() - start) / 1000;
+    uint64_t rate = us ? (uint64_t)bytes * 1000000 / us : 0;
+
+    return emu_printf(emu,
+                      "\r\n[emu] %s: %u bytes in %d.%03d s (%u B/s),"
+                      " %d bad packets, %s\r\n",
+                      what, bytes, (int)(us / 1000000),
+                      (int)(us / 1000 % 1000), (unsigned)rate,
+                      errors, result);
+}
+
+/* CRC-16/XMODEM, as used by XMODEM-CRC and KBOOT */
+static uint16_t crc16(uint16_t crc, const uint8_t *bytes, int nr)
+{
+    int i, j;
+
+    for (i = 0; i < nr; i++)
+    {
+        crc ^= bytes[i] << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+
+static int emulate_grouch(up_emulator_t *emu)
+{
+    static const char cue[] = "*LOAD*";
+    uint8_t hdr[4];
+    uint32_t len = 0, left = 0, sum = 0, host_sum;
+    uint64_t start;
+    int rv;
+
+    /* Keep asking until the host syncs with a '*' */
+    do
+    {
+        if (emu_put(emu, (const uint8_t *)cue, sizeof(cue) - 1) < 0)
+            return STAGE_STOPPED;
+        while ((rv = emu_get(emu, hdr, 1, EMU_LOAD_CUE_MS)) > 0 &&
+               hdr[0] != '*')
+            ;
+        if (rv < 0)
+            return STAGE_STOPPED;
+    } while (rv == 0);
+
+    start = utils_monotonic_ns();
+    rv = emu_get(emu, hdr, 4, EMU_STALL_MS);
+    if (rv <= 0)
+        goto stalled;
+    len = (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+
+    /* Sum the image straight out of the ring */
+    left = len;
+    while (left > 0)
+    {
+        const uint8_t *run;
+        int nr, i;
+
+        if (emu->in.count == 0)
+        {
+            rv = emu_fill(emu, EMU_STALL_MS);
+            if (rv <= 0)
+                goto stalled;
+        }
+        nr = up_ring_run(&emu->in, &run);
+        if (nr > (int)left)
+            nr = left;
+        for (i = 0; i < nr; i++)
+            sum += run[i];
+        up_ring_consume(&emu->in, nr);
+        left -= nr;
+    }
+
+    rv = emu_get(emu, hdr, 4, EMU_STALL_MS);
+    if (rv <= 0)
+        goto stalled;
+    host_sum = (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+    emu_delay(emu);
+    if (emu_report(emu, "grouch", start, len, 0,
+                   (sum == host_sum) ? "checksum ok" : "CHECKSUM BAD") < 0)
+        return STAGE_STOPPED;
+    return (sum == host_sum) ? STAGE_DONE : STAGE_FAILED;
+
+stalled:
+    if (rv < 0)
+        return STAGE_STOPPED;
+    emu_report(emu, "grouch", start, len - left, 0, "TIMED OUT");
+    return STAGE_FAILED;
+}
+
+
+static int emulate_xmodem(up_emulator_t *emu)
+{
+    uint8_t block[1024 + 4];
+    uint8_t type;
+    uint8_t blk = 1;
+    uint32_t bytes = 0;
+    uint64_t start;
+    int errors = 0;
+    int rv;
+
+    /* Ask for CRC mode until the first block turns up */
+    do
+    {
+        if (emu_put_byte(emu, 'C') < 0)
+            return STAGE_STOPPED;
+        rv = emu_get(emu, &type, 1, EMU_XMODEM_C_MS);
+        if (rv < 0)
+            return STAGE_STOPPED;
+    } while (rv == 0 || (type != XMODEM_SOH && type != XMODEM_STX));
+
+    start = utils_monotonic_ns();
+    while (1)
+    {
+        int size;
+        int crc_ok;
+
+        if (type == XMODEM_EOT)
+        {
+            emu_delay(emu);
+            if (emu_put_byte(emu, XMODEM_ACK) < 0)
+                return STAGE_STOPPED;
+            break;
+        }
+        if (type == XMODEM_CAN)
+        {
+            emu_report(emu, "xmodem", start, bytes, errors, "CANCELLED");
+            return STAGE_FAILED;
+        }
+        if (type == XMODEM_SOH || type == XMODEM_STX)
+        {
+            size = (type == XMODEM_SOH) ? 128 : 1024;
+            rv = emu_get(emu, block, size + 4, EMU_XMODEM_BLOCK_MS);
+            if (rv < 0)
+                return STAGE_STOPPED;
+            crc_ok = (rv > 0 && block[0] == (uint8_t)~block[1] &&
+                      crc16(0, &block[2], size) ==
+                      ((block[size + 2] << 8) | block[size + 3]));
+            emu_delay(emu);
+            if (!crc_ok || (block[0] != blk && block[0] != (uint8_t)(blk - 1)))
+            {
+                /* Short or damaged: let the line go quiet so the resend
+                 * starts on a block boundary, then ask for it */
+                errors++;
+                if (emu_purge(emu, EMU_XMODEM_PURGE_MS) < 0)
+                    return STAGE_STOPPED;
+                rv = emu_put_byte(emu, XMODEM_NAK);
+            }
+            else
+            {
+                /* A repeat of the last block means our ACK was lost */
+                if (block[0] == blk)
+                {
+                    bytes += size;
+                    blk++;
+                }
+                rv = emu_put_byte(emu, XMODEM_ACK);
+            }
+            if (rv < 0)
+                return STAGE_STOPPED;
+        }
+        /* Anything else is line noise */
+
+        rv = emu_get(emu, &type, 1, EMU_STALL_MS);
+        if (rv <= 0)
+            goto stalled;
+    }
+
+    if (emu_report(emu, "xmodem", start, bytes, errors, "ok") < 0)
+        return STAGE_STOPPED;
+    return STAGE_DONE;
+
+stalled:
+    if (rv < 0)
+        return STAGE_STOPPED;
+    emu_report(emu, "xmodem", start, bytes, errors, "TIMED OUT");
+    return STAGE_FAILED;
+}
+
+
+/* Read a KBOOT packet into pkt (which must hold 6 + KBOOT_MAX_LEN
+ * bytes).  Returns its type, KBOOT_BAD_CRC, 0 on timeout or -1 to
+ * stop.
+ */
+static int kboot_get(up_emulator_t *emu, uint8_t *pkt, int timeout_ms)
+{
+    int len;
+    int rv;
+
+    do
+    {
+        rv = emu_get(emu, &pkt[0], 1, timeout_ms);
+        if (rv <= 0)
+            return rv;
+    } while (pkt[0] != KBOOT_START);
+    rv = emu_get(emu, &pkt[1], 1, EMU_STALL_MS);
+    if (rv <= 0)
+        return rv;
+    if (pkt[1] != KBOOT_COMMAND && pkt[1] != KBOOT_DATA)
+        return pkt[1];
+
+    rv = emu_get(emu, &pkt[2], 4, EMU_STALL_MS);
+    if (rv <= 0)
+        return rv;
+    len = pkt[2] | (pkt[3] << 8);
+    if (len > KBOOT_MAX_LEN)
+        return KBOOT_BAD_CRC;
+    rv = emu_get(emu, &pkt[6], len, EMU_STALL_MS);
+    if (rv <= 0 && len > 0)
+        return rv;
+    if (crc16(crc16(0, pkt, 4), &pkt[6], len) != (pkt[4] | (pkt[5] << 8)))
+        return KBOOT_BAD_CRC;
+    return pkt[1];
+}
+
+static int kboot_put_simple(up_emulator_t *emu, uint8_t type)
+{
+    uint8_t pkt[2];
+
+    pkt[0] = KBOOT_START;
+    pkt[1] = type;
+    return emu_put(emu, pkt, 2);
+}
+
+static int kboot_put_ping_response(up_emulator_t *emu)
+{
+    /* Protocol P1.2.0, no options */
+    uint8_t pkt[10] = { KBOOT_START, KBOOT_PING_RESP, 0, 2, 1, 'P', 0, 0 };
+    uint16_t crc = crc16(0, pkt, 8);
+
+    pkt[8] = crc & 0xff;
+    pkt[9] = crc >> 8;
+    return emu_put(emu, pkt, 10);
+}
+
+static int kboot_put_response(up_emulator_t *emu, uint32_t status,
+                              uint8_t tag)
+{
+    uint8_t pkt[18] = { KBOOT_START, KBOOT_COMMAND, 12, 0, 0, 0,
+                        KBOOT_GENERIC_RESPONSE, 0, 0, 2 };
+    uint16_t crc;
+
+    pkt[10] = status & 0xff;
+    pkt[11] = (status >> 8) & 0xff;
+    pkt[12] = (status >> 16) & 0xff;
+    pkt[13] = (status >> 24) & 0xff;
+    pkt[14] = tag;
+    crc = crc16(crc16(0, pkt, 4), &pkt[6], 12);
+    pkt[4] = crc & 0xff;
+    pkt[5] = crc >> 8;
+    return emu_put(emu, pkt, 18);
+}
+
+static int emulate_kinetis(up_emulator_t *emu)
+{
+    uint8_t *pkt = (uint8_t *)malloc(6 + KBOOT_MAX_LEN);
+    uint64_t start = 0;
+    uint32_t bytes = 0;
+    uint32_t write_left = 0;
+    int started = 0;
+    int resetting = 0;
+    int errors = 0;
+    int result = STAGE_STOPPED;
+    int type;
+
+    if (pkt == NULL)
+        return STAGE_STOPPED;
+
+    while (1)
+    {
+        /* Wait as long as it takes for the host to start */
+        type = kboot_get(emu, pkt, started ? EMU_STALL_MS : 1000);
+        if (type < 0 && type != KBOOT_BAD_CRC)
+            goto end;
+        if (type == 0)
+        {
+            if (!started)
+                continue;
+            emu_report(emu, "kinetis", start, bytes, errors, "TIMED OUT");
+            result = STAGE_FAILED;
+            goto end;
+        }
+
+        switch (type)
+        {
+            case KBOOT_PING:
+                /* Pings are for autobauding; once the host is issuing
+                 * commands we are locked on and stay quiet, so that a
+                 * host re-pinging over a slow link doesn't start a
+                 * storm of responses.
+                 */
+                if (!started && kboot_put_ping_response(emu) < 0)
+                    goto end;
+                break;
+
+            case KBOOT_ACK:
+                if (resetting)
+                {
+                    /* The host has our reset response; we're done */
+                    if (emu_report(emu, "kinetis", start, bytes, errors,
+                                   "ok") == 0)
+                        result = STAGE_DONE;
+                    goto end;
+                }
+                break;
+
+            case KBOOT_BAD_CRC:
+                errors++;
+                emu_delay(emu);
+                if (kboot_put_simple(emu, KBOOT_NAK) < 0)
+                    goto end;
+                break;
+
+            case KBOOT_COMMAND:
+            {
+                uint8_t cmd = pkt[6];
+                uint32_t status = 0;
+
+                if (!started)
+                {
+                    started = 1;
+                    start = utils_monotonic_ns();
+                }
+                emu_delay(emu);
+                if (kboot_put_simple(emu, KBOOT_ACK) < 0)
+                    goto end;
+                switch (cmd)
+                {
+                    case KBOOT_CMD_WRITE_MEMORY:
+                        /* One response now, another after the data */
+                        write_left = (pkt[14] | (pkt[15] << 8) |
+                                      (pkt[16] << 16) |
+                                      ((uint32_t)pkt[17] << 24));
+                        break;
+                    case KBOOT_CMD_RESET:
+                        resetting = 1;
+                        break;
+                    case 0x0d:      /* flash-erase-all-unsecure */
+                    case 0x01:      /* flash-erase-all */
+                    case 0x02:      /* flash-erase-region */
+                        break;
+                    default:
+                        status = KBOOT_STATUS_UNKNOWN_CMD;
+                        break;
+                }
+                if (kboot_put_response(emu, status, cmd) < 0)
+                    goto end;
+                break;
+            }
+
+            case KBOOT_DATA:
+            {
+                int len = pkt[2] | (pkt[3] << 8);
+
+                emu_delay(emu);
+                if (kboot_put_simple(emu, KBOOT_ACK) < 0)
+                    goto end;
+                if (write_left == 0)
+                {
+                    /* Not expecting data */
+                    errors++;
+                    break;
+                }
+                bytes += len;
+                write_left = (write_left > (uint32_t)len) ?
+                    write_left - len : 0;
+                if (write_left == 0 &&
+                    kboot_put_response(emu, 0, KBOOT_CMD_WRITE_MEMORY) < 0)
+                    goto end;
+                break;
+            }
+
+            default:
+                /* NAKs and aborts from the host, or noise */
+                break;
+        }
+    }
+
+end:
+    free(pkt);
+    return result;
+}
+
+
+static int run_stage(up_emulator_t *emu, const char *protocol)
+{
+    if (!strcmp(protocol, "grouch"))
+        return emulate_grouch(emu);
+    if (!strncmp(protocol, "xmodem", 6))
+        return emulate_xmodem(emu);
+    if (!strncmp(protocol, "kinetis", 7))
+        return emulate_kinetis(emu);
+    emu_printf(emu, "\r\n[emu] cannot emulate %s\r\n", protocol);
+    return STAGE_FAILED;
+}
+
+static void *emulator_thread(void *arg)
+{
+    up_emulator_t *emu = (up_emulator_t *)arg;
+    int i;
+
+    for (i = 0; i < emu->nr_stages; i++)
+    {
+        int rv = run_stage(emu, emu->stages[i]);
+
+        if (rv == STAGE_STOPPED)
+            return NULL;
+        if (rv == STAGE_FAILED)
+            break;
+    }
+
+    /* Be a console */
+    emu_printf(emu, "\r\n[emu] target up\r\n");
+    while (1)
+    {
+        const uint8_t *run;
+        int nr;
+
+        if (emu->in.count == 0 && emu_fill(emu, -1) < 0)
+            break;
+        nr = up_ring_run(&emu->in, &run);
+        if (emu_put(emu, run, nr) < 0)
+            break;
+        up_ring_consume(&emu->in, nr);
+    }
+    return NULL;
+}
+
+
+up_emulator_t *up_emulator_create(int delay_us)
+{
+    up_emulator_t *emu = (up_emulator_t *)malloc(sizeof(up_emulator_t));
+
+    if (emu == NULL)
+        return NULL;
+    memset(emu, '\0', sizeof(up_emulator_t));
+    emu->delay_us = delay_us;
+    emu->fd = -1;
+    emu->stop_pipe[0] = emu->stop_pipe[1] = -1;
+    if (up_ring_init(&emu->in, UP_EMULATOR_IN_BYTES) < 0 ||
+        pipe(emu->stop_pipe) < 0)
+    {
+        up_emulator_dispose(emu);
+        return NULL;
+    }
+    return emu;
+}
+
+
+int up_emulator_add_stage(up_emulator_t *emu, const char *protocol)
+{
+    if (emu->nr_stages >= UP_EMULATOR_MAX_STAGES)
+        return -1;
+    emu->stages[emu->nr_stages++] = protocol;
+    return 0;
+}
+
+
+int up_emulator_start(up_emulator_t *emu, int fd)
+{
+    emu->fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (pthread_create(&emu->thread, NULL, emulator_thread, emu) != 0)
+    {
+        fprintf(stderr, "! Cannot start target emulator\n");
+        return -1;
+    }
+    emu->running = 1;
+    return 0;
+}
+
+
+void up_emulator_dispose(up_emulator_t *emu)
+{
+    if (emu == NULL)
+        return;
+    if (emu->running)
+    {
+        if (write(emu->stop_pipe[1], "x", 1) < 0)
+            pthread_cancel(emu->thread);
+        pthread_join(emu->thread, NULL);
+    }
+    if (emu->fd >= 0)
+        close(emu->fd);
+    if (emu->stop_pipe[0] >= 0)
+        close(emu->stop_pipe[0]);
+    if (emu->stop_pipe[1] >= 0)
+        close(emu->stop_pipe[1]);
+    up_ring_free(&emu->in);
+    free(emu);
+}
+
+/* End file */
@@ -0,0 +1,225 @@
+/* up_reactor.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  An epoll event loop with timerfd-backed deadlines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "upc2/up_reactor.h"
+#include "upc2/utils.h"
+
+
+up_reactor_t *up_reactor_create(void) {
+    up_reactor_t *r = (up_reactor_t *)malloc(sizeof(up_reactor_t));
+    struct epoll_event ev;
+    int i;
+
+    if (r == NULL)
+        return NULL;
+    memset(r, '\0', sizeof(up_reactor_t));
+    for (i = 0; i < UP_REACTOR_MAX_FDS; i++)
+        r->watch[i].fd = -1;
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (r->epoll_fd < 0 || r->timer_fd < 0)
+        goto fail;
+
+    /* The timer is the one event with no watch behind it */
+    memset(&ev, '\0', sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->timer_fd, &ev) < 0)
+        goto fail;
+    return r;
+
+fail:
+    {
+        int err = errno;
+
+        up_reactor_dispose(r);
+        errno = err;
+    }
+    return NULL;
+}
+
+void up_reactor_dispose(up_reactor_t *r) {
+    if (r == NULL)
+        return;
+    if (r->timer_fd >= 0)
+        close(r->timer_fd);
+    if (r->epoll_fd >= 0)
+        close(r->epoll_fd);
+    free(r);
+}
+
+
+static up_reactor_watch_t *find_watch(up_reactor_t *r, int fd) {
+    int i;
+
+    for (i = 0; i < UP_REACTOR_MAX_FDS; i++) {
+        if (r->watch[i].fd == fd)
+            return &r->watch[i];
+    }
+    return NULL;
+}
+
+int up_reactor_watch(up_reactor_t     *r,
+                     int               fd,
+                     int               events,
+                     up_reactor_fd_fn  fn,
+                     void             *arg) {
+    up_reactor_watch_t *w = find_watch(r, fd);
+    struct epoll_event ev;
+    int op = EPOLL_CTL_MOD;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (w == NULL) {
+        w = find_watch(r, -1);
+        if (w == NULL) {
+            errno = ENOSPC;
+            return -1;
+        }
+        op = EPOLL_CTL_ADD;
+    } else if (w->events == events) {
+        w->fn = fn;
+        w->arg = arg;
+        return 0;
+    }
+
+    memset(&ev, '\0', sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(r->epoll_fd, op, fd, &ev) < 0)
+        return -1;
+    w->fd = fd;
+    w->events = events;
+    w->fn = fn;
+    w->arg = arg;
+    return 0;
+}
+
+void up_reactor_unwatch(up_reactor_t *r, int fd) {
+    up_reactor_watch_t *w = find_watch(r, fd);
+
+    if (w == NULL || fd < 0)
+        return;
+    /* Closing the fd may already have taken it out of the set */
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    memset(w, '\0', sizeof(up_reactor_watch_t));
+    w->fd = -1;
+}
+
+
+void up_reactor_timer_stop(up_reactor_t *r, up_reactor_timer_t *t) {
+    up_reactor_timer_t **pp;
+
+    if (!t->armed)
+        return;
+    for (pp = &r->timers; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+    t->next = NULL;
+    t->armed = 0;
+}
+
+void up_reactor_timer_start(up_reactor_t *r, up_reactor_timer_t *t, int ms) {
+    up_reactor_timer_t **pp;
+
+    up_reactor_timer_stop(r, t);
+    t->due_ns = utils_monotonic_ns() + (uint64_t)(ms > 0 ? ms : 0) * 1000000ULL;
+    for (pp = &r->timers; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->due_ns > t->due_ns)
+            break;
+    }
+    t->next = *pp;
+    *pp = t;
+    t->armed = 1;
+}
+
+/* Set the timerfd for the soonest deadline, if that has changed */
+static int arm_timer_fd(up_reactor_t *r) {
+    uint64_t want = (r->timers != NULL) ? r->timers->due_ns : 0;
+    struct itimerspec its;
+
+    if (want == r->timer_set_ns)
+        return 0;
+    memset(&its, '\0', sizeof(its));
+    /* Zero disarms; a deadline of exactly zero cannot happen */
+    its.it_value.tv_sec = want / 1000000000ULL;
+    its.it_value.tv_nsec = want % 1000000000ULL;
+    if (timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        return -1;
+    r->timer_set_ns = want;
+    return 0;
+}
+
+/* Run every timer whose time has come */
+static int run_timers(up_reactor_t *r) {
+    uint64_t now = utils_monotonic_ns();
+    int ran = 0;
+
+    while (r->timers != NULL && r->timers->due_ns <= now) {
+        up_reactor_timer_t *t = r->timers;
+
+        /* Off the list first: the callback may well re-arm it */
+        r->timers = t->next;
+        t->next = NULL;
+        t->armed = 0;
+        t->expired(t, t->arg);
+        ran++;
+    }
+    return ran;
+}
+
+int up_reactor_run(up_reactor_t *r, int timeout_ms) {
+    struct epoll_event events[UP_REACTOR_MAX_FDS + 1];
+    int ran = 0;
+    int nr;
+    int i;
+
+    if (arm_timer_fd(r) < 0)
+        return -1;
+    nr = epoll_wait(r->epoll_fd, events, UP_REACTOR_MAX_FDS + 1,
+                    timeout_ms);
+    if (nr < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    for (i = 0; i < nr; i++) {
+        up_reactor_watch_t *w = (up_reactor_watch_t *)events[i].data.ptr;
+
+        if (w == NULL) {
+            uint64_t expiries;
+
+            /* Just clear it; run_timers() goes by the clock */
+            if (read(r->timer_fd, &expiries, sizeof(expiries)) < 0 &&
+                errno != EAGAIN)
+                return -1;
+            r->timer_set_ns = 0;
+            continue;
+        }
+        /* An earlier callback may have unwatched it */
+        if (w->fn == NULL)
+            continue;
+        w->fn(r, w->fd, events[i].events, w->arg);
+        ran++;
+    }
+    return ran + run_timers(r);
+}
+
+/* End file */
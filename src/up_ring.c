@@ -0,0 +1,131 @@
+/* up_ring.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A simple byte ring, used by BIOs to buffer input and output.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "upc2/up_ring.h"
+
+
+int up_ring_init(up_ring_t *ring, int size)
+{
+    memset(ring, '\0', sizeof(up_ring_t));
+    ring->data = (uint8_t *)malloc(size);
+    if (ring->data == NULL)
+        return -1;
+    ring->size = size;
+    return 0;
+}
+
+
+void up_ring_free(up_ring_t *ring)
+{
+    free(ring->data);
+    memset(ring, '\0', sizeof(up_ring_t));
+}
+
+
+int up_ring_put(up_ring_t *ring, const uint8_t *bytes, int nr)
+{
+    struct iovec iov[2];
+    int iovcnt = up_ring_space_iov(ring, iov);
+    int queued = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && queued < nr; i++)
+    {
+        int take = nr - queued;
+
+        if (take > (int)iov[i].iov_len)
+            take = iov[i].iov_len;
+        memcpy(iov[i].iov_base, &bytes[queued], take);
+        queued += take;
+    }
+    up_ring_commit(ring, queued);
+    return queued;
+}
+
+
+int up_ring_copy(const up_ring_t *ring, uint8_t *tgt, int nr)
+{
+    int first;
+
+    if (nr > ring->count)
+        nr = ring->count;
+    first = ring->size - ring->head;
+    if (first > nr)
+        first = nr;
+    memcpy(tgt, &ring->data[ring->head], first);
+    memcpy(tgt + first, &ring->data[0], nr - first);
+    return nr;
+}
+
+
+int up_ring_consume(up_ring_t *ring, int nr)
+{
+    if (nr > ring->count)
+        nr = ring->count;
+    ring->head = (ring->head + nr) % ring->size;
+    ring->count -= nr;
+    /* Keep runs as long as possible */
+    if (ring->count == 0)
+        ring->head = 0;
+    return nr;
+}
+
+
+int up_ring_run(const up_ring_t *ring, const uint8_t **bytes)
+{
+    int run = ring->size - ring->head;
+
+    if (run > ring->count)
+        run = ring->count;
+    *bytes = &ring->data[ring->head];
+    return run;
+}
+
+
+int up_ring_data_iov(const up_ring_t *ring, struct iovec iov[2])
+{
+    if (ring->count == 0)
+        return 0;
+    iov[0].iov_base = &ring->data[ring->head];
+    iov[0].iov_len = ring->count;
+    if (ring->head + ring->count <= ring->size)
+        return 1;
+    iov[0].iov_len = ring->size - ring->head;
+    iov[1].iov_base = &ring->data[0];
+    iov[1].iov_len = ring->count - iov[0].iov_len;
+    return 2;
+}
+
+
+int up_ring_space_iov(const up_ring_t *ring, struct iovec iov[2])
+{
+    int tail = (ring->head + ring->count) % ring->size;
+    int room = ring->size - ring->count;
+
+    if (room == 0)
+        return 0;
+    iov[0].iov_base = &ring->data[tail];
+    iov[0].iov_len = room;
+    if (tail + room <= ring->size)
+        return 1;
+    iov[0].iov_len = ring->size - tail;
+    iov[1].iov_base = &ring->data[0];
+    iov[1].iov_len = room - iov[0].iov_len;
+    return 2;
+}
+
+
+void up_ring_commit(up_ring_t *ring, int nr)
+{
+    ring->count += nr;
+}
+
+/* End file */
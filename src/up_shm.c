@@ -0,0 +1,342 @@
+/* up_shm.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A single-writer, many-reader ring in shared memory, for publishing
+ *  the serial stream to other processes.  See up_shm.h for the
+ *  layout.
+ *
+ *  Nothing here takes a lock.  The writer says where it is about to
+ *  write (reserve) before writing, and where it has finished (head)
+ *  after; a reader checks reserve again once it has looked at a
+ *  record, and if the writer has come round to it in the meantime,
+ *  throws away what it saw.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "upc2/up_shm.h"
+
+
+#define REC_LEN ((uint64_t)sizeof(up_shm_record_t))
+#define ALIGN8(n) (((uint64_t)(n) + 7) & ~(uint64_t)7)
+
+/* Sequence number a reader expects before it has seen any */
+#define SEQ_UNKNOWN (~(uint64_t)0)
+
+
+static void futex_wake_all(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Bytes taken by the record at pos, including any skip to the start */
+static uint64_t record_span(const up_shm_t *shm, uint64_t pos) {
+    uint64_t size = shm->hdr->data_size;
+    uint64_t left = size - (pos & (size - 1));
+    const up_shm_record_t *rec;
+
+    if (left < REC_LEN)
+        return left;
+    rec = (const up_shm_record_t *)&shm->data[pos & (size - 1)];
+    if (rec->flags & UP_SHM_PAD)
+        return left;
+    return REC_LEN + ALIGN8(rec->len);
+}
+
+/* Claim everything up to end, moving the tail past whatever that
+ * will overwrite
+ */
+static void reserve(up_shm_t *shm, uint64_t end) {
+    up_shm_header_t *hdr = shm->hdr;
+    uint64_t tail = hdr->tail;
+
+    while (tail + hdr->data_size < end && tail < hdr->head)
+        tail += record_span(shm, tail);
+    if (tail + hdr->data_size < end)
+        tail = end - hdr->data_size;
+    __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->reserve, end, __ATOMIC_RELAXED);
+    /* Readers must be able to see the claim before any of the writes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void publish_one(up_shm_t       *shm,
+                        const uint8_t  *bytes,
+                        int             nr,
+                        uint64_t        ts_ns) {
+    up_shm_header_t *hdr = shm->hdr;
+    uint64_t size = hdr->data_size;
+    uint64_t pos = hdr->head;
+    uint64_t off = pos & (size - 1);
+    uint64_t need = REC_LEN + ALIGN8(nr);
+    uint64_t left = size - off;
+    up_shm_record_t *rec;
+
+    if (left < need) {
+        /* Records never wrap, so skip to the start */
+        reserve(shm, pos + left + need);
+        if (left >= REC_LEN) {
+            rec = (up_shm_record_t *)&shm->data[off];
+            memset(rec, '\0', REC_LEN);
+            rec->len = left - REC_LEN;
+            rec->flags = UP_SHM_PAD;
+        }
+        pos += left;
+        off = 0;
+    } else {
+        reserve(shm, pos + need);
+    }
+
+    rec = (up_shm_record_t *)&shm->data[off];
+    rec->seq = hdr->records;
+    rec->ts_ns = ts_ns;
+    rec->len = nr;
+    rec->flags = 0;
+    memcpy(&shm->data[off + REC_LEN], bytes, nr);
+
+    __atomic_store_n(&hdr->records, hdr->records + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->head, pos + need, __ATOMIC_RELEASE);
+}
+
+void up_shm_publish(up_shm_t *shm, const uint8_t *bytes, int nr) {
+    up_shm_header_t *hdr = shm->hdr;
+    struct timespec now;
+    uint64_t ts_ns;
+
+    if (nr <= 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    while (nr > 0) {
+        int n = (nr > UP_SHM_MAX_RECORD) ? UP_SHM_MAX_RECORD : nr;
+
+        publish_one(shm, bytes, n, ts_ns);
+        bytes += n;
+        nr -= n;
+    }
+
+    /* Only pay for a system call if someone is waiting */
+    __atomic_add_fetch(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake_all(&hdr->wake);
+}
+
+
+static int map_ring(up_shm_t *shm, int fd, uint64_t len) {
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+        return -1;
+    shm->map_len = len;
+    shm->hdr = (up_shm_header_t *)map;
+    shm->data = (uint8_t *)map + UP_SHM_HEADER_BYTES;
+    return 0;
+}
+
+up_shm_t *up_shm_create(const char *name) {
+    up_shm_t *shm = (up_shm_t *)malloc(sizeof(up_shm_t));
+    uint64_t len = UP_SHM_HEADER_BYTES + UP_SHM_DATA_BYTES;
+    int fd;
+
+    if (shm == NULL) {
+        fprintf(stderr, "! Out of memory for shared ring\n");
+        return NULL;
+    }
+    memset(shm, '\0', sizeof(up_shm_t));
+    if (strlen(name) >= sizeof(shm->name)) {
+        fprintf(stderr, "! Shared ring name '%s' is too long\n", name);
+        free(shm);
+        return NULL;
+    }
+    strcpy(shm->name, name);
+    shm->writer = 1;
+
+    /* A ring left by a upc2 that crashed is of no use to anyone */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || ftruncate(fd, len) < 0 || map_ring(shm, fd, len) < 0) {
+        fprintf(stderr, "! Cannot create shared ring %s: %s [%d]\n",
+                name, strerror(errno), errno);
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name);
+        }
+        free(shm);
+        return NULL;
+    }
+    close(fd);
+
+    shm->hdr->header_size = UP_SHM_HEADER_BYTES;
+    shm->hdr->writer_pid = getpid();
+    shm->hdr->data_size = UP_SHM_DATA_BYTES;
+    /* Readers believe nothing until they see the magic */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shm->hdr->magic, UP_SHM_MAGIC, UP_SHM_MAGIC_LEN);
+    return shm;
+}
+
+up_shm_t *up_shm_open(const char *name, int from_start) {
+    up_shm_t *shm = (up_shm_t *)malloc(sizeof(up_shm_t));
+    struct stat st;
+    up_shm_header_t *hdr;
+    int err;
+    int fd;
+
+    if (shm == NULL)
+        return NULL;
+    memset(shm, '\0', sizeof(up_shm_t));
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        goto fail;
+    if (fstat(fd, &st) < 0 || st.st_size < UP_SHM_HEADER_BYTES ||
+        map_ring(shm, fd, st.st_size) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        goto fail;
+    }
+    close(fd);
+
+    hdr = shm->hdr;
+    if (memcmp(hdr->magic, UP_SHM_MAGIC, UP_SHM_MAGIC_LEN) != 0 ||
+        hdr->header_size != UP_SHM_HEADER_BYTES ||
+        hdr->data_size == 0 ||
+        (hdr->data_size & (hdr->data_size - 1)) != 0 ||
+        hdr->header_size + hdr->data_size > shm->map_len) {
+        munmap(hdr, shm->map_len);
+        errno = EINVAL;
+        goto fail;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    shm->pos = from_start ? __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) :
+        __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    shm->seq = SEQ_UNKNOWN;
+    return shm;
+
+fail:
+    err = errno;
+    free(shm);
+    errno = err;
+    return NULL;
+}
+
+/* Non-zero if the writer may have overwritten what was at pos */
+static int overwritten(const up_shm_t *shm, uint64_t pos) {
+    /* Whatever we read must be read before we look */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shm->hdr->reserve, __ATOMIC_RELAXED) - pos >
+        shm->hdr->data_size;
+}
+
+int up_shm_read(up_shm_t               *shm,
+                const up_shm_record_t **rec,
+                const uint8_t         **bytes,
+                uint64_t               *lost) {
+    up_shm_header_t *hdr = shm->hdr;
+    uint64_t size = hdr->data_size;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        uint64_t left = size - (shm->pos & (size - 1));
+        const up_shm_record_t *r;
+        uint64_t seq;
+        uint32_t len;
+        uint32_t flags;
+
+        if (shm->pos == head)
+            return 0;
+        if (head - shm->pos > size) {
+            /* Lapped: start again from the newest.  The gap in the
+             * sequence numbers tells the caller how much went.
+             */
+            shm->pos = head;
+            continue;
+        }
+        if (left < REC_LEN) {
+            shm->pos += left;
+            continue;
+        }
+        r = (const up_shm_record_t *)&shm->data[shm->pos & (size - 1)];
+        seq = r->seq;
+        len = r->len;
+        flags = r->flags;
+        if (overwritten(shm, shm->pos) || len > UP_SHM_MAX_RECORD) {
+            shm->pos = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (flags & UP_SHM_PAD) {
+            shm->pos += left;
+            continue;
+        }
+        if (shm->seq != SEQ_UNKNOWN && seq != shm->seq) {
+            *lost = seq - shm->seq;
+            shm->seq = seq;
+            return -1;
+        }
+        shm->seq = seq;
+        shm->cur_pos = shm->pos;
+        shm->cur_next = shm->pos + REC_LEN + ALIGN8(len);
+        *rec = r;
+        *bytes = (const uint8_t *)r + REC_LEN;
+        return 1;
+    }
+}
+
+int up_shm_done(up_shm_t *shm) {
+    shm->pos = shm->cur_next;
+    shm->seq++;
+    return overwritten(shm, shm->cur_pos) ? -1 : 0;
+}
+
+int up_shm_wait(up_shm_t *shm, int timeout_ms) {
+    up_shm_header_t *hdr = shm->hdr;
+    struct timespec ts;
+    uint32_t wake;
+    int rv;
+
+    /* Say we are waiting before looking, so that the writer either
+     * sees us or we see what it wrote
+     */
+    __atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    wake = __atomic_load_n(&hdr->wake, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) != shm->pos) {
+        rv = 1;
+    } else if (__atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST)) {
+        rv = -1;
+    } else {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+        rv = (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != shm->pos);
+    }
+    __atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    return rv;
+}
+
+void up_shm_dispose(up_shm_t *shm) {
+    if (shm == NULL)
+        return;
+    if (shm->writer) {
+        __atomic_store_n(&shm->hdr->closed, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&shm->hdr->wake, 1, __ATOMIC_SEQ_CST);
+        futex_wake_all(&shm->hdr->wake);
+        shm_unlink(shm->name);
+    }
+    munmap(shm->hdr, shm->map_len);
+    free(shm);
+}
+
+/* End file */
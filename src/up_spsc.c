@@ -0,0 +1,146 @@
+/* up_spsc.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A lock-free single-producer, single-consumer byte ring.
+ *
+ *  The producer loads head with acquire, so that it sees the space the
+ *  consumer has finished with, and stores tail with release, so that
+ *  the consumer sees the bytes before the new tail.  The consumer does
+ *  the reverse.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "upc2/up_spsc.h"
+
+
+int up_spsc_init(up_spsc_t *q, int size)
+{
+    uint32_t cap = 1;
+
+    memset(q, '\0', sizeof(up_spsc_t));
+    if (size <= 0)
+        return -1;
+    while (cap < (uint32_t)size)
+        cap <<= 1;
+    q->data = (uint8_t *)malloc(cap);
+    if (q->data == NULL)
+        return -1;
+    q->size = cap;
+    return 0;
+}
+
+
+void up_spsc_free(up_spsc_t *q)
+{
+    free(q->data);
+    memset(q, '\0', sizeof(up_spsc_t));
+}
+
+
+/* nr bytes from position pos, as at most two iovecs */
+static int ring_iov(const up_spsc_t *q, uint64_t pos, uint32_t nr,
+                    struct iovec iov[2])
+{
+    uint32_t off = pos & (q->size - 1);
+    uint32_t first = q->size - off;
+
+    if (nr == 0)
+        return 0;
+    iov[0].iov_base = &q->data[off];
+    if (nr <= first)
+    {
+        iov[0].iov_len = nr;
+        return 1;
+    }
+    iov[0].iov_len = first;
+    iov[1].iov_base = q->data;
+    iov[1].iov_len = nr - first;
+    return 2;
+}
+
+
+int up_spsc_space_iov(up_spsc_t *q, struct iovec iov[2])
+{
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    /* Only we move tail */
+    return ring_iov(q, q->tail, q->size - (uint32_t)(q->tail - head), iov);
+}
+
+
+void up_spsc_commit(up_spsc_t *q, int nr)
+{
+    __atomic_store_n(&q->tail, q->tail + nr, __ATOMIC_RELEASE);
+}
+
+
+int up_spsc_put(up_spsc_t *q, const uint8_t *bytes, int nr)
+{
+    struct iovec iov[2];
+    int iovcnt = up_spsc_space_iov(q, iov);
+    int queued = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && queued < nr; i++)
+    {
+        int take = nr - queued;
+
+        if (take > (int)iov[i].iov_len)
+            take = iov[i].iov_len;
+        memcpy(iov[i].iov_base, &bytes[queued], take);
+        queued += take;
+    }
+    if (queued > 0)
+        up_spsc_commit(q, queued);
+    return queued;
+}
+
+
+int up_spsc_data_iov(up_spsc_t *q, struct iovec iov[2])
+{
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    /* Only we move head */
+    return ring_iov(q, q->head, (uint32_t)(tail - q->head), iov);
+}
+
+
+int up_spsc_copy(up_spsc_t *q, uint8_t *tgt, int nr)
+{
+    struct iovec iov[2];
+    int iovcnt = up_spsc_data_iov(q, iov);
+    int copied = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && copied < nr; i++)
+    {
+        int take = nr - copied;
+
+        if (take > (int)iov[i].iov_len)
+            take = iov[i].iov_len;
+        memcpy(&tgt[copied], iov[i].iov_base, take);
+        copied += take;
+    }
+    return copied;
+}
+
+
+void up_spsc_consume(up_spsc_t *q, int nr)
+{
+    __atomic_store_n(&q->head, q->head + nr, __ATOMIC_RELEASE);
+}
+
+
+int up_spsc_count(up_spsc_t *q)
+{
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    return (int)(tail - head);
+}
+
+/* End file */
@@ -0,0 +1,174 @@
+/* up_txq.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A transmit queue with a lane for bulk output and one for urgent
+ *  output.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "upc2/up_txq.h"
+
+
+int up_txq_init(up_txq_t *q, int size)
+{
+    memset(q, '\0', sizeof(up_txq_t));
+    if (up_ring_init(&q->bulk, size) < 0)
+        return -1;
+    if (up_ring_init(&q->urgent, UP_TXQ_URGENT_BYTES) < 0)
+    {
+        up_ring_free(&q->bulk);
+        return -1;
+    }
+    return 0;
+}
+
+
+void up_txq_free(up_txq_t *q)
+{
+    up_ring_free(&q->bulk);
+    up_ring_free(&q->urgent);
+    memset(q, '\0', sizeof(up_txq_t));
+}
+
+
+int up_txq_room(const up_txq_t *q)
+{
+    return q->bulk.size - q->bulk.count;
+}
+
+
+int up_txq_put(up_txq_t *q, const uint8_t *bytes, int nr, int how)
+{
+    int queued = up_ring_put(&q->bulk, bytes, nr);
+    int last;
+
+    if (queued == 0)
+        return 0;
+    q->count += queued;
+    last = (q->frame_head + q->frames - 1) % UP_TXQ_FRAMES;
+    if ((how == UP_TXQ_MORE && q->frames > 0) ||
+        q->frames == UP_TXQ_FRAMES)
+    {
+        q->frame_len[last] += queued;
+        return queued;
+    }
+    /* The start of a frame we are told to continue has already gone */
+    if (q->frames == 0 && how != UP_TXQ_NEW)
+        q->started = 1;
+    last = (q->frame_head + q->frames) % UP_TXQ_FRAMES;
+    q->frame_len[last] = queued;
+    q->frames++;
+    return queued;
+}
+
+
+int up_txq_put_urgent(up_txq_t *q, const uint8_t *bytes, int nr)
+{
+    int queued = up_ring_put(&q->urgent, bytes, nr);
+
+    q->count += queued;
+    return queued;
+}
+
+
+/* Describe len bytes from offset off of the bulk lane */
+static int bulk_iov(const up_txq_t *q, int off, int len, struct iovec *iov)
+{
+    struct iovec all[2];
+    int nr = up_ring_data_iov(&q->bulk, all);
+    int iovcnt = 0;
+    int i;
+
+    for (i = 0; i < nr && len > 0; i++)
+    {
+        int piece = all[i].iov_len;
+
+        if (off >= piece)
+        {
+            off -= piece;
+            continue;
+        }
+        piece -= off;
+        if (piece > len)
+            piece = len;
+        iov[iovcnt].iov_base = (uint8_t *)all[i].iov_base + off;
+        iov[iovcnt].iov_len = piece;
+        iovcnt++;
+        len -= piece;
+        off = 0;
+    }
+    return iovcnt;
+}
+
+/* Bulk bytes which must go before any urgent ones */
+static int bulk_first(const up_txq_t *q)
+{
+    if (!q->started || q->frames == 0)
+        return 0;
+    return q->frame_len[q->frame_head];
+}
+
+int up_txq_data_iov(const up_txq_t *q, struct iovec iov[UP_TXQ_IOV])
+{
+    int first = bulk_first(q);
+    int iovcnt;
+
+    iovcnt = bulk_iov(q, 0, first, iov);
+    iovcnt += up_ring_data_iov(&q->urgent, &iov[iovcnt]);
+    iovcnt += bulk_iov(q, first, q->bulk.count - first, &iov[iovcnt]);
+    return iovcnt;
+}
+
+
+static void bulk_consume(up_txq_t *q, int nr)
+{
+    nr = up_ring_consume(&q->bulk, nr);
+    q->count -= nr;
+    while (nr > 0 && q->frames > 0)
+    {
+        int *len = &q->frame_len[q->frame_head];
+        int take = (nr < *len) ? nr : *len;
+
+        *len -= take;
+        nr -= take;
+        if (*len > 0)
+        {
+            q->started = 1;
+            break;
+        }
+        q->frame_head = (q->frame_head + 1) % UP_TXQ_FRAMES;
+        q->frames--;
+        q->started = 0;
+    }
+}
+
+void up_txq_consume(up_txq_t *q, int nr)
+{
+    int first = bulk_first(q);
+    int take;
+
+    take = (nr < first) ? nr : first;
+    bulk_consume(q, take);
+    nr -= take;
+    take = up_ring_consume(&q->urgent, nr);
+    q->count -= take;
+    nr -= take;
+    bulk_consume(q, nr);
+}
+
+
+void up_txq_discard(up_txq_t *q)
+{
+    up_ring_consume(&q->bulk, q->bulk.count);
+    up_ring_consume(&q->urgent, q->urgent.count);
+    q->frames = 0;
+    q->frame_head = 0;
+    q->started = 0;
+    q->count = 0;
+}
+
+/* End file */
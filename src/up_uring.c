@@ -0,0 +1,259 @@
+/* up_uring.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  A minimal io_uring over the raw system calls.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "upc2/up_uring.h"
+
+
+static int sys_io_uring_setup(unsigned int entries,
+                              struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags,
+                              void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, arg, argsz);
+}
+
+/* Submit what is queued and, if wait, wait up to timeout_ms for a
+ * completion.  Returns 0 or -1.
+ */
+static int uring_enter(up_uring_t *ring, int wait, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = 0;
+    int rv;
+
+    if (!wait && ring->to_submit == 0)
+        return 0;
+    if (wait) {
+        memset(&arg, '\0', sizeof(arg));
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+    ring->enters++;
+    rv = sys_io_uring_enter(ring->fd, ring->to_submit, wait ? 1 : 0, flags,
+                            wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (rv < 0) {
+        /* Timing out and being interrupted are not failures */
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN ||
+            errno == EBUSY)
+            return 0;
+        return -1;
+    }
+    ring->to_submit -= ((unsigned int)rv < ring->to_submit) ?
+        (unsigned int)rv : ring->to_submit;
+    return 0;
+}
+
+/* A cleared submission queue entry, or NULL if there is no room */
+static struct io_uring_sqe *get_sqe(up_uring_t *ring) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries) {
+        /* Full: make room by handing what we have to the kernel */
+        if (uring_enter(ring, 0, 0) < 0 ||
+            tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+            ring->sq_entries)
+            return NULL;
+    }
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, '\0', sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void queue_sqe(up_uring_t *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static int queue_rw(up_uring_t *ring, up_uring_op_t *op, int opcode,
+                    int fd, const void *buf, unsigned int nr) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = nr;
+    /* Use and update the file position, as read() and write() do */
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    op->busy = 1;
+    queue_sqe(ring);
+    return 0;
+}
+
+int up_uring_read(up_uring_t *ring, up_uring_op_t *op,
+                  int fd, void *buf, unsigned int nr) {
+    return queue_rw(ring, op, IORING_OP_READ, fd, buf, nr);
+}
+
+int up_uring_write(up_uring_t *ring, up_uring_op_t *op,
+                   int fd, const void *buf, unsigned int nr) {
+    return queue_rw(ring, op, IORING_OP_WRITE, fd, buf, nr);
+}
+
+int up_uring_poll(up_uring_t *ring, up_uring_op_t *op, int fd, int events) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    op->busy = 1;
+    queue_sqe(ring);
+    return 0;
+}
+
+int up_uring_poll_remove(up_uring_t *ring, up_uring_op_t *op) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)op;
+    /* The removal's own completion is of no interest */
+    sqe->user_data = 0;
+    queue_sqe(ring);
+    return 0;
+}
+
+int up_uring_reap(up_uring_t *ring) {
+    unsigned int head = *ring->cq_head;
+    int nr = 0;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        up_uring_op_t *op = (up_uring_op_t *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        /* Free the slot before the callback, which may queue more */
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (op != NULL) {
+            op->busy = 0;
+            op->complete(op, res);
+            nr++;
+        }
+    }
+    return nr;
+}
+
+int up_uring_submit(up_uring_t *ring) {
+    return uring_enter(ring, 0, 0);
+}
+
+int up_uring_wait(up_uring_t *ring, int timeout_ms) {
+    /* Don't sleep on completions we already have */
+    if (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != *ring->cq_head)
+        timeout_ms = 0;
+    if (uring_enter(ring, 1, timeout_ms) < 0)
+        return -1;
+    return up_uring_reap(ring);
+}
+
+
+up_uring_t *up_uring_create(void) {
+    struct io_uring_params p;
+    up_uring_t *ring = (up_uring_t *)malloc(sizeof(up_uring_t));
+    uint8_t *sq, *cq;
+
+    if (ring == NULL)
+        return NULL;
+    memset(ring, '\0', sizeof(up_uring_t));
+    memset(&p, '\0', sizeof(p));
+    ring->fd = sys_io_uring_setup(UP_URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    /* We need timed waits in one call (5.11), and one mapping for both
+     * queues (5.4) keeps things simple.
+     */
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        free(ring);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_map_len > ring->sq_map_len)
+        ring->sq_map_len = ring->cq_map_len;
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int err = errno;
+
+        if (ring->sq_map != MAP_FAILED)
+            munmap(ring->sq_map, ring->sq_map_len);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_len);
+        close(ring->fd);
+        free(ring);
+        errno = err;
+        return NULL;
+    }
+    ring->cq_map = ring->sq_map;
+
+    sq = (uint8_t *)ring->sq_map;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+
+    cq = (uint8_t *)ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return ring;
+}
+
+void up_uring_dispose(up_uring_t *ring) {
+    if (ring == NULL)
+        return;
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+    free(ring);
+}
+
+/* End file */
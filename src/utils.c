@@ -9,11 +9,39 @@
 #include <errno.h>
 #include <unistd.h>
 #include <poll.h>
+#include <time.h>
 
 #include "upc2/utils.h"
 #include "upc2/up.h"
 
 
+uint64_t utils_monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+void utils_sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / 1000000000ULL;
+    ts.tv_nsec = deadline_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+
+/* Milliseconds elapsed on the monotonic clock since start */
+static int ms_since(uint64_t start)
+{
+    return (utils_monotonic_ns() - start) / 1000000;
+}
+
+
 int utils_safe_write(int fd, const uint8_t *data, int len) {
     int done = 0;
     int rv;
@@ -85,33 +113,332 @@ int utils_check_critical_control(up_context_t *ctx) {
 }
 
 int utils_bio_safe_write(up_bio_t *bio, const uint8_t *data, int nr) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = nr;
+    return utils_bio_safe_writev(bio, &iov, 1);
+}
+
+int utils_bio_urgent_write(up_bio_t *bio, const uint8_t *data, int nr) {
     int done = 0;
-    struct pollfd fds[1];
 
+    if (bio->urgent_write == NULL)
+        return bio->safe_write(bio, data, nr);
     while (done < nr) {
-        int rv;
+        int rv = bio->urgent_write(bio, &data[done], nr - done);
 
-        rv = bio->write(bio, &data[done], nr-done);
         if (rv < 0) {
             if (errno != EINTR && errno != EAGAIN) {
                 fprintf(stderr, "! Cannot write to bio:  %s [%d] \n",
                         strerror(errno), errno);
-                exit(1);
+                return -1;
             }
+            rv = 0;
+        }
+        done += rv;
+        if (done < nr && utils_bio_wait(bio, POLLOUT, 1000) < 0)
+            return -1;
+    }
+    return done;
+}
+
+int utils_bio_safe_writev(up_bio_t           *bio,
+                          const struct iovec *iov,
+                          int                 iovcnt) {
+    struct iovec local[UTILS_BIO_MAX_IOV];
+    int cur = 0;
+    int done = 0;
+
+    if (iovcnt > UTILS_BIO_MAX_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(local, iov, iovcnt * sizeof(struct iovec));
+
+    while (cur < iovcnt) {
+        int rv;
+
+        if (local[cur].iov_len == 0) {
+            cur++;
+            continue;
+        }
+        if (bio->writev != NULL) {
+            rv = bio->writev(bio, &local[cur], iovcnt - cur);
         } else {
-            done += rv;
+            rv = bio->write(bio, local[cur].iov_base, local[cur].iov_len);
+        }
+        if (rv < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                fprintf(stderr, "! Cannot write to bio:  %s [%d] \n",
+                        strerror(errno), errno);
+                return -1;
+            }
+            rv = 0;
         }
-        if (done < nr) {
-            fds[0].revents = 0;
-            fds[0].events = POLLOUT;
-            fds[0].fd = bio->poll_fd(bio);
-            poll(fds, 1, 1000);
+        done += rv;
+        /* Step over whatever was written */
+        while (cur < iovcnt && rv >= (int)local[cur].iov_len) {
+            rv -= local[cur].iov_len;
+            cur++;
+        }
+        if (cur < iovcnt && rv > 0) {
+            local[cur].iov_base = (uint8_t *)local[cur].iov_base + rv;
+            local[cur].iov_len -= rv;
         }
+        if (cur < iovcnt && utils_bio_wait(bio, POLLOUT, 1000) < 0)
+            return -1;
     }
     return done;
 }
 
 
+int utils_bio_tx_pending(up_bio_t *bio)
+{
+    if (bio->tx_pending == NULL)
+        return 0;
+    return bio->tx_pending(bio);
+}
+
+
+int utils_bio_tx_congested(up_bio_t *bio)
+{
+    if (bio->tx_pending == NULL || bio->tx_high_water == NULL)
+        return 0;
+    return bio->tx_pending(bio) >= bio->tx_high_water(bio);
+}
+
+
+int utils_bio_tx_service(up_bio_t *bio)
+{
+    if (bio->tx_service == NULL)
+        return 0;
+    return bio->tx_service(bio);
+}
+
+
+int utils_bio_wait(up_bio_t *bio, int events, int timeout_ms)
+{
+    struct pollfd fds[1];
+    int wanted = events;
+    int bio_timeout;
+    int rv;
+
+    if (utils_bio_tx_service(bio) < 0)
+        return -1;
+    /* Input the BIO has already read ahead is invisible to poll() */
+    if ((events & POLLIN) && utils_bio_rx_pending(bio) > 0)
+        timeout_ms = 0;
+    /* ... as is a BIO's timer */
+    bio_timeout = utils_bio_poll_timeout(bio);
+    if (bio_timeout >= 0 && (timeout_ms < 0 || bio_timeout < timeout_ms))
+        timeout_ms = bio_timeout;
+    /* Output the BIO is holding back must keep moving, whatever the
+     * caller is waiting for
+     */
+    if (utils_bio_tx_pending(bio) > 0)
+        events |= POLLOUT;
+    if (bio_timeout > 0)
+        events &= ~POLLOUT;
+    fds[0].revents = 0;
+    fds[0].events = events;
+    fds[0].fd = bio->poll_fd(bio);
+    rv = poll(fds, 1, timeout_ms);
+    if (rv >= 0 && (events & POLLIN) && utils_bio_rx_pending(bio) > 0)
+        fds[0].revents |= POLLIN;
+    if (rv < 0)
+        return (errno == EINTR) ? 0 : -1;
+    if (((fds[0].revents & POLLOUT) || bio_timeout >= 0) &&
+        utils_bio_tx_service(bio) < 0)
+        return -1;
+    return fds[0].revents & (wanted | POLLERR | POLLHUP | POLLNVAL);
+}
+
+
+int utils_bio_rx_pending(up_bio_t *bio)
+{
+    if (bio->rx_pending == NULL)
+        return 0;
+    return bio->rx_pending(bio);
+}
+
+int utils_bio_poll_timeout(up_bio_t *bio)
+{
+    if (bio->poll_timeout == NULL)
+        return -1;
+    return bio->poll_timeout(bio);
+}
+
+
+int utils_bio_peek(up_bio_t *bio, uint8_t *data, int nr)
+{
+    if (bio->peek == NULL)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+    return bio->peek(bio, data, nr);
+}
+
+
+int utils_bio_consume(up_bio_t *bio, int nr)
+{
+    if (bio->consume == NULL)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+    return bio->consume(bio, nr);
+}
+
+
+int utils_bio_borrow(up_bio_t       *bio,
+                     const uint8_t **data,
+                     uint8_t        *scratch,
+                     int             nr)
+{
+    if (bio->borrow == NULL)
+    {
+        *data = scratch;
+        return bio->read(bio, scratch, nr);
+    }
+    return bio->borrow(bio, data);
+}
+
+
+int utils_bio_release(up_bio_t *bio, int nr)
+{
+    if (bio->release == NULL)
+        return nr; /* Consumed by the read() in utils_bio_borrow() */
+    return bio->release(bio, nr);
+}
+
+
+int utils_bio_read_byte(up_bio_t *bio, int timeout_ms)
+{
+    uint64_t start = utils_monotonic_ns();
+    uint8_t c;
+    int rv;
+
+    while (1)
+    {
+        int elapsed;
+
+        rv = bio->read(bio, &c, 1);
+        if (rv == 1)
+            return c;
+        if (rv == 0)
+        {
+            /* Hung up: waiting won't bring anything */
+            errno = EPIPE;
+            return -1;
+        }
+        if (errno != EINTR && errno != EAGAIN)
+            return -1;
+
+        elapsed = ms_since(start);
+        if (elapsed >= timeout_ms)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (utils_bio_wait(bio, POLLIN, timeout_ms - elapsed) < 0)
+            return -1;
+    }
+}
+
+
+int utils_bio_flush(up_bio_t *bio, int timeout_ms)
+{
+    uint64_t start = utils_monotonic_ns();
+    int pending;
+
+    while ((pending = utils_bio_tx_service(bio)) > 0)
+    {
+        int elapsed = ms_since(start);
+
+        if (elapsed >= timeout_ms)
+            break;
+        if (utils_bio_wait(bio, POLLOUT, timeout_ms - elapsed) < 0)
+            return -1;
+    }
+    return pending;
+}
+
+
+void utils_bio_count_read(up_bio_stats_t *stats, int nr, int rv)
+{
+    stats->reads++;
+    if (rv > 0)
+    {
+        stats->bytes_in += rv;
+        if (rv > stats->largest_read)
+            stats->largest_read = rv;
+    }
+    else if (rv < 0 && errno == EAGAIN)
+    {
+        stats->read_eagain++;
+    }
+}
+
+void utils_bio_count_write(up_bio_stats_t *stats, int nr, int rv)
+{
+    stats->writes++;
+    if (rv > 0)
+    {
+        stats->bytes_out += rv;
+        if (rv < nr)
+            stats->short_writes++;
+    }
+    else if (rv < 0 && errno == EAGAIN)
+    {
+        stats->write_eagain++;
+    }
+}
+
+const up_bio_stats_t *utils_bio_stats(up_bio_t *bio)
+{
+    if (bio->stats_sync != NULL)
+        bio->stats_sync(bio, 0);
+    return &bio->stats;
+}
+
+void utils_bio_stats_reset(up_bio_t *bio)
+{
+    memset(&bio->stats, '\0', sizeof(up_bio_stats_t));
+    if (bio->stats_sync != NULL)
+        bio->stats_sync(bio, 1);
+}
+
+void utils_bio_print_stats(up_context_t *ctx, up_bio_t *bio)
+{
+    const up_bio_stats_t *st = utils_bio_stats(bio);
+
+    utils_safe_printf(ctx,
+                      "[[ in %llu bytes, %llu reads (%llu EAGAIN),"
+                      " largest %d ]]\n"
+                      "[[ out %llu bytes, %llu writes (%llu EAGAIN,"
+                      " %llu short) ]]\n",
+                      (unsigned long long)st->bytes_in,
+                      (unsigned long long)st->reads,
+                      (unsigned long long)st->read_eagain,
+                      st->largest_read,
+                      (unsigned long long)st->bytes_out,
+                      (unsigned long long)st->writes,
+                      (unsigned long long)st->write_eagain,
+                      (unsigned long long)st->short_writes);
+    if (st->uart)
+        utils_safe_printf(ctx,
+                          "[[ uart rx %u tx %u: overrun %u, frame %u,"
+                          " parity %u, break %u, tty buffer overrun %u ]]\n",
+                          st->uart_rx, st->uart_tx, st->overrun, st->frame,
+                          st->parity, st->brk, st->buf_overrun);
+    if (st->rx_dropped > 0)
+        utils_safe_printf(ctx, "[[ dropped %llu bytes: host too slow ]]\n",
+                          (unsigned long long)st->rx_dropped);
+}
+
+
 int utils_safe_printf(up_context_t *ctx, const char *str, ...)
 {
     va_list ap;
@@ -121,20 +448,172 @@ int utils_safe_printf(up_context_t *ctx, const char *str, ...)
     va_start(ap, str);
     l = vsnprintf(buf, 4096, str, ap);
     va_end(ap);
-    utils_safe_write(ctx->ttyfd, (const uint8_t *)buf, l);
+    up_console_write(ctx, (const uint8_t *)buf, l);
     return l;
 }
 
 
+int utils_parse_line_sequence(const char     *spec,
+                              up_line_step_t *steps,
+                              int             max)
+{
+    const char *p = spec;
+    int nr = 0;
+
+    while (*p != '\0')
+    {
+        const char *eq = strchr(p, '=');
+        up_line_step_t *step;
+        char *end;
+        long val;
+        int line = 0;
+        int op = UP_LINE_SET;
+
+        if (eq == NULL)
+            goto bad;
+        val = strtol(eq + 1, &end, 0);
+        if (end == eq + 1 || (*end != ',' && *end != '\0') || val < 0)
+            goto bad;
+        if (!strncmp(p, "dtr=", 4))
+            line = UP_BIO_LINE_DTR;
+        else if (!strncmp(p, "rts=", 4))
+            line = UP_BIO_LINE_RTS;
+        else if (!strncmp(p, "break=", 6))
+            op = UP_LINE_BREAK;
+        else if (!strncmp(p, "wait=", 5))
+            op = UP_LINE_WAIT;
+        else
+            goto bad;
+        if (line != 0 && val > 1)
+            goto bad;
+
+        /* Lines named one after the other change together, unless
+         * the same line is named twice
+         */
+        step = (nr > 0) ? &steps[nr - 1] : NULL;
+        if (line == 0 || step == NULL || step->op != UP_LINE_SET ||
+            ((step->set | step->clear) & line))
+        {
+            if (nr >= max)
+            {
+                fprintf(stderr, "Only %d steps allowed in a line sequence\n",
+                        max);
+                return -1;
+            }
+            step = &steps[nr++];
+            memset(step, '\0', sizeof(up_line_step_t));
+            step->op = op;
+            step->ms = (line == 0) ? (int)val : 0;
+        }
+        if (line != 0)
+        {
+            if (val)
+                step->set |= line;
+            else
+                step->clear |= line;
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return nr;
+
+bad:
+    fprintf(stderr, "Bad line sequence '%s' at '%s'\n", spec, p);
+    return -1;
+}
+
+int utils_run_line_sequence(up_context_t         *ctx,
+                            const up_line_step_t *steps,
+                            int                   nr)
+{
+    up_bio_t *bio = ctx->bio;
+    uint64_t start = utils_monotonic_ns();
+    uint64_t due = start;
+    int elapsed_us;
+    int i;
+
+    if (nr <= 0)
+        return 0;
+    for (i = 0; i < nr; i++)
+    {
+        if ((steps[i].op == UP_LINE_SET && bio->set_lines == NULL) ||
+            (steps[i].op == UP_LINE_BREAK && bio->send_break == NULL))
+        {
+            utils_safe_printf(ctx, "[[ This connection has no %s;"
+                              " skipping the line sequence ]]\n",
+                              (steps[i].op == UP_LINE_SET) ?
+                              "modem control lines" : "BREAK");
+            return -1;
+        }
+    }
+
+    /* Whatever was sent before belongs to the old boot */
+    utils_bio_flush(bio, UP_LINE_FLUSH_MS);
+    for (i = 0; i < nr; i++)
+    {
+        const up_line_step_t *step = &steps[i];
+        int rv = 0;
+
+        switch (step->op)
+        {
+        case UP_LINE_SET:
+            rv = bio->set_lines(bio, step->set, step->clear);
+            due = utils_monotonic_ns();
+            break;
+        case UP_LINE_BREAK:
+            rv = bio->send_break(bio, step->ms);
+            due = utils_monotonic_ns();
+            break;
+        case UP_LINE_WAIT:
+            /* Timed from the last change, not from when we got here */
+            due += step->ms * 1000000ULL;
+            utils_sleep_until(due);
+            break;
+        }
+        if (rv < 0)
+        {
+            utils_safe_printf(ctx, "! Line sequence failed at step %d:"
+                              " %s [%d]\n", i, strerror(errno), errno);
+            return -1;
+        }
+    }
+    elapsed_us = (utils_monotonic_ns() - start) / 1000;
+    utils_safe_printf(ctx, "[[ Line sequence done in %d.%03d ms ]]\n",
+                      elapsed_us / 1000, elapsed_us % 1000);
+    return 0;
+}
+
+
 int utils_protocol_set_baud(void *h, up_context_t *ctx, up_load_arg_t *arg)
 {
-    return ctx->bio->set_baud(ctx->bio, arg->baud, arg->fc);
+    int fc = arg->fc;
+    int rv;
+
+    /* XON and XOFF are perfectly good bytes of a binary upload */
+    if (fc == UP_FLOW_CONTROL_XONXOFF)
+        fc = UP_FLOW_CONTROL_NONE;
+    rv = ctx->bio->set_baud(ctx->bio, arg->baud, fc);
+    if (rv < 0)
+        return rv;
+    /* A target that was not reset may yet be waiting, so carry on */
+    utils_run_line_sequence(ctx, arg->reset, arg->nr_reset);
+    return 0;
+}
+
+int utils_console_set_baud(void *h, up_context_t *ctx, up_load_arg_t *arg)
+{
+    int rv = ctx->bio->set_baud(ctx->bio, arg->baud, arg->fc);
+
+    if (rv < 0)
+        return rv;
+    utils_run_line_sequence(ctx, arg->reset, arg->nr_reset);
+    return 0;
 }
 
 const char *utils_decode_flow_control(int fc) { 
     switch (fc) {
     case UP_FLOW_CONTROL_NONE: return "none";
     case UP_FLOW_CONTROL_RTSCTS: return "rtscts";
+    case UP_FLOW_CONTROL_XONXOFF: return "xonxoff";
     default:
         return "unknown";
     }
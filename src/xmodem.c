@@ -50,47 +50,135 @@
 #define XMODEM_USE_CRC16 (0x43)
 #define XMODEM_DONE (0x04)
 
-static int xmodem_boot(void          *h,
-                       up_context_t  *ctx,
-                       up_load_arg_t *arg,
-                       const uint8_t *buf,
-                       int            buf_bytes);
+/* Where an upload has got to */
+#define XMODEM_STATE_WAIT_START 0 /* For the target to ask for data */
+#define XMODEM_STATE_WAIT_ACK   1 /* For it to take the block sent */
 
-static int xmodem128_boot(void          *h,
-                       up_context_t  *ctx,
-                       up_load_arg_t *arg,
-                       const uint8_t *buf,
-                       int            buf_bytes);
+typedef struct xmodem_struct
+{
+    int force_128;
+    int state;
+    int use_crc16;
+    int blk;
+    int blksz;
+    /* The stage's echo setting, while we turn it off */
+    int saved_echo;
+
+    /* The whole boot image, and the next byte of it to send */
+    uint8_t *image;
+    uint32_t image_bytes;
+    uint32_t image_pos;
 
+    /* The block in buffer: image bytes it holds, its length on the
+     * wire and how much of that the BIO has taken
+     */
+    uint32_t bytes_taken;
+    int tx_len;
+    int tx_done;
+
+    uint16_t crc_table[256];
+    uint8_t buffer[XBUFFER_BYTES];
+} xmodem_t;
+
+static void *init_xmodem(void);
+static void *init_xmodem128(void);
+static int prepare_xmodem(void          *h,
+                          up_context_t  *ctx,
+                          up_load_arg_t *arg);
+/* Waits for the target to start us off, then sends a block each time
+ * it acknowledges the last.  Returns 0 while there is more to do, -1
+ * on error or 1 once the upload is complete.
+ */
 static int xmodem_transfer(void          *h,
                            up_context_t  *ctx,
                            up_load_arg_t *arg,
                            const uint8_t *buf,
-                           int            buf_bytes,
-                           int force_128);
+                           int            buf_bytes);
+static int complete_xmodem(void          *h,
+                           up_context_t  *ctx,
+                           up_load_arg_t *arg);
+static int shutdown_xmodem(void *h, up_context_t *ctx);
 
 
 const up_protocol_t xmodem_protocol = {
     "xmodem",
-    NULL,
-    utils_protocol_set_baud,
-    xmodem_boot,
-    NULL,
-    NULL
+    init_xmodem,
+    prepare_xmodem,
+    xmodem_transfer,
+    complete_xmodem,
+    shutdown_xmodem
 };
 
 const up_protocol_t xmodem128_protocol = {
     "xmodem128",
-    NULL,
-    utils_protocol_set_baud,
-    xmodem128_boot,
-    NULL,
-    NULL
+    init_xmodem128,
+    prepare_xmodem,
+    xmodem_transfer,
+    complete_xmodem,
+    shutdown_xmodem
 };
 
 
-static int send_byte(up_context_t *upc, const uint8_t c);
-static int get_byte(up_context_t *upc);
+static void create_crc_table(uint16_t *crc_table);
+
+static xmodem_t *xmodem_create(int force_128)
+{
+    xmodem_t *x = (xmodem_t *)malloc(sizeof(xmodem_t));
+
+    if (x == NULL)
+        return NULL;
+    memset(x, '\0', sizeof(xmodem_t));
+    x->force_128 = force_128;
+    create_crc_table(x->crc_table);
+    return x;
+}
+
+static void *init_xmodem(void)
+{
+    return xmodem_create(0);
+}
+
+static void *init_xmodem128(void)
+{
+    return xmodem_create(1);
+}
+
+static int shutdown_xmodem(void *h, up_context_t *ctx)
+{
+    xmodem_t *x = (xmodem_t *)h;
+
+    if (x != NULL)
+        free(x->image);
+    free(x);
+    return 0;
+}
+
+static int prepare_xmodem(void          *h,
+                          up_context_t  *ctx,
+                          up_load_arg_t *arg)
+{
+    xmodem_t *x = (xmodem_t *)h;
+
+    free(x->image);
+    x->image = NULL;
+    x->state = XMODEM_STATE_WAIT_START;
+    x->tx_len = x->tx_done = 0;
+    x->saved_echo = arg->echo;
+    return utils_protocol_set_baud(h, ctx, arg);
+}
+
+static int complete_xmodem(void          *h,
+                           up_context_t  *ctx,
+                           up_load_arg_t *arg)
+{
+    xmodem_t *x = (xmodem_t *)h;
+
+    arg->echo = x->saved_echo;
+    free(x->image);
+    x->image = NULL;
+    return 0;
+}
+
 
 /*
  * Initialise CRC tables for CRC-16-CCITT
@@ -198,222 +286,71 @@ static uint32_t load_buffer(uint8_t *tx_buffer,
 }
 
 
-static int send_buffer(up_context_t *ctx, uint8_t *buffer,
-                       int use_crc16)
+/* Hand the BIO as much of the current block as it will take */
+static int send_some(xmodem_t *x, up_context_t *ctx)
 {
-    int length = (buffer[XBUFFER_TYPE_OFS] == XMODEM_TYPE_SHORT) ?
-        XBUFFER_SHORT_BYTES : XBUFFER_BYTES;
-    int done = 0;
-
-    if (!use_crc16)
-        /* Only one byte of CRC */
-        length--;
+    int rv = ctx->bio->write(ctx->bio, &x->buffer[x->tx_done],
+                             x->tx_len - x->tx_done);
 
-    while (done < length)
+    if (rv < 0)
     {
-        int rv = ctx->bio->write(ctx->bio, &buffer[done], length - done);
-        if (rv < 0)
-        {
-            if (errno == EINTR || errno == EAGAIN)
-                continue;
+        if (errno != EINTR && errno != EAGAIN)
             return -1;
-        }
-        done += rv;
+        rv = 0;
     }
-
-    return -1;
+    x->tx_done += rv;
+    if (x->tx_done < x->tx_len)
+        ctx->proto_wants_tx = 1;
+    return 0;
 }
 
 
-static int xmodem_go(up_context_t  *ctx,
-                     const uint8_t *boot_image,
-                     const ssize_t  ib,
-                     const int force_128)
+/* (Re)send the current block */
+static int send_buffer(xmodem_t *x, up_context_t *ctx)
 {
-    int done = 0;
-    int rx_byte;
-    int use_crc16;
-    uint16_t crc_table[256];
-    uint8_t buffer[XBUFFER_BYTES];
-    uint32_t bytes_taken;
-    int blk = 1; // First block in XModem is 1
-    int blksz;
-    ssize_t image_bytes = ib;
-
-    create_crc_table(crc_table);
-
-    // Set blksz non-zero to allow variable block sizes.
-    // blksz = (image_bytes <= XBUFFER_SHORT_DATA_BYTES) ?
-    //     XBUFFER_SHORT_DATA_BYTES : XBUFFER_DATA_BYTES;
-    blksz = force_128 ? XBUFFER_SHORT_DATA_BYTES : 0;
-#if DEBUG0
-    printf("blksz = %d \n", blksz);
-#endif
-
-    /* Pre-load the buffer */
-    bytes_taken = load_buffer(buffer, boot_image, image_bytes, blksz, blk);
-
-    image_bytes -= bytes_taken;
-    boot_image += bytes_taken;
-    ++blk;
-
-    /* Now wait for the client to start us off */
-    while (1)
-    {
-        rx_byte = get_byte(ctx);
-        if (rx_byte < 0) { return rx_byte; }
-        if (rx_byte == XMODEM_NAK)
-        {
-#if DEBUG0
-            printf("XMODEM_NAK \n");
-#endif
-            /* Use summing CRC */
-            use_crc16 = 0;
-            crc_buffer(buffer);
-            break;
-        }
-        else if (rx_byte == XMODEM_USE_CRC16)
-        {
-#if DEBUG0
-            printf("XMODEM_USE_CRC16\n");
-#endif
-
-            /* Do what it says */
-            use_crc16 = 1;
-            crc16_buffer(buffer, crc_table);
-            break;
-        }
-        else
-        {
-            uint8_t c = rx_byte;
-            printf("c = %02x \n", c);
-            utils_safe_write(ctx->ttyfd, &c, 1);
-        }
-    }
-
-    utils_safe_printf(ctx,
-                      "[[ XMODEM start detected. Uploading %d bytes. ]]\n",
-                      (int)ib);
-
-    /* We are started, send everything */
-    while (!done)
-    {
-#if DEBUG0
-        printf("Sending buffer...\n");
-#endif
-        if (utils_check_critical_control(ctx) < 0)
-            return -2;
-
-        utils_safe_printf(ctx, "[[ Send %d bytes (%d remain) ]]\n",
-                          (int)bytes_taken, (int)image_bytes);
-        send_buffer(ctx, buffer, use_crc16);
-
-        /* Wait to see if the 8148 liked it */
-        rx_byte = get_byte(ctx);
-        if (rx_byte < 0)
-            return rx_byte;
-
-#if DEBUG0
-        printf("rx_byte = 0x%02x \n", rx_byte);
-#endif
-
-        /* Consider anything other than ACK as requiring a resend */
-        if (rx_byte != XMODEM_ACK)
-            continue;  /* Resend the same buffer */
-
-        if (image_bytes != 0)
-        {
-            bytes_taken = load_buffer(buffer,
-                                      boot_image,
-                                      image_bytes, blksz,  blk);
-            printf("blksz[2] = %d \n", blksz);
-            ++blk;
-            image_bytes -= bytes_taken;
-            boot_image += bytes_taken;
-            if (use_crc16)
-                crc16_buffer(buffer, crc_table);
-            else
-                crc_buffer(buffer);
-        }
-        else
-        {
-            done = 1;
-        }
-    }
-
-#if DEBUG0
-    printf("XMODEM_DONE.\n");
-#endif
-
-    send_byte(ctx, XMODEM_DONE);
-    utils_safe_printf(ctx, "[[ XMODEM complete ]]\n");
+    x->tx_len = (x->buffer[XBUFFER_TYPE_OFS] == XMODEM_TYPE_SHORT) ?
+        XBUFFER_SHORT_BYTES : XBUFFER_BYTES;
+    if (!x->use_crc16)
+        /* Only one byte of CRC */
+        x->tx_len--;
+    x->tx_done = 0;
 
-    /* Download finished */
-    return 1;
+    utils_safe_printf(ctx, "[[ Send %d bytes (%d remain) ]]\n",
+                      (int)x->bytes_taken,
+                      (int)(x->image_bytes - x->image_pos));
+    return send_some(x, ctx);
 }
 
 
-static int get_byte(up_context_t *upc)
+/* Load the next block and its CRC */
+static void next_buffer(xmodem_t *x)
 {
-    uint8_t c;
-    int rv;
-    while (1)
-    {
-        if (utils_check_critical_control(upc) < 0)
-            return -3;
-        rv = upc->bio->read(upc->bio, &c, 1);
-        if (rv < 0)
-        {
-            if (errno == EINTR || errno == EAGAIN)
-                continue;
-            return rv;
-        }
-        else if (rv == 1)
-        {
-            return c;
-        }
-        else
-        {
-            return -2;
-        }
-    }
+    x->bytes_taken = load_buffer(x->buffer,
+                                 &x->image[x->image_pos],
+                                 x->image_bytes - x->image_pos,
+                                 x->blksz, x->blk);
+    ++x->blk;
+    x->image_pos += x->bytes_taken;
+    if (x->use_crc16)
+        crc16_buffer(x->buffer, x->crc_table);
+    else
+        crc_buffer(x->buffer);
 }
 
+
 static int send_byte(up_context_t *upc, const uint8_t c)
 {
-    int rv = upc->bio->safe_write(upc->bio, &c, 1);
+    /* Control bytes needn't queue behind block data */
+    int rv = utils_bio_urgent_write(upc->bio, &c, 1);
 
     return (rv < 0) ? rv : 0;
 }
 
-static int xmodem_boot(void          *h,
-                       up_context_t  *ctx,
-                       up_load_arg_t *arg,
-                       const uint8_t *buf,
-                       int            buf_bytes) {
-    return xmodem_transfer(h, ctx, arg, buf, buf_bytes, 0);
-}
-
-static int xmodem128_boot(void          *h,
-                       up_context_t  *ctx,
-                       up_load_arg_t *arg,
-                       const uint8_t *buf,
-                          int            buf_bytes) {
-    return xmodem_transfer(h, ctx, arg, buf, buf_bytes, 1);
-}
-
 
-
-static int xmodem_transfer(void          *h,
-                           up_context_t  *ctx,
-                           up_load_arg_t *arg,
-                           const uint8_t *serial_in_buf,
-                           int            buf_bytes,
-                           int force_128)
+/* Read the whole boot image into memory */
+static int load_image(xmodem_t *x, up_load_arg_t *arg)
 {
     off_t of;
-    uint32_t nr_bytes;
-    uint8_t *buf = NULL;
     uint32_t done = 0;
     int rv;
 
@@ -428,7 +365,7 @@ static int xmodem_transfer(void          *h,
         return -1;
     }
 
-    nr_bytes  = (uint32_t)of;
+    x->image_bytes = (uint32_t)of;
 
     of = lseek(arg->fd, 0, SEEK_SET);
     if (of == (off_t)-1)
@@ -441,37 +378,136 @@ static int xmodem_transfer(void          *h,
         return -1;
     }
 
-    buf = (uint8_t *)malloc(nr_bytes);
-    if (buf == NULL)
+    free(x->image);
+    /* One spare byte, so that an empty file still gets a buffer */
+    x->image = (uint8_t *)malloc(x->image_bytes + 1);
+    if (x->image == NULL)
     {
 #if DEBUG0
         fprintf(stderr, "Out of memory allocating input buffer\n");
 #endif
         return -1;
     }
-    while (done < nr_bytes)
+    while (done < x->image_bytes)
     {
-        rv = utils_safe_read(arg->fd, &buf[done], nr_bytes-done);
-        if (rv < 0)
-        {
-            goto end;
-        }
-        else if (!rv)
-        {
-            rv = -1;
-            goto end;
-        }
-        else
-        {
-            done += rv;
-        }
+        rv = utils_safe_read(arg->fd, &x->image[done],
+                             x->image_bytes - done);
+        if (rv <= 0)
+            return -1;
+        done += rv;
+    }
+    return 0;
+}
+
+
+/* Act on one byte from the target.  Returns as xmodem_transfer() */
+static int xmodem_byte(xmodem_t      *x,
+                       up_context_t  *ctx,
+                       up_load_arg_t *arg,
+                       uint8_t        rx_byte)
+{
+    switch (x->state)
+    {
+        case XMODEM_STATE_WAIT_START:
+            if (rx_byte == XMODEM_NAK)
+            {
+#if DEBUG0
+                printf("XMODEM_NAK \n");
+#endif
+                /* Use summing CRC */
+                x->use_crc16 = 0;
+            }
+            else if (rx_byte == XMODEM_USE_CRC16)
+            {
+#if DEBUG0
+                printf("XMODEM_USE_CRC16\n");
+#endif
+                /* Do what it says */
+                x->use_crc16 = 1;
+            }
+            else
+            {
+                /* Anything else is for the terminal, which has it */
+                return 0;
+            }
+
+            if (load_image(x, arg) < 0)
+                return -1;
+            utils_safe_printf(ctx,
+                              "[[ XMODEM start detected."
+                              " Uploading %d bytes. ]]\n",
+                              (int)x->image_bytes);
+
+            // Set blksz non-zero to allow variable block sizes.
+            // blksz = (image_bytes <= XBUFFER_SHORT_DATA_BYTES) ?
+            //     XBUFFER_SHORT_DATA_BYTES : XBUFFER_DATA_BYTES;
+            x->blksz = x->force_128 ? XBUFFER_SHORT_DATA_BYTES : 0;
+            x->blk = 1; // First block in XModem is 1
+            x->image_pos = 0;
+            next_buffer(x);
+
+            /* From here on the target talks in control bytes */
+            arg->echo = 0;
+            ctx->uploading = 1;
+            x->state = XMODEM_STATE_WAIT_ACK;
+            return send_buffer(x, ctx);
+
+        case XMODEM_STATE_WAIT_ACK:
+            /* Nothing counts until the target has the whole block */
+            if (x->tx_done < x->tx_len)
+                return 0;
+
+#if DEBUG0
+            printf("rx_byte = 0x%02x \n", rx_byte);
+#endif
+            /* Consider anything other than ACK as requiring a resend */
+            if (rx_byte != XMODEM_ACK)
+                return send_buffer(x, ctx);
+
+            if (x->image_pos < x->image_bytes)
+            {
+                next_buffer(x);
+                return send_buffer(x, ctx);
+            }
+
+#if DEBUG0
+            printf("XMODEM_DONE.\n");
+#endif
+            send_byte(ctx, XMODEM_DONE);
+            utils_safe_printf(ctx, "[[ XMODEM complete ]]\n");
+
+            /* Download finished */
+            return 1;
+    }
+    return 0;
+}
+
+
+static int xmodem_transfer(void          *h,
+                           up_context_t  *ctx,
+                           up_load_arg_t *arg,
+                           const uint8_t *serial_in_buf,
+                           int            buf_bytes)
+{
+    xmodem_t *x = (xmodem_t *)h;
+    int i;
+
+    /* Carry on with a block the BIO could not take all at once */
+    if (x->tx_done < x->tx_len && send_some(x, ctx) < 0)
+    {
+        utils_safe_printf(ctx, "! upc2: XMODEM write failed: %s [%d]\n",
+                          strerror(errno), errno);
+        return -1;
     }
-    rv = xmodem_go(ctx, buf, nr_bytes, force_128);
 
-end:
-    free(buf);
-    return rv;
+    for (i = 0; i < buf_bytes; i++)
+    {
+        int rv = xmodem_byte(x, ctx, arg, serial_in_buf[i]);
+
+        if (rv != 0)
+            return rv;
+    }
+    return 0;
 }
 
 /* End file */
-
@@ -0,0 +1,155 @@
+/* test_common.c */
+/* (C) Kynesim Ltd 2015 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "test_common.h"
+
+
+static const char *test_name = "test";
+
+void test_check(int ok, const char *what, const char *file, int line) {
+    if (ok)
+        return;
+    fprintf(stderr, "! %s: %s:%d: check failed: %s\n",
+            test_name, file, line, what);
+    exit(1);
+}
+
+void test_start(const char *name) {
+    test_name = name;
+    /* A hung test should fail, not stall the build */
+    alarm(TEST_TIMEOUT_S);
+    /* The BIOs expect a dead peer to be an error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+int test_listen_tcp(int *port) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    TEST_CHECK(fd >= 0);
+    memset(&sin, '\0', sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    TEST_CHECK(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    TEST_CHECK(listen(fd, 1) == 0);
+    TEST_CHECK(getsockname(fd, (struct sockaddr *)&sin, &len) == 0);
+    *port = ntohs(sin.sin_port);
+    return fd;
+}
+
+int test_listen_unix(const char *path) {
+    struct sockaddr_un sun;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(strlen(path) < sizeof(sun.sun_path));
+    memset(&sun, '\0', sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    TEST_CHECK(bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0);
+    TEST_CHECK(listen(fd, 1) == 0);
+    return fd;
+}
+
+pid_t test_server_start(int lfd, test_serve_fn_t serve, void *arg) {
+    pid_t pid = fork();
+
+    TEST_CHECK(pid >= 0);
+    if (pid == 0) {
+        int fd = accept(lfd, NULL, NULL);
+
+        TEST_CHECK(fd >= 0);
+        close(lfd);
+        exit(serve(fd, arg) ? 1 : 0);
+    }
+    close(lfd);
+    return pid;
+}
+
+int test_server_wait(pid_t pid) {
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (!WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+int test_read_all(int fd, uint8_t *buf, int nr) {
+    int done = 0;
+
+    while (done < nr) {
+        int rv = read(fd, &buf[done], nr - done);
+
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0)
+            return -1;
+        if (rv == 0)
+            break;
+        done += rv;
+    }
+    return done;
+}
+
+int test_write_all(int fd, const uint8_t *buf, int nr) {
+    int done = 0;
+
+    while (done < nr) {
+        int rv = write(fd, &buf[done], nr - done);
+
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0)
+            return -1;
+        done += rv;
+    }
+    return done;
+}
+
+void test_pattern(uint8_t *buf, int nr, uint32_t seed, int iac_heavy) {
+    uint32_t r = seed;
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        r = r * 1103515245 + 12345;
+        buf[i] = r >> 24;
+        if (!iac_heavy)
+            continue;
+        switch ((r >> 8) & 15) {
+        case 0: case 1: case 2:
+            buf[i] = 0xff;
+            break;
+        case 3:
+            /* A run, or something which looks like IAC SE */
+            buf[i] = 0xff;
+            if (i + 1 < nr)
+                buf[++i] = ((r >> 12) & 1) ? 0xff : 0xf0;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* End file */
@@ -0,0 +1,67 @@
+/* test_common.h */
+/* (C) Kynesim Ltd 2015 */
+
+#ifndef TEST_COMMON_H_INCLUDED
+#define TEST_COMMON_H_INCLUDED
+
+/** @file
+ *
+ *  Bits shared by the tests in this directory.  Each test talks to a
+ *  stand-in server which runs in a child process on the far end of a
+ *  loopback connection, so the BIO under test sees a real socket.
+ *  Both halves report a failed check and exit non-zero; the parent
+ *  collects the child's verdict with test_server_wait().
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Longest any one test may run before it is killed */
+#define TEST_TIMEOUT_S (30)
+
+/** Fail the test, with where and why, unless cond holds */
+#define TEST_CHECK(cond) test_check((cond), #cond, __FILE__, __LINE__)
+
+void test_check(int ok, const char *what, const char *file, int line);
+
+/** Start the clock on the whole test; see TEST_TIMEOUT_S */
+void test_start(const char *name);
+
+/** Listen on 127.0.0.1 at a port of the kernel's choosing, which is
+ *  returned in *port.  Returns the listening fd.
+ */
+int test_listen_tcp(int *port);
+
+/** Listen on a Unix-domain socket at path, replacing anything there */
+int test_listen_unix(const char *path);
+
+/** The server's side of a connection: given the accepted fd and arg,
+ *  returns 0 if the client did everything it should have
+ */
+typedef int (*test_serve_fn_t)(int fd, void *arg);
+
+/** Fork a child which accepts one connection on lfd, runs serve on it
+ *  and exits with its result.  The parent's copy of lfd is closed.
+ */
+pid_t test_server_start(int lfd, test_serve_fn_t serve, void *arg);
+
+/** Wait for the server to finish.  Returns its result, or -1 if it
+ *  died some other way.
+ */
+int test_server_wait(pid_t pid);
+
+/** Blocking I/O for the server side.  Both return the number of bytes
+ *  moved, which is short only at end of file, or -1.
+ */
+int test_read_all(int fd, uint8_t *buf, int nr);
+int test_write_all(int fd, const uint8_t *buf, int nr);
+
+/** Fill buf with nr repeatable bytes drawn from seed.  If iac_heavy,
+ *  about one byte in four is 0xff, with runs of them and the odd
+ *  0xff 0xf0 (telnet's IAC SE) for good measure.
+ */
+void test_pattern(uint8_t *buf, int nr, uint32_t seed, int iac_heavy);
+
+#endif
+
+/* End file */
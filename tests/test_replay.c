@@ -0,0 +1,167 @@
+/* test_replay.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  Record a grouch upload to the emulated target, then replay it.
+ *
+ *  This runs upc2 itself, on a pty as a user would, from the bin
+ *  directory above this test's own.  The replay must get to the end
+ *  of the trace, with the host sending what it sent when recorded;
+ *  with a byte changed in the image it must say so.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "test_common.h"
+
+
+#define IMAGE_BYTES  (30000)
+#define OUTPUT_BYTES (1 << 20)
+
+/* Seen once the emulated target has finished its boot stages */
+#define TARGET_UP "[emu] target up"
+
+
+/* Run upc2 with args on a pty, sending it C-a x once it has printed
+ * quit_on.  Returns what it printed.
+ */
+static char *run_upc2(const char *upc2, const char *const *args,
+                      const char *quit_on) {
+    char *out = (char *)malloc(OUTPUT_BYTES + 1);
+    const char *argv[16];
+    int len = 0;
+    int quit_sent = 0;
+    int status;
+    pid_t pid;
+    int fd;
+    int i;
+
+    TEST_CHECK(out != NULL);
+    argv[0] = upc2;
+    for (i = 0; args[i] != NULL; i++) {
+        TEST_CHECK(i + 2 < (int)(sizeof(argv) / sizeof(argv[0])));
+        argv[i + 1] = args[i];
+    }
+    argv[i + 1] = NULL;
+
+    pid = forkpty(&fd, NULL, NULL, NULL);
+    TEST_CHECK(pid >= 0);
+    if (pid == 0) {
+        execv(upc2, (char *const *)argv);
+        fprintf(stderr, "! Cannot run %s: %s [%d]\n",
+                upc2, strerror(errno), errno);
+        exit(127);
+    }
+
+    /* The pty reads as EIO once upc2 has gone */
+    while (len < OUTPUT_BYTES) {
+        int rv = read(fd, &out[len], OUTPUT_BYTES - len);
+
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            break;
+        len += rv;
+        out[len] = '\0';
+        if (!quit_sent && strstr(out, quit_on) != NULL) {
+            TEST_CHECK(write(fd, "\001x", 2) == 2);
+            quit_sent = 1;
+        }
+    }
+    out[len] = '\0';
+    close(fd);
+    TEST_CHECK(waitpid(pid, &status, 0) == pid);
+    if (!quit_sent)
+        fprintf(stderr, "%s\n", out);
+    TEST_CHECK(quit_sent);
+    return out;
+}
+
+/* Check that the replay got to the end, and return what it said */
+static const char *replay_summary(const char *out) {
+    const char *summary = strstr(out, "[[ replay:");
+    int cur, nr;
+
+    TEST_CHECK(summary != NULL);
+    TEST_CHECK(sscanf(strstr(summary, "record "), "record %d of %d",
+                      &cur, &nr) == 2);
+    TEST_CHECK(cur == nr && nr > 0);
+    return summary;
+}
+
+static void write_image(const char *path, const uint8_t *bytes, int nr) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(test_write_all(fd, bytes, nr) == nr);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    uint8_t *image = (uint8_t *)malloc(IMAGE_BYTES);
+    char upc2[1024];
+    char image_path[64], trace_path[64], replay_spec[80];
+    const char *slash = strrchr(argv[0], '/');
+    const char *summary;
+    char *out;
+
+    test_start("test_replay");
+    TEST_CHECK(image != NULL);
+    /* bin/tests/test_replay -> bin/upc2 */
+    TEST_CHECK(snprintf(upc2, sizeof(upc2), "%.*s/../upc2",
+                        slash ? (int)(slash - argv[0]) : 1,
+                        slash ? argv[0] : ".") < (int)sizeof(upc2));
+    sprintf(image_path, "/tmp/upc2-test-replay-%d.bin", (int)getpid());
+    sprintf(trace_path, "/tmp/upc2-test-replay-%d.trc", (int)getpid());
+    sprintf(replay_spec, "replay:%s", trace_path);
+    test_pattern(image, IMAGE_BYTES, 23, 0);
+    write_image(image_path, image, IMAGE_BYTES);
+
+    {
+        const char *args[] = { "--serial", "emu", "--record", trace_path,
+                               "--grouch", image_path,
+                               "--protocol", "grouch", NULL };
+
+        out = run_upc2(upc2, args, TARGET_UP);
+        TEST_CHECK(strstr(out, "checksum ok") != NULL);
+        TEST_CHECK(strstr(out, "[[ Recorded") != NULL);
+        free(out);
+    }
+
+    {
+        const char *args[] = { "--serial", replay_spec,
+                               "--grouch", image_path,
+                               "--protocol", "grouch", NULL };
+
+        out = run_upc2(upc2, args, TARGET_UP);
+        summary = replay_summary(out);
+        TEST_CHECK(strstr(summary, "(as recorded, 0 extra)") != NULL);
+        free(out);
+
+        /* Now with a byte changed */
+        image[IMAGE_BYTES / 2] ^= 0x55;
+        write_image(image_path, image, IMAGE_BYTES);
+        out = run_upc2(upc2, args, TARGET_UP);
+        summary = replay_summary(out);
+        TEST_CHECK(strstr(summary, "differed in") != NULL);
+        free(out);
+    }
+
+    unlink(image_path);
+    unlink(trace_path);
+    free(image);
+    printf("test_replay: OK\n");
+    return 0;
+}
+
+/* End file */
@@ -0,0 +1,339 @@
+/* test_rfc2217.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  The RFC 2217 BIO against a stand-in terminal server.
+ *
+ *  The server undoes the telnet escaping, answers COM-PORT-OPTION
+ *  requests as a real one would, and records each request along with
+ *  how much data had arrived before it.  The client uploads a stream
+ *  thick with 0xff, drives the line settings the way a multi-stage
+ *  boot does, and reads back a stream the server has escaped and
+ *  sprinkled with commands.  Each side checks what it got.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "upc2/up.h"
+#include "upc2/up_bio_rfc2217.h"
+#include "upc2/utils.h"
+#include "test_common.h"
+
+
+#define TN_SE    (240)
+#define TN_NOP   (241)
+#define TN_SB    (250)
+#define TN_WILL  (251)
+#define TN_WONT  (252)
+#define TN_DO    (253)
+#define TN_IAC   (255)
+
+#define TN_OPT_COM_PORT (44)
+/* An option nobody supports, which the client must refuse */
+#define TN_OPT_BOGUS    (99)
+
+#define CPO_SET_BAUDRATE  (1)
+#define CPO_SET_DATASIZE  (2)
+#define CPO_SET_PARITY    (3)
+#define CPO_SET_STOPSIZE  (4)
+#define CPO_SET_CONTROL   (5)
+#define CPO_SERVER_OFFSET (100)
+
+/* Sent to the server, and back from it */
+#define UPLOAD_BYTES   (100 * 1024)
+#define DOWNLOAD_BYTES (4096)
+
+/* The stand-in UART's fastest rate; asking for more gets this */
+#define SERVER_MAX_BAUD (921600)
+
+#define MAX_REQUESTS (32)
+
+typedef struct request_struct {
+    int command;
+    uint32_t value;
+    /** Data received before the request */
+    int data_before;
+} request_t;
+
+typedef struct server_struct {
+    int fd;
+    uint8_t *data;
+    int data_len;
+    request_t req[MAX_REQUESTS];
+    int nr_req;
+    int client_will_com_port;
+    int client_wont_bogus;
+} server_t;
+
+/* What the client should ask for, in order.  data_before < 0 means
+ * "whatever"; otherwise all of the upload must have arrived first.
+ */
+static const request_t expected[] = {
+    { CPO_SET_DATASIZE, 8, -1 },
+    { CPO_SET_PARITY, 1, -1 },
+    { CPO_SET_STOPSIZE, 1, -1 },
+    { CPO_SET_CONTROL, 1, -1 },          /* No flow control */
+    { CPO_SET_BAUDRATE, 115200, -1 },
+    { CPO_SET_CONTROL, 8, UPLOAD_BYTES },  /* DTR on */
+    { CPO_SET_CONTROL, 5, UPLOAD_BYTES },  /* Break on */
+    { CPO_SET_CONTROL, 6, UPLOAD_BYTES },  /* Break off */
+    { CPO_SET_CONTROL, 3, UPLOAD_BYTES },  /* Hardware flow control */
+    { CPO_SET_BAUDRATE, 3000000, UPLOAD_BYTES },
+};
+#define NR_EXPECTED ((int)(sizeof(expected) / sizeof(expected[0])))
+
+
+/* Send a telnet subnegotiation, escaping as we go */
+static void server_sb(server_t *s, const uint8_t *body, int nr) {
+    uint8_t out[2 + 2 * 16 + 2];
+    int len = 0;
+    int i;
+
+    out[len++] = TN_IAC;
+    out[len++] = TN_SB;
+    for (i = 0; i < nr; i++) {
+        if (body[i] == TN_IAC)
+            out[len++] = TN_IAC;
+        out[len++] = body[i];
+    }
+    out[len++] = TN_IAC;
+    out[len++] = TN_SE;
+    TEST_CHECK(test_write_all(s->fd, out, len) == len);
+}
+
+/* The client's download: escaped, with commands in the way */
+static void server_download(server_t *s) {
+    static const uint8_t notify[] = { TN_OPT_COM_PORT, 107, 0x30 };
+    uint8_t data[DOWNLOAD_BYTES];
+    uint8_t out[2 * DOWNLOAD_BYTES + 2];
+    int len = 0;
+    int i;
+
+    test_pattern(data, sizeof(data), 2217, 1);
+    for (i = 0; i < DOWNLOAD_BYTES; i++) {
+        if (i % 1000 == 500) {
+            out[len++] = TN_IAC;
+            out[len++] = TN_NOP;
+        }
+        if (data[i] == TN_IAC)
+            out[len++] = TN_IAC;
+        out[len++] = data[i];
+        if (i == DOWNLOAD_BYTES / 2) {
+            TEST_CHECK(test_write_all(s->fd, out, len) == len);
+            len = 0;
+            /* A line state notification in the middle */
+            server_sb(s, notify, sizeof(notify));
+        }
+    }
+    TEST_CHECK(test_write_all(s->fd, out, len) == len);
+}
+
+static void server_request(server_t *s, const uint8_t *sb, int nr) {
+    request_t *req;
+    uint8_t reply[2 + 4];
+    int i;
+
+    if (nr < 3 || sb[0] != TN_OPT_COM_PORT)
+        return;
+    TEST_CHECK(s->nr_req < MAX_REQUESTS);
+    req = &s->req[s->nr_req++];
+    req->command = sb[1];
+    req->value = 0;
+    for (i = 2; i < nr; i++)
+        req->value = (req->value << 8) | sb[i];
+    req->data_before = s->data_len;
+
+    /* Answer as a real server would: the setting now in force */
+    if (req->command == CPO_SET_BAUDRATE && req->value > SERVER_MAX_BAUD) {
+        memcpy(reply, sb, nr);
+        reply[2] = (SERVER_MAX_BAUD >> 24) & 0xff;
+        reply[3] = (SERVER_MAX_BAUD >> 16) & 0xff;
+        reply[4] = (SERVER_MAX_BAUD >> 8) & 0xff;
+        reply[5] = SERVER_MAX_BAUD & 0xff;
+    } else {
+        TEST_CHECK(nr <= (int)sizeof(reply));
+        memcpy(reply, sb, nr);
+    }
+    reply[1] += CPO_SERVER_OFFSET;
+    server_sb(s, reply, nr);
+
+    if (req->command == CPO_SET_BAUDRATE && req->value == 3000000)
+        server_download(s);
+}
+
+static int serve(int fd, void *arg) {
+    static const uint8_t hello[] = { TN_IAC, TN_DO, TN_OPT_BOGUS };
+    server_t *s = (server_t *)arg;
+    enum { DATA, IAC, OPTION, SB, SB_IAC } state = DATA;
+    uint8_t command = 0;
+    uint8_t sb[16];
+    int sb_len = 0;
+    uint8_t raw[4096];
+    uint8_t *expect;
+    int rv;
+    int i;
+
+    s->fd = fd;
+    s->data = (uint8_t *)malloc(2 * UPLOAD_BYTES);
+    expect = (uint8_t *)malloc(UPLOAD_BYTES);
+    TEST_CHECK(s->data != NULL && expect != NULL);
+    TEST_CHECK(test_write_all(fd, hello, sizeof(hello)) == sizeof(hello));
+
+    while ((rv = read(fd, raw, sizeof(raw))) != 0) {
+        if (rv < 0 && errno == EINTR)
+            continue;
+        TEST_CHECK(rv > 0);
+        for (i = 0; i < rv; i++) {
+            uint8_t c = raw[i];
+
+            switch (state) {
+            case DATA:
+                if (c == TN_IAC) {
+                    state = IAC;
+                } else {
+                    TEST_CHECK(s->data_len < 2 * UPLOAD_BYTES);
+                    s->data[s->data_len++] = c;
+                }
+                break;
+            case IAC:
+                state = DATA;
+                if (c == TN_IAC) {
+                    TEST_CHECK(s->data_len < 2 * UPLOAD_BYTES);
+                    s->data[s->data_len++] = c;
+                } else if (c >= TN_WILL) {
+                    command = c;
+                    state = OPTION;
+                } else if (c == TN_SB) {
+                    sb_len = 0;
+                    state = SB;
+                }
+                break;
+            case OPTION:
+                if (command == TN_WILL && c == TN_OPT_COM_PORT)
+                    s->client_will_com_port = 1;
+                if (command == TN_WONT && c == TN_OPT_BOGUS)
+                    s->client_wont_bogus = 1;
+                state = DATA;
+                break;
+            case SB:
+                if (c == TN_IAC) {
+                    state = SB_IAC;
+                } else {
+                    TEST_CHECK(sb_len < (int)sizeof(sb));
+                    sb[sb_len++] = c;
+                }
+                break;
+            case SB_IAC:
+                if (c == TN_IAC) {
+                    TEST_CHECK(sb_len < (int)sizeof(sb));
+                    sb[sb_len++] = c;
+                    state = SB;
+                } else {
+                    /* Half a subnegotiation would land us here */
+                    TEST_CHECK(c == TN_SE);
+                    server_request(s, sb, sb_len);
+                    state = DATA;
+                }
+                break;
+            }
+        }
+    }
+
+    TEST_CHECK(state == DATA);
+    TEST_CHECK(s->client_will_com_port);
+    TEST_CHECK(s->client_wont_bogus);
+
+    test_pattern(expect, UPLOAD_BYTES, 42, 1);
+    TEST_CHECK(s->data_len == UPLOAD_BYTES);
+    TEST_CHECK(!memcmp(s->data, expect, UPLOAD_BYTES));
+
+    TEST_CHECK(s->nr_req == NR_EXPECTED);
+    for (i = 0; i < NR_EXPECTED; i++) {
+        TEST_CHECK(s->req[i].command == expected[i].command);
+        TEST_CHECK(s->req[i].value == expected[i].value);
+        TEST_CHECK(expected[i].data_before < 0 ||
+                   s->req[i].data_before == expected[i].data_before);
+    }
+    free(expect);
+    free(s->data);
+    return 0;
+}
+
+
+/* Read exactly nr bytes from the BIO */
+static void client_read(up_bio_t *bio, uint8_t *buf, int nr) {
+    int done = 0;
+
+    while (done < nr) {
+        int rv = bio->read(bio, &buf[done], nr - done);
+
+        if (rv < 0) {
+            TEST_CHECK(errno == EAGAIN || errno == EINTR);
+            TEST_CHECK(utils_bio_wait(bio, POLLIN, 5000) > 0);
+            continue;
+        }
+        TEST_CHECK(rv > 0);
+        done += rv;
+    }
+}
+
+int main(int argc, char **argv) {
+    static server_t server;
+    up_bio_rfc2217_t *handle;
+    uint8_t *upload = (uint8_t *)malloc(UPLOAD_BYTES);
+    uint8_t download[DOWNLOAD_BYTES];
+    uint8_t expect[DOWNLOAD_BYTES];
+    char spec[64];
+    up_bio_t *bio;
+    pid_t pid;
+    int port;
+    int lfd;
+    int off;
+
+    test_start("test_rfc2217");
+    TEST_CHECK(upload != NULL);
+    lfd = test_listen_tcp(&port);
+    pid = test_server_start(lfd, serve, &server);
+
+    sprintf(spec, "rfc2217:127.0.0.1:%d", port);
+    bio = up_bio_rfc2217_create(spec, 0);
+    TEST_CHECK(bio != NULL);
+    handle = (up_bio_rfc2217_t *)bio->handle;
+
+    TEST_CHECK(bio->set_baud(bio, 115200, UP_FLOW_CONTROL_NONE) == 0);
+    TEST_CHECK(handle->server_baud == 115200);
+
+    /* In pieces the size grouch uses, as fast as the BIO takes them */
+    test_pattern(upload, UPLOAD_BYTES, 42, 1);
+    for (off = 0; off < UPLOAD_BYTES; off += 1024) {
+        int nr = (UPLOAD_BYTES - off < 1024) ? UPLOAD_BYTES - off : 1024;
+
+        TEST_CHECK(utils_bio_safe_write(bio, &upload[off], nr) == nr);
+    }
+
+    /* Each of these must follow the whole upload */
+    TEST_CHECK(bio->set_lines(bio, UP_BIO_LINE_DTR, 0) == 0);
+    TEST_CHECK(bio->send_break(bio, 10) == 0);
+    TEST_CHECK(bio->set_baud(bio, 3000000, UP_FLOW_CONTROL_RTSCTS) == 0);
+    TEST_CHECK(handle->server_baud == SERVER_MAX_BAUD);
+    TEST_CHECK(!handle->com_port_refused);
+
+    client_read(bio, download, DOWNLOAD_BYTES);
+    test_pattern(expect, DOWNLOAD_BYTES, 2217, 1);
+    TEST_CHECK(!memcmp(download, expect, DOWNLOAD_BYTES));
+
+    bio->dispose(bio);
+    TEST_CHECK(test_server_wait(pid) == 0);
+    free(upload);
+    printf("test_rfc2217: OK\n");
+    return 0;
+}
+
+/* End file */
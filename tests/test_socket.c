@@ -0,0 +1,190 @@
+/* test_socket.c */
+/* (C) Kynesim Ltd 2015 */
+
+/** @file
+ *
+ *  The socket BIO against a loopback listener, over TCP and over a
+ *  Unix-domain socket.
+ *
+ *  The client checks the socket options it asked for, that short
+ *  writes wait in the queue for company and a batch's worth goes at
+ *  once, that reading, safe_write() and dispose() each send what is
+ *  queued, and that a bulk transfer each way survives a small receive
+ *  buffer.  The server checks that the upload arrived intact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "upc2/up.h"
+#include "upc2/up_bio_socket.h"
+#include "upc2/utils.h"
+#include "test_common.h"
+
+
+/* What --rcvbuf asks for: well below any default */
+#define RCVBUF_BYTES   (8192)
+
+/* The upload, in the order the client sends it */
+#define SMALL_BYTES    (30)
+#define BULK_BYTES     (200 * 1024)
+#define TAIL_BYTES     (7)
+#define UPLOAD_BYTES   (SMALL_BYTES + UP_BIO_SOCKET_TX_BATCH + \
+                        BULK_BYTES + TAIL_BYTES)
+/* Sent back once the server has everything before the tail */
+#define DOWNLOAD_BYTES (64 * 1024)
+
+
+static int serve(int fd, void *arg) {
+    uint8_t *got = (uint8_t *)malloc(UPLOAD_BYTES + 1);
+    uint8_t *expect = (uint8_t *)malloc(UPLOAD_BYTES);
+    uint8_t *download = (uint8_t *)malloc(DOWNLOAD_BYTES);
+    int before_tail = UPLOAD_BYTES - TAIL_BYTES;
+
+    TEST_CHECK(got != NULL && expect != NULL && download != NULL);
+    test_pattern(expect, UPLOAD_BYTES, 8, 0);
+    test_pattern(download, DOWNLOAD_BYTES, 80, 0);
+
+    TEST_CHECK(test_read_all(fd, got, before_tail) == before_tail);
+    TEST_CHECK(test_write_all(fd, download, DOWNLOAD_BYTES) ==
+               DOWNLOAD_BYTES);
+    /* The tail only goes when the client disposes of the BIO, and
+     * then there must be nothing more
+     */
+    TEST_CHECK(test_read_all(fd, &got[before_tail], TAIL_BYTES + 1) ==
+               TAIL_BYTES);
+    TEST_CHECK(!memcmp(got, expect, UPLOAD_BYTES));
+    free(download);
+    free(expect);
+    free(got);
+    return 0;
+}
+
+
+static void client_read(up_bio_t *bio, uint8_t *buf, int nr) {
+    int done = 0;
+
+    while (done < nr) {
+        int rv = bio->read(bio, &buf[done], nr - done);
+
+        if (rv < 0) {
+            TEST_CHECK(errno == EAGAIN || errno == EINTR);
+            TEST_CHECK(utils_bio_wait(bio, POLLIN, 5000) > 0);
+            continue;
+        }
+        TEST_CHECK(rv > 0);
+        done += rv;
+    }
+}
+
+static void run_client(const char *spec, int is_tcp, pid_t server) {
+    uint8_t *upload = (uint8_t *)malloc(UPLOAD_BYTES);
+    uint8_t *download = (uint8_t *)malloc(DOWNLOAD_BYTES);
+    uint8_t *expect = (uint8_t *)malloc(DOWNLOAD_BYTES);
+    up_bio_socket_t *handle;
+    up_bio_t *bio;
+    socklen_t len;
+    uint8_t byte;
+    int off = 0;
+    int val;
+
+    TEST_CHECK(upload != NULL && download != NULL && expect != NULL);
+    test_pattern(upload, UPLOAD_BYTES, 8, 0);
+    test_pattern(expect, DOWNLOAD_BYTES, 80, 0);
+
+    bio = up_bio_socket_create(spec, RCVBUF_BYTES);
+    TEST_CHECK(bio != NULL);
+    handle = (up_bio_socket_t *)bio->handle;
+
+    /* Linux doubles what it is asked for, to allow for overhead */
+    len = sizeof(val);
+    TEST_CHECK(getsockopt(handle->fd, SOL_SOCKET, SO_RCVBUF,
+                          &val, &len) == 0);
+    TEST_CHECK(val >= RCVBUF_BYTES && val <= 2 * RCVBUF_BYTES);
+    if (is_tcp) {
+        len = sizeof(val);
+        TEST_CHECK(getsockopt(handle->fd, IPPROTO_TCP, TCP_NODELAY,
+                              &val, &len) == 0);
+        TEST_CHECK(val != 0);
+    }
+
+    /* Short writes wait for company ... */
+    TEST_CHECK(bio->write(bio, &upload[off], 10) == 10);
+    off += 10;
+    TEST_CHECK(bio->write(bio, &upload[off], SMALL_BYTES - 10) ==
+               SMALL_BYTES - 10);
+    off += SMALL_BYTES - 10;
+    TEST_CHECK(utils_bio_tx_pending(bio) == SMALL_BYTES);
+
+    /* ... until the caller goes to read, when they must go */
+    TEST_CHECK(bio->read(bio, &byte, 1) < 0 && errno == EAGAIN);
+    TEST_CHECK(utils_bio_tx_pending(bio) == 0);
+
+    /* A batch's worth goes straight away */
+    TEST_CHECK(bio->write(bio, &upload[off], UP_BIO_SOCKET_TX_BATCH) ==
+               UP_BIO_SOCKET_TX_BATCH);
+    off += UP_BIO_SOCKET_TX_BATCH;
+    TEST_CHECK(utils_bio_tx_pending(bio) == 0);
+
+    /* Bulk, as fast as the BIO takes it, then safe_write() to flush */
+    while (off < UPLOAD_BYTES - TAIL_BYTES - 100) {
+        int nr = UPLOAD_BYTES - TAIL_BYTES - 100 - off;
+
+        if (nr > 1024)
+            nr = 1024;
+        TEST_CHECK(utils_bio_safe_write(bio, &upload[off], nr) == nr);
+        off += nr;
+    }
+    TEST_CHECK(bio->safe_write(bio, &upload[off], 100) == 100);
+    off += 100;
+    TEST_CHECK(utils_bio_tx_pending(bio) == 0);
+
+    client_read(bio, download, DOWNLOAD_BYTES);
+    TEST_CHECK(!memcmp(download, expect, DOWNLOAD_BYTES));
+
+    /* Left queued for dispose() to send */
+    TEST_CHECK(bio->write(bio, &upload[off], TAIL_BYTES) == TAIL_BYTES);
+    TEST_CHECK(utils_bio_tx_pending(bio) == TAIL_BYTES);
+    bio->dispose(bio);
+
+    TEST_CHECK(test_server_wait(server) == 0);
+    free(expect);
+    free(download);
+    free(upload);
+}
+
+int main(int argc, char **argv) {
+    char spec[128];
+    char path[64];
+    pid_t pid;
+    int port;
+    int lfd;
+
+    test_start("test_socket");
+
+    lfd = test_listen_tcp(&port);
+    pid = test_server_start(lfd, serve, NULL);
+    sprintf(spec, "tcp:127.0.0.1:%d", port);
+    run_client(spec, 1, pid);
+
+    sprintf(path, "/tmp/upc2-test-socket-%d", (int)getpid());
+    lfd = test_listen_unix(path);
+    pid = test_server_start(lfd, serve, NULL);
+    sprintf(spec, "unix:%s", path);
+    run_client(spec, 0, pid);
+    unlink(path);
+
+    printf("test_socket: OK\n");
+    return 0;
+}
+
+/* End file */